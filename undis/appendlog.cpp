@@ -0,0 +1,345 @@
+#include "appendlog.h"
+
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+AppendLog::AppendLog(Path filename, FsyncPolicy policy, Drain drain, Cut cut)
+    : filename_{std::move(filename)}, tmp_filename_{filename_},
+      policy_{policy}, drain_{std::move(drain)}, cut_{std::move(cut)},
+      file_{open_file(filename_, "ab")},
+      size_{std::filesystem::file_size(filename_)}, base_size_{0},
+      last_fsync_{std::chrono::steady_clock::now()} {
+    tmp_filename_ += ".rewrite";
+    if (size_ == 0) {
+        if (!write_header(file_) || !sync_file(file_)) {
+            std::fclose(file_);
+            throw std::runtime_error{"Could not write " + filename_.string()};
+        }
+        size_ = HEADER_SIZE;
+    }
+    base_size_ = size_;
+    writer_ = std::jthread{[this](std::stop_token stoken) {
+        writer_loop(stoken);
+    }};
+}
+
+AppendLog::~AppendLog() {
+    writer_.request_stop();
+    writer_.join();
+    std::fclose(file_);
+}
+
+void AppendLog::encode_set(Reply &journal, std::string_view key,
+                           const StoreValue &val) {
+    using std::uint32_t;
+
+    char header[1 + 4 * sizeof(uint32_t)];
+    header[0] = SET_OP;
+    uint32_t fields[] = {static_cast<uint32_t>(key.size()),
+                         static_cast<uint32_t>(val.str_val.size()), val.flags,
+                         val.exp_time};
+    std::memcpy(header + 1, fields, sizeof fields);
+    journal.append(std::string_view{header, sizeof header})
+        .append(key)
+        .append(val.str_val);
+}
+
+void AppendLog::encode_del(Reply &journal, std::string_view key) {
+    char header[1 + sizeof(std::uint32_t)];
+    header[0] = DEL_OP;
+    auto klen = static_cast<std::uint32_t>(key.size());
+    std::memcpy(header + 1, &klen, sizeof klen);
+    journal.append(std::string_view{header, sizeof header}).append(key);
+}
+
+void AppendLog::reset(const Path &filename) {
+    // Replaced like a rewrite, so a failure leaves the old log whole
+    auto tmp_filename = filename;
+    tmp_filename += ".rewrite";
+    auto *file = open_file(tmp_filename, "wb");
+    bool ok = write_header(file) && sync_file(file);
+    std::fclose(file);
+
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmp_filename, filename, ec);
+    }
+    if (!ok || ec) {
+        std::filesystem::remove(tmp_filename, ec);
+        throw std::runtime_error{"Could not write " + filename.string()};
+    }
+    sync_dir(filename);
+}
+
+void AppendLog::sync() {
+    if (policy_ != FsyncPolicy::always) {
+        return;
+    }
+    std::unique_lock lk{mtx_};
+    auto target = started_ + 1;
+    sync_requested_ = true;
+    writer_cv_.notify_one();
+    sync_cv_.wait(lk, [this, target] {
+        return completed_ >= target || stopped_;
+    });
+    if (failed_) {
+        throw LogError{};
+    }
+}
+
+bool AppendLog::rewrite() {
+    std::scoped_lock lk{mtx_};
+    if (rewrite_state_ != RewriteState::idle || stopped_) {
+        return false;
+    }
+    rewrite_state_ = RewriteState::cut_requested;
+    writer_cv_.notify_one();
+    return true;
+}
+
+std::uint64_t AppendLog::size() const { return size_.load(); }
+
+std::FILE *AppendLog::open_file(const Path &filename, const char *mode) {
+    auto *file = std::fopen(filename.string().c_str(), mode);
+    if (file == nullptr) {
+        throw std::runtime_error{"Could not open " + filename.string()};
+    }
+    return file;
+}
+
+bool AppendLog::write_header(std::FILE *file) {
+    return std::fwrite(MAGIC, 1, sizeof MAGIC, file) == sizeof MAGIC &&
+           std::fwrite(&VERSION, sizeof VERSION, 1, file) == 1;
+}
+
+bool AppendLog::write(std::FILE *file, const Reply &records) {
+    for (auto buf : records.buffers()) {
+        if (std::fwrite(buf.data(), 1, buf.size(), file) != buf.size()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AppendLog::write(std::FILE *file, const Batch &batch) {
+    for (const auto &records : batch) {
+        if (!write(file, records)) {
+            return false;
+        }
+    }
+    return std::fflush(file) == 0;
+}
+
+bool AppendLog::sync_file(std::FILE *file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+void AppendLog::sync_dir([[maybe_unused]] const Path &filename) {
+#ifndef _WIN32
+    auto dir = filename.parent_path();
+    int dirfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+#endif
+}
+
+void AppendLog::writer_loop(std::stop_token stoken) {
+    using namespace std::chrono;
+
+    bool dirty = false;
+    std::unique_lock lk{mtx_};
+    while (true) {
+        writer_cv_.wait_for(lk, stoken, WRITE_INTERVAL, [this] {
+            return sync_requested_ ||
+                   rewrite_state_ == RewriteState::cut_requested ||
+                   rewrite_state_ == RewriteState::written ||
+                   rewrite_state_ == RewriteState::failed;
+        });
+        bool stopping = stoken.stop_requested();
+        sync_requested_ = false;
+        auto cycle = ++started_;
+        auto state = rewrite_state_;
+        bool failed = failed_;
+        lk.unlock();
+
+        Batch batch;
+        Snapshot snapshot;
+        bool cut = false;
+        if (state == RewriteState::cut_requested) {
+            cut = cut_(batch, snapshot);
+        } else {
+            drain_(batch);
+        }
+
+        // Once a write fails, records are dropped until a rewrite replaces
+        // the log, as they would follow a torn one
+        bool broken = false;
+        if (!batch.empty() && !failed) {
+            broken = !write(file_, batch);
+            for (const auto &records : batch) {
+                size_ += records.size();
+            }
+            dirty = true;
+        }
+        auto now = steady_clock::now();
+        if (dirty && !failed && !broken &&
+            (policy_ == FsyncPolicy::always || stopping ||
+             (policy_ == FsyncPolicy::everysec &&
+              now - last_fsync_ >= FSYNC_INTERVAL))) {
+            broken = !sync_file(file_);
+            last_fsync_ = now;
+            dirty = false;
+        }
+
+        if (cut) {
+            rewriter_ = std::jthread{[this, s = std::move(snapshot)](
+                                         std::stop_token stoken) mutable {
+                write_base(stoken, std::move(s));
+            }};
+        } else if (state == RewriteState::writing ||
+                   state == RewriteState::written) {
+            // Written since the cut, so the rewritten log needs it too
+            std::ranges::move(batch, std::back_inserter(tail_));
+        }
+        // The rewritten log holds everything, this batch included
+        bool recovered = false;
+        if (state == RewriteState::written) {
+            recovered = finish_rewrite();
+        } else if (state == RewriteState::failed) {
+            abandon_rewrite();
+        }
+
+        lk.lock();
+        if (state == RewriteState::cut_requested) {
+            rewrite_state_ = cut ? RewriteState::writing : RewriteState::idle;
+        } else if (state == RewriteState::written ||
+                   state == RewriteState::failed) {
+            rewrite_state_ = RewriteState::idle;
+        }
+        if (recovered) {
+            failed_ = false;
+        } else if (broken) {
+            failed_ = true;
+        }
+        completed_ = cycle;
+        sync_cv_.notify_all();
+
+        if (stopping) {
+            break;
+        }
+        if (rewrite_state_ == RewriteState::idle && failed_ &&
+            now - last_recovery_ >= RECOVERY_INTERVAL) {
+            rewrite_state_ = RewriteState::cut_requested;
+            last_recovery_ = now;
+        }
+        if (rewrite_state_ == RewriteState::idle &&
+            size_ >= AUTO_REWRITE_MIN_SIZE && size_ >= 2 * base_size_) {
+            rewrite_state_ = RewriteState::cut_requested;
+        }
+    }
+
+    // An unfinished rewrite is abandoned; the current log stays complete
+    if (rewriter_.joinable()) {
+        lk.unlock();
+        rewriter_.request_stop();
+        abandon_rewrite();
+        lk.lock();
+    }
+    stopped_ = true;
+    sync_cv_.notify_all();
+}
+
+void AppendLog::write_base(std::stop_token stoken, Snapshot snapshot) {
+    constexpr std::size_t CHUNK_SIZE = 1 << 20;
+
+    // Failures are handed to the writer thread, which leaves the current
+    // log in place
+    std::FILE *file = nullptr;
+    try {
+        file = open_file(tmp_filename_, "wb");
+    } catch (const std::runtime_error &) {
+    }
+    bool ok = file != nullptr && write_header(file);
+
+    Reply chunk;
+    chunk.append(std::string_view{&CLEAR_OP, 1});
+    for (auto it = snapshot.begin(); ok && it != snapshot.end(); ++it) {
+        if (stoken.stop_requested()) {
+            std::fclose(file);
+            return;
+        }
+        encode_set(chunk, it->first, it->second);
+        if (chunk.size() >= CHUNK_SIZE) {
+            ok = write(file, chunk);
+            chunk = Reply{};
+        }
+    }
+    ok = ok && write(file, chunk) && sync_file(file);
+    if (!ok && file != nullptr) {
+        std::fclose(file);
+    }
+
+    std::scoped_lock lk{mtx_};
+    rewrite_file_ = ok ? file : nullptr;
+    rewrite_state_ = ok ? RewriteState::written : RewriteState::failed;
+    writer_cv_.notify_one();
+}
+
+bool AppendLog::finish_rewrite() {
+    rewriter_.join();
+    bool ok = write(rewrite_file_, tail_) && sync_file(rewrite_file_);
+    tail_.clear();
+
+    // The rename is the commit point: before it the old log is complete, and
+    // after it the new one is
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmp_filename_, filename_, ec);
+    }
+    if (!ok || ec) {
+        abandon_rewrite();
+        return false;
+    }
+    std::fclose(file_);
+    sync_dir(filename_);
+
+    std::scoped_lock lk{mtx_};
+    file_ = std::exchange(rewrite_file_, nullptr);
+    size_ = std::filesystem::file_size(filename_, ec);
+    base_size_ = size_;
+    return true;
+}
+
+void AppendLog::abandon_rewrite() {
+    if (rewriter_.joinable()) {
+        rewriter_.join();
+    }
+    tail_.clear();
+    std::FILE *file;
+    {
+        std::scoped_lock lk{mtx_};
+        file = std::exchange(rewrite_file_, nullptr);
+    }
+    if (file != nullptr) {
+        std::fclose(file);
+    }
+    std::error_code ec;
+    std::filesystem::remove(tmp_filename_, ec);
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "reply.h"
+#include "storevalue.h"
+
+enum class FsyncPolicy { always, everysec, never };
+
+// Anything mutation records can be replayed into
+template <typename T>
+concept LogSink = requires(T &sink, std::string key, StoreValue val) {
+    sink.clear();
+    sink.emplace(std::move(key), std::move(val));
+    sink.erase(key);
+};
+
+// Thrown when records could not be written to the log or synced
+class LogError : public std::runtime_error {
+  public:
+    LogError() : std::runtime_error{"writing the append-only log"} {}
+};
+
+// Append-only log of store mutations. Records hold the resulting state of an
+// item rather than the command that produced it, so replaying a log over a
+// snapshot taken at any point after the log started gives the same result.
+//
+// Writers encode records into per-shard journals under their shard's lock. A
+// dedicated thread drains the journals, writes them out and syncs the file
+// according to the fsync policy, so concurrent writers share one fsync. If a
+// write or sync fails, the log stops taking records, since they would follow
+// a torn one, and is rewritten from the store to recover.
+class AppendLog {
+    using Path = std::filesystem::path;
+
+  public:
+    using Batch = std::vector<Reply>;
+    using Snapshot = std::vector<std::pair<std::string, StoreValue>>;
+    // Moves pending records into the batch
+    using Drain = std::function<void(Batch &)>;
+    // Moves pending records into the batch and, unless the store cannot be
+    // copied yet, copies every live entry into the snapshot, atomically with
+    // respect to each shard. Returns whether the entries were copied.
+    using Cut = std::function<bool(Batch &, Snapshot &)>;
+
+    AppendLog(Path filename, FsyncPolicy policy, Drain drain, Cut cut);
+    // Writes out and syncs the remaining records
+    ~AppendLog();
+    AppendLog(const AppendLog &) = delete;
+    AppendLog &operator=(const AppendLog &) = delete;
+
+    static void encode_set(Reply &journal, std::string_view key,
+                           const StoreValue &val);
+    static void encode_del(Reply &journal, std::string_view key);
+
+    // Applies the records in the log to the sink, and truncates a torn final
+    // record left by a crash. Throws std::runtime_error if the file is not a
+    // log.
+    template <LogSink S> static void replay(const Path &filename, S &sink);
+
+    // Empties the log, once its records are in a snapshot. Throws
+    // std::runtime_error if it could not, leaving the log as it was.
+    static void reset(const Path &filename);
+
+    // Returns once every record encoded before the call is on disk under the
+    // always policy, and immediately otherwise. Throws LogError if the log
+    // has failed and not yet been rewritten.
+    void sync();
+
+    // Starts compacting the log in the background. Returns false if a rewrite
+    // is already running.
+    bool rewrite();
+
+    std::uint64_t size() const;
+
+  private:
+    static constexpr char MAGIC[] = {'U', 'N', 'D', 'L'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::size_t HEADER_SIZE = sizeof MAGIC + sizeof VERSION;
+    static constexpr char SET_OP = 'S', DEL_OP = 'D', CLEAR_OP = 'C';
+
+    static constexpr std::chrono::milliseconds WRITE_INTERVAL{10};
+    static constexpr std::chrono::seconds FSYNC_INTERVAL{1};
+    // Rewrite automatically once the log has doubled since the last rewrite
+    // and is at least this large
+    static constexpr std::uint64_t AUTO_REWRITE_MIN_SIZE = 64 << 20;
+    // How often a failed log tries to recover by rewriting
+    static constexpr std::chrono::seconds RECOVERY_INTERVAL{1};
+
+    enum class RewriteState { idle, cut_requested, writing, written, failed };
+
+    static std::FILE *open_file(const Path &filename, const char *mode);
+    // These return false if the file could not be written
+    static bool write_header(std::FILE *file);
+    static bool write(std::FILE *file, const Reply &records);
+    // Also flushes the stdio buffer
+    static bool write(std::FILE *file, const Batch &batch);
+    static bool sync_file(std::FILE *file);
+    // Makes a rename in filename's directory durable, where supported
+    static void sync_dir(const Path &filename);
+
+    void writer_loop(std::stop_token stoken);
+    void write_base(std::stop_token stoken, Snapshot snapshot);
+    // Returns whether the rewritten log replaced the current one
+    bool finish_rewrite();
+    // Drops the rewrite's output, leaving the current log in place
+    void abandon_rewrite();
+
+    Path filename_;
+    Path tmp_filename_;
+    FsyncPolicy policy_;
+    Drain drain_;
+    Cut cut_;
+
+    // Owned by the writer thread once it is started
+    std::FILE *file_;
+    std::atomic<std::uint64_t> size_;
+    std::uint64_t base_size_;
+    std::chrono::steady_clock::time_point last_fsync_;
+    std::chrono::steady_clock::time_point last_recovery_;
+    // Records written since the rewrite's cut, to be appended to its output
+    Batch tail_;
+
+    // Guards everything below
+    mutable std::mutex mtx_;
+    std::condition_variable_any writer_cv_;
+    std::condition_variable sync_cv_;
+    // Writer cycles started and completed; a record encoded before a cycle
+    // starts is durable once it completes
+    std::uint64_t started_ = 0;
+    std::uint64_t completed_ = 0;
+    bool sync_requested_ = false;
+    bool stopped_ = false;
+    // A write or sync failed, and the log is missing records until it is
+    // rewritten
+    bool failed_ = false;
+
+    RewriteState rewrite_state_ = RewriteState::idle;
+    std::FILE *rewrite_file_ = nullptr;
+
+    // Threads must be destroyed first
+    std::jthread rewriter_;
+    std::jthread writer_;
+};
+
+template <LogSink S> void AppendLog::replay(const Path &filename, S &sink) {
+    using std::uint32_t;
+
+    std::ifstream ifs{filename, std::ios::in | std::ios::binary};
+    if (!ifs || std::filesystem::file_size(filename) == 0) {
+        return;
+    }
+
+    char magic[sizeof MAGIC];
+    uint32_t version;
+    ifs.read(magic, sizeof magic);
+    ifs.read(reinterpret_cast<char *>(&version), sizeof version);
+    if (!ifs || !std::equal(magic, magic + sizeof magic, MAGIC) ||
+        version != VERSION) {
+        throw std::runtime_error{filename.string() +
+                                 " is not an append-only log"};
+    }
+
+    std::uint64_t valid = HEADER_SIZE;
+    char op;
+    while (ifs.get(op)) {
+        if (op == CLEAR_OP) {
+            sink.clear();
+            valid = ifs.tellg();
+            continue;
+        }
+
+        uint32_t klen;
+        ifs.read(reinterpret_cast<char *>(&klen), sizeof klen);
+        if (op == SET_OP) {
+            uint32_t vlen, flags, exp_time;
+            ifs.read(reinterpret_cast<char *>(&vlen), sizeof vlen);
+            ifs.read(reinterpret_cast<char *>(&flags), sizeof flags);
+            ifs.read(reinterpret_cast<char *>(&exp_time), sizeof exp_time);
+            if (!ifs) {
+                break;
+            }
+            std::string k(klen, '\0'), v(vlen, '\0');
+            ifs.read(k.data(), klen);
+            ifs.read(v.data(), vlen);
+            if (!ifs) {
+                break;
+            }
+            sink.emplace(std::move(k),
+                         StoreValue{std::move(v), flags, exp_time});
+        } else if (op == DEL_OP && ifs) {
+            std::string k(klen, '\0');
+            ifs.read(k.data(), klen);
+            if (!ifs) {
+                break;
+            }
+            sink.erase(k);
+        } else {
+            break;
+        }
+        valid = ifs.tellg();
+    }
+
+    ifs.close();
+    if (std::filesystem::file_size(filename) != valid) {
+        std::filesystem::resize_file(filename, valid);
+    }
+}
@@ -0,0 +1,396 @@
+#include "binarycommand.h"
+
+#include <new>
+#include <stdexcept>
+#include <string>
+
+using namespace binary_protocol;
+
+namespace {
+// Fields are big-endian
+template <typename T> T load_be(const char *p) {
+    T value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        value = static_cast<T>(value << 8) | static_cast<unsigned char>(p[i]);
+    }
+    return value;
+}
+
+template <typename T> void store_be(char *p, T value) {
+    for (std::size_t i = sizeof(T); i-- > 0;) {
+        p[i] = static_cast<char>(value & 0xff);
+        value = static_cast<T>(value >> 8);
+    }
+}
+
+constexpr std::string_view VERSION = UNDIS_VERSION;
+
+constexpr std::size_t KEY_LENGTH_OFFSET = 2;
+constexpr std::size_t EXTRAS_LENGTH_OFFSET = 4;
+constexpr std::size_t STATUS_OFFSET = 6;
+constexpr std::size_t BODY_LENGTH_OFFSET = 8;
+constexpr std::size_t OPAQUE_OFFSET = 12;
+constexpr std::size_t CAS_OFFSET = 16;
+} // namespace
+
+std::optional<std::size_t> BinaryCommand::size(std::string_view input) {
+    if (input.size() < HEADER_SIZE) {
+        return std::nullopt;
+    }
+    return HEADER_SIZE +
+           load_be<std::uint32_t>(input.data() + BODY_LENGTH_OFFSET);
+}
+
+BinaryCommand::BinaryCommand(std::string_view request)
+    : magic_{static_cast<std::uint8_t>(request[0])},
+      opcode_{static_cast<Opcode>(request[1])},
+      opaque_{load_be<std::uint32_t>(request.data() + OPAQUE_OFFSET)},
+      cas_{load_be<std::uint64_t>(request.data() + CAS_OFFSET)} {
+    auto key_length =
+        load_be<std::uint16_t>(request.data() + KEY_LENGTH_OFFSET);
+    auto extras_length =
+        static_cast<unsigned char>(request[EXTRAS_LENGTH_OFFSET]);
+    auto body = request.substr(HEADER_SIZE);
+    if (key_length + extras_length > body.size()) {
+        // Left empty; rejected as invalid when executed
+        magic_ = 0;
+        return;
+    }
+    extras_ = body.substr(0, extras_length);
+    key_ = body.substr(extras_length, key_length);
+    value_ = body.substr(extras_length + key_length);
+}
+
+bool BinaryCommand::quit() const {
+    return opcode_ == Opcode::quit || opcode_ == Opcode::quitq;
+}
+
+std::optional<Stats::Op> BinaryCommand::op() const {
+    using enum Stats::Op;
+
+    switch (opcode_) {
+    case Opcode::get:
+    case Opcode::getq:
+    case Opcode::getk:
+    case Opcode::getkq:
+        return get;
+    case Opcode::gat:
+    case Opcode::gatq:
+    case Opcode::gatk:
+    case Opcode::gatkq:
+        return gat;
+    case Opcode::set:
+    case Opcode::setq:
+        return cas_ != 0 ? cas : set;
+    case Opcode::add:
+    case Opcode::addq:
+        return add;
+    case Opcode::replace:
+    case Opcode::replaceq:
+        return cas_ != 0 ? cas : replace;
+    case Opcode::append:
+    case Opcode::appendq:
+        return append;
+    case Opcode::prepend:
+    case Opcode::prependq:
+        return prepend;
+    case Opcode::del:
+    case Opcode::delq:
+        return del;
+    case Opcode::increment:
+    case Opcode::incrementq:
+        return incr;
+    case Opcode::decrement:
+    case Opcode::decrementq:
+        return decr;
+    case Opcode::touch:
+        return touch;
+    default:
+        return std::nullopt;
+    }
+}
+
+Reply BinaryCommand::execute(KVStore &store) {
+    if (magic_ != REQUEST_MAGIC) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+
+    try {
+        switch (opcode_) {
+        case Opcode::get:
+            return execute_get(store, false, false);
+        case Opcode::getq:
+            return execute_get(store, true, false);
+        case Opcode::getk:
+            return execute_get(store, false, true);
+        case Opcode::getkq:
+            return execute_get(store, true, true);
+        case Opcode::gat:
+            return execute_get(store, false, false, true);
+        case Opcode::gatq:
+            return execute_get(store, true, false, true);
+        case Opcode::gatk:
+            return execute_get(store, false, true, true);
+        case Opcode::gatkq:
+            return execute_get(store, true, true, true);
+        case Opcode::touch:
+            return execute_touch(store);
+
+        case Opcode::set:
+        case Opcode::add:
+        case Opcode::replace:
+        case Opcode::append:
+        case Opcode::prepend:
+            return execute_storage(store, opcode_, false);
+        case Opcode::setq:
+            return execute_storage(store, Opcode::set, true);
+        case Opcode::addq:
+            return execute_storage(store, Opcode::add, true);
+        case Opcode::replaceq:
+            return execute_storage(store, Opcode::replace, true);
+        case Opcode::appendq:
+            return execute_storage(store, Opcode::append, true);
+        case Opcode::prependq:
+            return execute_storage(store, Opcode::prepend, true);
+
+        case Opcode::del:
+            return execute_delete(store, false);
+        case Opcode::delq:
+            return execute_delete(store, true);
+
+        case Opcode::increment:
+            return execute_arithmetic(store, true, false);
+        case Opcode::decrement:
+            return execute_arithmetic(store, false, false);
+        case Opcode::incrementq:
+            return execute_arithmetic(store, true, true);
+        case Opcode::decrementq:
+            return execute_arithmetic(store, false, true);
+
+        case Opcode::stat:
+            return execute_stat(store);
+
+        case Opcode::noop:
+        case Opcode::quit:
+            return response(Status::no_error);
+        case Opcode::quitq:
+            return Reply{};
+        case Opcode::version: {
+            auto reply = response(Status::no_error, {}, {}, VERSION.size());
+            return reply.append(VERSION);
+        }
+        }
+    } catch (const std::length_error &err) {
+        return error(Status::out_of_memory, err.what());
+    } catch (const LoadingError &err) {
+        return error(Status::temporary_failure, err.what());
+    } catch (const LogError &err) {
+        return error(Status::internal_error, err.what());
+    } catch (const std::bad_alloc &) {
+        return error(Status::out_of_memory, "Out of memory");
+    } catch (const std::exception &err) {
+        // Anything else fails just the command, not the server
+        return error(Status::internal_error, err.what());
+    }
+    return error(Status::unknown_command, "Unknown command");
+}
+
+Reply BinaryCommand::execute_get(KVStore &store, bool quiet, bool with_key,
+                                 bool touch) {
+    if (extras_.size() != (touch ? 4 : 0) || key_.empty() || !value_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+
+    auto val = touch ? store.get_and_touch(key_, exp_time()) : store.get(key_);
+    Stats::add(val.has_value() ? Stats::Counter::get_hits
+                               : Stats::Counter::get_misses);
+    if (!val.has_value()) {
+        if (quiet) {
+            return Reply{};
+        }
+        return with_key ? response(Status::key_not_found, {}, key_)
+                        : error(Status::key_not_found, "Not found");
+    }
+
+    char flags[sizeof(std::uint32_t)];
+    store_be(flags, val->flags);
+    auto reply = response(Status::no_error, {flags, sizeof flags},
+                          with_key ? key_ : std::string_view{},
+                          val->str_val.size(), val->cas);
+    return reply.append(val->str_val);
+}
+
+Reply BinaryCommand::execute_storage(KVStore &store, Opcode op, bool quiet) {
+    bool with_extras = op == Opcode::set || op == Opcode::add ||
+                       op == Opcode::replace;
+    if (extras_.size() != (with_extras ? 8 : 0) || key_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+    // Only whole values can be compared and swapped
+    if (cas_ != 0 && op != Opcode::set && op != Opcode::replace) {
+        return error(Status::not_supported, "Not supported");
+    }
+
+    std::uint32_t flags = 0;
+    int exp_time = 0;
+    if (with_extras) {
+        flags = load_be<std::uint32_t>(extras_.data());
+        exp_time =
+            static_cast<int>(load_be<std::uint32_t>(extras_.data() + 4));
+    }
+
+    Status status = Status::no_error;
+    if (cas_ != 0) {
+        switch (store.cas(key_, cas_, std::string{value_}, flags, exp_time)) {
+        case KVStore::CasResult::stored:
+            break;
+        case KVStore::CasResult::exists:
+            status = Status::key_exists;
+            break;
+        case KVStore::CasResult::not_found:
+            status = Status::key_not_found;
+            break;
+        }
+    } else if (op == Opcode::set) {
+        store.set(std::string{key_}, std::string{value_}, flags, exp_time);
+    } else if (op == Opcode::add) {
+        if (!store.add(std::string{key_}, std::string{value_}, flags,
+                       exp_time)) {
+            status = Status::key_exists;
+        }
+    } else if (op == Opcode::replace) {
+        if (!store.replace(key_, std::string{value_}, flags, exp_time)) {
+            status = Status::key_not_found;
+        }
+    } else if (op == Opcode::append) {
+        if (!store.append(key_, value_)) {
+            status = Status::not_stored;
+        }
+    } else if (op == Opcode::prepend) {
+        if (!store.prepend(key_, value_)) {
+            status = Status::not_stored;
+        }
+    }
+
+    switch (status) {
+    case Status::no_error:
+        return quiet ? Reply{} : response(status);
+    case Status::key_exists:
+        return error(status, "Data exists for key");
+    case Status::key_not_found:
+        return error(status, "Not found");
+    default:
+        return error(status, "Not stored");
+    }
+}
+
+Reply BinaryCommand::execute_touch(KVStore &store) {
+    if (extras_.size() != 4 || key_.empty() || !value_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+    if (!store.touch(key_, exp_time())) {
+        return error(Status::key_not_found, "Not found");
+    }
+    return response(Status::no_error);
+}
+
+Reply BinaryCommand::execute_stat(KVStore &store) {
+    if (!extras_.empty() || !value_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+    auto report = Stats::report(key_, store);
+    if (!report.has_value()) {
+        return error(Status::key_not_found, "Not found");
+    }
+
+    Reply reply;
+    for (const auto &[name, value] : *report) {
+        reply.append(
+            response(Status::no_error, {}, name, value.size()).str());
+        reply.append(value);
+    }
+    reply.append(response(Status::no_error).str());
+    return reply;
+}
+
+Reply BinaryCommand::execute_delete(KVStore &store, bool quiet) {
+    if (!extras_.empty() || key_.empty() || !value_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+    if (!store.del(key_)) {
+        return error(Status::key_not_found, "Not found");
+    }
+    return quiet ? Reply{} : response(Status::no_error);
+}
+
+Reply BinaryCommand::execute_arithmetic(KVStore &store, bool incr,
+                                        bool quiet) {
+    // The delta, the initial value and the expiration of a created counter
+    if (extras_.size() != 20 || key_.empty() || !value_.empty()) {
+        return error(Status::invalid_arguments, "Invalid arguments");
+    }
+    auto delta = load_be<std::uint64_t>(extras_.data());
+    auto initial = load_be<std::uint64_t>(extras_.data() + 8);
+    auto expiration = load_be<std::uint32_t>(extras_.data() + 16);
+
+    auto apply = [&] {
+        return incr ? store.incr(key_, delta) : store.decr(key_, delta);
+    };
+    std::optional<std::uint64_t> number;
+    try {
+        number = apply();
+        // An expiration of all ones means the counter must already exist
+        while (!number.has_value() && expiration != 0xffffffff) {
+            if (store.add(std::string{key_}, std::to_string(initial),
+                          std::uint32_t{0}, static_cast<int>(expiration))) {
+                number = initial;
+            } else {
+                // Lost a race with another writer, so apply the delta
+                number = apply();
+            }
+        }
+    } catch (const std::invalid_argument &err) {
+        return error(Status::non_numeric, err.what());
+    }
+    if (!number.has_value()) {
+        return error(Status::key_not_found, "Not found");
+    }
+    if (quiet) {
+        return Reply{};
+    }
+
+    char value[sizeof(std::uint64_t)];
+    store_be(value, *number);
+    auto reply = response(Status::no_error, {}, {}, sizeof value);
+    return reply.append({value, sizeof value});
+}
+
+int BinaryCommand::exp_time() const {
+    return static_cast<int>(load_be<std::uint32_t>(extras_.data()));
+}
+
+Reply BinaryCommand::response(Status status, std::string_view extras,
+                              std::string_view key, std::size_t value_size,
+                              std::uint64_t cas) const {
+    char header[HEADER_SIZE] = {};
+    header[0] = static_cast<char>(RESPONSE_MAGIC);
+    header[1] = static_cast<char>(opcode_);
+    store_be(header + KEY_LENGTH_OFFSET,
+             static_cast<std::uint16_t>(key.size()));
+    header[EXTRAS_LENGTH_OFFSET] = static_cast<char>(extras.size());
+    store_be(header + STATUS_OFFSET, static_cast<std::uint16_t>(status));
+    store_be(header + BODY_LENGTH_OFFSET,
+             static_cast<std::uint32_t>(extras.size() + key.size() +
+                                        value_size));
+    store_be(header + OPAQUE_OFFSET, opaque_);
+    store_be(header + CAS_OFFSET, cas);
+
+    Reply reply{std::string_view{header, sizeof header}};
+    reply.append(extras).append(key);
+    return reply;
+}
+
+Reply BinaryCommand::error(Status status, std::string_view message) const {
+    auto reply = response(status, {}, {}, message.size());
+    return reply.append(message);
+}
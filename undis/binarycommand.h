@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "kvstore.h"
+#include "reply.h"
+#include "stats.h"
+
+namespace binary_protocol {
+
+inline constexpr std::uint8_t REQUEST_MAGIC = 0x80;
+inline constexpr std::uint8_t RESPONSE_MAGIC = 0x81;
+inline constexpr std::size_t HEADER_SIZE = 24;
+
+enum class Opcode : std::uint8_t {
+    get = 0x00,
+    set = 0x01,
+    add = 0x02,
+    replace = 0x03,
+    del = 0x04,
+    increment = 0x05,
+    decrement = 0x06,
+    quit = 0x07,
+    getq = 0x09,
+    noop = 0x0a,
+    version = 0x0b,
+    getk = 0x0c,
+    getkq = 0x0d,
+    append = 0x0e,
+    prepend = 0x0f,
+    stat = 0x10,
+    setq = 0x11,
+    addq = 0x12,
+    replaceq = 0x13,
+    delq = 0x14,
+    incrementq = 0x15,
+    decrementq = 0x16,
+    quitq = 0x17,
+    appendq = 0x19,
+    prependq = 0x1a,
+    touch = 0x1c,
+    gat = 0x1d,
+    gatq = 0x1e,
+    gatk = 0x23,
+    gatkq = 0x24,
+};
+
+enum class Status : std::uint16_t {
+    no_error = 0x00,
+    key_not_found = 0x01,
+    key_exists = 0x02,
+    value_too_large = 0x03,
+    invalid_arguments = 0x04,
+    not_stored = 0x05,
+    non_numeric = 0x06,
+    unknown_command = 0x81,
+    out_of_memory = 0x82,
+    not_supported = 0x83,
+    internal_error = 0x84,
+    temporary_failure = 0x86,
+};
+
+} // namespace binary_protocol
+
+// A request in the memcached binary protocol: a fixed 24-byte header giving
+// the lengths of the extras, key and value that follow, so that the request
+// is sliced up rather than parsed. Quiet variants of the opcodes only reply
+// on failure, or for gets, on a hit. Gets return the item's version, and a
+// set or replace that carries one is a compare-and-swap.
+class BinaryCommand {
+  public:
+    // Returns the size of the request at the front of `input`, which may be
+    // larger than the input, or nothing if the header is incomplete
+    static std::optional<std::size_t> size(std::string_view input);
+
+    // `request` must hold the whole request
+    explicit BinaryCommand(std::string_view request);
+
+    // Empty for a quiet request that succeeded
+    Reply execute(KVStore &store);
+
+    bool quit() const;
+
+    // What the request's latency is recorded as, if anything
+    std::optional<Stats::Op> op() const;
+
+  private:
+    using Opcode = binary_protocol::Opcode;
+    using Status = binary_protocol::Status;
+
+    // Gets that touch take the expiration in their extras
+    Reply execute_get(KVStore &store, bool quiet, bool with_key,
+                      bool touch = false);
+    Reply execute_touch(KVStore &store);
+    // One response per statistic, ended by one with an empty key
+    Reply execute_stat(KVStore &store);
+    // The expiration at the front of the extras
+    int exp_time() const;
+    Reply execute_storage(KVStore &store, Opcode op, bool quiet);
+    Reply execute_delete(KVStore &store, bool quiet);
+    Reply execute_arithmetic(KVStore &store, bool incr, bool quiet);
+
+    // Header and body of a response; the value is appended by the caller
+    Reply response(Status status, std::string_view extras = {},
+                   std::string_view key = {}, std::size_t value_size = 0,
+                   std::uint64_t cas = 0) const;
+    Reply error(Status status, std::string_view message) const;
+
+    std::uint8_t magic_;
+    Opcode opcode_;
+    std::uint32_t opaque_;
+    std::uint64_t cas_;
+    std::string_view extras_;
+    std::string_view key_;
+    std::string_view value_;
+};
@@ -0,0 +1,54 @@
+#include "checksum.h"
+
+#include <array>
+#include <cstring>
+
+namespace {
+constexpr std::uint32_t POLYNOMIAL = 0x82f63b78; // Reflected 0x1edc6f41
+
+// Slicing-by-8 tables: tables[k][b] is the CRC of byte b followed by k
+// zero bytes, so eight input bytes are folded in per step
+constexpr auto make_tables() {
+    std::array<std::array<std::uint32_t, 256>, 8> tables{};
+    for (std::uint32_t b = 0; b < 256; ++b) {
+        auto crc = b;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+        }
+        tables[0][b] = crc;
+    }
+    for (std::uint32_t b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+            auto prev = tables[k - 1][b];
+            tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xff];
+        }
+    }
+    return tables;
+}
+
+constexpr auto TABLES = make_tables();
+} // namespace
+
+std::uint32_t crc32c(std::string_view data, std::uint32_t crc) noexcept {
+    const auto *p = reinterpret_cast<const unsigned char *>(data.data());
+    auto n = data.size();
+    crc = ~crc;
+
+    while (n >= 8) {
+        // Assumes a little-endian host, as the snapshot format does
+        std::uint32_t lo, hi;
+        std::memcpy(&lo, p, 4);
+        std::memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = TABLES[7][lo & 0xff] ^ TABLES[6][(lo >> 8) & 0xff] ^
+              TABLES[5][(lo >> 16) & 0xff] ^ TABLES[4][lo >> 24] ^
+              TABLES[3][hi & 0xff] ^ TABLES[2][(hi >> 8) & 0xff] ^
+              TABLES[1][(hi >> 16) & 0xff] ^ TABLES[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n-- > 0) {
+        crc = (crc >> 8) ^ TABLES[0][(crc ^ *p++) & 0xff];
+    }
+    return ~crc;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and RocksDB. Pass the
+// previous result as crc to checksum data in pieces.
+std::uint32_t crc32c(std::string_view data, std::uint32_t crc = 0) noexcept;
@@ -0,0 +1,43 @@
+#include "coarseclock.h"
+
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+std::atomic<std::uint32_t> CoarseClock::now_{
+    static_cast<std::uint32_t>(std::time(nullptr))};
+std::atomic<std::uint32_t> CoarseClock::ticks_{0};
+
+// Defined in this file so that any use of the clock links the ticker in
+class Ticker {
+  public:
+    Ticker()
+        : start_{std::chrono::steady_clock::now()},
+          thread_{[this](std::stop_token stoken) { run(stoken); }} {}
+
+  private:
+    void run(std::stop_token stoken) {
+        std::mutex mtx;
+        std::condition_variable_any cv;
+        std::unique_lock lk{mtx};
+        while (!cv.wait_for(lk, stoken, CoarseClock::TICK,
+                            [&stoken] { return stoken.stop_requested(); })) {
+            CoarseClock::now_.store(
+                static_cast<std::uint32_t>(std::time(nullptr)),
+                std::memory_order_relaxed);
+            CoarseClock::ticks_.store(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start_)
+                    .count(),
+                std::memory_order_relaxed);
+        }
+    }
+
+    std::chrono::steady_clock::time_point start_;
+    std::jthread thread_;
+};
+
+namespace {
+Ticker ticker;
+} // namespace
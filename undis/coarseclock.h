@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Process-wide clock for hot paths. A ticker thread refreshes the cached
+// readings every TICK, so reading the time is a relaxed atomic load instead
+// of a call into the C library or the vDSO.
+class CoarseClock {
+  public:
+    static constexpr std::chrono::milliseconds TICK{10};
+
+    // Seconds since the Unix epoch, in the units of StoreValue::exp_time
+    static std::uint32_t now() noexcept {
+        return now_.load(std::memory_order_relaxed);
+    }
+
+    // Milliseconds since the process started; wraps after 49 days, so
+    // compare readings by subtraction
+    static std::uint32_t ticks() noexcept {
+        return ticks_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    friend class Ticker;
+
+    static std::atomic<std::uint32_t> now_;
+    static std::atomic<std::uint32_t> ticks_;
+};
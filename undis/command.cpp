@@ -1,10 +1,57 @@
 #include "command.h"
 
-Command::Command(std::string command) : s_{std::move(command)} { parse(); }
+#include <charconv>
+#include <new>
+#include <span>
 
-CommandStatus Command::set_command(std::string command) {
-    s_ = std::move(command);
-    parse();
+#include "scan.h"
+#include "stats.h"
+
+namespace {
+// Splits a request line at spaces without copying it
+class Tokenizer {
+  public:
+    explicit Tokenizer(std::string_view line) : line_{line} {}
+
+    // Empty once the line is exhausted
+    std::string_view next() {
+        while (pos_ < line_.size() && line_[pos_] == ' ') {
+            ++pos_;
+        }
+        auto end = std::min(scan::find(line_, ' ', pos_), line_.size());
+        auto token = line_.substr(pos_, end - pos_);
+        pos_ = end;
+        return token;
+    }
+
+  private:
+    std::string_view line_;
+    std::size_t pos_ = 0;
+};
+
+template <typename T> bool parse_number(std::string_view str, T &value) {
+    auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+    return res.ec == std::errc{} && res.ptr == str.data() + str.size();
+}
+
+// Status lines in the format of memcached's "stats" command
+template <typename T>
+void append_stat(Reply &reply, std::string_view name, const T &value) {
+    reply.append("STAT ").append(name).append(" ");
+    if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+        reply.append(value);
+    } else {
+        reply.append(std::to_string(value));
+    }
+    reply.append("\r\n");
+}
+} // namespace
+
+Command::Command(std::string_view command) { parse(command); }
+
+CommandStatus Command::set_command(std::string_view command) {
+    command_ = {};
+    parse(command);
     return status();
 }
 
@@ -18,26 +65,47 @@ CommandStatus Command::status() const {
                                                             : valid_command;
 }
 
-std::string Command::execute(KVStore &store) {
+Reply Command::execute(KVStore &store) {
     using namespace command_types;
 
     if (const auto *c = std::get_if<Retrieval>(&command_)) {
-        std::string reply;
-
-        for (const std::string &key : c->keys) {
-            if (auto val = store.get(key); val.has_value()) {
-                reply.append("VALUE ")
-                    .append(key)
-                    .append(" ")
-                    .append(std::to_string(val->flags))
-                    .append(" ")
-                    .append(std::to_string(val->str_val.size()))
-                    .append("\r\n")
-                    .append(val->str_val)
-                    .append("\r\n");
+        Reply reply;
+        std::uint64_t hits = 0;
+        auto append_value = [&reply, &hits,
+                             c](std::string_view key,
+                                const std::optional<StoreValue> &val) {
+            if (!val.has_value()) {
+                return;
+            }
+            ++hits;
+            reply.append("VALUE ")
+                .append(key)
+                .append(" ")
+                .append(std::to_string(val->flags))
+                .append(" ")
+                .append(std::to_string(val->str_val.size()));
+            if (c->with_cas) {
+                reply.append(" ").append(std::to_string(val->cas));
+            }
+            reply.append("\r\n").append(val->str_val).append("\r\n");
+        };
+
+        const auto &keys = c->keys;
+        if (c->touch) {
+            for (auto key : keys) {
+                append_value(key, store.get_and_touch(key, c->exp_time));
+            }
+        } else if (keys.size() == 1) {
+            append_value(keys[0], store.get(keys[0]));
+        } else {
+            auto values = store.multi_get({keys.begin(), keys.size()});
+            for (std::size_t i = 0; i < keys.size(); ++i) {
+                append_value(keys[i], values[i]);
             }
         }
         reply.append("END\r\n");
+        Stats::add(Stats::Counter::get_hits, hits);
+        Stats::add(Stats::Counter::get_misses, keys.size() - hits);
 
         command_ = {};
         return reply;
@@ -47,56 +115,230 @@ std::string Command::execute(KVStore &store) {
         bool deleted = store.del(c->key);
 
         command_ = {};
-        return deleted ? "DELETED\r\n" : "NOT_FOUND\r\n";
+        return Reply{deleted ? "DELETED\r\n" : "NOT_FOUND\r\n"};
+    }
+
+    if (const auto *c = std::get_if<Touch>(&command_)) {
+        bool touched = store.touch(c->key, c->exp_time);
+
+        command_ = {};
+        return Reply{touched ? "TOUCHED\r\n" : "NOT_FOUND\r\n"};
+    }
+
+    if (const auto *c = std::get_if<Arithmetic>(&command_)) {
+        auto number = c->incr ? store.incr(c->key, c->delta)
+                              : store.decr(c->key, c->delta);
+
+        command_ = {};
+        if (!number.has_value()) {
+            return Reply{"NOT_FOUND\r\n"};
+        }
+        return Reply{std::to_string(*number) + "\r\n"};
+    }
+
+    if (const auto *c = std::get_if<Admin>(&command_)) {
+        Reply reply;
+        switch (c->type) {
+        case AdminType::rewrite_log:
+            if (!store.logging()) {
+                reply.append("SERVER_ERROR append-only log disabled\r\n");
+            } else if (!store.rewrite_log()) {
+                reply.append("SERVER_ERROR rewrite already in progress\r\n");
+            } else {
+                reply.append("OK\r\n");
+            }
+            break;
+
+        case AdminType::save_snapshot:
+            if (!store.snapshots()) {
+                reply.append("SERVER_ERROR snapshots disabled\r\n");
+            } else if (!store.save_snapshot()) {
+                reply.append("SERVER_ERROR snapshot already in progress\r\n");
+            } else {
+                reply.append("OK\r\n");
+            }
+            break;
+
+        case AdminType::snapshot_status:
+            if (auto status = store.snapshot_status(); status.has_value()) {
+                append_stat(reply, "in_progress", status->in_progress);
+                append_stat(reply, "items_written", status->items_written);
+                append_stat(reply, "items_total", status->items_total);
+                append_stat(reply, "last_save", status->last_save);
+                append_stat(reply, "last_duration_ms",
+                            status->last_duration.count());
+                append_stat(reply, "last_status",
+                            status->last_ok ? "ok" : "failed");
+                append_stat(reply, "changes_since_save", status->changes);
+                reply.append("END\r\n");
+            } else {
+                reply.append("SERVER_ERROR snapshots disabled\r\n");
+            }
+            break;
+        }
+
+        command_ = {};
+        return reply;
+    }
+
+    if (const auto *c = std::get_if<Statistics>(&command_)) {
+        auto report = Stats::report(c->group, store);
+        command_ = {};
+        if (!report.has_value()) {
+            throw std::invalid_argument{"unknown stats group"};
+        }
+
+        Reply reply;
+        for (const auto &[name, value] : *report) {
+            append_stat(reply, name, value);
+        }
+        reply.append("END\r\n");
+        return reply;
     }
 
     throw std::invalid_argument{"Invalid command"};
 }
 
-void Command::parse() {
+bool CommandBatch::add(Command &c, std::string_view data) {
     using namespace command_types;
 
-    if (s_.empty()) {
-        return;
+    Kind kind;
+    if (auto *s = std::get_if<Storage>(&c.command_)) {
+        if (s->type != StorageType::set || data.size() != s->bytes) {
+            return false;
+        }
+        sets_.emplace_back(
+            std::move(s->key),
+            StoreValue{std::string{data}, s->flags, s->exp_time});
+        kind = Kind::set;
+    } else if (auto *d = std::get_if<Deletion>(&c.command_)) {
+        deletes_.push_back(d->key);
+        kind = Kind::del;
+    } else {
+        return false;
+    }
+
+    c.command_ = {};
+    if (runs_.empty() || runs_.back().first != kind) {
+        runs_.emplace_back(kind, 0);
+    }
+    ++runs_.back().second;
+    return true;
+}
+
+std::vector<Reply> CommandBatch::execute(KVStore &store) {
+    std::vector<Reply> replies;
+    replies.reserve(sets_.size() + deletes_.size());
+    std::span sets{sets_};
+    std::span deletes{std::as_const(deletes_)};
+    for (auto [kind, n] : runs_) {
+        std::vector<KVStore::BatchResult> results;
+        if (kind == Kind::set) {
+            results = store.multi_set(sets.first(n));
+            sets = sets.subspan(n);
+        } else {
+            results = store.multi_delete(deletes.first(n));
+            deletes = deletes.subspan(n);
+        }
+        for (const auto &result : results) {
+            if (result.error) {
+                replies.push_back(error_reply(result.error));
+            } else if (kind == Kind::set) {
+                replies.emplace_back("STORED\r\n");
+            } else {
+                replies.emplace_back(result.done ? "DELETED\r\n"
+                                                 : "NOT_FOUND\r\n");
+            }
+        }
     }
 
-    std::istringstream is{s_};
+    // Replaced values are released here, outside the shard locks
+    sets_.clear();
+    deletes_.clear();
+    runs_.clear();
+    return replies;
+}
+
+void Command::parse(std::string_view command) {
+    using namespace command_types;
 
-    std::string command;
-    is >> command;
+    Tokenizer tokens{command};
+    auto name = tokens.next();
 
-    auto it = storage_type_map.find(command);
-    if (it != storage_type_map.end()) {
-        std::string key;
+    if (auto type = lookup(storage_type_map, name); type.has_value()) {
+        auto key = tokens.next();
         std::uint32_t flags;
         int exp_time;
         unsigned bytes;
-        is >> key >> flags >> exp_time >> std::ws;
-
-        if (!is || is.peek() == '-') {
+        std::uint64_t cas_unique = 0;
+        if (!key.empty() && parse_number(tokens.next(), flags) &&
+            parse_number(tokens.next(), exp_time) &&
+            parse_number(tokens.next(), bytes) &&
+            (*type != StorageType::cas ||
+             parse_number(tokens.next(), cas_unique))) {
+            command_.emplace<Storage>(Storage{*type, std::string{key}, flags,
+                                              exp_time, bytes, cas_unique});
+        }
+    } else if (name == "get" || name == "gets" || name == "gat" ||
+               name == "gats") {
+        Retrieval retrieval;
+        retrieval.with_cas = name == "gets" || name == "gats";
+        retrieval.touch = name.starts_with("gat");
+        if (retrieval.touch &&
+            !parse_number(tokens.next(), retrieval.exp_time)) {
             return;
         }
-        is >> bytes;
-
-        if (is) {
-            command_.emplace<Storage>(
-                Storage{it->second, key, flags, exp_time, bytes});
+        for (auto key = tokens.next(); !key.empty(); key = tokens.next()) {
+            retrieval.keys.push_back(key);
         }
-    } else if (command == "get") {
-        std::vector<std::string> keys;
-        std::copy(std::istream_iterator<std::string>{is},
-                  std::istream_iterator<std::string>{},
-                  std::back_inserter(keys));
-
-        if (!keys.empty()) {
-            command_.emplace<Retrieval>(Retrieval{keys});
+        if (!retrieval.keys.empty()) {
+            command_.emplace<Retrieval>(std::move(retrieval));
         }
-    } else if (command == "delete") {
-        std::string key;
-        is >> key;
-
-        if (is) {
+    } else if (name == "delete") {
+        if (auto key = tokens.next(); !key.empty()) {
             command_.emplace<Deletion>(Deletion{key});
         }
+    } else if (name == "touch") {
+        auto key = tokens.next();
+        int exp_time;
+        if (!key.empty() && parse_number(tokens.next(), exp_time)) {
+            command_.emplace<Touch>(Touch{key, exp_time});
+        }
+    } else if (name == "incr" || name == "decr") {
+        auto key = tokens.next();
+        std::uint64_t delta;
+        if (!key.empty() && parse_number(tokens.next(), delta)) {
+            command_.emplace<Arithmetic>(
+                Arithmetic{name == "incr", key, delta});
+        }
+    } else if (name == "stats") {
+        command_.emplace<Statistics>(Statistics{tokens.next()});
+    } else if (auto admin = lookup(admin_type_map, name);
+               admin.has_value()) {
+        command_.emplace<Admin>(Admin{*admin});
+    }
+}
+
+Reply error_reply(std::exception_ptr error) {
+    using namespace std::literals;
+
+    Reply reply;
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::invalid_argument &err) {
+        reply.append("CLIENT_ERROR "sv).append(err.what()).append(
+            "\r\nERROR\r\n"sv);
+    } catch (const std::length_error &err) {
+        reply.append("SERVER_ERROR "sv).append(err.what()).append("\r\n"sv);
+    } catch (const LoadingError &err) {
+        reply.append("SERVER_ERROR "sv).append(err.what()).append("\r\n"sv);
+    } catch (const LogError &err) {
+        reply.append("SERVER_ERROR "sv).append(err.what()).append("\r\n"sv);
+    } catch (const std::bad_alloc &) {
+        reply.append("SERVER_ERROR out of memory\r\n"sv);
+    } catch (const std::exception &err) {
+        // Anything else fails just the command, not the server
+        reply.append("SERVER_ERROR "sv).append(err.what()).append("\r\n"sv);
     }
+    return reply;
 }
@@ -4,44 +4,76 @@
 #include <concepts>
 #include <cstdint>
 #include <cstring>
-#include <iterator>
-#include <sstream>
+#include <exception>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "commandtypes.h"
 #include "kvstore.h"
+#include "reply.h"
 
 enum class CommandStatus { valid_command, invalid_command, data_required };
 
+// A text protocol request line. The line is tokenized in place rather than
+// copied, so it must outlive the command until execute() is called, unless
+// the command still needs its data.
 class Command {
   public:
     using enum CommandStatus;
 
     Command() = default;
-    explicit Command(std::string command);
+    explicit Command(std::string_view command);
 
-    CommandStatus set_command(std::string command);
+    CommandStatus set_command(std::string_view command);
     CommandStatus status() const;
 
     template <typename T>
         requires std::convertible_to<T, std::string>
-    std::string execute(KVStore &store, T &&data);
-    std::string execute(KVStore &store);
+    Reply execute(KVStore &store, T &&data);
+    Reply execute(KVStore &store);
 
   private:
-    void parse();
+    void parse(std::string_view command);
 
-    std::string s_;
     command_types::CommandVariant command_;
+
+    friend class CommandBatch;
 };
 
+// Consecutive sets and deletes from a pipeline, collected so that each run
+// of them is executed with one lock acquisition per shard. Deletes refer to
+// their request lines, which must outlive the batch.
+class CommandBatch {
+  public:
+    // Takes over a set along with its data, or a delete. Returns false for
+    // other commands, which must only be executed after the batch.
+    bool add(Command &c, std::string_view data = {});
+
+    bool empty() const { return runs_.empty(); }
+
+    // Executes and clears the batch, returning the replies in order
+    std::vector<Reply> execute(KVStore &store);
+
+  private:
+    enum class Kind { set, del };
+
+    std::vector<std::pair<std::string, StoreValue>> sets_;
+    std::vector<std::string_view> deletes_;
+    // Lengths of the runs of each kind, in order
+    std::vector<std::pair<Kind, std::size_t>> runs_;
+};
+
+// The reply to an exception thrown by a command's execution. Exceptions
+// that are not the client's or the store's doing are rethrown.
+Reply error_reply(std::exception_ptr error);
+
 template <typename T>
     requires std::convertible_to<T, std::string>
-std::string Command::execute(KVStore &store, T &&data) {
+Reply Command::execute(KVStore &store, T &&data) {
     using namespace command_types;
 
     if (auto *c = std::get_if<Storage>(&command_)) {
@@ -58,6 +90,22 @@ std::string Command::execute(KVStore &store, T &&data) {
 
         bool stored = false;
         switch (c->type) {
+        case StorageType::cas: {
+            auto result = store.cas(c->key, c->cas_unique,
+                                    std::forward<T>(data), c->flags,
+                                    c->exp_time);
+            command_ = {};
+            switch (result) {
+            case KVStore::CasResult::stored:
+                return Reply{"STORED\r\n"};
+            case KVStore::CasResult::exists:
+                return Reply{"EXISTS\r\n"};
+            case KVStore::CasResult::not_found:
+                return Reply{"NOT_FOUND\r\n"};
+            }
+            break;
+        }
+
         case StorageType::set:
             store.set(std::move(c->key), std::forward<T>(data), c->flags,
                       c->exp_time);
@@ -84,7 +132,7 @@ std::string Command::execute(KVStore &store, T &&data) {
         }
 
         command_ = {};
-        return stored ? "STORED\r\n" : "NOT_STORED\r\n";
+        return Reply{stored ? "STORED\r\n" : "NOT_STORED\r\n"};
     }
 
     throw std::invalid_argument{"Invalid command"};
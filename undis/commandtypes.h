@@ -1,37 +1,103 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
 #include <variant>
-#include <vector>
+
+#include "smallvector.h"
 
 namespace command_types {
 
-enum class StorageType { set, add, replace, append, prepend };
+enum class StorageType { set, add, replace, append, prepend, cas };
 
-const std::unordered_map<std::string, StorageType> storage_type_map = {
-    {"set", StorageType::set},         {"add", StorageType::add},
-    {"replace", StorageType::replace}, {"append", StorageType::append},
-    {"prepend", StorageType::prepend},
-};
+inline constexpr std::array<std::pair<std::string_view, StorageType>, 6>
+    storage_type_map = {{
+        {"set", StorageType::set},
+        {"add", StorageType::add},
+        {"replace", StorageType::replace},
+        {"append", StorageType::append},
+        {"prepend", StorageType::prepend},
+        {"cas", StorageType::cas},
+    }};
+
+enum class AdminType { rewrite_log, save_snapshot, snapshot_status };
+
+inline constexpr std::array<std::pair<std::string_view, AdminType>, 3>
+    admin_type_map = {{
+        {"bgrewriteaof", AdminType::rewrite_log},
+        {"bgsave", AdminType::save_snapshot},
+        {"lastsave", AdminType::snapshot_status},
+    }};
 
+// The maps are small enough that a linear scan beats hashing
+template <typename Map>
+auto lookup(const Map &map, std::string_view name)
+    -> std::optional<typename Map::value_type::second_type> {
+    for (const auto &[key, value] : map) {
+        if (key == name) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+// Keys of a get that are stored without allocating
+inline constexpr std::size_t INLINE_KEYS = 16;
+
+// Outlives the request line while waiting for its data, so it owns its key
 struct Storage {
     StorageType type;
     std::string key;
     std::uint32_t flags;
     int exp_time;
     unsigned bytes;
+    // The version a cas expects
+    std::uint64_t cas_unique = 0;
 };
 
+// Refers to the request line, which must outlive it
 struct Retrieval {
-    std::vector<std::string> keys;
+    SmallVector<std::string_view, INLINE_KEYS> keys;
+    // gets also replies with each item's version
+    bool with_cas = false;
+    // gat and gats also set each item's expiration
+    bool touch = false;
+    int exp_time = 0;
 };
 
+// Refers to the request line, which must outlive it
 struct Deletion {
-    std::string key;
+    std::string_view key;
+};
+
+// Refers to the request line, which must outlive it
+struct Touch {
+    std::string_view key;
+    int exp_time;
+};
+
+// Refers to the request line, which must outlive it
+struct Arithmetic {
+    bool incr;
+    std::string_view key;
+    std::uint64_t delta;
+};
+
+struct Admin {
+    AdminType type;
+};
+
+// Refers to the request line, which must outlive it
+struct Statistics {
+    std::string_view group;
 };
 
 using CommandVariant =
-    std::variant<std::monostate, Storage, Retrieval, Deletion>;
+    std::variant<std::monostate, Storage, Retrieval, Deletion, Touch,
+                 Arithmetic, Admin, Statistics>;
 
 } // namespace command_types
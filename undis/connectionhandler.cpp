@@ -1,86 +1,65 @@
 #include "connectionhandler.h"
 
-ConnectionHandler::ConnectionHandler(KVStore &store, SOCKET newfd)
-    : store_{store}, newfd_{newfd}, buf_{}, buf_pos_{0} {}
+#include "stats.h"
+
+ConnectionHandler::ConnectionHandler(KVStore &store, SOCKET newfd,
+                                     const ServerOptions &options)
+    : store_{store}, newfd_{newfd}, options_{options}, buf_{} {}
 
 void ConnectionHandler::operator()() {
-    using namespace std::literals;
+    Session session{store_, options_.prompt};
+    ReplyQueue out;
+    std::string in;
 
     while (true) {
-        send_str("undis > "sv);
-        std::string s{receive_line()};
-        if (s == "quit") {
+        int nread = recv(newfd_, buf_.data(), BUFFER_SIZE, 0);
+        Stats::add(Stats::Counter::syscalls);
+        if (nread == 0 || nread == SOCKET_ERROR) {
             break;
         }
+        Stats::add(Stats::Counter::bytes_read, nread);
 
-        Command c{std::move(s)};
-        try {
-            switch (c.status()) {
-            case CommandStatus::valid_command:
-                send_str(c.execute(store_));
-                break;
-            case CommandStatus::data_required:
-                send_str(c.execute(store_, receive_line()));
-                break;
-            case CommandStatus::invalid_command:
-                send_str("ERROR\r\n"sv);
-                break;
-            }
-        } catch (const std::invalid_argument &err) {
-            std::string err_str{"CLIENT_ERROR "sv};
-            err_str += err.what();
-            err_str += "\r\nERROR\r\n"sv;
-            send_str(err_str);
-        }
-    }
-
-    Server::close_socket(newfd_);
-}
-
-int ConnectionHandler::send_str(std::string_view s) const {
-    int sent = 0;
-    int to_send = s.size();
-
-    int n = 0;
-    while (sent < s.size()) {
-        n = send(newfd_, s.data() + sent, to_send, 0);
-        if (n == -1) {
+        in.append(buf_.data(), nread);
+        in.erase(0, session.process(in, out));
+        if (!flush(out) || session.closed()) {
             break;
         }
-
-        sent += n;
-        to_send -= n;
     }
 
-    return n;
+    Server::close_socket(newfd_);
+    Stats::connection_closed();
 }
 
-std::string ConnectionHandler::receive_line() {
-    constexpr std::string_view crlf = "\r\n";
-    std::string line;
-
-    while (true) {
-        auto it = buf_.begin() + buf_pos_;
-        int nread = recv(newfd_, &*it, BUFFER_SIZE - buf_pos_, 0);
-        if (nread == 0 || nread == SOCKET_ERROR) {
-            return "quit";
+bool ConnectionHandler::flush(ReplyQueue &out) const {
+    std::vector<std::string_view> bufs;
+    while (!out.empty()) {
+        bufs.clear();
+#ifdef _WIN32
+        out.buffers(bufs, 1);
+        int n = send(newfd_, bufs[0].data(), bufs[0].size(), 0);
+#else
+        // Gather the text and the shared value buffers into one call
+        out.buffers(bufs, IOV_MAX);
+        std::vector<iovec> iov;
+        iov.reserve(bufs.size());
+        std::size_t gathered = 0;
+        for (auto buf : bufs) {
+            iov.push_back({const_cast<char *>(buf.data()), buf.size()});
+            gathered += buf.size();
         }
-
-        auto buf_end = it + nread;
-        auto line_end = std::search(it, buf_end, crlf.begin(), crlf.end());
-
-        line.append(it, line_end);
-
-        auto dist = std::distance(line_end, buf_end);
-        if (dist == 2) {
-            return line;
-        }
-
-        if (dist == 0) {
-            buf_pos_ = 0;
-        } else {
-            buf_pos_ = dist - 2;
-            std::copy(line_end + 2, buf_end, buf_.begin());
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        ssize_t n = sendmsg(
+            newfd_, &msg,
+            Server::send_flags(options_, gathered < out.size()));
+#endif
+        Stats::add(Stats::Counter::syscalls);
+        if (n == SOCKET_ERROR) {
+            return false;
         }
+        Stats::add(Stats::Counter::bytes_written, n);
+        out.consume(n);
     }
+    return true;
 }
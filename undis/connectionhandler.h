@@ -2,30 +2,32 @@
 
 #include <algorithm>
 #include <array>
-#include <stdexcept>
 #include <string>
 #include <string_view>
-#include <utility>
+#include <vector>
 
-#include "command.h"
+#include "reply.h"
 #include "server.h"
+#include "session.h"
 
 class KVStore;
 
+// Serves one connection on a dedicated thread with blocking socket calls
 class ConnectionHandler {
   public:
-    ConnectionHandler(KVStore &store, SOCKET newfd);
+    ConnectionHandler(KVStore &store, SOCKET newfd,
+                      const ServerOptions &options);
 
     void operator()();
 
   private:
     KVStore &store_;
     SOCKET newfd_;
+    ServerOptions options_;
 
     static constexpr std::size_t BUFFER_SIZE = 1024;
     std::array<char, BUFFER_SIZE> buf_;
-    std::size_t buf_pos_;
 
-    int send_str(std::string_view s) const;
-    std::string receive_line();
+    // Writes out every queued reply. Returns false on error.
+    bool flush(ReplyQueue &out) const;
 };
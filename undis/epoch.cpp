@@ -0,0 +1,122 @@
+#include "epoch.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace epoch {
+namespace {
+// A thread's pin, on a line of its own: the epoch it pinned at, shifted
+// left by one, with the low bit set while pinned
+struct alignas(64) Record {
+    std::atomic<std::uint64_t> state{0};
+    std::atomic<bool> owned{true};
+    Record *next = nullptr;
+};
+
+alignas(64) std::atomic<std::uint64_t> global_epoch{0};
+// Records are never freed: threads that exit leave theirs to new threads
+std::atomic<Record *> records{nullptr};
+
+Record &acquire_record() {
+    for (auto *r = records.load(std::memory_order_acquire); r != nullptr;
+         r = r->next) {
+        bool owned = false;
+        if (!r->owned.load(std::memory_order_relaxed) &&
+            r->owned.compare_exchange_strong(owned, true,
+                                             std::memory_order_acquire)) {
+            return *r;
+        }
+    }
+    auto *r = new Record;
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+    return *r;
+}
+
+struct Local {
+    Local() = default;
+    Local(const Local &) = delete;
+    Local &operator=(const Local &) = delete;
+    ~Local() {
+        if (record != nullptr) {
+            record->owned.store(false, std::memory_order_release);
+        }
+    }
+
+    Record *record = nullptr;
+    unsigned depth = 0;
+};
+thread_local Local local;
+
+// The epoch, after advancing it if every pinned thread has seen it
+std::uint64_t advance() {
+    auto epoch = global_epoch.load(std::memory_order_seq_cst);
+    for (auto *r = records.load(std::memory_order_acquire); r != nullptr;
+         r = r->next) {
+        auto state = r->state.load(std::memory_order_seq_cst);
+        if ((state & 1) != 0 && (state >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    // Another thread may have advanced it first
+    if (global_epoch.compare_exchange_strong(epoch, epoch + 1,
+                                             std::memory_order_seq_cst)) {
+        ++epoch;
+    }
+    return epoch;
+}
+} // namespace
+
+Guard::Guard() {
+    if (local.depth == 0) {
+        if (local.record == nullptr) {
+            local.record = &acquire_record();
+        }
+        local.record->state.store(
+            (global_epoch.load(std::memory_order_relaxed) << 1) | 1,
+            std::memory_order_relaxed);
+        // The pin must be visible before anything the reader loads next
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    ++local.depth;
+}
+
+Guard::~Guard() {
+    if (--local.depth == 0) {
+        local.record->state.store(0, std::memory_order_release);
+    }
+}
+
+RetireList::~RetireList() {
+    for (auto &r : retired_) {
+        r.free(r.ptr);
+    }
+}
+
+void RetireList::retire(void *ptr, Free free) {
+    // Readers that pin after the epoch is read can no longer reach ptr
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    retired_.push_back(
+        {global_epoch.load(std::memory_order_relaxed), ptr, free});
+}
+
+void RetireList::reserve(std::size_t n) {
+    if (retired_.capacity() - retired_.size() < n) {
+        retired_.reserve(
+            std::max(2 * retired_.capacity(), retired_.size() + n));
+    }
+}
+
+void RetireList::collect() {
+    auto epoch = advance();
+    auto it = retired_.begin();
+    for (; it != retired_.end() && it->epoch + 2 <= epoch; ++it) {
+        it->free(it->ptr);
+    }
+    retired_.erase(retired_.begin(), it);
+}
+
+} // namespace epoch
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Epoch-based reclamation (Fraser, "Practical lock-freedom"), so that
+// readers can walk shared structures without locks while writers unlink
+// and free parts of them. Readers pin their thread with a Guard for as long
+// as they use anything they found. Writers retire what they unlink to a
+// RetireList instead of freeing it. A global epoch only advances once every
+// pinned thread has seen it, so what was retired two epochs ago can no
+// longer be in use and is freed.
+//
+// Pinning stores to a cache line of the thread's own and fences, so readers
+// never write to a line that other threads share.
+namespace epoch {
+
+// Pins the calling thread. Guards nest.
+class Guard {
+  public:
+    // Throws std::bad_alloc the first time a thread pins
+    Guard();
+    ~Guard();
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+};
+
+// Objects retired by one writer at a time, such as the holders of a lock,
+// and freed in the order they were retired
+class RetireList {
+  public:
+    using Free = void (*)(void *) noexcept;
+
+    RetireList() = default;
+    // Frees everything, so no reader may still be pinned on what is left
+    ~RetireList();
+    RetireList(const RetireList &) = delete;
+    RetireList &operator=(const RetireList &) = delete;
+
+    // ptr must already be unreachable for readers that pin from now on.
+    // Throws std::bad_alloc.
+    void retire(void *ptr, Free free);
+    // Makes room for n more retire calls that will not throw. Throws
+    // std::bad_alloc.
+    void reserve(std::size_t n);
+    // Advances the epoch if every pinned thread has seen it, and frees what
+    // no reader can still be using
+    void collect();
+    std::size_t size() const noexcept { return retired_.size(); }
+
+  private:
+    struct Retired {
+        std::uint64_t epoch;
+        void *ptr;
+        Free free;
+    };
+    std::vector<Retired> retired_;
+};
+
+} // namespace epoch
@@ -0,0 +1,264 @@
+#include "eventloop.h"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <climits>
+#include <string_view>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "stats.h"
+#include "threadpool.h"
+
+EventLoop::EventLoop(SOCKET listen_fd, KVStore &store, ThreadPool &pool,
+                     const ServerOptions &options)
+    : listen_fd_{listen_fd}, epfd_{epoll_create1(EPOLL_CLOEXEC)},
+      wakefd_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)}, store_{store},
+      pool_{pool}, options_{options}, read_buf_(READ_SIZE) {
+    if (epfd_ == -1 || wakefd_ == -1) {
+        throw std::runtime_error{"epoll setup failed."};
+    }
+
+    // Several loops may wait on the listener; wake only one per connection
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, listen_fd_, &ev) == -1) {
+        throw std::runtime_error{"epoll_ctl failed."};
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakefd_;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev) == -1) {
+        throw std::runtime_error{"epoll_ctl failed."};
+    }
+}
+
+EventLoop::~EventLoop() {
+    for (auto &[fd, conn] : conns_) {
+        Server::close_socket(fd);
+    }
+    ::close(wakefd_);
+    ::close(epfd_);
+}
+
+void EventLoop::run(const volatile std::sig_atomic_t &stop) {
+    std::vector<epoll_event> events(MAX_EVENTS);
+
+    while (true) {
+        // Workers still reference busy connections, so wait for them on the
+        // way out
+        if (!stopping_ && stop) {
+            stopping_ = true;
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, listen_fd_, nullptr);
+        }
+        if (stopping_ && busy_count_ == 0) {
+            break;
+        }
+
+        int n = epoll_wait(epfd_, events.data(), MAX_EVENTS, WAIT_TIMEOUT_MS);
+        ++syscalls_;
+        for (int i = 0; i < n; ++i) {
+            auto *ptr = events[i].data.ptr;
+            if (ptr == nullptr) {
+                if (!stopping_) {
+                    accept_all();
+                }
+            } else if (ptr == &wakefd_) {
+                on_completions();
+            } else {
+                on_event(*static_cast<Connection *>(ptr), events[i].events);
+            }
+        }
+        closed_.clear();
+        Stats::add(Stats::Counter::syscalls, std::exchange(syscalls_, 0));
+    }
+}
+
+void EventLoop::accept_all() {
+    while (true) {
+        SOCKET fd =
+            accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        ++syscalls_;
+        if (fd == INVALID_SOCKET) {
+            // EAGAIN once drained; other loops may have raced us to it
+            return;
+        }
+        Stats::connection_opened();
+        Server::configure_socket(fd, options_);
+
+        auto &conn = *conns_
+                          .emplace(fd, std::make_unique<Connection>(
+                                           fd, store_, options_.prompt))
+                          .first->second;
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &conn;
+        ++syscalls_;
+        if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(conn);
+            continue;
+        }
+    }
+}
+
+void EventLoop::on_event(Connection &conn, std::uint32_t events) {
+    if (conn.fd == INVALID_SOCKET) {
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        conn.readable = true;
+    }
+    if (!conn.busy) {
+        resume(conn);
+    }
+}
+
+void EventLoop::read_all(Connection &conn) {
+    // Otherwise the input waits in the socket, with readable still set
+    while (conn.out.size() < MAX_PENDING_OUTPUT &&
+           !(conn.unprocessed && conn.in.size() >= MAX_PENDING_INPUT)) {
+        auto n = recv(conn.fd, read_buf_.data(), read_buf_.size(), 0);
+        ++syscalls_;
+        if (n > 0) {
+            Stats::add(Stats::Counter::bytes_read, n);
+            conn.in.append(read_buf_.data(), n);
+            conn.unprocessed = true;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        conn.readable = false;
+        if (n == 0) {
+            conn.eof = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn.broken = true;
+        }
+        return;
+    }
+}
+
+void EventLoop::flush(Connection &conn) {
+    std::vector<std::string_view> bufs;
+    std::vector<iovec> iov;
+    while (!conn.out.empty()) {
+        bufs.clear();
+        conn.out.buffers(bufs, IOV_MAX);
+
+        iov.clear();
+        std::size_t gathered = 0;
+        for (auto buf : bufs) {
+            iov.push_back({const_cast<char *>(buf.data()), buf.size()});
+            gathered += buf.size();
+        }
+
+        msghdr msg{};
+        msg.msg_iov = iov.data();
+        msg.msg_iovlen = iov.size();
+        auto n = sendmsg(
+            conn.fd, &msg,
+            Server::send_flags(options_, gathered < conn.out.size()));
+        ++syscalls_;
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn.broken = true;
+            }
+            // Otherwise EPOLLOUT signals when to continue
+            return;
+        }
+        Stats::add(Stats::Counter::bytes_written, n);
+        conn.out.consume(n);
+    }
+}
+
+void EventLoop::dispatch(Connection &conn) {
+    conn.busy = true;
+    conn.unprocessed = false;
+    ++busy_count_;
+    pool_.queue_job([this, c = &conn]() {
+        c->in.erase(0, c->session.process(c->in, c->out));
+        complete(c);
+    });
+}
+
+void EventLoop::complete(Connection *conn) {
+    bool was_empty;
+    {
+        std::scoped_lock lk{completed_mtx_};
+        was_empty = completed_.empty();
+        completed_.push_back(conn);
+    }
+    if (was_empty) {
+        eventfd_write(wakefd_, 1);
+    }
+}
+
+void EventLoop::on_completions() {
+    eventfd_t count;
+    eventfd_read(wakefd_, &count);
+    ++syscalls_;
+
+    std::vector<Connection *> completed;
+    {
+        std::scoped_lock lk{completed_mtx_};
+        completed.swap(completed_);
+    }
+
+    for (auto *conn : completed) {
+        conn->busy = false;
+        --busy_count_;
+        resume(*conn);
+    }
+}
+
+void EventLoop::resume(Connection &conn) {
+    flush(conn);
+    if (conn.readable && !conn.session.closed() && !conn.broken) {
+        read_all(conn);
+    }
+
+    if (conn.broken) {
+        close(conn);
+        return;
+    }
+    // After quit, close once the replies before it are sent
+    if (conn.session.closed()) {
+        if (conn.out.empty()) {
+            close(conn);
+        }
+        return;
+    }
+
+    if (conn.unprocessed && !stopping_ &&
+        conn.out.size() < MAX_PENDING_OUTPUT) {
+        dispatch(conn);
+        return;
+    }
+
+    // After EOF, close once the last replies are sent
+    if (conn.eof && conn.out.empty()) {
+        close(conn);
+    }
+}
+
+void EventLoop::close(Connection &conn) {
+    SOCKET fd = std::exchange(conn.fd, INVALID_SOCKET);
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    Server::close_socket(fd);
+    syscalls_ += 2;
+    Stats::connection_closed();
+
+    // Later events in the current batch may still point to the connection
+    auto it = conns_.find(fd);
+    closed_.push_back(std::move(it->second));
+    conns_.erase(it);
+}
+
+#endif
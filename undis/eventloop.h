@@ -0,0 +1,98 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "reply.h"
+#include "server.h"
+#include "session.h"
+
+class KVStore;
+
+// Edge-triggered epoll reactor. The loop thread owns its sockets and does all
+// reading and writing without blocking; parsing and executing requests is
+// handed to the thread pool, one batch per connection at a time so that
+// replies keep their order.
+class EventLoop {
+  public:
+    EventLoop(SOCKET listen_fd, KVStore &store, ThreadPool &pool,
+              const ServerOptions &options);
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop(EventLoop &&) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+    EventLoop &operator=(EventLoop &&) = delete;
+
+    // Serves clients until `stop` is set
+    void run(const volatile std::sig_atomic_t &stop);
+
+  private:
+    struct Connection {
+        Connection(SOCKET fd, KVStore &store, bool prompt)
+            : fd{fd}, session{store, prompt} {}
+
+        SOCKET fd;
+        Session session;
+        std::string in;
+        ReplyQueue out;
+        // The session, `in` and `out` belong to a worker while busy
+        bool busy = false;
+        // The socket may have input that has not been read yet
+        bool readable = false;
+        // `in` has data the session has not seen yet
+        bool unprocessed = false;
+        // The client sent everything it will send; requests already in `in`
+        // are still answered
+        bool eof = false;
+        // The socket failed, so nothing more can be sent either
+        bool broken = false;
+    };
+
+    // Stop handing input to workers while this much output is unsent
+    static constexpr std::size_t MAX_PENDING_OUTPUT = 1 << 20;
+    // Stop reading while this much input waits for the session. Input it
+    // has seen, such as a partial request, does not count.
+    static constexpr std::size_t MAX_PENDING_INPUT = 1 << 20;
+    static constexpr std::size_t READ_SIZE = 64 * 1024;
+    static constexpr int MAX_EVENTS = 256;
+    static constexpr int WAIT_TIMEOUT_MS = 200;
+
+    void accept_all();
+    void on_event(Connection &conn, std::uint32_t events);
+    // Reads until the socket is drained or input or output backs up
+    void read_all(Connection &conn);
+    void flush(Connection &conn);
+    void dispatch(Connection &conn);
+    void complete(Connection *conn);
+    void on_completions();
+    // Continues after a worker finishes or output drains
+    void resume(Connection &conn);
+    void close(Connection &conn);
+
+    SOCKET listen_fd_;
+    int epfd_;
+    int wakefd_;
+    KVStore &store_;
+    ThreadPool &pool_;
+    ServerOptions options_;
+
+    std::unordered_map<SOCKET, std::unique_ptr<Connection>> conns_;
+    std::vector<std::unique_ptr<Connection>> closed_;
+    unsigned busy_count_ = 0;
+    bool stopping_ = false;
+    // Added to the thread's stats once per iteration
+    std::uint64_t syscalls_ = 0;
+    std::vector<char> read_buf_;
+
+    std::mutex completed_mtx_;
+    std::vector<Connection *> completed_;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "epoch.h"
+
+// Readers' vector loads race with a writer's stores to single control
+// bytes, which x86 makes harmless since every byte is read whole, but which
+// ThreadSanitizer would report, so it gets the scalar atomic loads
+#if defined(__SANITIZE_THREAD__)
+#define UNDIS_INDEX_TSAN
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define UNDIS_INDEX_TSAN
+#endif
+#endif
+
+#if (defined(__SSE2__) || defined(_M_X64) ||                                   \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) &&                              \
+    !defined(UNDIS_INDEX_TSAN)
+#include <emmintrin.h>
+#define UNDIS_INDEX_SSE2
+#endif
+
+// An open-addressing hash index in the style of Swiss tables, of pointers to
+// elements it does not own, found by a string_view key that KeyOf extracts
+// from them. Each slot has a control byte: empty, deleted, or full with the
+// top 7 bits of the element's hash. A lookup compares a group of 16 control
+// bytes against its hash fragment at once, with SSE2 where available, and
+// only compares keys for the matches, so a miss seldom touches an element.
+//
+// Groups are probed quadratically from a position taken from the hash, and
+// the table grows to keep at most 7/8 of its slots in use. Erased slots
+// become tombstones unless no probe could have passed them, and are
+// reclaimed by insertion and rehashing.
+//
+// find may run on any thread while one writer at a time changes the index,
+// provided the reader is pinned with an epoch::Guard until it is done with
+// the element. Slots and control bytes are updated with atomic stores, and
+// a table the index outgrows is retired rather than freed, until collect
+// finds that no reader can still be probing it; elements that are erased or
+// replaced must be retired by their owner in the same way. Everything else,
+// iteration included, is for the writer.
+template <typename T, typename KeyOf,
+          typename Hash = std::hash<std::string_view>>
+class FlatIndex {
+    static constexpr std::size_t GROUP_WIDTH = 16;
+    static constexpr std::size_t MIN_CAPACITY = GROUP_WIDTH;
+
+    using Ctrl = std::int8_t;
+    static constexpr Ctrl EMPTY = -128;
+    static constexpr Ctrl DELETED = -2;
+
+    // Followed by the slots, then the control bytes and a copy of the first
+    // group of them, so that groups starting near the end load in one piece
+    struct Table {
+        std::size_t capacity;
+        int shift;
+
+        std::atomic<T *> *slots() {
+            return reinterpret_cast<std::atomic<T *> *>(this + 1);
+        }
+        Ctrl *ctrl() { return reinterpret_cast<Ctrl *>(slots() + capacity); }
+        std::size_t mask() const { return capacity - 1; }
+    };
+
+  public:
+    using value_type = T *;
+    class iterator;
+
+    FlatIndex() = default;
+    ~FlatIndex() { free_table(table_.load(std::memory_order_relaxed)); }
+    FlatIndex(const FlatIndex &) = delete;
+    FlatIndex &operator=(const FlatIndex &) = delete;
+
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::size_t capacity() const noexcept {
+        auto *table = table_.load(std::memory_order_relaxed);
+        return table != nullptr ? table->capacity : 0;
+    }
+
+    iterator begin() const noexcept {
+        auto *table = table_.load(std::memory_order_relaxed);
+        return table != nullptr ? iterator{table, skip_free(*table, 0)}
+                                : iterator{};
+    }
+    iterator end() const noexcept {
+        auto *table = table_.load(std::memory_order_relaxed);
+        return table != nullptr ? iterator{table, table->capacity}
+                                : iterator{};
+    }
+
+    // The element with the key, or nullptr. Any thread.
+    T *find(std::string_view key) const noexcept {
+        auto *table = table_.load(std::memory_order_acquire);
+        if (table == nullptr) {
+            return nullptr;
+        }
+        return probe(*table, key, Hash{}(key)).second;
+    }
+    bool contains(std::string_view key) const noexcept {
+        return find(key) != nullptr;
+    }
+
+    // Adds the element unless one with the same key is present. Throws
+    // std::bad_alloc.
+    bool insert(T &element) {
+        auto key = KeyOf{}(element);
+        auto hash = Hash{}(key);
+        auto *table = table_.load(std::memory_order_relaxed);
+        if (table != nullptr && probe(*table, key, hash).second != nullptr) {
+            return false;
+        }
+        auto i = table != nullptr ? find_free(*table, hash) : 0;
+        if (growth_left_ == 0 &&
+            (table == nullptr || table->ctrl()[i] == EMPTY)) {
+            // Drop the tombstones if that leaves enough room, else grow
+            auto capacity = table == nullptr ? MIN_CAPACITY
+                            : size_ * 32 <= table->capacity * 25
+                                ? table->capacity
+                                : table->capacity * 2;
+            rehash(capacity);
+            table = table_.load(std::memory_order_relaxed);
+            i = find_free(*table, hash);
+        }
+        growth_left_ -= table->ctrl()[i] == EMPTY;
+        table->slots()[i].store(&element, std::memory_order_release);
+        set_ctrl(*table, i, fragment(mix(hash)));
+        ++size_;
+        return true;
+    }
+
+    // Removes the element with the key and returns it, or nullptr if absent
+    T *erase(std::string_view key) {
+        auto *table = table_.load(std::memory_order_relaxed);
+        if (table == nullptr) {
+            return nullptr;
+        }
+        auto [i, element] = probe(*table, key, Hash{}(key));
+        if (element == nullptr) {
+            return nullptr;
+        }
+        // A slot can be emptied again if no group that holds it was ever
+        // full, as no probe can then have gone past it
+        auto before =
+            match(group(*table, (i - GROUP_WIDTH) & table->mask()), EMPTY);
+        auto after = match(group(*table, i), EMPTY);
+        if (before != 0 && after != 0 &&
+            std::countr_zero(after) + std::countl_zero(before) - 16 <
+                static_cast<int>(GROUP_WIDTH)) {
+            set_ctrl(*table, i, EMPTY);
+            ++growth_left_;
+        } else {
+            set_ctrl(*table, i, DELETED);
+        }
+        table->slots()[i].store(nullptr, std::memory_order_relaxed);
+        --size_;
+        return element;
+    }
+
+    // Puts the element in the place of the one with the same key, and
+    // returns that one, or nullptr if absent
+    T *replace(T &element) {
+        auto *table = table_.load(std::memory_order_relaxed);
+        if (table == nullptr) {
+            return nullptr;
+        }
+        auto key = KeyOf{}(element);
+        auto [i, old] = probe(*table, key, Hash{}(key));
+        if (old != nullptr) {
+            table->slots()[i].store(&element, std::memory_order_release);
+        }
+        return old;
+    }
+
+    // Frees the table at once, so no reader may be using the index
+    void clear() {
+        free_table(table_.exchange(nullptr, std::memory_order_relaxed));
+        size_ = growth_left_ = 0;
+    }
+
+    // Makes room for n elements without rehashing. Throws std::bad_alloc.
+    void reserve(std::size_t n) {
+        if (n <= size_ + growth_left_) {
+            return;
+        }
+        auto capacity = std::max(this->capacity(), MIN_CAPACITY);
+        while (max_load(capacity) < n) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+
+    // The first element at or after slot n, wrapping around, so that a
+    // random n picks a roughly random element. nullptr if the index is
+    // empty.
+    T *sample(std::size_t n) const noexcept {
+        if (size_ == 0) {
+            return nullptr;
+        }
+        auto &table = *table_.load(std::memory_order_relaxed);
+        for (auto i = n & table.mask();; i = (i + 1) & table.mask()) {
+            if (table.ctrl()[i] >= 0) {
+                return table.slots()[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Frees the tables the index has outgrown once no reader can still be
+    // probing them
+    void collect() { retired_.collect(); }
+
+  private:
+    // Bits of a group's control bytes that match, the lowest for the first
+    using Mask = std::uint32_t;
+
+    static std::size_t max_load(std::size_t capacity) {
+        return capacity - capacity / 8;
+    }
+
+    // The hash is multiplied out so that every bit of it counts, as the
+    // store's shards already take its low bits: the top 7 bits are the
+    // fragment, and the ones below pick the first group
+    static std::uint64_t mix(std::size_t hash) {
+        return static_cast<std::uint64_t>(hash) * 0x9e3779b97f4a7c15ull;
+    }
+    static Ctrl fragment(std::uint64_t mixed) {
+        return static_cast<Ctrl>(mixed >> 57);
+    }
+    static std::size_t position(const Table &table, std::uint64_t mixed) {
+        return static_cast<std::size_t>((mixed << 7) >> table.shift);
+    }
+
+    static Ctrl *group(Table &table, std::size_t i) {
+        return table.ctrl() + i;
+    }
+
+    static Mask match(Ctrl *group, Ctrl value) {
+#ifdef UNDIS_INDEX_SSE2
+        auto ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<Mask>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value))));
+#else
+        Mask bits = 0;
+        for (std::size_t i = 0; i < GROUP_WIDTH; ++i) {
+            auto ctrl =
+                std::atomic_ref{group[i]}.load(std::memory_order_relaxed);
+            bits |= static_cast<Mask>(ctrl == value) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Empty and deleted slots both have the sign bit set
+    static Mask match_free(Ctrl *group) {
+#ifdef UNDIS_INDEX_SSE2
+        return static_cast<Mask>(_mm_movemask_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+        Mask bits = 0;
+        for (std::size_t i = 0; i < GROUP_WIDTH; ++i) {
+            auto ctrl =
+                std::atomic_ref{group[i]}.load(std::memory_order_relaxed);
+            bits |= static_cast<Mask>(ctrl < 0) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // The slot and element with the key, or the capacity and nullptr.
+    // Readers may see a fragment before the element it belongs to, or after
+    // it was erased, and skip the slot.
+    static std::pair<std::size_t, T *>
+    probe(Table &table, std::string_view key, std::size_t hash) {
+        auto mixed = mix(hash);
+        auto h2 = fragment(mixed);
+        auto pos = position(table, mixed);
+        for (std::size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+            auto *g = group(table, pos);
+            for (auto bits = match(g, h2); bits != 0; bits &= bits - 1) {
+                auto i = (pos + std::countr_zero(bits)) & table.mask();
+                auto *element =
+                    table.slots()[i].load(std::memory_order_acquire);
+                if (element != nullptr && KeyOf{}(*element) == key) {
+                    return {i, element};
+                }
+            }
+            if (match(g, EMPTY) != 0) {
+                return {table.capacity, nullptr};
+            }
+            pos = (pos + step) & table.mask();
+        }
+    }
+
+    // The first empty or deleted slot on the hash's probe sequence
+    static std::size_t find_free(Table &table, std::size_t hash) {
+        auto pos = position(table, mix(hash));
+        for (std::size_t step = GROUP_WIDTH;; step += GROUP_WIDTH) {
+            if (auto bits = match_free(group(table, pos)); bits != 0) {
+                return (pos + std::countr_zero(bits)) & table.mask();
+            }
+            pos = (pos + step) & table.mask();
+        }
+    }
+
+    static void set_ctrl(Table &table, std::size_t i, Ctrl value) {
+        std::atomic_ref{table.ctrl()[i]}.store(value,
+                                               std::memory_order_relaxed);
+        if (i < GROUP_WIDTH) {
+            std::atomic_ref{table.ctrl()[table.capacity + i]}.store(
+                value, std::memory_order_relaxed);
+        }
+    }
+
+    static std::size_t skip_free(Table &table, std::size_t i) {
+        while (i < table.capacity && table.ctrl()[i] < 0) {
+            ++i;
+        }
+        return i;
+    }
+
+    static Table *allocate(std::size_t capacity) {
+        auto bytes = sizeof(Table) + capacity * sizeof(std::atomic<T *>) +
+                     capacity + GROUP_WIDTH;
+        auto *table = new (::operator new(bytes))
+            Table{capacity, 64 - std::countr_zero(capacity)};
+        for (std::size_t i = 0; i < capacity; ++i) {
+            new (&table->slots()[i]) std::atomic<T *>{nullptr};
+        }
+        std::fill_n(table->ctrl(), capacity + GROUP_WIDTH, EMPTY);
+        return table;
+    }
+    static void free_table(void *table) noexcept { ::operator delete(table); }
+
+    // Moves the elements to a new table without tombstones, and publishes
+    // it. Should retiring the old table fail, it is leaked, as readers may
+    // still be probing it.
+    void rehash(std::size_t capacity) {
+        auto *table = allocate(capacity);
+        auto *old = table_.load(std::memory_order_relaxed);
+        if (old != nullptr) {
+            for (std::size_t i = 0; i < old->capacity; ++i) {
+                if (old->ctrl()[i] < 0) {
+                    continue;
+                }
+                auto *element =
+                    old->slots()[i].load(std::memory_order_relaxed);
+                auto hash = Hash{}(KeyOf{}(*element));
+                auto j = find_free(*table, hash);
+                table->slots()[j].store(element, std::memory_order_relaxed);
+                set_ctrl(*table, j, fragment(mix(hash)));
+            }
+        }
+        table_.store(table, std::memory_order_release);
+        growth_left_ = max_load(capacity) - size_;
+        if (old != nullptr) {
+            retired_.retire(old, free_table);
+        }
+    }
+
+    std::atomic<Table *> table_{nullptr};
+    std::size_t size_ = 0;
+    // Insertions into empty slots left before the table must be rehashed
+    std::size_t growth_left_ = 0;
+    epoch::RetireList retired_;
+};
+
+template <typename T, typename KeyOf, typename Hash>
+class FlatIndex<T, KeyOf, Hash>::iterator {
+  public:
+    using iterator_concept = std::forward_iterator_tag;
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T *;
+    using difference_type = std::ptrdiff_t;
+    using reference = T *;
+
+    iterator() = default;
+
+    T *operator*() const {
+        return table_->slots()[index_].load(std::memory_order_relaxed);
+    }
+
+    iterator &operator++() {
+        index_ = skip_free(*table_, index_ + 1);
+        return *this;
+    }
+    iterator operator++(int) {
+        auto copy = *this;
+        ++*this;
+        return copy;
+    }
+
+    friend bool operator==(const iterator &, const iterator &) = default;
+
+  private:
+    friend class FlatIndex;
+
+    iterator(Table *table, std::size_t index)
+        : table_{table}, index_{index} {}
+
+    Table *table_ = nullptr;
+    std::size_t index_ = 0;
+};
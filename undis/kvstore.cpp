@@ -1,41 +1,820 @@
 #include "kvstore.h"
 
-KVStore::KVStore(std::filesystem::path filename) : ser_{std::move(filename)} {
-    *ser_ >> map_;
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+KVStore::KVStore(unsigned shard_count)
+    : KVStore{StoreOptions{.shards = shard_count}} {}
+
+KVStore::KVStore(std::filesystem::path filename, unsigned shard_count)
+    : KVStore{std::move(filename), StoreOptions{.shards = shard_count}} {}
+
+KVStore::KVStore(StoreOptions options) : KVStore{{}, std::move(options)} {}
+
+KVStore::KVStore(std::filesystem::path filename, StoreOptions options)
+    : shards_(std::max(options.shards, 1u)),
+      shard_limit_{options.memory_limit == 0
+                       ? std::numeric_limits<std::size_t>::max()
+                       : options.memory_limit / shards_.size()},
+      evict_{options.evict},
+      expirer_{[this](std::stop_token stoken) { expire_loop(stoken); }} {
+    if (!options.log_file.empty()) {
+        log_file_ = options.log_file;
+        Loader loader{*this, true};
+        AppendLog::replay(log_file_, loader);
+        open_log(options);
+    }
+    if (!filename.empty()) {
+        ser_.emplace(filename);
+        open_saver(std::move(filename), options.save);
+    }
+
+    if (!options.lazy_load) {
+        load_snapshot();
+        finish_loading();
+        return;
+    }
+    loader_ = std::jthread{[this] {
+        try {
+            load_snapshot();
+        } catch (const std::runtime_error &e) {
+            std::cerr << "Could not load snapshot: " << e.what() << '\n';
+            load_failed_ = true;
+        }
+        finish_loading();
+    }};
 }
 
 KVStore::~KVStore() {
-    if (ser_.has_value()) {
-        *ser_ << map_;
+    expirer_.request_stop();
+    expirer_.join();
+    if (loader_.joinable()) {
+        loader_.join();
+    }
+    saver_.reset();
+    // Writes out the remaining records
+    aof_.reset();
+    if (ser_.has_value() && !load_failed_) {
+        *ser_ << entries();
+        // Once the snapshot is on disk it holds everything in the log. If
+        // writing it failed, the log is the only copy of the latest writes.
+        if (ser_->good() && !log_file_.empty()) {
+            try {
+                AppendLog::reset(log_file_);
+            } catch (const std::runtime_error &) {
+                // The old log replays over the snapshot to the same state
+            }
+        }
     }
 }
 
 std::optional<StoreValue> KVStore::get(std::string_view key) const {
-    std::shared_lock lk{mtx_};
-    auto it = map_.find(key);
-    return (it != map_.end() && it->second.exp_time > std::time(nullptr))
-               ? std::optional{it->second}
-               : std::nullopt;
+    const auto &shard = shard_for(key);
+    auto now = CoarseClock::ticks();
+    if (loading()) {
+        std::shared_lock lk{shard.mtx};
+        return read(shard, key, now);
+    }
+    epoch::Guard guard;
+    return read(shard, key, now);
+}
+
+std::optional<StoreValue> KVStore::read(const Shard &shard,
+                                        std::string_view key,
+                                        std::uint32_t now) const {
+    auto *item = shard.map.find(key);
+    if (item == nullptr && loading() && !shard.settled.contains(key)) {
+        throw LoadingError{};
+    }
+    if (item == nullptr || item->expired()) {
+        return std::nullopt;
+    }
+
+    // Skip the store when unchanged so that hot keys do not keep
+    // invalidating the cache line on every core
+    std::atomic_ref last_access{item->last_access};
+    if (last_access.load(std::memory_order_relaxed) != now) {
+        last_access.store(now, std::memory_order_relaxed);
+    }
+    return item->share();
 }
 
 bool KVStore::append(std::string_view key, std::string_view suffix) {
-    std::scoped_lock lk{mtx_};
-    auto it = map_.find(key);
-    if (it != map_.end()) {
-        it->second.str_val.append(suffix);
-        return true;
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        auto *old = find(shard, key);
+        if (old == nullptr) {
+            return false;
+        }
+        auto old_size = item_size(*old);
+        auto size = old->value_size;
+        auto &item =
+            make_room(shard, old_size, old_size + suffix.size(), old,
+                      [&]() -> Item & {
+                          return copy(shard, *old, size + suffix.size(), size);
+                      });
+        std::memcpy(item.value_data() + size, suffix.data(), suffix.size());
+        item.value_size = size + suffix.size();
+        log_set(shard, item);
+        publish(shard, *old, item);
+    }
+    sync_log();
+    return true;
+}
+
+bool KVStore::prepend(std::string_view key, std::string_view prefix) {
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        auto *old = find(shard, key);
+        if (old == nullptr) {
+            return false;
+        }
+        auto old_size = item_size(*old);
+        auto size = old->value_size;
+        auto &item =
+            make_room(shard, old_size, old_size + prefix.size(), old,
+                      [&]() -> Item & {
+                          return copy(shard, *old, size + prefix.size(), 0);
+                      });
+        std::memcpy(item.value_data(), prefix.data(), prefix.size());
+        std::memcpy(item.value_data() + prefix.size(), old->value().data(),
+                    size);
+        item.value_size = size + prefix.size();
+        log_set(shard, item);
+        publish(shard, *old, item);
+    }
+    sync_log();
+    return true;
+}
+
+std::optional<std::uint64_t> KVStore::incr(std::string_view key,
+                                           std::uint64_t delta) {
+    return add_delta(key, delta, true);
+}
+
+std::optional<std::uint64_t> KVStore::decr(std::string_view key,
+                                           std::uint64_t delta) {
+    return add_delta(key, delta, false);
+}
+
+std::optional<std::uint64_t>
+KVStore::add_delta(std::string_view key, std::uint64_t delta, bool incr) {
+    // Enough for any 64-bit number
+    constexpr std::size_t MAX_DIGITS = 20;
+
+    auto &shard = shard_for(key);
+    std::uint64_t number;
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        auto *old = find(shard, key);
+        if (old == nullptr) {
+            return std::nullopt;
+        }
+
+        if (old->counter_cas == old->cas) {
+            number = old->counter;
+        } else {
+            auto str = old->value();
+            auto res =
+                std::from_chars(str.data(), str.data() + str.size(), number);
+            if (str.empty() || res.ec != std::errc{} ||
+                res.ptr != str.data() + str.size()) {
+                throw std::invalid_argument{
+                    "cannot increment or decrement non-numeric value"};
+            }
+        }
+        number = incr ? number + delta : number - std::min(number, delta);
+
+        char digits[MAX_DIGITS];
+        auto size = std::to_chars(digits, digits + MAX_DIGITS, number).ptr -
+                    digits;
+        std::string_view text{digits, static_cast<std::size_t>(size)};
+        auto old_size = item_size(*old);
+        auto &item = make_room(
+            shard, old_size, old_size - old->value_size + text.size(), old,
+            [&]() -> Item & { return copy(shard, *old, text.size(), 0); });
+        std::memcpy(item.value_data(), text.data(), text.size());
+        item.value_size = text.size();
+        log_set(shard, item);
+        item.counter = number;
+        item.counter_cas = item.cas;
+        publish(shard, *old, item);
+    }
+    sync_log();
+    return number;
+}
+
+bool KVStore::touch(std::string_view key, int exp_time) {
+    auto expiry = StoreValue::expiry(exp_time);
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        if (retime(shard, key, expiry) == nullptr) {
+            return false;
+        }
+    }
+    sync_log();
+    return true;
+}
+
+std::optional<StoreValue> KVStore::get_and_touch(std::string_view key,
+                                                 int exp_time) {
+    auto expiry = StoreValue::expiry(exp_time);
+    auto &shard = shard_for(key);
+    std::optional<StoreValue> val;
+    {
+        std::scoped_lock lk{shard.mtx};
+        auto *item = retime(shard, key, expiry);
+        if (item == nullptr) {
+            return std::nullopt;
+        }
+        val = item->share();
+    }
+    sync_log();
+    return val;
+}
+
+KVStore::Item *KVStore::retime(Shard &shard, std::string_view key,
+                               std::uint32_t exp_time) {
+    settle(shard, key);
+    auto *item = find(shard, key);
+    if (item == nullptr) {
+        return nullptr;
     }
-    return false;
+    std::atomic_ref{item->last_access}.store(CoarseClock::ticks(),
+                                             std::memory_order_relaxed);
+    if (item->exp_time != exp_time) {
+        std::atomic_ref{item->exp_time}.store(exp_time,
+                                              std::memory_order_relaxed);
+        schedule(shard, *item);
+        log_touch(shard, *item);
+    }
+    return item;
 }
 
 bool KVStore::del(std::string_view key) {
-    std::scoped_lock lk{mtx_};
-    // C++ 23
-    // return map_.erase(key);
-    return map_.erase(std::string{key});
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        if (!remove(shard, key)) {
+            return false;
+        }
+    }
+    sync_log();
+    return true;
+}
+
+bool KVStore::remove(Shard &shard, std::string_view key) {
+    settle(shard, key);
+    auto *item = shard.map.find(key);
+    if (item == nullptr) {
+        return false;
+    }
+    if (loading()) {
+        shard.settled.emplace(key);
+    }
+    bool expired = item->expired();
+    erase(shard, *item);
+    if (expired) {
+        ++shard.reclaimed;
+        return false;
+    }
+    log_del(shard, key);
+    return true;
+}
+
+std::vector<std::optional<StoreValue>>
+KVStore::multi_get(std::span<const std::string_view> keys) const {
+    std::vector<std::optional<StoreValue>> values(keys.size());
+    auto now = CoarseClock::ticks();
+    if (!loading()) {
+        epoch::Guard guard;
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            values[i] = read(shard_for(keys[i]), keys[i], now);
+        }
+        return values;
+    }
+    for_each_by_shard<std::shared_lock<std::shared_mutex>>(
+        shards_, by_shard(keys.size(), [&](std::size_t i) { return keys[i]; }),
+        [&](const Shard &shard, std::size_t i) {
+            values[i] = read(shard, keys[i], now);
+        });
+    return values;
+}
+
+std::vector<KVStore::BatchResult>
+KVStore::multi_set(std::span<std::pair<std::string, StoreValue>> items) {
+    std::vector<BatchResult> results(items.size());
+    auto order = by_shard(items.size(), [&](std::size_t i) {
+        return std::string_view{items[i].first};
+    });
+    for_each_by_shard<std::unique_lock<std::shared_mutex>>(
+        shards_, order, [&](Shard &shard, std::size_t i) {
+            auto &[key, val] = items[i];
+            try {
+                settle(shard, key, true);
+                store(shard, key, val, StoreMode::set);
+                results[i].done = true;
+            } catch (const std::length_error &) {
+                results[i].error = std::current_exception();
+            }
+        });
+    sync_batch(results);
+    return results;
+}
+
+std::vector<KVStore::BatchResult>
+KVStore::multi_delete(std::span<const std::string_view> keys) {
+    std::vector<BatchResult> results(keys.size());
+    for_each_by_shard<std::unique_lock<std::shared_mutex>>(
+        shards_, by_shard(keys.size(), [&](std::size_t i) { return keys[i]; }),
+        [&](Shard &shard, std::size_t i) {
+            try {
+                results[i].done = remove(shard, keys[i]);
+            } catch (const LoadingError &) {
+                results[i].error = std::current_exception();
+            }
+        });
+    sync_batch(results);
+    return results;
+}
+
+void KVStore::sync_batch(std::vector<BatchResult> &results) {
+    try {
+        sync_log();
+    } catch (const LogError &) {
+        for (auto &result : results) {
+            if (result.done) {
+                result.error = std::current_exception();
+            }
+        }
+    }
 }
 
 std::size_t KVStore::size() const {
-    std::scoped_lock lk{mtx_};
-    return map_.size();
+    std::size_t total = 0;
+    for (const auto &shard : shards_) {
+        std::shared_lock lk{shard.mtx};
+        total += shard.map.size();
+    }
+    return total;
+}
+
+unsigned KVStore::shard_count() const { return shards_.size(); }
+
+std::size_t KVStore::memory_usage() const {
+    std::size_t total = 0;
+    for (const auto &shard : shards_) {
+        std::shared_lock lk{shard.mtx};
+        total += shard.bytes;
+    }
+    return total;
+}
+
+std::size_t KVStore::memory_limit() const {
+    return shard_limit_ == std::numeric_limits<std::size_t>::max()
+               ? 0
+               : shard_limit_ * shards_.size();
+}
+
+std::uint64_t KVStore::evictions() const {
+    std::uint64_t total = 0;
+    for (const auto &shard : shards_) {
+        std::shared_lock lk{shard.mtx};
+        total += shard.evictions;
+    }
+    return total;
+}
+
+std::uint64_t KVStore::reclaimed() const {
+    std::uint64_t total = 0;
+    for (const auto &shard : shards_) {
+        std::shared_lock lk{shard.mtx};
+        total += shard.reclaimed;
+    }
+    return total;
+}
+
+KVStore::SlabStats KVStore::slab_stats() const {
+    SlabStats stats;
+    stats.classes.resize(SlabAllocator::class_count());
+    for (const auto &shard : shards_) {
+        // Taking back chunks freed elsewhere changes the slab
+        std::scoped_lock lk{shard.mtx};
+        auto classes = shard.slab->stats();
+        for (std::size_t i = 0; i < classes.size(); ++i) {
+            auto &total = stats.classes[i];
+            total.chunk_size = classes[i].chunk_size;
+            total.chunks_per_page = classes[i].chunks_per_page;
+            total.pages += classes[i].pages;
+            total.used_chunks += classes[i].used_chunks;
+            total.free_chunks += classes[i].free_chunks;
+        }
+        stats.moved += shard.moved;
+    }
+    return stats;
+}
+
+bool KVStore::save_snapshot() {
+    if (loading()) {
+        throw LoadingError{};
+    }
+    return snapshots() && saver_->start();
+}
+
+std::optional<Snapshotter::Status> KVStore::snapshot_status() const {
+    if (!saver_) {
+        return std::nullopt;
+    }
+    return saver_->status();
+}
+
+bool KVStore::rewrite_log() {
+    if (loading()) {
+        throw LoadingError{};
+    }
+    return aof_ && aof_->rewrite();
+}
+
+void KVStore::copy_entries(const Shard &shard, Snapshotter::Snapshot &out,
+                           std::uint32_t now) {
+    for (auto *item : shard.map) {
+        if (!item->expired(now)) {
+            out.emplace_back(item->key(), item->share());
+        }
+    }
+}
+
+void KVStore::open_log(const StoreOptions &options) {
+    auto drain = [this](AppendLog::Batch &batch) {
+        for (auto &shard : shards_) {
+            std::scoped_lock lk{shard.mtx};
+            if (shard.journal.size() > 0) {
+                batch.push_back(std::exchange(shard.journal, Reply{}));
+            }
+        }
+    };
+    // Values share the items, so copying a shard costs about as much as
+    // copying its keys
+    auto cut = [this, drain](AppendLog::Batch &batch,
+                             AppendLog::Snapshot &snapshot) {
+        // The rewritten log replaces the snapshot, so it must not be taken
+        // before the snapshot has loaded
+        if (loading()) {
+            drain(batch);
+            return false;
+        }
+        auto now = CoarseClock::now();
+        for (auto &shard : shards_) {
+            std::scoped_lock lk{shard.mtx};
+            if (shard.journal.size() > 0) {
+                batch.push_back(std::exchange(shard.journal, Reply{}));
+            }
+            copy_entries(shard, snapshot, now);
+        }
+        return true;
+    };
+    aof_ = std::make_unique<AppendLog>(log_file_, options.fsync,
+                                       std::move(drain), std::move(cut));
+}
+
+void KVStore::open_saver(std::filesystem::path filename, SavePolicy policy) {
+    auto cut = [this](Snapshotter::Snapshot &snapshot)
+        -> std::optional<std::uint64_t> {
+        if (loading() || load_failed_) {
+            return std::nullopt;
+        }
+        auto now = CoarseClock::now();
+        std::uint64_t changes = 0;
+        for (const auto &shard : shards_) {
+            std::shared_lock lk{shard.mtx};
+            copy_entries(shard, snapshot, now);
+            changes += shard.changes;
+        }
+        return changes;
+    };
+    auto changes = [this] {
+        std::uint64_t total = 0;
+        for (const auto &shard : shards_) {
+            std::shared_lock lk{shard.mtx};
+            total += shard.changes;
+        }
+        return total;
+    };
+    saver_ = std::make_unique<Snapshotter>(std::move(filename), policy,
+                                           std::move(cut), std::move(changes));
+}
+
+bool KVStore::store(Shard &shard, std::string_view key,
+                    const StoreValue &val, StoreMode mode) {
+    auto size = item_size(key, val.str_val.size());
+    auto *old = shard.map.find(key);
+    if (old != nullptr && mode == StoreMode::add && !old->expired()) {
+        return false;
+    }
+    auto old_size = old != nullptr ? item_size(*old) : 0;
+    auto *item = &make_room(shard, old_size, size, old, [&]() -> Item & {
+        if (old == nullptr) {
+            shard.map.reserve(shard.map.size() + 1);
+        }
+        return make_item(shard, key, val);
+    });
+    if (mode != StoreMode::load) {
+        log_set(shard, *item);
+    } else {
+        item->cas = ++shard.cas;
+    }
+    if (old == nullptr) {
+        schedule(shard, *item);
+        shard.map.insert(*item);
+    } else {
+        publish(shard, *old, *item);
+    }
+    return true;
+}
+
+KVStore::Item &KVStore::make_item(Shard &shard, std::string_view key,
+                                  const StoreValue &val) {
+    auto size = val.str_val.size();
+    auto &item = Item::create(*shard.slab, key, size);
+    std::memcpy(item.value_data(), val.str_val.data(), size);
+    item.value_size = size;
+    item.flags = val.flags;
+    item.exp_time = val.exp_time;
+    item.last_access = CoarseClock::ticks();
+    return item;
+}
+
+KVStore::Item &KVStore::copy(Shard &shard, const Item &item,
+                             std::size_t size, std::size_t keep) {
+    auto &copy = Item::create(*shard.slab, item.key(), size);
+    std::memcpy(copy.value_data(), item.value().data(), keep);
+    copy.value_size = keep;
+    copy.flags = item.flags;
+    copy.exp_time = item.exp_time;
+    copy.last_access =
+        std::atomic_ref{const_cast<std::uint32_t &>(item.last_access)}.load(
+            std::memory_order_relaxed);
+    copy.cas = item.cas;
+    copy.counter = item.counter;
+    copy.counter_cas = item.counter_cas;
+    return copy;
+}
+
+void KVStore::publish(Shard &shard, Item &old, Item &item) {
+    shard.wheel.cancel(old);
+    schedule(shard, item);
+    shard.map.replace(item);
+    retire(shard, old);
+}
+
+void KVStore::retire(Shard &shard, Item &item) {
+    shard.retired.retire(&item, [](void *item) noexcept {
+        static_cast<Item *>(item)->release();
+    });
+    if (shard.retired.size() >= RETIRE_BATCH) {
+        shard.retired.collect();
+    }
+}
+
+void KVStore::collect(Shard &shard) {
+    shard.retired.collect();
+    shard.map.collect();
+}
+
+KVStore::Item &KVStore::Item::create(SlabAllocator &slab, std::string_view key,
+                                     std::size_t value_capacity) {
+    auto chunk = slab.allocate(sizeof(Item) + key.size() + value_capacity);
+    auto &item = *new (chunk.ptr)
+        Item{static_cast<std::uint32_t>(chunk.size - sizeof(Item))};
+    std::memcpy(item.bytes(), key.data(), key.size());
+    item.key_size = static_cast<std::uint32_t>(key.size());
+    return item;
+}
+
+void KVStore::Item::free(SharedBuffer *buf) noexcept {
+    auto *item = static_cast<Item *>(buf);
+    auto size = sizeof(Item) + item->capacity;
+    item->~Item();
+    SlabAllocator::deallocate(item, size);
+}
+
+KVStore::Item *KVStore::find(const Shard &shard, std::string_view key) {
+    auto *item = shard.map.find(key);
+    return item != nullptr && !item->expired() ? item : nullptr;
+}
+
+void KVStore::erase(Shard &shard, Item &item) {
+    shard.bytes -= item_size(item);
+    shard.wheel.cancel(item);
+    shard.map.erase(item.key());
+    retire(shard, item);
+}
+
+void KVStore::schedule(Shard &shard, Item &item) {
+    if (item.exp_time == StoreValue::NO_EXPIRY) {
+        shard.wheel.cancel(item);
+    } else {
+        shard.wheel.schedule(item, item.exp_time);
+    }
+}
+
+void KVStore::expire_loop(std::stop_token stoken) {
+    std::mutex mtx;
+    std::condition_variable_any cv;
+    std::unique_lock lk{mtx};
+    do {
+        // Work in bounded slices so that writers are never held up for
+        // long, going around again until every shard has caught up
+        bool caught_up;
+        do {
+            caught_up = true;
+            auto now = CoarseClock::now();
+            for (auto &shard : shards_) {
+                std::scoped_lock shard_lk{shard.mtx};
+                caught_up &= shard.wheel.expire(
+                    now, EXPIRY_BUDGET, [&shard](TimerNode &node) {
+                        ++shard.reclaimed;
+                        erase(shard, static_cast<Item &>(node));
+                    });
+            }
+        } while (!caught_up && !stoken.stop_requested());
+        for (auto &shard : shards_) {
+            std::scoped_lock shard_lk{shard.mtx};
+            rebalance(shard);
+            collect(shard);
+        }
+    } while (!cv.wait_for(lk, stoken, EXPIRY_INTERVAL,
+                          [&stoken] { return stoken.stop_requested(); }));
+}
+
+void KVStore::rebalance(Shard &shard) {
+    // The slab keeps allocating around the page until it is asked for the
+    // next one, so its chunks stay put between slices
+    if (shard.moving.empty()) {
+        // The chunks are in use for now, though their items may be gone
+        // from the index, still held by readers or not yet returned
+        try {
+            for (auto *chunk : shard.slab->rebalance()) {
+                const auto &item = *static_cast<const Item *>(chunk);
+                if (shard.map.find(item.key()) == &item) {
+                    shard.moving.emplace_back(item.key(), chunk);
+                }
+            }
+        } catch (const std::bad_alloc &) {
+            // Moves what was recorded
+        }
+    }
+    for (std::size_t n = 0; n < REBALANCE_BUDGET && !shard.moving.empty();
+         ++n) {
+        auto [key, chunk] = std::move(shard.moving.back());
+        shard.moving.pop_back();
+        auto *item = shard.map.find(key);
+        if (item != chunk) {
+            continue;
+        }
+        try {
+            // Room to retire the old item, so only the copy can fail
+            shard.retired.reserve(1);
+            publish(shard, *item,
+                    copy(shard, *item, item->value_size, item->value_size));
+            ++shard.moved;
+        } catch (const std::bad_alloc &) {
+            // The item stays, holding the page back until a later pass
+        }
+    }
+}
+
+void KVStore::make_room(Shard &shard, std::size_t old_size,
+                        std::size_t new_size, const Item *keep) {
+    using namespace std::literals;
+
+    if (new_size > shard_limit_) {
+        throw std::length_error{"object too large for cache"s};
+    }
+    while (shard.bytes - old_size + new_size > shard_limit_) {
+        if (!evict_ || !evict_one(shard, keep)) {
+            throw std::length_error{"out of memory storing object"s};
+        }
+    }
+    shard.bytes = shard.bytes - old_size + new_size;
+}
+
+bool KVStore::evict_one(Shard &shard, const Item *keep) {
+    auto &map = shard.map;
+    if (map.empty()) {
+        return false;
+    }
+    auto now = CoarseClock::ticks();
+    auto wall_now = CoarseClock::now();
+
+    // Sample a few random entries and evict the least recently used one.
+    // Expired entries go first, without counting as evictions.
+    Item *victim = nullptr;
+    std::uint32_t victim_age = 0;
+    bool victim_expired = false;
+    for (int i = 0; i < EVICTION_SAMPLES; ++i) {
+        auto *item = map.sample(shard.rng());
+        if (item == keep) {
+            continue;
+        }
+        bool expired = item->expired(wall_now);
+        std::uint32_t age =
+            now - std::atomic_ref{item->last_access}.load(
+                      std::memory_order_relaxed);
+        if (victim == nullptr || (expired && !victim_expired) ||
+            (expired == victim_expired && age > victim_age)) {
+            victim = item;
+            victim_age = age;
+            victim_expired = expired;
+        }
+    }
+    if (victim == nullptr) {
+        // Every sample landed on keep
+        auto it = std::ranges::find_if(
+            map, [keep](const Item *item) { return item != keep; });
+        if (it == map.end()) {
+            return false;
+        }
+        victim = *it;
+        victim_expired = victim->expired(wall_now);
+    }
+
+    if (victim_expired) {
+        ++shard.reclaimed;
+    } else {
+        ++shard.evictions;
+        // Keep the item from coming back when the log is replayed
+        log_del(shard, victim->key());
+    }
+    erase(shard, *victim);
+    return true;
+}
+
+void KVStore::Loader::clear() {
+    if (!from_log) {
+        // The store may already hold newer entries
+        return;
+    }
+    store.snapshot_stale_ = true;
+    for (auto &shard : store.shards_) {
+        std::scoped_lock lk{shard.mtx};
+        shard.clear();
+        shard.settled.clear();
+    }
+}
+
+void KVStore::Loader::reserve(std::size_t n) {
+    auto per_shard = n / store.shards_.size() + 1;
+    for (auto &shard : store.shards_) {
+        std::scoped_lock lk{shard.mtx};
+        shard.map.reserve(per_shard);
+    }
+}
+
+void KVStore::Loader::emplace(std::string &&key, StoreValue &&val) {
+    auto &shard = store.shard_for(key);
+    // The expiry thread is already running
+    std::scoped_lock lk{shard.mtx};
+    if (from_log) {
+        shard.settled.insert(key);
+    } else if (shard.map.contains(key) || shard.settled.contains(key)) {
+        return;
+    }
+    try {
+        store.store(shard, key, val, StoreMode::load);
+    } catch (const std::length_error &) {
+        // Entries that do not fit are dropped
+    }
+}
+
+void KVStore::Loader::erase(const std::string &key) {
+    auto &shard = store.shard_for(key);
+    std::scoped_lock lk{shard.mtx};
+    shard.settled.insert(key);
+    if (auto *item = shard.map.find(key); item != nullptr) {
+        KVStore::erase(shard, *item);
+    }
+}
+
+void KVStore::load_snapshot() {
+    if (ser_.has_value() && !snapshot_stale_) {
+        Loader loader{*this};
+        *ser_ >> loader;
+    }
+}
+
+void KVStore::finish_loading() {
+    loading_.store(false, std::memory_order_release);
+    for (auto &shard : shards_) {
+        std::scoped_lock lk{shard.mtx};
+        shard.settled = KeySet{};
+    }
 }
@@ -1,22 +1,40 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <concepts>
+#include <condition_variable>
 #include <cstdint>
-#include <ctime>
+#include <exception>
 #include <filesystem>
 #include <functional>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <random>
+#include <ranges>
 #include <shared_mutex>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <string_view>
-#include <type_traits>
-#include <unordered_map>
+#include <thread>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include "appendlog.h"
+#include "coarseclock.h"
+#include "epoch.h"
+#include "flatindex.h"
+#include "reply.h"
 #include "serializer.h"
+#include "slab.h"
+#include "snapshotter.h"
 #include "storevalue.h"
+#include "timingwheel.h"
 
 template <typename T>
 concept StringLike = std::convertible_to<T, std::string>;
@@ -24,10 +42,50 @@ concept StringLike = std::convertible_to<T, std::string>;
 template <typename ...Args>
 concept ValueArgs = std::constructible_from<StoreValue, Args...>;
 
+inline constexpr unsigned DEFAULT_SHARD_COUNT = 16;
+
+struct StoreOptions {
+    unsigned shards = DEFAULT_SHARD_COUNT;
+    // Upper bound on the bytes taken by keys, values and per-item overhead,
+    // split evenly between the shards. 0 means unlimited.
+    std::size_t memory_limit = 0;
+    // When false, writes that do not fit fail instead of evicting items
+    bool evict = true;
+    // Append-only log of mutations, replayed after the snapshot on startup.
+    // Empty to disable.
+    std::filesystem::path log_file{};
+    FsyncPolicy fsync = FsyncPolicy::everysec;
+    // When to take background snapshots, if snapshots are enabled
+    SavePolicy save{};
+    // Load the snapshot in the background instead of in the constructor
+    bool lazy_load = false;
+};
+
+// Thrown by operations that need a key the store may not have loaded yet
+class LoadingError : public std::runtime_error {
+  public:
+    LoadingError() : std::runtime_error{"loading the snapshot"} {}
+};
+
+// Writes throw std::length_error when an item cannot be stored within the
+// memory limit, and LogError when they could not be made durable under the
+// always fsync policy, though they have taken effect in memory. Expired
+// items count as absent, and a background thread reclaims them as they
+// expire.
+//
+// The append-only log is replayed before the snapshot, and keys it mentions
+// are not loaded from the snapshot since the log is newer. With lazy loading,
+// keys written while the snapshot is loading are treated the same way, and
+// operations other than sets on keys the store has not seen yet throw
+// LoadingError until it is done.
 class KVStore {
   public:
-    KVStore() = default;
-    explicit KVStore(std::filesystem::path filename);
+    explicit KVStore(unsigned shard_count = DEFAULT_SHARD_COUNT);
+    explicit KVStore(std::filesystem::path filename,
+                     unsigned shard_count = DEFAULT_SHARD_COUNT);
+    explicit KVStore(StoreOptions options);
+    // An empty filename disables snapshots
+    KVStore(std::filesystem::path filename, StoreOptions options);
     ~KVStore();
     KVStore(const KVStore &) = delete;
     KVStore &operator=(const KVStore &) = delete;
@@ -36,6 +94,8 @@ class KVStore {
     KVStore(KVStore &&) = delete;
     KVStore &operator=(KVStore &&) = delete;
 
+    // Takes no lock once the store has loaded: the item is looked up while
+    // pinned in an epoch, and the returned value shares its bytes
     std::optional<StoreValue> get(std::string_view key) const;
 
     template <StringLike K, typename... Args>
@@ -50,13 +110,88 @@ class KVStore {
         requires ValueArgs<Args...>
     bool replace(std::string_view key, Args &&...args);
 
+    // Stores the value only if the item exists and its version still
+    // matches `cas`, as returned by get
+    enum class CasResult { stored, exists, not_found };
+    template <typename... Args>
+        requires ValueArgs<Args...>
+    CasResult cas(std::string_view key, std::uint64_t cas, Args &&...args);
+
     bool append(std::string_view key, std::string_view suffix);
 
-    template <StringLike T> bool prepend(std::string_view key, T &&prefix);
+    // Add to or subtract from a value holding a decimal number, as in
+    // memcached: incr wraps around at 2^64 and decr stops at 0. Returns the
+    // new number, or nothing if the key is absent, and throws
+    // std::invalid_argument if the value is not a number.
+    std::optional<std::uint64_t> incr(std::string_view key,
+                                      std::uint64_t delta);
+    std::optional<std::uint64_t> decr(std::string_view key,
+                                      std::uint64_t delta);
+
+    bool prepend(std::string_view key, std::string_view prefix);
 
     bool del(std::string_view key);
 
+    // Change only the expiration of an item, with the same meaning as in
+    // the constructors of StoreValue. The value is neither copied nor given
+    // a new version. get_and_touch returns the item, like get.
+    bool touch(std::string_view key, int exp_time);
+    std::optional<StoreValue> get_and_touch(std::string_view key,
+                                            int exp_time);
+
+    // Outcome of one operation in a batch: whether it took effect, or what
+    // the single-key operation would have thrown
+    struct BatchResult {
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    // Batched forms of get, set and del that lock each shard once for all
+    // of its keys, and sync the log once. Operations on the same key take
+    // effect in order. multi_get throws like get, and a failed sync is an
+    // error for every write in the batch.
+    std::vector<std::optional<StoreValue>>
+    multi_get(std::span<const std::string_view> keys) const;
+    std::vector<BatchResult>
+    multi_set(std::span<std::pair<std::string, StoreValue>> items);
+    std::vector<BatchResult>
+    multi_delete(std::span<const std::string_view> keys);
+
     std::size_t size() const;
+    unsigned shard_count() const;
+
+    std::size_t memory_usage() const;
+    std::size_t memory_limit() const;
+    // Number of unexpired items removed to make room for writes
+    std::uint64_t evictions() const;
+    // Number of expired items removed before being overwritten or deleted
+    std::uint64_t reclaimed() const;
+
+    // Slab usage by size class, summed over the shards
+    struct SlabStats {
+        std::vector<SlabAllocator::ClassStats> classes;
+        // Items moved out of sparse pages so the pages could be reused
+        std::uint64_t moved = 0;
+    };
+    SlabStats slab_stats() const;
+
+    bool loading() const { return loading_.load(std::memory_order_acquire); }
+
+    // Snapshots are disabled when there is no snapshot file, or when it
+    // could not be loaded, so that it is left for recovery
+    bool snapshots() const { return saver_ != nullptr && !load_failed_; }
+    // Starts a snapshot in the background. Returns false if snapshots are
+    // disabled or one is already running, and throws LoadingError while
+    // loading.
+    bool save_snapshot();
+    // Empty if snapshots are disabled
+    std::optional<Snapshotter::Status> snapshot_status() const;
+
+    bool logging() const { return aof_ != nullptr; }
+    // Compacts the append-only log in the background. Returns false if
+    // logging is disabled or a rewrite is already running, and throws
+    // LoadingError while loading.
+    bool rewrite_log();
 
   private:
     struct StringHash {
@@ -73,57 +208,439 @@ class KVStore {
         }
     };
 
-    std::unordered_map<std::string, StoreValue, StringHash, std::equal_to<>>
-        map_;
-    mutable std::shared_mutex mtx_;
+    // An item is one slab chunk: this header, then the key, then the value.
+    // The store holds one reference, and values handed out share the item.
+    // Readers find items without locks, so once in the index an item only
+    // changes its expiry and last access; writes build a new item and swap
+    // it in, and the old one is retired until no reader can be using it.
+    // Items are also timers in their shard's expiry wheel, and must be
+    // cancelled before the store lets go of them.
+    struct Item : SharedBuffer, TimerNode {
+        // Throws std::bad_alloc
+        static Item &create(SlabAllocator &slab, std::string_view key,
+                            std::size_t value_capacity);
+
+        std::string_view key() const { return {bytes(), key_size}; }
+        std::string_view value() const {
+            return {bytes() + key_size, value_size};
+        }
+        char *value_data() { return bytes() + key_size; }
+
+        bool expired(std::uint32_t now = CoarseClock::now()) const noexcept {
+            return expiry() <= now;
+        }
+        std::uint32_t expiry() const noexcept {
+            return std::atomic_ref{const_cast<std::uint32_t &>(exp_time)}.load(
+                std::memory_order_relaxed);
+        }
+
+        // A value sharing the item's bytes
+        StoreValue share() {
+            StoreValue val{SharedString{*this, value()}, flags, expiry()};
+            val.cas = cas;
+            return val;
+        }
+
+        // Bytes after the header
+        std::uint32_t capacity = 0;
+        std::uint32_t key_size = 0;
+        std::uint32_t value_size = 0;
+        std::uint32_t flags = 0;
+        // Touches change it while readers load it, so once the item is
+        // indexed it is only stored to through std::atomic_ref
+        std::uint32_t exp_time = StoreValue::NO_EXPIRY;
+        // CoarseClock::ticks() as of the last access. Readers update it
+        // without the lock, so it must only be accessed through
+        // std::atomic_ref once the item is indexed.
+        std::uint32_t last_access = 0;
+        std::uint64_t cas = 0;
+        // The value as a number, kept by incr and decr so that counters are
+        // not parsed on every update. Only valid while the item's version
+        // is still counter_cas, so other writes need not clear it.
+        std::uint64_t counter = 0;
+        std::uint64_t counter_cas = 0;
+
+      private:
+        explicit Item(std::uint32_t capacity)
+            : SharedBuffer{free}, capacity{capacity} {}
+        static void free(SharedBuffer *buf) noexcept;
+
+        const char *bytes() const {
+            return reinterpret_cast<const char *>(this + 1);
+        }
+        char *bytes() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    struct ItemKey {
+        std::string_view operator()(const Item &item) const {
+            return item.key();
+        }
+    };
+
+    using Map = FlatIndex<Item, ItemKey, StringHash>;
+    using KeySet =
+        std::unordered_set<std::string, StringHash, std::equal_to<>>;
+
+    // Each shard is locked independently; aligned so that neighbouring
+    // mutexes do not share a cache line
+    struct alignas(64) Shard {
+        ~Shard() { clear(); }
+
+        // Drops every item at once. Must be called with the shard locked
+        // exclusively, while readers take the lock too: when loading, or
+        // when the store is destroyed.
+        void clear() {
+            for (auto *item : map) {
+                wheel.cancel(*item);
+                item->release();
+            }
+            map.clear();
+            bytes = 0;
+        }
+
+        TimingWheel wheel{CoarseClock::now()};
+        SlabAllocator::Handle slab = SlabAllocator::create();
+        // Items taken out of the index, released once no reader can still
+        // be using them
+        epoch::RetireList retired;
+        Map map;
+        mutable std::shared_mutex mtx;
+        std::size_t bytes = 0;
+        std::uint64_t evictions = 0;
+        std::uint64_t reclaimed = 0;
+        // Items moved out of sparse slab pages
+        std::uint64_t moved = 0;
+        // Keys and chunks of the indexed items in the sparse page being
+        // emptied that are yet to be moved. Chunks may be freed in between,
+        // so they are only compared, never read.
+        std::vector<std::pair<std::string, const void *>> moving;
+        std::minstd_rand rng;
+        // Mutations since the store was opened, for the snapshot policy
+        std::uint64_t changes = 0;
+        // Last version given to an item. Keys stay in their shard, so a
+        // shard-local counter is enough to never repeat a key's version.
+        std::uint64_t cas = 0;
+        // While loading, keys that the snapshot must not overwrite
+        KeySet settled;
+        // Log records not yet handed to the log's writer thread
+        Reply journal;
+    };
+
+    // Approximate per-item cost beyond the key and value bytes: the item's
+    // header, and the index slot and control byte, doubled as the index may
+    // be half empty after growing. Slack at the end of slab chunks is not
+    // counted.
+    static constexpr std::size_t ITEM_OVERHEAD =
+        sizeof(Item) + 2 * (sizeof(Map::value_type) + 1);
+
+    // Retired items a shard holds before it tries to release some
+    static constexpr std::size_t RETIRE_BATCH = 64;
+
+    // Entries compared for each eviction, as in Redis' approximated LRU
+    static constexpr int EVICTION_SAMPLES = 5;
+
+    // The expiry thread wakes up every interval and removes at most a
+    // budget of items per shard lock acquisition
+    static constexpr std::chrono::milliseconds EXPIRY_INTERVAL{100};
+    static constexpr std::size_t EXPIRY_BUDGET = 256;
+    // Items moved out of a sparse page per interval; a page with more is
+    // emptied over several
+    static constexpr std::size_t REBALANCE_BUDGET = 256;
+
+    static std::size_t item_size(std::string_view key, std::size_t value_size) {
+        return key.size() + value_size + ITEM_OVERHEAD;
+    }
+    static std::size_t item_size(const Item &item) {
+        return item_size(item.key(), item.value_size);
+    }
+
+    // Distributes loaded entries and replayed log records to their shards.
+    // Entries are stored under their shard's lock, so snapshots can be
+    // loaded from several threads.
+    struct Loader {
+        static constexpr bool concurrent = true;
+        KVStore &store;
+        // Log records settle their keys, and clearing the log makes the
+        // snapshot stale; snapshot entries only fill in unsettled keys
+        bool from_log = false;
+        void clear();
+        void reserve(std::size_t n);
+        void emplace(std::string &&key, StoreValue &&val);
+        void erase(const std::string &key);
+    };
+
+    std::size_t shard_index(std::string_view key) const {
+        return StringHash{}(key) % shards_.size();
+    }
+    Shard &shard_for(std::string_view key) { return shards_[shard_index(key)]; }
+    const Shard &shard_for(std::string_view key) const {
+        return shards_[shard_index(key)];
+    }
+
+    // Pairs of shard index and position for the keys of a batch, ordered by
+    // shard and then by position
+    using ShardOrder = std::vector<std::pair<std::size_t, std::size_t>>;
+
+    template <typename KeyAt>
+    ShardOrder by_shard(std::size_t n, KeyAt key_at) const {
+        ShardOrder order;
+        order.reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            order.emplace_back(shard_index(key_at(i)), i);
+        }
+        std::sort(order.begin(), order.end());
+        return order;
+    }
+
+    // Calls f(shard, position) for each entry of an order from by_shard,
+    // taking each shard's lock once
+    template <typename Lock, typename Shards, typename F>
+    static void for_each_by_shard(Shards &shards, const ShardOrder &order,
+                                  F f) {
+        for (std::size_t begin = 0, end; begin < order.size(); begin = end) {
+            auto &shard = shards[order[begin].first];
+            Lock lk{shard.mtx};
+            for (end = begin;
+                 end < order.size() && order[end].first == order[begin].first;
+                 ++end) {
+                f(shard, order[end].second);
+            }
+        }
+    }
+
+    // Joined view over the key/value pairs of every shard, used for
+    // serialization. Callers must make sure no writers are active.
+    auto entries() const {
+        return shards_ |
+               std::views::transform(
+                   [](const Shard &s) -> const Map & { return s.map; }) |
+               std::views::join | std::views::transform([](Item *item) {
+                   return std::pair{item->key(), item->share()};
+               });
+    }
+
+    // add only inserts the value or overwrites an expired one, and load
+    // overwrites it without counting or logging the change
+    enum class StoreMode { set, add, load };
+
+    // Must be called with the shard locked exclusively
+    bool store(Shard &shard, std::string_view key, const StoreValue &val,
+               StoreMode mode);
+    // Creates an item holding a value, not yet indexed, accounted for or
+    // logged. Throws std::bad_alloc.
+    static Item &make_item(Shard &shard, std::string_view key,
+                           const StoreValue &val);
+    // Creates an unindexed copy of an item with room for a value of `size`
+    // bytes, carrying over the first `keep` bytes of the value, to be
+    // changed and then published. Throws std::bad_alloc.
+    static Item &copy(Shard &shard, const Item &item, std::size_t size,
+                      std::size_t keep);
+    // Swaps an item into the index in place of the old one with its key,
+    // which is retired. Must be called with the shard locked exclusively.
+    static void publish(Shard &shard, Item &old, Item &item);
+    // Releases the store's reference to an item that is out of the index,
+    // once no reader can still be using it
+    static void retire(Shard &shard, Item &item);
+    // Releases what the shard retired and no reader can be using any more
+    static void collect(Shard &shard);
+    std::optional<std::uint64_t> add_delta(std::string_view key,
+                                           std::uint64_t delta, bool incr);
+    // Sets the expiry of an item and returns it, or nullptr if absent. Must
+    // be called with the shard locked exclusively.
+    Item *retime(Shard &shard, std::string_view key, std::uint32_t exp_time);
+
+    // While loading, makes sure the snapshot cannot overwrite the key, which
+    // must be known already unless blind is set, and throws LoadingError
+    // otherwise. Must be called with the shard locked exclusively.
+    void settle(Shard &shard, std::string_view key, bool blind = false) {
+        if (loading() && !shard.map.contains(key) &&
+            !shard.settled.contains(key)) {
+            if (!blind) {
+                throw LoadingError{};
+            }
+            shard.settled.emplace(key);
+        }
+    }
+    void load_snapshot();
+    void finish_loading();
+
+    // Finds an unexpired item. Must be called with the shard locked, or
+    // while pinned in an epoch.
+    static Item *find(const Shard &shard, std::string_view key);
+
+    // get on a shard that is locked, shared for read, or while pinned
+    std::optional<StoreValue> read(const Shard &shard, std::string_view key,
+                                   std::uint32_t now) const;
+    // del on a shard that is locked exclusively
+    bool remove(Shard &shard, std::string_view key);
+
+    // Removes an item and accounts for it. Must be called with the shard
+    // locked exclusively.
+    static void erase(Shard &shard, Item &item);
+
+    static void schedule(Shard &shard, Item &item);
+    void expire_loop(std::stop_token stoken);
+    // Moves items out of a sparse slab page, so that the page can go to a
+    // class that needs it, at most REBALANCE_BUDGET at a time and picking
+    // up where the last call left off. Must be called with the shard locked
+    // exclusively.
+    static void rebalance(Shard &shard);
+
+    // Copies the shard's unexpired entries. Must be called with the shard
+    // locked.
+    static void copy_entries(const Shard &shard, Snapshotter::Snapshot &out,
+                             std::uint32_t now);
+
+    // Count, version and journal mutations under the shard's exclusive
+    // lock, and wait for them to become durable after releasing it. New
+    // items are versioned before they are published.
+    void log_set(Shard &shard, Item &item) {
+        item.cas = ++shard.cas;
+        log_touch(shard, item);
+    }
+    // The record of a touch carries the value too, but by reference
+    void log_touch(Shard &shard, Item &item) {
+        ++shard.changes;
+        if (aof_) {
+            AppendLog::encode_set(shard.journal, item.key(), item.share());
+        }
+    }
+    void log_del(Shard &shard, std::string_view key) {
+        ++shard.changes;
+        if (aof_) {
+            AppendLog::encode_del(shard.journal, key);
+        }
+    }
+    void sync_log() {
+        if (aof_) {
+            aof_->sync();
+        }
+    }
+    // Fails the writes that were done if the sync fails
+    void sync_batch(std::vector<BatchResult> &results);
+    void open_log(const StoreOptions &options);
+    void open_saver(std::filesystem::path filename, SavePolicy policy);
+
+    // Makes sure the shard can go from holding an item of old_size bytes to
+    // one of new_size bytes, evicting items other than keep if allowed, and
+    // accounts for the change. Throws std::length_error if the item does
+    // not fit. Must be called with the shard locked exclusively.
+    void make_room(Shard &shard, std::size_t old_size, std::size_t new_size,
+                   const Item *keep);
+    // Makes room as above, then returns the item made by alloc, giving the
+    // room back if it throws std::bad_alloc
+    template <std::invocable F>
+    Item &make_room(Shard &shard, std::size_t old_size, std::size_t new_size,
+                    const Item *keep, F &&alloc);
+    bool evict_one(Shard &shard, const Item *keep);
+
+    std::vector<Shard> shards_;
+    std::size_t shard_limit_;
+    bool evict_;
 
     std::optional<Serializer> ser_;
+    std::atomic<bool> loading_ = true;
+    std::atomic<bool> load_failed_ = false;
+    // Set when the log was cleared, so the snapshot is older than all of it
+    bool snapshot_stale_ = false;
+    std::filesystem::path log_file_;
+    std::unique_ptr<AppendLog> aof_;
+    std::unique_ptr<Snapshotter> saver_;
+
+    std::jthread expirer_;
+    std::jthread loader_;
 };
 
+template <std::invocable F>
+KVStore::Item &KVStore::make_room(Shard &shard, std::size_t old_size,
+                                  std::size_t new_size, const Item *keep,
+                                  F &&alloc) {
+    make_room(shard, old_size, new_size, keep);
+    try {
+        return std::forward<F>(alloc)();
+    } catch (const std::bad_alloc &) {
+        shard.bytes = shard.bytes - new_size + old_size;
+        throw;
+    }
+}
+
+// Values are constructed before taking the lock, and copied into the
+// shard's slab under it
 template <StringLike K, typename... Args>
     requires ValueArgs<Args...>
 void KVStore::set(K &&key, Args &&...args) {
-    std::scoped_lock lk{mtx_};
-    auto [it, stored] =
-        map_.try_emplace(std::forward<K>(key), std::forward<Args>(args)...);
-    if (!stored) {
-        it->second = {std::forward<Args>(args)...};
+    StoreValue val{std::forward<Args>(args)...};
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key, true);
+        store(shard, key, val, StoreMode::set);
     }
+    sync_log();
 }
 
 template <StringLike K, typename... Args>
     requires ValueArgs<Args...>
 bool KVStore::add(K &&key, Args &&...args) {
-    std::scoped_lock lk{mtx_};
-    return map_.try_emplace(std::forward<K>(key), std::forward<Args>(args)...)
-        .second;
+    StoreValue val{std::forward<Args>(args)...};
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        if (!store(shard, key, val, StoreMode::add)) {
+            return false;
+        }
+    }
+    sync_log();
+    return true;
 }
 
 template <typename... Args>
     requires ValueArgs<Args...>
 bool KVStore::replace(std::string_view key, Args &&...args) {
-    std::scoped_lock lk{mtx_};
-    auto it = map_.find(key);
-    if (it != map_.end()) {
-        it->second = {std::forward<Args>(args)...};
-        return true;
+    StoreValue val{std::forward<Args>(args)...};
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        auto *old = find(shard, key);
+        if (old == nullptr) {
+            return false;
+        }
+        auto &item =
+            make_room(shard, item_size(*old),
+                      item_size(key, val.str_val.size()), old,
+                      [&]() -> Item & { return make_item(shard, key, val); });
+        log_set(shard, item);
+        publish(shard, *old, item);
     }
-    return false;
+    sync_log();
+    return true;
 }
 
-template <StringLike T>
-bool KVStore::prepend(std::string_view key, T &&prefix) {
-    std::scoped_lock lk{mtx_};
-    auto it = map_.find(key);
-    if (it != map_.end()) {
-        if constexpr (std::is_same_v<std::remove_reference_t<T>, std::string> &&
-                      !std::is_lvalue_reference_v<T>) {
-            prefix.append(it->second.str_val);
-            it->second.str_val = std::move(prefix); // NOLINT(bugprone-move-forwarding-reference)
-        } else {
-            it->second.str_val.insert(0, prefix);
-        }
-        return true;
-    }
-    return false;
+template <typename... Args>
+    requires ValueArgs<Args...>
+KVStore::CasResult KVStore::cas(std::string_view key, std::uint64_t cas,
+                                Args &&...args) {
+    StoreValue val{std::forward<Args>(args)...};
+    auto &shard = shard_for(key);
+    {
+        std::scoped_lock lk{shard.mtx};
+        settle(shard, key);
+        auto *old = find(shard, key);
+        if (old == nullptr) {
+            return CasResult::not_found;
+        }
+        if (old->cas != cas) {
+            return CasResult::exists;
+        }
+        auto &item =
+            make_room(shard, item_size(*old),
+                      item_size(key, val.str_val.size()), old,
+                      [&]() -> Item & { return make_item(shard, key, val); });
+        log_set(shard, item);
+        publish(shard, *old, item);
+    }
+    sync_log();
+    return CasResult::stored;
 }
@@ -1,5 +1,8 @@
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <iostream>
+#include <limits>
 #include <string_view>
 
 #include "kvstore.h"
@@ -7,9 +10,18 @@
 
 using namespace std::literals;
 
+namespace {
+template <typename T> bool parse_number(std::string_view str, T &value) {
+    auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+    return res.ec == std::errc{} && res.ptr == str.data() + str.size();
+}
+} // namespace
+
 int main(int argc, char **argv) {
     std::string_view filename{"undis.db"sv};
     unsigned port = 8080;
+    StoreOptions store_options;
+    ServerOptions options;
 
     for (int i = 1; i < argc; ++i) {
         std::string_view arg{argv[i]};
@@ -25,23 +37,168 @@ int main(int argc, char **argv) {
                 return 3;
             }
             std::string_view port_str{argv[++i]};
-            if (auto res = std::from_chars(
-                    port_str.data(), port_str.data() + port_str.size(), port);
-                res.ec != std::errc{}) {
+            if (!parse_number(port_str, port)) {
                 std::cerr << "Invalid port number: " << port_str << '\n';
                 return 4;
             }
+        } else if (arg == "-s") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected shard count after -s\n";
+                return 3;
+            }
+            std::string_view shards_str{argv[++i]};
+            if (!parse_number(shards_str, store_options.shards) ||
+                store_options.shards == 0) {
+                std::cerr << "Invalid shard count: " << shards_str << '\n';
+                return 4;
+            }
+        } else if (arg == "-m") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected memory limit after -m\n";
+                return 3;
+            }
+            std::string_view limit_str{argv[++i]};
+            std::size_t megabytes;
+            if (!parse_number(limit_str, megabytes) ||
+                megabytes > std::numeric_limits<std::size_t>::max() >> 20) {
+                std::cerr << "Invalid memory limit: " << limit_str << '\n';
+                return 4;
+            }
+            store_options.memory_limit = megabytes << 20;
+        } else if (arg == "-M") {
+            store_options.evict = false;
+        } else if (arg == "-l") {
+            store_options.lazy_load = true;
+        } else if (arg == "-a") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected filename after -a\n";
+                return 3;
+            }
+            store_options.log_file = argv[++i];
+        } else if (arg == "-y") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected fsync policy after -y\n";
+                return 3;
+            }
+            std::string_view policy{argv[++i]};
+            if (policy == "always") {
+                store_options.fsync = FsyncPolicy::always;
+            } else if (policy == "everysec") {
+                store_options.fsync = FsyncPolicy::everysec;
+            } else if (policy == "never") {
+                store_options.fsync = FsyncPolicy::never;
+            } else {
+                std::cerr << "Invalid fsync policy: " << policy << '\n';
+                return 4;
+            }
+        } else if (arg == "-S") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected snapshot policy after -S\n";
+                return 3;
+            }
+            std::string_view policy{argv[++i]};
+            auto colon = policy.find(':');
+            unsigned seconds;
+            auto &changes = store_options.save.changes;
+            if (!parse_number(policy.substr(0, colon), seconds) ||
+                (colon != std::string_view::npos &&
+                 !parse_number(policy.substr(colon + 1), changes))) {
+                std::cerr << "Invalid snapshot policy: " << policy << '\n';
+                return 4;
+            }
+            store_options.save.interval = std::chrono::seconds{seconds};
+        } else if (arg == "-e") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected I/O engine after -e\n";
+                return 3;
+            }
+            std::string_view engine{argv[++i]};
+            if (engine == "blocking") {
+                options.engine = IoEngine::blocking;
+            } else if (engine == "epoll") {
+                options.engine = IoEngine::epoll;
+            } else if (engine == "io_uring") {
+                options.engine = IoEngine::io_uring;
+            } else {
+                std::cerr << "Invalid I/O engine: " << engine << '\n';
+                return 4;
+            }
+        } else if (arg == "-q") {
+            options.prompt = false;
+        } else if (arg == "-T") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected TCP mode after -T\n";
+                return 3;
+            }
+            std::string_view mode{argv[++i]};
+            if (mode == "nodelay") {
+                options.tcp = TcpMode::nodelay;
+            } else if (mode == "nagle") {
+                options.tcp = TcpMode::nagle;
+            } else if (mode == "cork") {
+                options.tcp = TcpMode::cork;
+            } else {
+                std::cerr << "Invalid TCP mode: " << mode << '\n';
+                return 4;
+            }
+        } else if (arg == "-t") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected event loop count after -t\n";
+                return 3;
+            }
+            std::string_view loops_str{argv[++i]};
+            if (!parse_number(loops_str, options.event_loops) ||
+                options.event_loops == 0) {
+                std::cerr << "Invalid event loop count: " << loops_str << '\n';
+                return 4;
+            }
+        } else if (arg == "-w") {
+            if (i + 1 >= argc) {
+                std::cerr << "Expected thread pool limits after -w\n";
+                return 3;
+            }
+            // min:max[:idle seconds]
+            std::string_view limits{argv[++i]};
+            auto first = limits.find(':');
+            auto second = limits.find(':', first + 1);
+            auto seconds =
+                static_cast<unsigned>(options.idle_timeout.count());
+            if (first == std::string_view::npos ||
+                !parse_number(limits.substr(0, first), options.min_threads) ||
+                !parse_number(limits.substr(first + 1, second - first - 1),
+                              options.max_threads) ||
+                (second != std::string_view::npos &&
+                 !parse_number(limits.substr(second + 1), seconds)) ||
+                options.max_threads == 0 ||
+                options.min_threads > options.max_threads) {
+                std::cerr << "Invalid thread pool limits: " << limits << '\n';
+                return 4;
+            }
+            options.idle_timeout = std::chrono::seconds{seconds};
         } else {
             std::cerr << "Unknown option: " << arg << "\nUsage: " << argv[0]
-                      << " [-f filename (undis.db)] [-p port (8080)]\n";
+                      << " [-f filename (undis.db)] [-p port (8080)]"
+                         " [-s shards (16)] [-m megabytes (0, unlimited)]"
+                         " [-M] [-l] [-a log filename]"
+                         " [-y always|everysec|never]"
+                         " [-S seconds[:changes] (0, disabled)]"
+                         " [-e blocking|epoll|io_uring]"
+                         " [-t event loops (1)] [-q]"
+                         " [-T nodelay|nagle|cork]"
+                         " [-w min:max[:idle seconds] (1:10:5)]\n";
             return 2;
         }
     }
 
-    KVStore db{filename};
     try {
-        Server server{port, db};
+        KVStore db{filename, store_options};
+        Server server{port, db, options};
         server.start();
+        if (db.memory_limit() != 0) {
+            std::cout << "Memory used: " << db.memory_usage() << " of "
+                      << db.memory_limit() << " bytes, "
+                      << db.evictions() << " items evicted\n";
+        }
         return 0;
     } catch (std::runtime_error &e) {
         std::cerr << e.what() << '\n';
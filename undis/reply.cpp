@@ -0,0 +1,92 @@
+#include "reply.h"
+
+Reply::Reply(std::string_view text) { append(text); }
+
+Reply &Reply::append(std::string_view text) {
+    if (segments_.empty() ||
+        !std::holds_alternative<std::string>(segments_.back())) {
+        segments_.emplace_back(std::string{});
+    }
+    std::get<std::string>(segments_.back()).append(text);
+    return *this;
+}
+
+Reply &Reply::append(const SharedString &value) {
+    segments_.emplace_back(value);
+    return *this;
+}
+
+std::vector<std::string_view> Reply::buffers() const {
+    std::vector<std::string_view> bufs;
+    bufs.reserve(segments_.size());
+    buffers(bufs);
+    return bufs;
+}
+
+void Reply::buffers(std::vector<std::string_view> &bufs) const {
+    for (const auto &segment : segments_) {
+        std::visit([&bufs](const auto &s) { bufs.emplace_back(s); }, segment);
+    }
+}
+
+std::size_t Reply::size() const {
+    std::size_t total = 0;
+    for (const auto &segment : segments_) {
+        std::visit([&total](const auto &s) { total += s.size(); }, segment);
+    }
+    return total;
+}
+
+std::string Reply::str() const {
+    std::string s;
+    s.reserve(size());
+    for (auto buf : buffers()) {
+        s.append(buf);
+    }
+    return s;
+}
+
+void ReplyQueue::push(Reply reply) {
+    auto n = reply.size();
+    if (n == 0) {
+        return;
+    }
+    size_ += n;
+    replies_.emplace_back(std::move(reply), n);
+}
+
+void ReplyQueue::buffers(std::vector<std::string_view> &bufs,
+                         std::size_t max) const {
+    auto start = bufs.size();
+    for (const auto &[reply, n] : replies_) {
+        if (bufs.size() - start >= max) {
+            break;
+        }
+        reply.buffers(bufs);
+    }
+
+    // Skip what was already written of the first reply
+    auto skip = offset_;
+    auto it = bufs.begin() + start;
+    while (skip > 0 && skip >= it->size()) {
+        skip -= it->size();
+        it = bufs.erase(it);
+    }
+    if (skip > 0) {
+        it->remove_prefix(skip);
+    }
+
+    if (bufs.size() - start > max) {
+        bufs.resize(start + max);
+    }
+}
+
+void ReplyQueue::consume(std::size_t n) {
+    size_ -= n;
+    n += offset_;
+    while (!replies_.empty() && n >= replies_.front().second) {
+        n -= replies_.front().second;
+        replies_.pop_front();
+    }
+    offset_ = n;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <deque>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "storevalue.h"
+
+// A response made of owned text and shared value buffers. Values are
+// referenced rather than copied, and the pieces are sent with one gather
+// write.
+class Reply {
+  public:
+    Reply() = default;
+    explicit Reply(std::string_view text);
+
+    Reply &append(std::string_view text);
+    Reply &append(const SharedString &value);
+
+    std::vector<std::string_view> buffers() const;
+    void buffers(std::vector<std::string_view> &bufs) const;
+    std::size_t size() const;
+    std::string str() const;
+
+    friend bool operator==(const Reply &lhs, std::string_view rhs) {
+        return lhs.str() == rhs;
+    }
+    friend std::ostream &operator<<(std::ostream &os, const Reply &reply) {
+        return os << reply.str();
+    }
+
+  private:
+    std::vector<std::variant<std::string, SharedString>> segments_;
+};
+
+// Replies waiting to be written to a socket, which may accept them only
+// partially
+class ReplyQueue {
+  public:
+    void push(Reply reply);
+
+    bool empty() const { return replies_.empty(); }
+    // Number of bytes not yet written
+    std::size_t size() const { return size_; }
+
+    // Up to `max` buffers of unwritten data, in order
+    void buffers(std::vector<std::string_view> &bufs, std::size_t max) const;
+    // Drops the first `n` unwritten bytes
+    void consume(std::size_t n);
+
+  private:
+    std::deque<std::pair<Reply, std::size_t>> replies_;
+    std::size_t offset_ = 0;
+    std::size_t size_ = 0;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UNDIS_SCAN_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UNDIS_SCAN_SSE2
+#endif
+
+// Delimiter searches for the request parsers. They compare 32 bytes at a time
+// with AVX2 when the build enables it (-DUNDIS_AVX2=ON), otherwise 16 at a
+// time with SSE2, falling back to a byte loop elsewhere and for the tail.
+// They are defined here so that the short lines of typical requests are not
+// dominated by call overhead.
+namespace scan {
+
+// Offset of the first `c` at or after `from`, or npos
+inline std::size_t find(std::string_view s, char c, std::size_t from = 0) {
+    const char *data = s.data();
+    std::size_t i = from;
+#ifdef UNDIS_SCAN_AVX2
+    const __m256i c32 = _mm256_set1_epi8(c);
+    for (; i + 32 <= s.size(); i += 32) {
+        auto chunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto mask = static_cast<unsigned>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, c32)));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+#endif
+#ifdef UNDIS_SCAN_SSE2
+    const __m128i c16 = _mm_set1_epi8(c);
+    for (; i + 16 <= s.size(); i += 16) {
+        auto chunk =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto mask = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, c16)));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+#endif
+    for (; i < s.size(); ++i) {
+        if (data[i] == c) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// Offset of the first "\r\n" at or after `from`, or npos. Each block is
+// compared for '\r' and, shifted by a byte, for '\n', so a terminator
+// straddling two blocks is still found.
+inline std::size_t find_crlf(std::string_view s, std::size_t from = 0) {
+    const char *data = s.data();
+    std::size_t i = from;
+#ifdef UNDIS_SCAN_AVX2
+    const __m256i cr32 = _mm256_set1_epi8('\r');
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    for (; i + 33 <= s.size(); i += 32) {
+        auto first =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto second = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(data + i + 1));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(first, cr32),
+                             _mm256_cmpeq_epi8(second, lf32))));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+#endif
+#ifdef UNDIS_SCAN_SSE2
+    const __m128i cr16 = _mm_set1_epi8('\r');
+    const __m128i lf16 = _mm_set1_epi8('\n');
+    for (; i + 17 <= s.size(); i += 16) {
+        auto first =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto second =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, cr16), _mm_cmpeq_epi8(second, lf16))));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+#endif
+    for (; i + 1 < s.size(); ++i) {
+        if (data[i] == '\r' && data[i + 1] == '\n') {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+} // namespace scan
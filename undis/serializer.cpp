@@ -0,0 +1,298 @@
+#include "serializer.h"
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "checksum.h"
+
+#ifdef UNDIS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+template <typename T> void append(std::string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof value);
+}
+} // namespace
+
+Serializer::BlockWriter::BlockWriter(std::ofstream &ofs)
+    : ofs_{ofs}, offset_{HEADER_SIZE} {
+    ofs_.write(MAGIC, sizeof MAGIC);
+    ofs_.write(reinterpret_cast<const char *>(&VERSION_MARKER),
+               sizeof VERSION_MARKER);
+    ofs_.write(reinterpret_cast<const char *>(&VERSION), sizeof VERSION);
+    records_.reserve(BLOCK_SIZE);
+}
+
+void Serializer::BlockWriter::add(std::string_view key,
+                                  const StoreValue &val) {
+    using std::uint32_t;
+
+    append(records_, val.exp_time);
+    append(records_, static_cast<uint32_t>(key.size()));
+    records_.append(key);
+    append(records_, static_cast<uint32_t>(val.str_val.size()));
+    records_.append(val.str_val.view());
+    append(records_, val.flags);
+    ++block_items_;
+    if (records_.size() >= BLOCK_SIZE) {
+        flush();
+    }
+}
+
+void Serializer::BlockWriter::flush() {
+    if (block_items_ == 0) {
+        return;
+    }
+
+    auto codec = Codec::stored;
+    std::string_view payload{records_};
+#ifdef UNDIS_HAVE_ZLIB
+    // Favour speed: snapshots are written while serving requests
+    std::string compressed(compressBound(records_.size()), '\0');
+    auto compressed_size = static_cast<uLongf>(compressed.size());
+    if (compress2(reinterpret_cast<Bytef *>(compressed.data()),
+                  &compressed_size,
+                  reinterpret_cast<const Bytef *>(records_.data()),
+                  records_.size(), Z_BEST_SPEED) == Z_OK &&
+        compressed_size < records_.size()) {
+        codec = Codec::zlib;
+        payload = std::string_view{compressed.data(), compressed_size};
+    }
+#endif
+
+    std::string header;
+    append(header, static_cast<std::uint8_t>(codec));
+    append(header, block_items_);
+    append(header, static_cast<std::uint32_t>(records_.size()));
+    append(header, static_cast<std::uint32_t>(payload.size()));
+    append(header, crc32c(payload));
+    ofs_.write(header.data(), header.size());
+    ofs_.write(payload.data(), payload.size());
+
+    offsets_.push_back(offset_);
+    offset_ += header.size() + payload.size();
+    total_items_ += block_items_;
+    block_items_ = 0;
+    records_.clear();
+}
+
+void Serializer::BlockWriter::finish() {
+    flush();
+
+    std::string index;
+    append(index, total_items_);
+    append(index, static_cast<std::uint32_t>(offsets_.size()));
+    for (auto offset : offsets_) {
+        append(index, offset);
+    }
+    append(index, offset_);
+    append(index, crc32c(index.substr(0, index.size() - sizeof offset_)));
+    index.append(INDEX_MAGIC, sizeof INDEX_MAGIC);
+    ofs_.write(index.data(), index.size());
+}
+
+#ifdef _WIN32
+Serializer::MappedFile::MappedFile(const Path &filename) {
+    std::ifstream ifs{filename, std::ios::in | std::ios::binary};
+    size_ = std::filesystem::file_size(filename);
+    data_ = new char[size_];
+    ifs.read(data_, size_);
+}
+
+Serializer::MappedFile::~MappedFile() { delete[] data_; }
+#else
+Serializer::MappedFile::MappedFile(const Path &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error{"Could not open " + filename.string()};
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_ = st.st_size;
+        void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            data_ = static_cast<char *>(addr);
+            mapped_ = true;
+            // Blocks are decoded out of order, so read ahead aggressively
+            madvise(addr, size_, MADV_WILLNEED);
+        } else {
+            size_ = 0;
+        }
+    }
+    close(fd);
+    if (!mapped_ && st.st_size > 0) {
+        throw std::runtime_error{"Could not map " + filename.string()};
+    }
+}
+
+Serializer::MappedFile::~MappedFile() {
+    if (mapped_) {
+        munmap(data_, size_);
+    }
+}
+#endif
+
+void Serializer::corrupt() {
+    throw std::runtime_error{"Snapshot is truncated or corrupt"};
+}
+
+bool Serializer::sync_file(const Path &filename) {
+#ifdef _WIN32
+    int fd = _wopen(filename.c_str(), _O_RDWR | _O_BINARY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = _commit(fd) == 0;
+    _close(fd);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+#endif
+    return ok;
+}
+
+void Serializer::sync_dir([[maybe_unused]] const Path &filename) {
+#ifndef _WIN32
+    auto dir = filename.parent_path();
+    int dirfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+#endif
+}
+
+Serializer::Index Serializer::read_index(std::string_view file) {
+    using std::uint32_t, std::uint64_t;
+
+    if (file.size() < HEADER_SIZE + TRAILER_SIZE ||
+        !file.ends_with(std::string_view{INDEX_MAGIC, sizeof INDEX_MAGIC})) {
+        corrupt();
+    }
+    auto trailer = file.substr(file.size() - TRAILER_SIZE);
+    auto index_offset = read<uint64_t>(trailer);
+    auto index_crc = read<uint32_t>(trailer);
+    if (index_offset < HEADER_SIZE ||
+        index_offset > file.size() - TRAILER_SIZE) {
+        corrupt();
+    }
+    auto data = file.substr(index_offset,
+                            file.size() - TRAILER_SIZE - index_offset);
+    if (crc32c(data) != index_crc) {
+        corrupt();
+    }
+
+    Index index;
+    index.items = read<uint64_t>(data);
+    auto blocks = read<uint32_t>(data);
+    if (data.size() != blocks * sizeof(uint64_t)) {
+        corrupt();
+    }
+    index.offsets.reserve(blocks);
+    while (blocks-- > 0) {
+        auto offset = read<uint64_t>(data);
+        if (offset < HEADER_SIZE || offset >= index_offset) {
+            corrupt();
+        }
+        index.offsets.push_back(offset);
+    }
+    return index;
+}
+
+std::pair<std::string_view, std::uint32_t>
+Serializer::read_block(std::string_view file, std::uint64_t offset,
+                       std::string &buf) {
+    using std::uint32_t;
+
+    auto data = file.substr(offset);
+    auto codec = read<std::uint8_t>(data);
+    auto items = read<uint32_t>(data);
+    auto raw_size = read<uint32_t>(data);
+    auto stored_size = read<uint32_t>(data);
+    auto crc = read<uint32_t>(data);
+    if (data.size() < stored_size) {
+        corrupt();
+    }
+    auto payload = data.substr(0, stored_size);
+    if (crc32c(payload) != crc) {
+        corrupt();
+    }
+
+    switch (codec) {
+    case Codec::stored:
+        if (stored_size != raw_size) {
+            corrupt();
+        }
+        return {payload, items};
+
+    case Codec::zlib: {
+#ifdef UNDIS_HAVE_ZLIB
+        buf.resize(raw_size);
+        auto size = static_cast<uLongf>(raw_size);
+        if (uncompress(reinterpret_cast<Bytef *>(buf.data()), &size,
+                       reinterpret_cast<const Bytef *>(payload.data()),
+                       payload.size()) != Z_OK ||
+            size != raw_size) {
+            corrupt();
+        }
+        return {buf, items};
+#else
+        throw std::runtime_error{
+            "Snapshot is compressed, but undis was built without zlib"};
+#endif
+    }
+    }
+    corrupt();
+}
+
+void Serializer::load_parallel(
+    std::size_t n,
+    const std::function<void(std::size_t, std::string &)> &load) {
+    std::atomic<std::size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mtx;
+    auto worker = [&] {
+        std::string buf;
+        try {
+            for (auto i = next++; i < n; i = next++) {
+                load(i, buf);
+            }
+        } catch (...) {
+            std::scoped_lock lk{error_mtx};
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = n;
+        }
+    };
+
+    auto threads = std::min<std::size_t>(
+        std::max(std::thread::hardware_concurrency(), 1u), n);
+    {
+        std::vector<std::jthread> pool;
+        for (std::size_t i = 1; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+        worker();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -1,124 +1,262 @@
 #pragma once
 
+#include <algorithm>
+#include <concepts>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <ranges>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #include "storevalue.h"
 
+// Anything that can be filled with loaded entries, e.g. std::unordered_map
+template <typename T>
+concept EntrySink =
+    requires(T &sink, std::string key, StoreValue val, std::size_t n) {
+        sink.clear();
+        sink.reserve(n);
+        sink.emplace(std::move(key), std::move(val));
+    };
+
+// Sinks whose emplace can be called from several threads at once opt in to
+// parallel loading with a static constexpr bool concurrent = true
+template <typename T>
+concept ConcurrentEntrySink =
+    EntrySink<T> && requires { requires T::concurrent; };
+
+// Snapshot files start with "UNDS". Version 1 follows it with the item count
+// and the records. Version 2 follows it with 0xffffffff, which no version 1
+// count can be, and the version number; then come independently compressed
+// and checksummed blocks of records, an index of the blocks, and a trailer
+// locating the index:
+//
+//   block:   codec u8, items u32, raw size u32, stored size u32,
+//            CRC-32C of the stored bytes u32, stored bytes
+//   index:   total items u64, block count u32, block offsets u64...
+//   trailer: index offset u64, CRC-32C of the index u32, "UNDX"
+//
+// A record is expiry u32, key size u32, key, value size u32, value, flags
+// u32, all little-endian.
 class Serializer {
     using Path = std::filesystem::path;
 
-    template <typename Hash, typename KeyEqual, typename Allocator>
-    using Map =
-        std::unordered_map<std::string, StoreValue, Hash, KeyEqual, Allocator>;
-
   public:
     explicit Serializer(Path filename) : dbfile_{std::move(filename)} {}
 
-    template <typename Hash, typename KeyEqual, typename Allocator>
-    Serializer &operator<<(const Map<Hash, KeyEqual, Allocator> &);
+    // Accepts any range of key/value pairs, so a map or a joined view over
+    // several maps can be written. The entries go to a temporary file that
+    // then replaces the old one, so a failed write leaves it intact.
+    template <std::ranges::input_range R> Serializer &operator<<(R &&entries);
+
+    // Reads version 1 and 2 files, decoding version 2 blocks on every core
+    // for concurrent sinks. Throws std::runtime_error if the file is
+    // truncated or corrupt.
+    template <EntrySink S> Serializer &operator>>(S &sink);
 
-    template <typename Hash, typename KeyEqual, typename Allocator>
-    Serializer &operator>>(Map<Hash, KeyEqual, Allocator> &);
+    // Whether the last write succeeded
+    bool good() const { return good_; }
 
   private:
+    static constexpr char MAGIC[] = {'U', 'N', 'D', 'S'};
+    static constexpr char INDEX_MAGIC[] = {'U', 'N', 'D', 'X'};
+    static constexpr std::uint32_t VERSION_MARKER = 0xffffffff;
+    static constexpr std::uint32_t VERSION = 2;
+    static constexpr std::size_t HEADER_SIZE = 12;
+    static constexpr std::size_t BLOCK_HEADER_SIZE = 17;
+    static constexpr std::size_t TRAILER_SIZE = 16;
+    // Uncompressed bytes of records per block
+    static constexpr std::size_t BLOCK_SIZE = 1 << 20;
+
+    enum Codec : std::uint8_t { stored = 0, zlib = 1 };
+
+    // Buffers records and writes them out a block at a time
+    class BlockWriter {
+      public:
+        explicit BlockWriter(std::ofstream &ofs);
+        void add(std::string_view key, const StoreValue &val);
+        // Writes the last block, the index and the trailer
+        void finish();
+
+      private:
+        void flush();
+
+        std::ofstream &ofs_;
+        std::string records_;
+        std::uint32_t block_items_ = 0;
+        std::uint64_t offset_;
+        std::uint64_t total_items_ = 0;
+        std::vector<std::uint64_t> offsets_;
+    };
+
+    // The whole file, memory-mapped where supported
+    class MappedFile {
+      public:
+        explicit MappedFile(const Path &filename);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        std::string_view data() const { return {data_, size_}; }
+
+      private:
+        char *data_ = nullptr;
+        std::size_t size_ = 0;
+        bool mapped_ = false;
+    };
+
+    struct Index {
+        std::uint64_t items;
+        std::vector<std::uint64_t> offsets;
+    };
+
+    template <typename T> static T read(std::string_view &data);
+    [[noreturn]] static void corrupt();
+
+    // Flushes a written file to disk
+    static bool sync_file(const Path &filename);
+    // Makes a rename in filename's directory durable, where supported
+    static void sync_dir(const Path &filename);
+
+    static Index read_index(std::string_view file);
+    // Verifies the block at offset and returns its records, decompressing
+    // them into buf if needed, along with their count
+    static std::pair<std::string_view, std::uint32_t>
+    read_block(std::string_view file, std::uint64_t offset, std::string &buf);
+    // Calls load(i, buf) for every i below n, spread over all cores, with a
+    // scratch buffer per thread. Rethrows the first exception thrown.
+    static void
+    load_parallel(std::size_t n,
+                  const std::function<void(std::size_t, std::string &)> &load);
+
+    template <EntrySink S>
+    static void load_records(std::string_view records, std::uint64_t count,
+                             std::time_t now, S &sink);
+
     Path dbfile_;
+    bool good_ = true;
 };
 
-template <typename Hash, typename KeyEqual, typename Allocator>
-Serializer &Serializer::operator<<(const Map<Hash, KeyEqual, Allocator> &mp) {
-    using std::uint32_t;
-
-    std::ofstream ofs{dbfile_,
+template <std::ranges::input_range R>
+Serializer &Serializer::operator<<(R &&entries) {
+    auto tmpfile = dbfile_;
+    tmpfile += ".tmp";
+    std::ofstream ofs{tmpfile,
                       std::ios::out | std::ios::binary | std::ios::trunc};
     if (!ofs) {
+        good_ = false;
         return *this;
     }
 
-    ofs.write("UNDS", 4);
-
-    uint32_t size = 0;
-    ofs.seekp(sizeof size + 4);
-
+    BlockWriter writer{ofs};
     auto now = std::time(nullptr);
-    for (const auto &[k, v] : mp) {
-        if (v.exp_time <= now) {
-            continue;
+    for (const auto &[k, v] : entries) {
+        if (v.exp_time > now) {
+            writer.add(k, v);
         }
-        ++size;
-
-        ofs.write(reinterpret_cast<const char *>(&v.exp_time),
-                  sizeof v.exp_time);
-
-        const auto &str = v.str_val;
-        auto klen = static_cast<uint32_t>(k.size()),
-             vlen = static_cast<uint32_t>(str.size());
-
-        ofs.write(reinterpret_cast<const char *>(&klen), sizeof klen);
-        ofs.write(k.data(), klen);
-
-        ofs.write(reinterpret_cast<const char *>(&vlen), sizeof vlen);
-        ofs.write(str.data(), vlen);
-
-        ofs.write(reinterpret_cast<const char *>(&v.flags), sizeof v.flags);
     }
-
-    ofs.seekp(4);
-    ofs.write(reinterpret_cast<const char *>(&size), sizeof size);
-
+    writer.finish();
+    ofs.close();
+
+    // As with the append log, the file must be on disk before the rename
+    // replaces the last snapshot with it
+    std::error_code ec;
+    bool ok = ofs && sync_file(tmpfile);
+    if (ok) {
+        std::filesystem::rename(tmpfile, dbfile_, ec);
+    }
+    good_ = ok && !ec;
+    if (!good_) {
+        std::filesystem::remove(tmpfile, ec);
+        return *this;
+    }
+    sync_dir(dbfile_);
     return *this;
 }
 
-template <typename Hash, typename KeyEqual, typename Allocator>
-Serializer &Serializer::operator>>(Map<Hash, KeyEqual, Allocator> &mp) {
-    using std::uint32_t;
-
-    std::ifstream ifs{dbfile_, std::ios::in | std::ios::binary};
-    if (!ifs) {
+template <EntrySink S> Serializer &Serializer::operator>>(S &sink) {
+    if (!std::filesystem::exists(dbfile_)) {
         return *this;
     }
-
-    char h[4];
-    ifs.read(h, 4);
-    if (!(h[0] == 'U' && h[1] == 'N' && h[2] == 'D' && h[3] == 'S')) {
+    MappedFile file{dbfile_};
+    auto data = file.data();
+    if (data.size() < 2 * sizeof(std::uint32_t) ||
+        !std::equal(MAGIC, MAGIC + sizeof MAGIC, data.begin())) {
         return *this;
     }
-
-    uint32_t size;
-    ifs.read(reinterpret_cast<char *>(&size), sizeof size);
-
-    mp.clear();
-    mp.reserve(size);
+    data.remove_prefix(sizeof MAGIC);
 
     auto now = std::time(nullptr);
-    while (size-- > 0) {
-        uint32_t klen, vlen, flags, exp_time;
-
-        ifs.read(reinterpret_cast<char *>(&exp_time), sizeof exp_time);
-        if (exp_time <= now) {
-            ifs.read(reinterpret_cast<char *>(&klen), sizeof klen);
-            ifs.seekg(klen, std::ios::cur);
-            ifs.read(reinterpret_cast<char *>(&vlen), sizeof vlen);
-            ifs.seekg(vlen + 4, std::ios::cur);
-            continue;
-        }
+    auto count = read<std::uint32_t>(data);
+    if (count != VERSION_MARKER) {
+        sink.clear();
+        sink.reserve(count);
+        load_records(data, count, now, sink);
+        return *this;
+    }
+    if (read<std::uint32_t>(data) != VERSION) {
+        throw std::runtime_error{dbfile_.string() +
+                                 " has an unsupported snapshot version"};
+    }
 
-        ifs.read(reinterpret_cast<char *>(&klen), sizeof klen);
-        std::string k(klen, '0');
-        ifs.read(k.data(), klen);
+    auto index = read_index(file.data());
+    sink.clear();
+    sink.reserve(index.items);
+    auto load = [&](std::size_t i, std::string &buf) {
+        auto [records, items] = read_block(file.data(), index.offsets[i], buf);
+        load_records(records, items, now, sink);
+    };
+    if constexpr (ConcurrentEntrySink<S>) {
+        load_parallel(index.offsets.size(), load);
+    } else {
+        std::string buf;
+        for (std::size_t i = 0; i < index.offsets.size(); ++i) {
+            load(i, buf);
+        }
+    }
+    return *this;
+}
 
-        ifs.read(reinterpret_cast<char *>(&vlen), sizeof vlen);
-        std::string v(vlen, '0');
-        ifs.read(v.data(), vlen);
+template <typename T> T Serializer::read(std::string_view &data) {
+    if (data.size() < sizeof(T)) {
+        corrupt();
+    }
+    T value;
+    std::memcpy(&value, data.data(), sizeof value);
+    data.remove_prefix(sizeof value);
+    return value;
+}
 
-        ifs.read(reinterpret_cast<char *>(&flags), sizeof flags);
+template <EntrySink S>
+void Serializer::load_records(std::string_view records, std::uint64_t count,
+                              std::time_t now, S &sink) {
+    using std::uint32_t;
 
-        mp.emplace(std::move(k), StoreValue{std::move(v), flags, exp_time});
+    auto read_bytes = [&records](uint32_t size) {
+        if (records.size() < size) {
+            corrupt();
+        }
+        auto bytes = records.substr(0, size);
+        records.remove_prefix(size);
+        return bytes;
+    };
+
+    while (count-- > 0) {
+        auto exp_time = read<uint32_t>(records);
+        auto k = read_bytes(read<uint32_t>(records));
+        auto v = read_bytes(read<uint32_t>(records));
+        auto flags = read<uint32_t>(records);
+        if (exp_time > now) {
+            sink.emplace(std::string{k},
+                         StoreValue{std::string{v}, flags, exp_time});
+        }
     }
-
-    return *this;
 }
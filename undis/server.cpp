@@ -1,13 +1,20 @@
 #include "server.h"
 
 #include "connectionhandler.h"
+#include "eventloop.h"
+#include "stats.h"
+#include "uringloop.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
 
 // Parts adapted from https://beej.us/guide/bgnet/html/
 
-volatile static std::sig_atomic_t stop = 0;
+volatile static std::sig_atomic_t stop_requested = 0;
 
-Server::Server(unsigned port, KVStore &store)
-    : store_{store}, wsaclean_{false} {
+Server::Server(unsigned port, KVStore &store, ServerOptions options)
+    : store_{store}, options_{options}, wsaclean_{false} {
 #ifdef _WIN32
     WSAData wsa_data;
     if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
@@ -64,14 +71,17 @@ Server::Server(unsigned port, KVStore &store)
         throw std::runtime_error{"failed to bind."};
     }
 
-    if (listen(sockfd_, 10)) {
+    if (listen(sockfd_, SOMAXCONN)) {
         throw std::runtime_error{"listen failed."};
     }
 
-    std::cout << "Server initialized on port " << port << '\n';
+    std::cout << "Server initialized on port " << this->port() << '\n';
 }
 
-Server::~Server() { close_socket(sockfd_); }
+Server::~Server() {
+    Stats::watch_pool(nullptr);
+    close_socket(sockfd_);
+}
 
 void Server::start() {
 #ifdef _WIN32
@@ -85,18 +95,143 @@ void Server::start() {
     sigaction(SIGTERM, &sa, nullptr);
 #endif
 
-    tp_.emplace(1, 10, std::chrono::seconds(5));
+    stop_requested = 0;
+    Stats::watch_pool(nullptr);
+    tp_.emplace(options_.min_threads, options_.max_threads,
+                options_.idle_timeout);
+    Stats::watch_pool(&*tp_);
 
     std::cout << "Waiting for connections...\n";
-    while (!stop) {
+    switch (options_.engine) {
+    case IoEngine::blocking:
+        run_blocking();
+        break;
+    case IoEngine::epoll:
+        run_epoll();
+        break;
+    case IoEngine::io_uring:
+        run_io_uring();
+        break;
+    }
+    std::cout << "Stopping...\n";
+}
+
+void Server::stop() {
+    stop_requested = 1;
+    // Wakes the blocking engine's accept call
+#ifdef _WIN32
+    shutdown(sockfd_, SD_BOTH);
+#else
+    shutdown(sockfd_, SHUT_RDWR);
+#endif
+}
+
+unsigned Server::port() const {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof addr;
+    if (getsockname(sockfd_, reinterpret_cast<sockaddr *>(&addr), &len) ==
+        SOCKET_ERROR) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port);
+    }
+    return ntohs(reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+}
+
+std::uint64_t Server::syscall_count() {
+    return Stats::collect()[Stats::Counter::syscalls];
+}
+
+void Server::run_blocking() {
+    while (!stop_requested) {
         SOCKET newfd = accept(sockfd_, nullptr, nullptr);
 
         if (newfd != INVALID_SOCKET) {
-            std::cout << "Got connection\n";
-            tp_->queue_job(ConnectionHandler{store_, newfd});
+            Stats::connection_opened();
+            configure_socket(newfd, options_);
+            tp_->queue_job(ConnectionHandler{store_, newfd, options_});
         }
     }
-    std::cout << "Stopping...\n";
+}
+
+void Server::run_epoll() {
+#ifdef __linux__
+    if (fcntl(sockfd_, F_SETFL, fcntl(sockfd_, F_GETFL) | O_NONBLOCK) == -1) {
+        throw std::runtime_error{"fcntl failed."};
+    }
+
+    // Every loop waits on the listening socket, so connections are spread
+    // across them by the kernel
+    unsigned count = std::max(options_.event_loops, 1u);
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    for (unsigned i = 0; i < count; ++i) {
+        loops.push_back(std::make_unique<EventLoop>(sockfd_, store_, *tp_,
+                                                   options_));
+    }
+
+    std::vector<std::jthread> threads;
+    for (unsigned i = 1; i < count; ++i) {
+        threads.emplace_back(
+            [&loop = *loops[i]]() { loop.run(stop_requested); });
+    }
+    loops[0]->run(stop_requested);
+#else
+    throw std::runtime_error{"epoll is not supported on this platform."};
+#endif
+}
+
+void Server::run_io_uring() {
+#ifdef UNDIS_HAVE_IO_URING
+    std::vector<std::unique_ptr<UringLoop>> loops;
+    try {
+        unsigned count = std::max(options_.event_loops, 1u);
+        for (unsigned i = 0; i < count; ++i) {
+            loops.push_back(
+                std::make_unique<UringLoop>(sockfd_, store_, *tp_, options_));
+        }
+    } catch (const std::runtime_error &e) {
+        std::cerr << "io_uring unavailable (" << e.what()
+                  << "), falling back to epoll\n";
+        loops.clear();
+        run_epoll();
+        return;
+    }
+
+    std::vector<std::jthread> threads;
+    for (std::size_t i = 1; i < loops.size(); ++i) {
+        threads.emplace_back(
+            [&loop = *loops[i]]() { loop.run(stop_requested); });
+    }
+    loops[0]->run(stop_requested);
+#else
+    std::cerr << "Built without io_uring support, falling back to epoll\n";
+    run_epoll();
+#endif
+}
+
+void Server::configure_socket(SOCKET fd, const ServerOptions &options) {
+    if (options.tcp == TcpMode::nagle) {
+        return;
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char *>(&yes),
+               sizeof yes);
+    Stats::add(Stats::Counter::syscalls);
+}
+
+int Server::send_flags(const ServerOptions &options, bool more) {
+#ifdef _WIN32
+    return 0;
+#else
+    int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+    if (more && options.tcp == TcpMode::cork) {
+        flags |= MSG_MORE;
+    }
+#endif
+    return flags;
+#endif
 }
 
 void Server::close_socket(SOCKET fd) {
@@ -107,4 +242,4 @@ void Server::close_socket(SOCKET fd) {
 #endif
 }
 
-void Server::sig_handler(int s) { stop = 1; }
+void Server::sig_handler(int s) { stop_requested = 1; }
@@ -7,15 +7,22 @@
 #pragma comment(lib, "Ws2_32.lib")
 #else
 #include <arpa/inet.h>
+#include <climits>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 using SOCKET = int;
 constexpr int INVALID_SOCKET = -1;
 constexpr int SOCKET_ERROR = -1;
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <csignal>
 #include <iostream>
 #include <memory>
@@ -28,16 +35,58 @@ constexpr int SOCKET_ERROR = -1;
 
 class KVStore;
 
+enum class IoEngine { blocking, epoll, io_uring };
+
+// How replies are handed to TCP. Each engine writes out every reply queued
+// for a connection at once, so a batch rarely benefits from Nagle's
+// algorithm holding it back.
+enum class TcpMode {
+    // Send each batch right away
+    nodelay,
+    // Leave Nagle's algorithm on
+    nagle,
+    // Like nodelay, but a batch written in several calls is held back until
+    // its last part, so that it leaves in full segments (Linux only)
+    cork,
+};
+
+struct ServerOptions {
+#ifdef __linux__
+    IoEngine engine = IoEngine::epoll;
+#else
+    IoEngine engine = IoEngine::blocking;
+#endif
+    // Number of event loop threads for the epoll and io_uring engines
+    unsigned event_loops = 1;
+    // End text replies with an interactive prompt; machine clients that
+    // pipeline requests have no use for it
+    bool prompt = true;
+    TcpMode tcp = TcpMode::nodelay;
+    // Thread pool limits; the pool sizes itself in between, and stops
+    // threads once it has had more than it needs for idle_timeout
+    unsigned min_threads = 1;
+    unsigned max_threads = 10;
+    std::chrono::seconds idle_timeout{5};
+};
+
 class Server {
   public:
-    Server(unsigned port, KVStore &store);
+    Server(unsigned port, KVStore &store, ServerOptions options = {});
     ~Server();
     Server(const Server &) = delete;
     Server(Server &&) = delete;
     Server &operator=(const Server &) = delete;
     Server &operator=(Server &&) = delete;
 
+    // Serves clients until interrupted by a signal or stop()
     void start();
+    void stop();
+
+    // The bound port, useful when constructed with port 0
+    unsigned port() const;
+
+    // System calls made by the I/O engines so far, for comparing them
+    static std::uint64_t syscall_count();
 
   private:
     struct WSACleanupWrapper {
@@ -51,14 +100,28 @@ class Server {
         }
     };
     static void close_socket(SOCKET fd);
+    // Applies the TCP options to an accepted connection
+    static void configure_socket(SOCKET fd, const ServerOptions &options);
+    // Flags for sending part of a batch; `more` if the rest of it follows
+    static int send_flags(const ServerOptions &options, bool more);
     static void sig_handler(int s);
 
+    // One thread per connection, blocking in recv
+    void run_blocking();
+    // Non-blocking reactors that hand requests to the thread pool
+    void run_epoll();
+    // Falls back to epoll if the kernel lacks io_uring support
+    void run_io_uring();
+
     SOCKET sockfd_;
 
     KVStore &store_;
+    ServerOptions options_;
     std::optional<ThreadPool> tp_;
 
     WSACleanupWrapper wsaclean_;
 
     friend class ConnectionHandler;
+    friend class EventLoop;
+    friend class UringLoop;
 };
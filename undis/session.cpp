@@ -0,0 +1,152 @@
+#include "session.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "binarycommand.h"
+#include "scan.h"
+
+using namespace std::literals;
+
+namespace {
+constexpr std::string_view prompt = "undis > "sv;
+
+std::string_view command_name(std::string_view line) {
+    auto begin = std::min(line.find_first_not_of(' '), line.size());
+    auto end = std::min(scan::find(line, ' ', begin), line.size());
+    return line.substr(begin, end - begin);
+}
+} // namespace
+
+Session::Session(KVStore &store, bool prompt)
+    : store_{store}, prompt_{prompt} {}
+
+std::size_t Session::process(std::string_view input, ReplyQueue &out) {
+    if (protocol_ == Protocol::unknown) {
+        if (input.empty()) {
+            return 0;
+        }
+        protocol_ = static_cast<std::uint8_t>(input[0]) ==
+                            binary_protocol::REQUEST_MAGIC
+                        ? Protocol::binary
+                        : Protocol::text;
+    }
+    return protocol_ == Protocol::binary ? process_binary(input, out)
+                                         : process_text(input, out);
+}
+
+std::size_t Session::process_binary(std::string_view input,
+                                    ReplyQueue &out) {
+    std::size_t consumed = 0;
+    while (!closed_) {
+        auto rest = input.substr(consumed);
+        auto size = BinaryCommand::size(rest);
+        if (!size.has_value() || rest.size() < *size) {
+            break;
+        }
+        if (static_cast<std::uint8_t>(rest[0]) !=
+            binary_protocol::REQUEST_MAGIC) {
+            // Out of sync with the client
+            closed_ = true;
+            break;
+        }
+
+        auto start = Clock::now();
+        BinaryCommand c{rest.substr(0, *size)};
+        auto reply = c.execute(store_);
+        if (auto op = c.op(); op.has_value()) {
+            Stats::record(*op, Clock::now() - start);
+        }
+        if (reply.size() > 0) {
+            out.push(std::move(reply));
+        }
+        consumed += *size;
+        closed_ = c.quit();
+    }
+    return consumed;
+}
+
+std::size_t Session::process_text(std::string_view input, ReplyQueue &out) {
+    std::size_t consumed = 0;
+    while (!closed_) {
+        auto line_end = scan::find_crlf(input, consumed + scan_from_);
+        if (line_end == std::string_view::npos) {
+            // The last byte may be the first half of a CRLF
+            auto pending = input.size() - consumed;
+            scan_from_ = pending > 0 ? pending - 1 : 0;
+            break;
+        }
+        scan_from_ = 0;
+
+        auto line = input.substr(consumed, line_end - consumed);
+        consumed = line_end + 2;
+        handle_line(line, out);
+    }
+    // Deletes in the batch refer to the input
+    flush_batch(out);
+    return consumed;
+}
+
+void Session::handle_line(std::string_view line, ReplyQueue &out) {
+    Reply reply;
+    try {
+        if (pending_.has_value()) {
+            auto c = std::move(*pending_);
+            pending_.reset();
+            if (batch_.add(c, line)) {
+                return;
+            }
+            flush_batch(out);
+            reply = c.execute(store_, std::string{line});
+        } else if (line == "quit"sv) {
+            flush_batch(out);
+            closed_ = true;
+            return;
+        } else {
+            timings_.push_back({Stats::op(command_name(line)), Clock::now()});
+            Command c{line};
+            switch (c.status()) {
+            case CommandStatus::valid_command:
+                if (batch_.add(c)) {
+                    return;
+                }
+                flush_batch(out);
+                reply = c.execute(store_);
+                break;
+            case CommandStatus::data_required:
+                pending_.emplace(std::move(c));
+                return;
+            case CommandStatus::invalid_command:
+                flush_batch(out);
+                reply.append("ERROR\r\n"sv);
+                break;
+            }
+        }
+    } catch (const std::exception &) {
+        reply = error_reply(std::current_exception());
+    }
+    push(std::move(reply), out);
+}
+
+void Session::flush_batch(ReplyQueue &out) {
+    if (batch_.empty()) {
+        return;
+    }
+    for (auto &reply : batch_.execute(store_)) {
+        push(std::move(reply), out);
+    }
+}
+
+void Session::push(Reply reply, ReplyQueue &out) {
+    if (!timings_.empty()) {
+        auto [op, start] = timings_.front();
+        timings_.pop_front();
+        if (op.has_value()) {
+            Stats::record(*op, Clock::now() - start);
+        }
+    }
+    if (prompt_) {
+        reply.append(prompt);
+    }
+    out.push(std::move(reply));
+}
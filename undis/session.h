@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "command.h"
+#include "reply.h"
+#include "stats.h"
+
+class KVStore;
+
+// Protocol state of one client connection, independent of how its bytes are
+// received and sent. Input is fed in as it arrives, and replies are queued
+// for the caller to write.
+//
+// The protocol is detected from the first byte: memcached binary requests
+// start with 0x80, and anything else is text. Text replies end with a
+// prompt unless it is turned off, but nothing is sent before the first
+// request so that binary clients do not receive one.
+//
+// Runs of pipelined text sets and deletes are executed as a batch, locking
+// each shard once, before any other request and at the end of the input.
+//
+// The latency of each request, from its line being read to its reply being
+// queued, is recorded in the server's statistics.
+class Session {
+  public:
+    explicit Session(KVStore &store, bool prompt = true);
+
+    // Executes every complete request at the front of `input`, queueing the
+    // replies. Returns the number of bytes consumed; the rest must be passed
+    // again, followed by more input.
+    std::size_t process(std::string_view input, ReplyQueue &out);
+
+    bool closed() const { return closed_; }
+
+  private:
+    enum class Protocol { unknown, text, binary };
+    using Clock = std::chrono::steady_clock;
+
+    // A text request whose reply is not queued yet
+    struct Timing {
+        std::optional<Stats::Op> op;
+        Clock::time_point start;
+    };
+
+    std::size_t process_text(std::string_view input, ReplyQueue &out);
+    std::size_t process_binary(std::string_view input, ReplyQueue &out);
+    void handle_line(std::string_view line, ReplyQueue &out);
+    // Executes the batched commands, which must precede any other reply
+    void flush_batch(ReplyQueue &out);
+    void push(Reply reply, ReplyQueue &out);
+
+    KVStore &store_;
+    bool prompt_;
+    Protocol protocol_ = Protocol::unknown;
+    // Storage command waiting for its data line
+    std::optional<Command> pending_;
+    // Pipelined sets and deletes not executed yet
+    CommandBatch batch_;
+    // In the order of their replies
+    std::deque<Timing> timings_;
+    // Where to resume searching for the end of a partially received line
+    std::size_t scan_from_ = 0;
+    bool closed_ = false;
+};
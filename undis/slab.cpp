@@ -0,0 +1,309 @@
+#include "slab.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+struct SlabAllocator::Page {
+    static constexpr std::size_t MAX_CHUNKS = PAGE_SIZE / MIN_CHUNK;
+
+    // Pages are aligned to their size, so a chunk's page is found from its
+    // address alone
+    static Page &of(const void *ptr) {
+        return *reinterpret_cast<Page *>(reinterpret_cast<std::uintptr_t>(ptr) &
+                                         ~(PAGE_SIZE - 1));
+    }
+    static std::size_t header_size() {
+        return (sizeof(Page) + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1);
+    }
+
+    char *chunks() { return reinterpret_cast<char *>(this) + header_size(); }
+
+    bool in_use(std::size_t i) const {
+        return (used_bits[i / 64] >> (i % 64) & 1) != 0;
+    }
+    void mark(std::size_t i, bool used) {
+        if (used) {
+            used_bits[i / 64] |= std::uint64_t{1} << (i % 64);
+        } else {
+            used_bits[i / 64] &= ~(std::uint64_t{1} << (i % 64));
+        }
+    }
+
+    // Written only while the page has no chunks in use, so other threads
+    // freeing a chunk can read it
+    SlabAllocator *owner = nullptr;
+    std::size_t cls = 0;
+
+    Page *prev = nullptr;
+    Page *next = nullptr;
+    bool listed = false;
+    // Being emptied by the owner, so not allocated from
+    bool draining = false;
+    FreeChunk *free = nullptr;
+    std::size_t used = 0;
+    // Chunks handed out at least once; those past them are untouched
+    std::size_t carved = 0;
+    std::array<std::uint64_t, MAX_CHUNKS / 64> used_bits{};
+};
+
+namespace {
+// Empty pages shared by every allocator
+class PagePool {
+  public:
+    static PagePool &instance() {
+        static PagePool pool;
+        return pool;
+    }
+
+    ~PagePool() {
+        for (auto *page : pages_) {
+            free(page);
+        }
+    }
+
+    void *take() {
+        {
+            std::scoped_lock lk{mtx_};
+            if (!pages_.empty()) {
+                auto *page = pages_.back();
+                pages_.pop_back();
+                return page;
+            }
+        }
+        return ::operator new(SlabAllocator::PAGE_SIZE,
+                              std::align_val_t{SlabAllocator::PAGE_SIZE});
+    }
+
+    void put(void *page) {
+        {
+            std::scoped_lock lk{mtx_};
+            if (pages_.size() < SlabAllocator::MAX_POOLED_PAGES) {
+                pages_.push_back(page);
+                return;
+            }
+        }
+        free(page);
+    }
+
+    std::size_t size() {
+        std::scoped_lock lk{mtx_};
+        return pages_.size();
+    }
+
+  private:
+    static void free(void *page) {
+        ::operator delete(page, std::align_val_t{SlabAllocator::PAGE_SIZE});
+    }
+
+    std::mutex mtx_;
+    std::vector<void *> pages_;
+};
+
+const std::vector<std::size_t> &class_sizes() {
+    static const auto sizes = [] {
+        std::vector<std::size_t> sizes;
+        for (double size = SlabAllocator::MIN_CHUNK;
+             size < SlabAllocator::MAX_CHUNK;
+             size *= SlabAllocator::GROWTH_FACTOR) {
+            auto aligned = (static_cast<std::size_t>(size) +
+                            SlabAllocator::CHUNK_ALIGNMENT - 1) &
+                           ~(SlabAllocator::CHUNK_ALIGNMENT - 1);
+            if (sizes.empty() || aligned > sizes.back()) {
+                sizes.push_back(aligned);
+            }
+        }
+        sizes.push_back(SlabAllocator::MAX_CHUNK);
+        return sizes;
+    }();
+    return sizes;
+}
+} // namespace
+
+SlabAllocator::SlabAllocator() {
+    const auto &sizes = class_sizes();
+    classes_.resize(sizes.size());
+    for (std::size_t i = 0; i < sizes.size(); ++i) {
+        classes_[i].chunk_size = sizes[i];
+        classes_[i].per_page = (PAGE_SIZE - Page::header_size()) / sizes[i];
+    }
+}
+
+SlabAllocator::~SlabAllocator() {
+    auto &pool = PagePool::instance();
+    for (auto &c : classes_) {
+        for (auto *page : c.pages) {
+            page->~Page();
+            pool.put(page);
+        }
+    }
+}
+
+std::size_t SlabAllocator::class_count() { return class_sizes().size(); }
+
+std::size_t SlabAllocator::pooled_pages() {
+    return PagePool::instance().size();
+}
+
+SlabAllocator::Chunk SlabAllocator::allocate(std::size_t size) {
+    drain();
+    if (size > MAX_CHUNK) {
+        return {::operator new(size), size};
+    }
+
+    const auto &sizes = class_sizes();
+    auto cls = static_cast<std::size_t>(
+        std::lower_bound(sizes.begin(), sizes.end(), size) - sizes.begin());
+    auto &c = classes_[cls];
+    auto &page = c.partial != nullptr ? *c.partial : add_page(cls);
+
+    char *ptr;
+    if (page.free != nullptr) {
+        ptr = reinterpret_cast<char *>(page.free);
+        page.free = page.free->next;
+    } else {
+        ptr = page.chunks() + page.carved++ * c.chunk_size;
+    }
+    page.mark((ptr - page.chunks()) / c.chunk_size, true);
+    ++c.used;
+    if (++page.used == c.per_page) {
+        unlist(page);
+    }
+    refs_.fetch_add(1, std::memory_order_relaxed);
+    return {ptr, c.chunk_size};
+}
+
+void SlabAllocator::deallocate(void *ptr, std::size_t size) noexcept {
+    if (size > MAX_CHUNK) {
+        ::operator delete(ptr);
+        return;
+    }
+    auto *owner = Page::of(ptr).owner;
+    auto *chunk = new (ptr) FreeChunk{owner->returned_.load(
+        std::memory_order_relaxed)};
+    while (!owner->returned_.compare_exchange_weak(
+        chunk->next, chunk, std::memory_order_release,
+        std::memory_order_relaxed)) {
+    }
+    owner->unref();
+}
+
+void SlabAllocator::drain() {
+    // Taking the whole list at once leaves no room for ABA problems
+    auto *chunk = returned_.exchange(nullptr, std::memory_order_acquire);
+    while (chunk != nullptr) {
+        auto *next = chunk->next;
+        put_back(chunk);
+        chunk = next;
+    }
+}
+
+void SlabAllocator::put_back(void *ptr) {
+    auto &page = Page::of(ptr);
+    auto &c = classes_[page.cls];
+    page.mark((static_cast<char *>(ptr) - page.chunks()) / c.chunk_size,
+              false);
+    page.free = new (ptr) FreeChunk{page.free};
+    --page.used;
+    --c.used;
+    if (!page.listed && !page.draining) {
+        list(page);
+    }
+}
+
+SlabAllocator::Page &SlabAllocator::add_page(std::size_t cls) {
+    auto &c = classes_[cls];
+    c.pages.reserve(c.pages.size() + 1);
+    auto *page = new (PagePool::instance().take()) Page;
+    page->owner = this;
+    page->cls = cls;
+    c.pages.push_back(page);
+    list(*page);
+    return *page;
+}
+
+void SlabAllocator::list(Page &page) {
+    auto &c = classes_[page.cls];
+    page.prev = nullptr;
+    page.next = c.partial;
+    if (c.partial != nullptr) {
+        c.partial->prev = &page;
+    }
+    c.partial = &page;
+    page.listed = true;
+}
+
+void SlabAllocator::unlist(Page &page) {
+    auto &c = classes_[page.cls];
+    (page.prev != nullptr ? page.prev->next : c.partial) = page.next;
+    if (page.next != nullptr) {
+        page.next->prev = page.prev;
+    }
+    page.prev = page.next = nullptr;
+    page.listed = false;
+}
+
+std::vector<void *> SlabAllocator::rebalance() {
+    drain();
+    auto &pool = PagePool::instance();
+    Page *sparsest = nullptr;
+    for (auto &c : classes_) {
+        std::erase_if(c.pages, [&](Page *page) {
+            page->draining = false;
+            if (page->used == 0) {
+                if (page->listed) {
+                    unlist(*page);
+                }
+                page->~Page();
+                pool.put(page);
+                return true;
+            }
+            if (!page->listed && page->used < c.per_page) {
+                list(*page);
+            }
+            return false;
+        });
+
+        // Worth it when there is a page's worth of free chunks, and the
+        // other pages have room for everything in the sparsest one
+        auto free_chunks = c.pages.size() * c.per_page - c.used;
+        if (free_chunks < c.per_page) {
+            continue;
+        }
+        auto *page = *std::ranges::min_element(
+            c.pages, {}, [](const Page *p) { return p->used; });
+        if (free_chunks - (c.per_page - page->used) >= page->used &&
+            (sparsest == nullptr || page->used < sparsest->used)) {
+            sparsest = page;
+        }
+    }
+    if (sparsest == nullptr) {
+        return {};
+    }
+
+    if (sparsest->listed) {
+        unlist(*sparsest);
+    }
+    sparsest->draining = true;
+    std::vector<void *> chunks;
+    chunks.reserve(sparsest->used);
+    auto chunk_size = classes_[sparsest->cls].chunk_size;
+    for (std::size_t i = 0; i < sparsest->carved; ++i) {
+        if (sparsest->in_use(i)) {
+            chunks.push_back(sparsest->chunks() + i * chunk_size);
+        }
+    }
+    return chunks;
+}
+
+std::vector<SlabAllocator::ClassStats> SlabAllocator::stats() {
+    drain();
+    std::vector<ClassStats> stats(classes_.size());
+    for (std::size_t i = 0; i < classes_.size(); ++i) {
+        const auto &c = classes_[i];
+        stats[i] = {c.chunk_size, c.per_page, c.pages.size(), c.used,
+                    c.pages.size() * c.per_page - c.used};
+    }
+    return stats;
+}
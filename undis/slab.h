@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Memory for the store's items, as in memcached: PAGE_SIZE pages are carved
+// into chunks of one of a series of size classes, starting at MIN_CHUNK
+// bytes and growing by GROWTH_FACTOR, so items of similar sizes are packed
+// together instead of fragmenting the heap. Requests larger than MAX_CHUNK
+// are served by operator new.
+//
+// Each shard of the store has its own allocator, used under the shard's
+// lock. Chunks may be freed from any thread, as values share them with
+// replies, and come back through a lock-free list that the owner drains.
+// Pages that empty out go to a pool shared by every allocator, where any
+// class can pick them up, so memory follows the mix of item sizes; rebalance
+// helps it along by choosing sparse pages to move items out of. An allocator
+// lives until its owner has let go of it and all of its chunks are freed.
+class SlabAllocator {
+    struct Page;
+
+  public:
+    static constexpr std::size_t PAGE_SIZE = 1 << 20;
+    static constexpr std::size_t MIN_CHUNK = 64;
+    static constexpr double GROWTH_FACTOR = 1.25;
+    static constexpr std::size_t MAX_CHUNK = PAGE_SIZE / 4;
+    static constexpr std::size_t CHUNK_ALIGNMENT = 8;
+    // Empty pages kept for reuse; the rest go back to the system
+    static constexpr std::size_t MAX_POOLED_PAGES = 16;
+
+    struct Release {
+        void operator()(SlabAllocator *slab) const noexcept { slab->unref(); }
+    };
+    using Handle = std::unique_ptr<SlabAllocator, Release>;
+    static Handle create() { return Handle{new SlabAllocator}; }
+
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    struct Chunk {
+        void *ptr;
+        // At least the requested size: the whole chunk may be used
+        std::size_t size;
+    };
+    // Throws std::bad_alloc
+    Chunk allocate(std::size_t size);
+    // Any thread. Takes the size allocate returned.
+    static void deallocate(void *ptr, std::size_t size) noexcept;
+
+    // Releases empty pages to the pool, and returns the chunks in use in the
+    // sparsest page of a class with a page's worth of free chunks, if the
+    // class's other pages have room for them. Until the next call, allocate
+    // avoids that page, so the owner can empty it by moving those chunks'
+    // contents to new ones.
+    std::vector<void *> rebalance();
+
+    struct ClassStats {
+        std::size_t chunk_size = 0;
+        std::size_t chunks_per_page = 0;
+        std::size_t pages = 0;
+        std::size_t used_chunks = 0;
+        std::size_t free_chunks = 0;
+    };
+    static std::size_t class_count();
+    // Indexed by class, after taking back the chunks freed elsewhere
+    std::vector<ClassStats> stats();
+    // Empty pages in the shared pool
+    static std::size_t pooled_pages();
+
+  private:
+    struct FreeChunk {
+        FreeChunk *next;
+    };
+
+    struct SizeClass {
+        std::size_t chunk_size = 0;
+        std::size_t per_page = 0;
+        std::vector<Page *> pages;
+        // Pages with free chunks, linked through Page::prev and next
+        Page *partial = nullptr;
+        std::size_t used = 0;
+    };
+
+    SlabAllocator();
+    ~SlabAllocator();
+
+    void unref() noexcept {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    // Puts the chunks freed by other threads back in their pages
+    void drain();
+    void put_back(void *ptr);
+
+    Page &add_page(std::size_t cls);
+    void list(Page &page);
+    void unlist(Page &page);
+
+    std::vector<SizeClass> classes_;
+    // Freed chunks not yet back in their pages
+    std::atomic<FreeChunk *> returned_{nullptr};
+    // One for the owner and one for each chunk in use
+    std::atomic<std::size_t> refs_{1};
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+// A vector whose first N elements are stored inline, so that it only
+// allocates once it outgrows them. Only appending is supported.
+template <typename T, std::size_t N>
+    requires std::is_trivially_copyable_v<T>
+class SmallVector {
+  public:
+    void push_back(const T &value) {
+        if (size_ < N) {
+            inline_[size_] = value;
+        } else {
+            if (size_ == N) {
+                heap_.assign(inline_.begin(), inline_.end());
+            }
+            heap_.push_back(value);
+        }
+        ++size_;
+    }
+
+    const T *begin() const {
+        return size_ <= N ? inline_.data() : heap_.data();
+    }
+    const T *end() const { return begin() + size_; }
+    const T &operator[](std::size_t i) const { return begin()[i]; }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+  private:
+    std::array<T, N> inline_;
+    std::vector<T> heap_;
+    std::size_t size_ = 0;
+};
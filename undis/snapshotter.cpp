@@ -0,0 +1,126 @@
+#include "snapshotter.h"
+
+#include <ranges>
+
+#include "serializer.h"
+
+Snapshotter::Snapshotter(Path filename, SavePolicy policy, Cut cut,
+                         Changes changes)
+    : filename_{std::move(filename)}, policy_{policy}, cut_{std::move(cut)},
+      changes_{std::move(changes)},
+      last_attempt_{std::chrono::steady_clock::now()} {
+    saver_ = std::jthread{[this](std::stop_token stoken) {
+        saver_loop(stoken);
+    }};
+}
+
+Snapshotter::~Snapshotter() {
+    saver_.request_stop();
+    saver_.join();
+}
+
+bool Snapshotter::start() {
+    std::scoped_lock lk{mtx_};
+    if (in_progress_) {
+        return false;
+    }
+    requested_ = true;
+    in_progress_ = true;
+    cv_.notify_one();
+    return true;
+}
+
+Snapshotter::Status Snapshotter::status() const {
+    auto changes = changes_();
+    std::scoped_lock lk{mtx_};
+    return Status{
+        .in_progress = in_progress_,
+        .items_written =
+            in_progress_ ? items_written_.load(std::memory_order_relaxed) : 0,
+        .items_total = in_progress_ ? items_total_ : 0,
+        .last_save = last_save_,
+        .last_duration = last_duration_,
+        .last_ok = last_ok_,
+        .changes = changes - saved_changes_,
+    };
+}
+
+void Snapshotter::saver_loop(std::stop_token stoken) {
+    std::unique_lock lk{mtx_};
+    while (true) {
+        cv_.wait_for(lk, stoken, POLICY_INTERVAL, [this, &stoken] {
+            return requested_ || stoken.stop_requested();
+        });
+        if (stoken.stop_requested()) {
+            // A requested snapshot is superseded by the one taken at shutdown
+            in_progress_ = false;
+            return;
+        }
+        if (!requested_) {
+            lk.unlock();
+            bool save_now = due();
+            lk.lock();
+            if (!save_now || in_progress_) {
+                continue;
+            }
+            in_progress_ = true;
+        }
+        requested_ = false;
+
+        lk.unlock();
+        save();
+        lk.lock();
+    }
+}
+
+bool Snapshotter::due() {
+    if (policy_.interval.count() == 0) {
+        return false;
+    }
+    std::uint64_t saved;
+    {
+        std::scoped_lock lk{mtx_};
+        if (std::chrono::steady_clock::now() - last_attempt_ <
+            policy_.interval) {
+            return false;
+        }
+        saved = saved_changes_;
+    }
+    return changes_() - saved >= policy_.changes;
+}
+
+void Snapshotter::save() {
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    Snapshot snapshot;
+    auto changes = cut_(snapshot);
+    if (!changes.has_value()) {
+        std::scoped_lock lk{mtx_};
+        in_progress_ = false;
+        return;
+    }
+    {
+        std::scoped_lock lk{mtx_};
+        items_total_ = snapshot.size();
+        items_written_.store(0, std::memory_order_relaxed);
+    }
+
+    auto counted = snapshot | std::views::transform([this](const auto &e)
+                                                        -> const auto & {
+                       items_written_.fetch_add(1, std::memory_order_relaxed);
+                       return e;
+                   });
+    Serializer ser{filename_};
+    bool ok = (ser << counted).good();
+
+    std::scoped_lock lk{mtx_};
+    in_progress_ = false;
+    last_attempt_ = steady_clock::now();
+    last_duration_ = duration_cast<milliseconds>(last_attempt_ - start);
+    last_ok_ = ok;
+    if (ok) {
+        last_save_ = std::time(nullptr);
+        saved_changes_ = *changes;
+    }
+}
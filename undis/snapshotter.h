@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "storevalue.h"
+
+// Take a snapshot once the interval has passed since the last one and at
+// least this many changes have been made, like Redis' "save" directive
+struct SavePolicy {
+    // 0 disables periodic snapshots
+    std::chrono::seconds interval{0};
+    std::uint64_t changes = 1;
+};
+
+// Writes snapshots of the store on a background thread while it keeps
+// serving requests. The store is only locked while its entries are copied,
+// one shard at a time; values are shared rather than copied, and writers
+// replace shared values instead of modifying them, so the copy stays
+// unchanged while it is serialized.
+class Snapshotter {
+    using Path = std::filesystem::path;
+
+  public:
+    using Snapshot = std::vector<std::pair<std::string, StoreValue>>;
+    // Copies every live entry into the snapshot, and returns the number of
+    // changes made to the store up to the copy, or nothing if the store
+    // cannot be copied yet
+    using Cut = std::function<std::optional<std::uint64_t>(Snapshot &)>;
+    // Returns the number of changes made to the store so far
+    using Changes = std::function<std::uint64_t()>;
+
+    struct Status {
+        bool in_progress;
+        // Progress of the running snapshot
+        std::size_t items_written;
+        std::size_t items_total;
+        // Unix time of the last successful snapshot, 0 if there is none
+        std::time_t last_save;
+        std::chrono::milliseconds last_duration;
+        bool last_ok;
+        // Changes made since the last successful snapshot
+        std::uint64_t changes;
+    };
+
+    Snapshotter(Path filename, SavePolicy policy, Cut cut, Changes changes);
+    // Waits for a running snapshot to finish
+    ~Snapshotter();
+    Snapshotter(const Snapshotter &) = delete;
+    Snapshotter &operator=(const Snapshotter &) = delete;
+
+    // Starts a snapshot. Returns false if one is already running.
+    bool start();
+
+    Status status() const;
+
+  private:
+    // How often the policy is checked
+    static constexpr std::chrono::seconds POLICY_INTERVAL{1};
+
+    void saver_loop(std::stop_token stoken);
+    bool due();
+    void save();
+
+    Path filename_;
+    SavePolicy policy_;
+    Cut cut_;
+    Changes changes_;
+
+    std::atomic<std::size_t> items_written_ = 0;
+
+    // Guards everything below
+    mutable std::mutex mtx_;
+    std::condition_variable_any cv_;
+    bool requested_ = false;
+    bool in_progress_ = false;
+    std::size_t items_total_ = 0;
+    std::chrono::steady_clock::time_point last_attempt_;
+    std::time_t last_save_ = 0;
+    std::chrono::milliseconds last_duration_{0};
+    bool last_ok_ = true;
+    std::uint64_t saved_changes_ = 0;
+
+    std::jthread saver_;
+};
@@ -0,0 +1,238 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <ctime>
+#include <memory>
+#include <mutex>
+
+#include "kvstore.h"
+#include "threadpool.h"
+
+std::size_t Histogram::bucket(std::uint64_t value) {
+    value = std::min(value, (std::uint64_t{1} << MAX_BITS) - 1);
+    if (value < SUB_BUCKETS) {
+        return static_cast<std::size_t>(value);
+    }
+    auto exponent = static_cast<unsigned>(std::bit_width(value)) - 1;
+    auto shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+std::uint64_t Histogram::highest(std::size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    auto shift = bucket / SUB_BUCKETS - 1;
+    auto lowest = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lowest + (std::uint64_t{1} << shift) - 1;
+}
+
+std::uint64_t Histogram::percentile(double q) const {
+    if (total_ == 0) {
+        return 0;
+    }
+    auto rank = std::max<std::uint64_t>(
+        static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(total_))),
+        1);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < BUCKETS; ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            return highest(i);
+        }
+    }
+    return highest(BUCKETS - 1);
+}
+
+// Owns every block, including those of exited threads. Never destroyed, as
+// threads may exit after static destruction has begun.
+class BlockRegistry {
+  public:
+    using Block = Stats::Block;
+
+    static BlockRegistry &instance() {
+        static auto *registry = new BlockRegistry;
+        return *registry;
+    }
+
+    Block &acquire() {
+        std::scoped_lock lk{mtx_};
+        if (!free_.empty()) {
+            auto *block = free_.back();
+            free_.pop_back();
+            return *block;
+        }
+        return *blocks_.emplace_back(std::make_unique<Block>());
+    }
+
+    void release(Block &block) {
+        std::scoped_lock lk{mtx_};
+        free_.push_back(&block);
+    }
+
+    template <typename F> void for_each(F f) {
+        std::scoped_lock lk{mtx_};
+        for (const auto &block : blocks_) {
+            f(*block);
+        }
+    }
+
+  private:
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Block>> blocks_;
+    std::vector<Block *> free_;
+};
+
+namespace {
+const auto start_time = std::chrono::steady_clock::now();
+} // namespace
+
+struct Stats::Attachment {
+    Block *block = nullptr;
+    ~Attachment() {
+        if (block != nullptr) {
+            local_ = nullptr;
+            detached_ = true;
+            BlockRegistry::instance().release(*block);
+        }
+    }
+};
+
+Stats::Block *Stats::attach() {
+    // The attachment is destroyed by then, and must not be used again
+    if (detached_) {
+        return nullptr;
+    }
+    thread_local Attachment attachment;
+    attachment.block = &BlockRegistry::instance().acquire();
+    local_ = attachment.block;
+    return local_;
+}
+
+std::optional<Stats::Op> Stats::op(std::string_view name) {
+    for (std::size_t i = 0; i < OPS; ++i) {
+        if (op_names[i] == name) {
+            return static_cast<Op>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+Stats::Totals Stats::collect() {
+    Totals totals;
+    BlockRegistry::instance().for_each([&totals](const Block &block) {
+        for (std::size_t i = 0; i < COUNTERS; ++i) {
+            totals.counters[i] +=
+                block.counters[i].load(std::memory_order_relaxed);
+        }
+        for (std::size_t op = 0; op < OPS; ++op) {
+            for (std::size_t i = 0; i < Histogram::BUCKETS; ++i) {
+                if (auto n = block.latencies[op][i].load(
+                        std::memory_order_relaxed);
+                    n != 0) {
+                    totals.latencies[op].add(i, n);
+                }
+            }
+        }
+    });
+    totals.current_connections =
+        current_connections_.load(std::memory_order_relaxed);
+    totals.total_connections =
+        total_connections_.load(std::memory_order_relaxed);
+    return totals;
+}
+
+std::uint64_t Stats::uptime() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::steady_clock::now() - start_time)
+        .count();
+}
+
+std::optional<Stats::Report> Stats::report(std::string_view group,
+                                           const KVStore &store) {
+    auto totals = collect();
+    Report report;
+    auto add = [&report](std::string_view name, auto value) {
+        report.emplace_back(std::string{name}, std::to_string(value));
+    };
+
+    if (group.empty()) {
+        using enum Counter;
+        add("uptime", uptime());
+        add("time", std::time(nullptr));
+        report.emplace_back("version", UNDIS_VERSION);
+        add("curr_connections", totals.current_connections);
+        add("total_connections", totals.total_connections);
+        add("cmd_get", totals[get_hits] + totals[get_misses]);
+        add("cmd_set", totals[Op::set].count() + totals[Op::add].count() +
+                           totals[Op::replace].count() +
+                           totals[Op::append].count() +
+                           totals[Op::prepend].count() +
+                           totals[Op::cas].count());
+        add("cmd_touch", totals[Op::touch].count() + totals[Op::gat].count() +
+                             totals[Op::gats].count());
+        add("get_hits", totals[get_hits]);
+        add("get_misses", totals[get_misses]);
+        add("bytes_read", totals[bytes_read]);
+        add("bytes_written", totals[bytes_written]);
+        add("curr_items", store.size());
+        add("bytes", store.memory_usage());
+        add("limit_maxbytes", store.memory_limit());
+        add("evictions", store.evictions());
+        add("reclaimed", store.reclaimed());
+    } else if (group == "latency") {
+        for (std::size_t i = 0; i < OPS; ++i) {
+            const auto &histogram = totals.latencies[i];
+            if (histogram.count() == 0) {
+                continue;
+            }
+            std::string prefix{op_names[i]};
+            add(prefix + "_count", histogram.count());
+            add(prefix + "_p50_ns", histogram.percentile(0.5));
+            add(prefix + "_p99_ns", histogram.percentile(0.99));
+            add(prefix + "_p999_ns", histogram.percentile(0.999));
+        }
+    } else if (group == "pool") {
+        if (const auto *pool = pool_.load()) {
+            auto metrics = pool->metrics();
+            add("threads", metrics.threads);
+            add("busy", metrics.busy);
+            add("queued", metrics.queued);
+            add("min_threads", metrics.min_threads);
+            add("max_threads", metrics.max_threads);
+            add("spawned", metrics.spawned);
+            add("reaped", metrics.reaped);
+            add("jobs", metrics.jobs);
+            add("wait_p50_ns", metrics.wait.percentile(0.5));
+            add("wait_p99_ns", metrics.wait.percentile(0.99));
+            add("wait_p999_ns", metrics.wait.percentile(0.999));
+        }
+    } else if (group == "slabs") {
+        // As in memcached, prefixed by the class's number, from 1
+        auto slabs = store.slab_stats();
+        std::size_t active = 0, pages = 0;
+        for (std::size_t i = 0; i < slabs.classes.size(); ++i) {
+            const auto &c = slabs.classes[i];
+            if (c.pages == 0) {
+                continue;
+            }
+            ++active;
+            pages += c.pages;
+            auto prefix = std::to_string(i + 1) + ':';
+            add(prefix + "chunk_size", c.chunk_size);
+            add(prefix + "chunks_per_page", c.chunks_per_page);
+            add(prefix + "total_pages", c.pages);
+            add(prefix + "used_chunks", c.used_chunks);
+            add(prefix + "free_chunks", c.free_chunks);
+        }
+        add("active_slabs", active);
+        add("total_malloced", pages * SlabAllocator::PAGE_SIZE);
+        add("pooled_pages", SlabAllocator::pooled_pages());
+        add("moved_items", slabs.moved);
+    } else {
+        return std::nullopt;
+    }
+    return report;
+}
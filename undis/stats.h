@@ -0,0 +1,178 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class KVStore;
+class ThreadPool;
+
+// Counts of values in nanoseconds, bucketed as in HdrHistogram: exact up to
+// 16, then 16 linear sub-buckets per power of two, so a value is reported
+// within 1/16 of itself. Values from 2^32 (about 4 s) on share the last
+// bucket.
+class Histogram {
+  public:
+    static constexpr unsigned SUB_BUCKET_BITS = 4;
+    static constexpr std::size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr unsigned MAX_BITS = 32;
+    static constexpr std::size_t BUCKETS =
+        (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static std::size_t bucket(std::uint64_t value);
+    // The largest value counted in the bucket
+    static std::uint64_t highest(std::size_t bucket);
+
+    void record(std::uint64_t value) { add(bucket(value), 1); }
+    void add(std::size_t bucket, std::uint64_t count) {
+        counts_[bucket] += count;
+        total_ += count;
+    }
+    Histogram &operator+=(const Histogram &other) {
+        for (std::size_t i = 0; i < BUCKETS; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        return *this;
+    }
+
+    std::uint64_t count() const { return total_; }
+    // The value that a fraction q of the counts are at or below, or 0 if
+    // nothing was recorded
+    std::uint64_t percentile(double q) const;
+
+  private:
+    std::array<std::uint64_t, BUCKETS> counts_{};
+    std::uint64_t total_ = 0;
+};
+
+// Process-wide server statistics. Each thread updates its own block of
+// counters with plain loads and stores, so recording never contends, and
+// readers add the blocks up. Blocks outlive their threads, and are reused
+// by new ones, so nothing is lost when the thread pool shrinks.
+class Stats {
+  public:
+    enum class Counter {
+        get_hits,
+        get_misses,
+        bytes_read,
+        bytes_written,
+        // Made by the I/O engines, for comparing them
+        syscalls,
+    };
+    static constexpr std::size_t COUNTERS = 5;
+
+    // Commands with a latency histogram
+    enum class Op {
+        get,
+        gets,
+        gat,
+        gats,
+        set,
+        add,
+        replace,
+        append,
+        prepend,
+        cas,
+        del,
+        incr,
+        decr,
+        touch,
+    };
+    static constexpr std::array<std::string_view, 14> op_names = {
+        "get",    "gets",    "gat", "gats",   "set",  "add",  "replace",
+        "append", "prepend", "cas", "delete", "incr", "decr", "touch",
+    };
+    static constexpr std::size_t OPS = op_names.size();
+    static std::optional<Op> op(std::string_view name);
+
+    static void add(Counter counter, std::uint64_t n = 1) {
+        if (auto *block = local(); block != nullptr) {
+            bump(block->counters[static_cast<std::size_t>(counter)], n);
+        }
+    }
+    static void record(Op op, std::chrono::nanoseconds latency) {
+        auto ns = latency.count() > 0
+                      ? static_cast<std::uint64_t>(latency.count())
+                      : 0;
+        if (auto *block = local(); block != nullptr) {
+            bump(block->latencies[static_cast<std::size_t>(op)]
+                                 [Histogram::bucket(ns)],
+                 1);
+        }
+    }
+
+    // Connections come and go rarely enough to share counters
+    static void connection_opened() {
+        current_connections_.fetch_add(1, std::memory_order_relaxed);
+        total_connections_.fetch_add(1, std::memory_order_relaxed);
+    }
+    static void connection_closed() {
+        current_connections_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    struct Totals {
+        std::array<std::uint64_t, COUNTERS> counters{};
+        std::array<Histogram, OPS> latencies;
+        std::uint64_t current_connections = 0;
+        std::uint64_t total_connections = 0;
+
+        std::uint64_t operator[](Counter counter) const {
+            return counters[static_cast<std::size_t>(counter)];
+        }
+        const Histogram &operator[](Op op) const {
+            return latencies[static_cast<std::size_t>(op)];
+        }
+    };
+    static Totals collect();
+
+    // The pool whose metrics the "pool" group reports, or nullptr
+    static void watch_pool(const ThreadPool *pool) { pool_ = pool; }
+
+    // Seconds since the process started
+    static std::uint64_t uptime();
+
+    // Name and value pairs, as listed by the stats command: the general
+    // statistics for an empty group, the latency percentiles of each
+    // command that was executed for "latency", the thread pool's size,
+    // activity and queue waits for "pool", or the use of each slab class
+    // for "slabs". Nothing for other groups.
+    using Report = std::vector<std::pair<std::string, std::string>>;
+    static std::optional<Report> report(std::string_view group,
+                                        const KVStore &store);
+
+  private:
+    struct alignas(64) Block {
+        std::array<std::atomic<std::uint64_t>, COUNTERS> counters{};
+        std::array<std::array<std::atomic<std::uint64_t>, Histogram::BUCKETS>,
+                   OPS>
+            latencies{};
+    };
+
+    // Only the owning thread writes to a block
+    static void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+                      std::memory_order_relaxed);
+    }
+
+    static Block *local() { return local_ != nullptr ? local_ : attach(); }
+    // Gives the thread a block, returned when the thread exits. Returns
+    // nullptr once it has, so anything recorded later in the exit is dropped.
+    static Block *attach();
+    struct Attachment;
+
+    static inline thread_local Block *local_ = nullptr;
+    static inline thread_local bool detached_ = false;
+    static inline std::atomic<std::uint64_t> current_connections_{0};
+    static inline std::atomic<std::uint64_t> total_connections_{0};
+    static inline std::atomic<const ThreadPool *> pool_{nullptr};
+
+    friend class BlockRegistry;
+};
@@ -1,36 +1,176 @@
 #pragma once
 
+#include <atomic>
+#include <compare>
 #include <concepts>
 #include <cstdint>
-#include <ctime>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+#include "coarseclock.h"
+
+// Base of the buffers that SharedString shares bytes from: a reference
+// count, and the function that frees the buffer when the count drops to
+// zero, which may happen on any thread.
+class SharedBuffer {
+  public:
+    SharedBuffer(const SharedBuffer &) = delete;
+    SharedBuffer &operator=(const SharedBuffer &) = delete;
+
+    void acquire() noexcept { refs_.fetch_add(1, std::memory_order_relaxed); }
+    void release() noexcept {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            free_(this);
+        }
+    }
+
+  protected:
+    using Free = void (*)(SharedBuffer *) noexcept;
+    // Starts with one reference, held by the creator
+    explicit SharedBuffer(Free free) noexcept : free_{free} {}
+    ~SharedBuffer() = default;
+
+  private:
+    std::atomic<std::uint32_t> refs_{1};
+    Free free_;
+};
+
+// Reference-counted, immutable string. Copies share the same buffer, so a
+// value can be handed out of the store and sent to a client without copying
+// its bytes. The buffer is either a string of its own or, for values read
+// from the store, the item holding the value.
+class SharedString {
+  public:
+    SharedString() noexcept = default;
+
+    template <typename T>
+        requires std::constructible_from<std::string, T>
+    explicit SharedString(T &&str)
+        : SharedString{StringBuffer::make(std::string(std::forward<T>(str)))} {
+    }
+
+    // Shares `bytes`, which must live as long as `owner`
+    SharedString(SharedBuffer &owner, std::string_view bytes) noexcept
+        : owner_{&owner}, data_{bytes.data()}, size_{bytes.size()} {
+        owner.acquire();
+    }
+
+    SharedString(const SharedString &other) noexcept
+        : owner_{other.owner_}, data_{other.data_}, size_{other.size_} {
+        if (owner_ != nullptr) {
+            owner_->acquire();
+        }
+    }
+    SharedString(SharedString &&other) noexcept
+        : owner_{std::exchange(other.owner_, nullptr)},
+          data_{std::exchange(other.data_, "")},
+          size_{std::exchange(other.size_, 0)} {}
+    SharedString &operator=(SharedString other) noexcept {
+        std::swap(owner_, other.owner_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    ~SharedString() {
+        if (owner_ != nullptr) {
+            owner_->release();
+        }
+    }
+
+    const char *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    std::string_view view() const noexcept { return {data_, size_}; }
+    operator std::string_view() const noexcept { return view(); }
+
+    friend bool operator==(const SharedString &lhs, const SharedString &rhs) {
+        return lhs.view() == rhs.view();
+    }
+    friend bool operator==(const SharedString &lhs, std::string_view rhs) {
+        return lhs.view() == rhs;
+    }
+    friend auto operator<=>(const SharedString &lhs, const SharedString &rhs) {
+        return lhs.view() <=> rhs.view();
+    }
+
+  private:
+    struct StringBuffer : SharedBuffer {
+        explicit StringBuffer(std::string &&str) noexcept
+            : SharedBuffer{free}, str{std::move(str)} {}
+
+        static SharedString make(std::string &&str) {
+            auto *buf = new StringBuffer{std::move(str)};
+            SharedString shared{*buf, buf->str};
+            buf->release();
+            return shared;
+        }
+        static void free(SharedBuffer *buf) noexcept {
+            delete static_cast<StringBuffer *>(buf);
+        }
+
+        std::string str;
+    };
+
+    SharedBuffer *owner_ = nullptr;
+    const char *data_ = "";
+    std::size_t size_ = 0;
+};
+
+template <typename T>
+concept StoreString =
+    std::same_as<std::remove_cvref_t<T>, SharedString> ||
+    std::convertible_to<T, std::string>;
 
 struct StoreValue {
-    std::string str_val;
+    static constexpr std::uint32_t NO_EXPIRY =
+        std::numeric_limits<std::uint32_t>::max();
+
+    SharedString str_val;
     std::uint32_t flags;
     std::uint32_t exp_time;
+    // Version for compare-and-swap, assigned by the store on every write.
+    // It is not persisted, and values compare equal regardless of it.
+    std::uint64_t cas = 0;
 
-    template <typename T>
-        requires std::convertible_to<T, std::string>
+    template <StoreString T>
     StoreValue(T &&str_val, std::uint32_t flags, int exp)
-        : str_val{str_val}, flags{flags}, exp_time{} {
+        : str_val{std::forward<T>(str_val)}, flags{flags},
+          exp_time{expiry(exp)} {}
+
+    // TODO: Fix awful overload design
+    template <StoreString T>
+    StoreValue(T &&str_val, std::uint32_t flags, std::uint32_t exp)
+        : str_val{std::forward<T>(str_val)}, flags{flags}, exp_time{exp} {}
+
+    // The expiry time for an expiration given as in memcached: 0 for none,
+    // up to 30 days relative to now, beyond that a Unix time, and already
+    // expired if negative
+    static std::uint32_t expiry(int exp) {
         if (exp < 0) {
-            return;
+            return 0;
         }
         if (exp == 0) {
-            exp_time = -1;
-        } else if (exp <= 60 * 60 * 24 * 30) {
-            exp_time = std::time(nullptr) + exp;
-        } else {
-            exp_time = exp;
+            return NO_EXPIRY;
+        }
+        if (exp <= 60 * 60 * 24 * 30) {
+            return CoarseClock::now() + exp;
         }
+        return static_cast<std::uint32_t>(exp);
     }
 
-    // TODO: Fix awful overload design
-    template <typename T>
-        requires std::convertible_to<T, std::string>
-    StoreValue(T &&str_val, std::uint32_t flags, std::uint32_t exp)
-        : str_val{str_val}, flags{flags}, exp_time{exp} {}
+    bool expired(std::uint32_t now = CoarseClock::now()) const noexcept {
+        return exp_time <= now;
+    }
 
-    friend auto operator<=>(const StoreValue &lhs,
-                            const StoreValue &rhs) = default;
+    friend bool operator==(const StoreValue &lhs, const StoreValue &rhs) {
+        return std::tie(lhs.str_val, lhs.flags, lhs.exp_time) ==
+               std::tie(rhs.str_val, rhs.flags, rhs.exp_time);
+    }
+    friend auto operator<=>(const StoreValue &lhs, const StoreValue &rhs) {
+        return std::tie(lhs.str_val, lhs.flags, lhs.exp_time) <=>
+               std::tie(rhs.str_val, rhs.flags, rhs.exp_time);
+    }
 };
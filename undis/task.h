@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// A move-only void() callable, as queued on the thread pool. Unlike
+// std::function it accepts move-only callables and never copies them.
+// Callables of up to INLINE_SIZE bytes are stored in place, so queueing a
+// small lambda does not allocate; larger ones are moved to the heap once.
+class Task {
+  public:
+    static constexpr std::size_t INLINE_SIZE = 48;
+
+    Task() = default;
+
+    template <typename F>
+        requires(!std::is_same_v<std::decay_t<F>, Task> &&
+                 std::is_invocable_r_v<void, std::decay_t<F> &>)
+    Task(F &&f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (fits_inline<Fn>) {
+            new (storage_) Fn(std::forward<F>(f));
+            vtable_ = &inline_vtable<Fn>;
+        } else {
+            new (storage_) Fn *(new Fn(std::forward<F>(f)));
+            vtable_ = &heap_vtable<Fn>;
+        }
+    }
+
+    Task(Task &&other) noexcept : vtable_{other.vtable_} {
+        if (vtable_) {
+            vtable_->move(storage_, other.storage_);
+            other.vtable_ = nullptr;
+        }
+    }
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            reset();
+            if (other.vtable_) {
+                other.vtable_->move(storage_, other.storage_);
+                vtable_ = std::exchange(other.vtable_, nullptr);
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const { return vtable_ != nullptr; }
+
+    void operator()() { vtable_->invoke(storage_); }
+
+  private:
+    struct VTable {
+        void (*invoke)(void *);
+        // Move-constructs into dst and destroys src
+        void (*move)(void *dst, void *src) noexcept;
+        void (*destroy)(void *) noexcept;
+    };
+
+    template <typename Fn>
+    static constexpr bool fits_inline =
+        sizeof(Fn) <= INLINE_SIZE &&
+        alignof(Fn) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<Fn>;
+
+    template <typename Fn>
+    static constexpr VTable inline_vtable = {
+        [](void *p) { (*static_cast<Fn *>(p))(); },
+        [](void *dst, void *src) noexcept {
+            new (dst) Fn(std::move(*static_cast<Fn *>(src)));
+            static_cast<Fn *>(src)->~Fn();
+        },
+        [](void *p) noexcept { static_cast<Fn *>(p)->~Fn(); },
+    };
+
+    template <typename Fn>
+    static constexpr VTable heap_vtable = {
+        [](void *p) { (**static_cast<Fn **>(p))(); },
+        [](void *dst, void *src) noexcept {
+            new (dst) Fn *(*static_cast<Fn **>(src));
+        },
+        [](void *p) noexcept { delete *static_cast<Fn **>(p); },
+    };
+
+    void reset() {
+        if (vtable_) {
+            vtable_->destroy(storage_);
+            vtable_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const VTable *vtable_ = nullptr;
+};
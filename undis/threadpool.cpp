@@ -1,29 +1,71 @@
 #include "threadpool.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <limits>
+#include <list>
+#include <utility>
+#include <vector>
+
+namespace {
+// The pool and slot of the calling thread, if it is a pool thread
+struct CurrentWorker {
+    const ThreadPool *pool = nullptr;
+    std::size_t slot = 0;
+};
+thread_local CurrentWorker current;
+
+// For counters only their owning thread writes
+void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+} // namespace
+
 ThreadPool::ThreadPool(unsigned min_thread_count, unsigned max_thread_count,
                        std::chrono::seconds timeout)
-    : min_thread_count_{min_thread_count}, max_thread_count_{max_thread_count},
-      timeout_{timeout}, age_{0}, active_jobs_{0} {
-    std::scoped_lock lk{threads_mtx_};
-    for (unsigned i = 0; i < min_thread_count_; ++i) {
-        create_thread();
-    }
+    : min_thread_count_{0}, max_thread_count_{0}, timeout_{timeout},
+      slot_count_{0}, injected_count_{0}, queued_{0}, active_jobs_{0},
+      thread_count_{0}, spawned_{0}, reaped_{0}, sleepers_{0}, wake_seq_{0},
+      last_tick_{Clock::now()} {
+    set_limits(min_thread_count, max_thread_count);
+    controller_ = std::jthread{
+        [this](std::stop_token stoken) { control_loop(stoken); }};
 }
 
-void ThreadPool::queue_job(const std::function<void()> &job) {
-    std::scoped_lock threads_lk{threads_mtx_};
+ThreadPool::~ThreadPool() {
+    controller_ = {};
+    // Jobs never run go with their slots' nodes. Joined outside the lock,
+    // as running jobs may still queue more, like in reap(), but no longer
+    // start threads
+    std::list<Worker> stopped;
     {
-        std::scoped_lock jobs_lk{jobs_mtx_};
-        if (active_jobs_ + jobs_.size() >= threads_.size()) {
-            create_thread();
-        }
-        jobs_.push(job);
+        std::scoped_lock lk{threads_mtx_};
+        max_thread_count_ = 0;
+        stopped.swap(threads_);
+    }
+    stopped.clear();
+}
+
+void ThreadPool::queue_job(Task job) {
+    ++queued_;
+    if (current.pool == this) {
+        auto &slot = *slots_[current.slot];
+        auto &node = acquire_node(slot);
+        node.job = {std::move(job), Clock::now()};
+        slot.deque.push(&node);
+    } else {
+        std::scoped_lock lk{injected_mtx_};
+        injected_.push_back({std::move(job), Clock::now()});
+        ++injected_count_;
     }
 
-    cv_.notify_one();
-    if (++age_ >= CLEANUP_INTERVAL) {
-        cleanup();
+    if (active_jobs_ + queued_ > thread_count_ &&
+        thread_count_ < max_thread_count_) {
+        std::scoped_lock lk{threads_mtx_};
+        create_thread();
     }
+    wake();
 }
 
 void ThreadPool::grow(unsigned new_thread_count) {
@@ -40,47 +82,290 @@ void ThreadPool::grow(unsigned new_thread_count) {
 }
 
 void ThreadPool::cleanup() {
-    age_ = 0;
-    auto now = std::chrono::steady_clock::now();
-
-    for (auto it = threads_.begin(), end = threads_.end(); it != end;) {
-        if (threads_.size() > min_thread_count_ && it->first.joinable() &&
-            it->second.load() != TimePoint{} &&
-            now - it->second.load() > timeout_) {
-            it = threads_.erase(it);
-        } else {
-            ++it;
+    reap(std::numeric_limits<std::size_t>::max(), true);
+}
+
+void ThreadPool::set_limits(unsigned min_thread_count,
+                            unsigned max_thread_count) {
+    max_thread_count = std::clamp(max_thread_count, 1u, MAX_THREADS);
+    min_thread_count_ = std::min(min_thread_count, max_thread_count);
+    max_thread_count_ = max_thread_count;
+    grow(min_thread_count_);
+    if (threads() > max_thread_count) {
+        reap(threads() - max_thread_count, false);
+    }
+}
+
+ThreadPool::Metrics ThreadPool::metrics() const {
+    Metrics m{};
+    m.threads = threads();
+    m.busy = busy();
+    m.queued = queued_.load();
+    m.min_threads = min_thread_count_.load();
+    m.max_threads = max_thread_count_.load();
+    m.spawned = spawned_.load();
+    m.reaped = reaped_.load();
+    for (std::size_t i = 0, n = slot_count_.load(); i < n; ++i) {
+        const auto &slot = *slots_[i];
+        m.jobs += slot.jobs.load(std::memory_order_relaxed);
+        for (std::size_t b = 0; b < Histogram::BUCKETS; ++b) {
+            if (auto count = slot.waits[b].load(std::memory_order_relaxed);
+                count != 0) {
+                m.wait.add(b, count);
+            }
         }
     }
+    return m;
 }
 
-void ThreadPool::create_thread() {
-    using namespace std::placeholders;
+void ThreadPool::reap(std::size_t limit, bool expired_only) {
+    auto now = Clock::now();
+    auto timeout = timeout_.load();
 
-    if (threads_.size() < max_thread_count_) {
-        auto &back = threads_.emplace_back();
-        back.first = std::jthread{std::bind(&ThreadPool::worker_loop, this, _1,
-                                            std::ref(back.second))};
+    // Joined outside the lock, as their last jobs may still queue more
+    std::list<Worker> stopped;
+    {
+        std::scoped_lock lk{threads_mtx_};
+        // Workers keep stamping last_active, so sort a snapshot of it
+        std::vector<std::pair<TimePoint, std::list<Worker>::iterator>> idle;
+        for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+            auto last_active = it->last_active.load();
+            if (last_active != TimePoint{} &&
+                (!expired_only || now - last_active > timeout)) {
+                idle.emplace_back(last_active, it);
+            }
+        }
+        std::sort(idle.begin(), idle.end(), [](auto &a, auto &b) {
+            return a.first < b.first;
+        });
+        for (const auto &entry : idle) {
+            if (stopped.size() >= limit ||
+                threads_.size() <= min_thread_count_) {
+                break;
+            }
+            stopped.splice(stopped.end(), threads_, entry.second);
+            --thread_count_;
+            ++reaped_;
+        }
+    }
+    if (stopped.empty()) {
+        return;
+    }
+
+    std::vector<std::size_t> freed;
+    for (const auto &worker : stopped) {
+        freed.push_back(worker.slot);
+    }
+    stopped.clear();
+    std::scoped_lock lk{threads_mtx_};
+    for (auto slot : freed) {
+        slots_[slot]->used = false;
     }
 }
 
-void ThreadPool::worker_loop(std::stop_token stoken,
-                             std::atomic<TimePoint> &last_active) {
-    std::function<void()> job;
-    while (true) {
-        last_active = std::chrono::steady_clock::now();
-        {
-            std::unique_lock lk{jobs_mtx_};
-            if (!cv_.wait(lk, stoken, [this]() { return !jobs_.empty(); })) {
-                return;
+void ThreadPool::create_thread() {
+    if (threads_.size() >= max_thread_count_) {
+        return;
+    }
+    // Stopped threads may not have released their slots yet
+    std::size_t slot = 0, count = slot_count_.load();
+    while (slot < count && slots_[slot]->used) {
+        ++slot;
+    }
+    if (slot == count) {
+        if (count == MAX_THREADS) {
+            return;
+        }
+        slots_[count] = std::make_unique<Slot>();
+        slot_count_.store(count + 1, std::memory_order_release);
+    }
+    slots_[slot]->used = true;
+
+    auto &back = threads_.emplace_back();
+    back.slot = slot;
+    back.thread = std::jthread{
+        [this, &back](std::stop_token stoken) { worker_loop(stoken, back); }};
+    ++thread_count_;
+    ++spawned_;
+}
+
+void ThreadPool::worker_loop(std::stop_token stoken, Worker &self) {
+    current = {this, self.slot};
+    auto wake_all = [this] {
+        ++wake_seq_;
+        wake_seq_.notify_all();
+    };
+    std::stop_callback on_stop{stoken, wake_all};
+    auto &slot = *slots_[self.slot];
+
+    self.last_active = Clock::now();
+    while (!stoken.stop_requested()) {
+        auto job = find_job(self.slot);
+        if (!job.task) {
+            // Announce the wait before looking once more, so that a job
+            // queued in between either is found or changes wake_seq_
+            ++sleepers_;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            auto seq = wake_seq_.load();
+            job = find_job(self.slot);
+            if (!job.task && !stoken.stop_requested()) {
+                wake_seq_.wait(seq);
+            }
+            --sleepers_;
+            if (!job.task) {
+                continue;
             }
+        }
+
+        self.last_active = TimePoint{};
+        run(slot, job);
+        self.last_active = Clock::now();
+    }
+
+    // Hand jobs this thread queued to the others
+    bool handed_over = false;
+    while (auto node = slot.deque.pop()) {
+        std::scoped_lock lk{injected_mtx_};
+        injected_.push_back(take(**node, true));
+        ++injected_count_;
+        handed_over = true;
+    }
+    if (handed_over) {
+        wake();
+    }
+    current = {};
+}
+
+void ThreadPool::run(Slot &slot, Job &job) {
+    auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      Clock::now() - job.queued)
+                      .count();
+    auto ns = waited > 0 ? static_cast<std::uint64_t>(waited) : 0;
+    bump(slot.jobs, 1);
+    bump(slot.wait_ns, ns);
+    bump(slot.waits[Histogram::bucket(ns)], 1);
+
+    ++active_jobs_;
+    --queued_;
+    job.task();
+    --active_jobs_;
+}
 
-            last_active = TimePoint{};
-            job = std::move(jobs_.front());
-            jobs_.pop();
+void ThreadPool::control_loop(std::stop_token stoken) {
+    std::mutex mtx;
+    std::condition_variable_any cv;
+    std::unique_lock lk{mtx};
+    while (!cv.wait_for(lk, stoken, TICK, [] { return false; }) &&
+           !stoken.stop_requested()) {
+        control();
+    }
+}
+
+void ThreadPool::control() {
+    auto now = Clock::now();
+    auto elapsed = now - last_tick_;
+    last_tick_ = now;
+
+    std::uint64_t jobs = 0, wait_ns = 0;
+    for (std::size_t i = 0, n = slot_count_.load(std::memory_order_acquire);
+         i < n; ++i) {
+        jobs += slots_[i]->jobs.load(std::memory_order_relaxed);
+        wait_ns += slots_[i]->wait_ns.load(std::memory_order_relaxed);
+    }
+    auto started = jobs - last_jobs_;
+    std::chrono::nanoseconds wait{
+        started > 0 ? (wait_ns - last_wait_ns_) / started : 0};
+    last_jobs_ = jobs;
+    last_wait_ns_ = wait_ns;
+    // Nothing started while jobs were queued: they waited the whole tick
+    if (started == 0 && queued_ > 0) {
+        wait = elapsed;
+    }
+
+    auto count = threads();
+    auto sample = count > 0 ? static_cast<double>(busy()) / count : 1.0;
+    utilization_ = 0.7 * utilization_ + 0.3 * sample;
+
+    if (count > max_thread_count_) {
+        reap(count - max_thread_count_, false);
+    } else if (count < min_thread_count_) {
+        grow(min_thread_count_);
+    } else if (wait > GROW_WAIT && utilization_ > HIGH_UTILIZATION) {
+        calm_since_ = {};
+        grow(count + std::max(1u, count / 4));
+    } else if (wait < SHRINK_WAIT && utilization_ < LOW_UTILIZATION) {
+        if (calm_since_ == TimePoint{}) {
+            calm_since_ = now;
+        } else if (now - calm_since_ >= timeout_.load()) {
+            reap(1, false);
         }
-        ++active_jobs_;
-        job();
-        --active_jobs_;
+    } else {
+        calm_since_ = {};
+    }
+}
+
+ThreadPool::Job ThreadPool::find_job(std::size_t slot) {
+    if (auto node = slots_[slot]->deque.pop()) {
+        return take(**node, true);
+    }
+
+    if (injected_count_.load(std::memory_order_relaxed) > 0) {
+        std::scoped_lock lk{injected_mtx_};
+        if (!injected_.empty()) {
+            Job taken{std::move(injected_.front())};
+            injected_.pop_front();
+            --injected_count_;
+            return taken;
+        }
+    }
+
+    // Starting after our own deque spreads stealers across victims
+    auto n = slot_count_.load(std::memory_order_acquire);
+    for (std::size_t i = 1; i < n; ++i) {
+        auto &victim = slots_[(slot + i) % n]->deque;
+        // A failed steal may have lost a race for one of several jobs
+        while (!victim.empty()) {
+            if (auto node = victim.steal()) {
+                return take(**node, false);
+            }
+        }
+    }
+    return {};
+}
+
+ThreadPool::Node &ThreadPool::acquire_node(Slot &slot) {
+    if (slot.free == nullptr) {
+        // Taking the whole list at once leaves no room for ABA problems
+        slot.free = slot.returned.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (slot.free == nullptr) {
+        auto &node = *slot.nodes.emplace_back(std::make_unique<Node>());
+        node.home = &slot;
+        return node;
+    }
+    return *std::exchange(slot.free, slot.free->next);
+}
+
+ThreadPool::Job ThreadPool::take(Node &node, bool owner) {
+    Job job{std::move(node.job)};
+    auto &slot = *node.home;
+    if (owner) {
+        node.next = slot.free;
+        slot.free = &node;
+        return job;
+    }
+    node.next = slot.returned.load(std::memory_order_relaxed);
+    while (!slot.returned.compare_exchange_weak(node.next, &node,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+    }
+    return job;
+}
+
+void ThreadPool::wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        ++wake_seq_;
+        wake_seq_.notify_one();
     }
 }
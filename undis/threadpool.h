@@ -1,66 +1,187 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <chrono>
-#include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <list>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <stop_token>
 #include <thread>
-#include <utility>
+#include <vector>
 
-class ThreadPool {
-    using TimePoint = std::chrono::time_point<std::chrono::steady_clock>;
+#include "stats.h"
+#include "task.h"
+#include "workdeque.h"
 
-    constexpr static unsigned CLEANUP_INTERVAL = 10;
+// Runs jobs on a pool of threads between a minimum and a maximum count. Each
+// thread owns a work-stealing deque: jobs queued from one of the pool's
+// threads go onto its own deque without locking, jobs from elsewhere onto a
+// shared queue, and idle threads take from that queue or steal from the
+// others.
+//
+// A thread is spawned at once when a job is queued while every thread is
+// busy. Otherwise a controller sizes the pool every TICK from how long jobs
+// waited to start and how busy the threads were: it adds threads while jobs
+// wait over GROW_WAIT and utilization is above HIGH_UTILIZATION, and once
+// waits stay under SHRINK_WAIT and utilization under LOW_UTILIZATION for the
+// idle timeout, stops one idle thread per tick. Between the two it leaves the
+// pool alone.
+class ThreadPool {
+    using Clock = std::chrono::steady_clock;
+    using TimePoint = std::chrono::time_point<Clock>;
 
   public:
+    static constexpr unsigned MAX_THREADS = 1024;
+    static constexpr auto TICK = std::chrono::milliseconds(100);
+    static constexpr auto GROW_WAIT = std::chrono::milliseconds(1);
+    static constexpr auto SHRINK_WAIT = std::chrono::microseconds(200);
+    static constexpr double HIGH_UTILIZATION = 0.75;
+    static constexpr double LOW_UTILIZATION = 0.25;
+
     explicit ThreadPool(
         unsigned min_thread_count = std::thread::hardware_concurrency(),
         unsigned max_thread_count = 100,
         std::chrono::seconds timeout = std::chrono::seconds(60));
-    ~ThreadPool() = default;
+    ~ThreadPool();
     ThreadPool(const ThreadPool &) = delete;
     ThreadPool(ThreadPool &&) = delete;
     ThreadPool &operator=(const ThreadPool &) = delete;
     ThreadPool &operator=(ThreadPool &&) = delete;
 
-    void queue_job(const std::function<void()> &job);
+    void queue_job(Task job);
     void grow(unsigned new_thread_count);
+    // Stops threads idle for longer than the timeout, down to the minimum
     void cleanup();
 
-    unsigned threads() {
-        std::scoped_lock lk{threads_mtx_};
-        return threads_.size();
-    }
+    // Take effect at once: threads are spawned up to a raised minimum, and
+    // idle threads over a lowered maximum stopped, busy ones when they idle
+    void set_limits(unsigned min_thread_count, unsigned max_thread_count);
+    void set_timeout(std::chrono::seconds timeout) { timeout_ = timeout; }
+
+    unsigned threads() const { return thread_count_.load(); }
 
-    unsigned busy() { return active_jobs_.load(); }
+    unsigned busy() const { return active_jobs_.load(); }
 
-    unsigned available() {
+    unsigned available() const {
         unsigned t = threads(), b = busy();
         return t > b ? t - b : 0;
     }
 
+    struct Metrics {
+        unsigned threads;
+        unsigned busy;
+        std::size_t queued;
+        unsigned min_threads;
+        unsigned max_threads;
+        std::uint64_t spawned;
+        std::uint64_t reaped;
+        // Jobs started, and how long each waited in a queue, in nanoseconds
+        std::uint64_t jobs;
+        Histogram wait;
+    };
+    Metrics metrics() const;
+
   private:
+    struct Job {
+        Task task;
+        TimePoint queued;
+    };
+
+    struct Slot;
+
+    // Jobs on a slot's deque live in nodes the slot recycles, so that once
+    // it has enough, queueing from a pool thread does not allocate
+    struct Node {
+        Job job;
+        Slot *home = nullptr;
+        Node *next = nullptr;
+    };
+
+    struct Worker {
+        std::jthread thread;
+        std::atomic<TimePoint> last_active;
+        // Index of the slot it owns
+        std::size_t slot;
+    };
+
+    // Slots outlive the threads owning them, as stealers scan them all
+    struct Slot {
+        WorkDeque<Node *> deque;
+        bool used = false;
+        // Owner only: nodes ready for reuse, and every node the slot has
+        std::vector<std::unique_ptr<Node>> nodes;
+        Node *free = nullptr;
+        // Nodes whose jobs other threads took, pushed from any thread
+        std::atomic<Node *> returned{nullptr};
+        // Written by the owning thread only
+        std::atomic<std::uint64_t> jobs{0};
+        std::atomic<std::uint64_t> wait_ns{0};
+        std::array<std::atomic<std::uint64_t>, Histogram::BUCKETS> waits{};
+    };
+
     void create_thread();
+    // Stops up to `limit` idle threads, longest idle first, but none below
+    // the minimum. With `expired_only`, only those idle for longer than the
+    // timeout.
+    void reap(std::size_t limit, bool expired_only);
 
-    void worker_loop(std::stop_token stoken,
-                     std::atomic<TimePoint> &last_active);
+    void worker_loop(std::stop_token stoken, Worker &self);
+    void control_loop(std::stop_token stoken);
+    // One round of sizing decisions
+    void control();
 
-    unsigned min_thread_count_;
-    unsigned max_thread_count_;
-    std::chrono::seconds timeout_;
-    int age_;
+    // Takes a job from the slot's own deque, the shared queue or another
+    // thread's deque, in that order
+    Job find_job(std::size_t slot);
+    void run(Slot &slot, Job &job);
 
-    mutable std::mutex threads_mtx_;
-    mutable std::mutex jobs_mtx_;
-    std::condition_variable_any cv_;
+    // Owner of the slot only
+    static Node &acquire_node(Slot &slot);
+    // Moves the job out and gives the node back to its slot. With `owner`,
+    // the calling thread owns that slot.
+    static Job take(Node &node, bool owner);
+
+    // Wakes a sleeping thread, if any, after a job was queued
+    void wake();
+
+    std::atomic<unsigned> min_thread_count_;
+    std::atomic<unsigned> max_thread_count_;
+    std::atomic<std::chrono::seconds> timeout_;
+
+    // Created as needed, up to MAX_THREADS; the first slot_count_ exist
+    std::array<std::unique_ptr<Slot>, MAX_THREADS> slots_;
+    std::atomic<std::size_t> slot_count_;
 
-    std::queue<std::function<void()>> jobs_;
+    // Jobs queued from outside the pool
+    std::mutex injected_mtx_;
+    std::deque<Job> injected_;
+    std::atomic<std::size_t> injected_count_;
+
+    // Jobs queued but not yet taken, wherever they are
+    std::atomic<std::size_t> queued_;
     std::atomic<unsigned> active_jobs_;
+    std::atomic<unsigned> thread_count_;
+    std::atomic<std::uint64_t> spawned_;
+    std::atomic<std::uint64_t> reaped_;
+
+    // Idle threads wait for wake_seq_ to change
+    std::atomic<unsigned> sleepers_;
+    std::atomic<std::uint32_t> wake_seq_;
 
-    // Threads must be destroyed first to prevent access violation
-    std::list<std::pair<std::jthread, std::atomic<TimePoint>>> threads_;
+    // Controller state, from the previous tick
+    std::uint64_t last_jobs_ = 0;
+    std::uint64_t last_wait_ns_ = 0;
+    TimePoint last_tick_;
+    double utilization_ = 0;
+    // When waits and utilization last dropped below the shrink thresholds
+    TimePoint calm_since_;
+
+    mutable std::mutex threads_mtx_;
+    std::list<Worker> threads_;
+    // Stopped first, then the threads, before anything they use
+    std::jthread controller_;
 };
@@ -0,0 +1,78 @@
+#include "timingwheel.h"
+
+#include <algorithm>
+
+void TimerNode::unlink() noexcept {
+    if (next_ == nullptr) {
+        return;
+    }
+    prev_->next_ = next_;
+    next_->prev_ = prev_;
+    prev_ = next_ = nullptr;
+}
+
+TimingWheel::TimingWheel(std::uint32_t now) : current_{now} {
+    for (auto &level : levels_) {
+        for (auto &head : level) {
+            head.prev_ = head.next_ = &head;
+        }
+    }
+}
+
+TimingWheel::~TimingWheel() {
+    // Detach the remaining timers so that they do not point into the wheel
+    for (auto &level : levels_) {
+        for (auto &head : level) {
+            while (head.next_ != &head) {
+                head.next_->unlink();
+            }
+        }
+    }
+}
+
+void TimingWheel::schedule(TimerNode &node, std::uint32_t expires) {
+    node.unlink();
+    node.expires_ = expires;
+    place(node);
+}
+
+void TimingWheel::place(TimerNode &node) {
+    std::uint32_t time = std::max(node.expires_, current_);
+    std::uint32_t delta = time - current_;
+
+    int level = 0;
+    while (level < LEVELS - 1 &&
+           delta >= std::uint32_t{1} << ((level + 1) * LEVEL_BITS)) {
+        ++level;
+    }
+    // Beyond the last level, park the timer in its furthest slot; it is
+    // placed again when that slot cascades
+    constexpr std::uint32_t span = std::uint32_t{1} << (LEVELS * LEVEL_BITS);
+    if (delta >= span) {
+        time = current_ + span - 1;
+    }
+
+    auto &head = slot(level, time);
+    node.prev_ = head.prev_;
+    node.next_ = &head;
+    head.prev_->next_ = &node;
+    head.prev_ = &node;
+}
+
+void TimingWheel::cascade(int level) {
+    auto &head = slot(level, current_);
+    if (head.next_ == &head) {
+        return;
+    }
+    // Detach the whole list first, since timers may land back in this slot
+    TimerNode *node = head.next_;
+    head.prev_->next_ = nullptr;
+    head.prev_ = head.next_ = &head;
+
+    while (node != nullptr) {
+        auto *next = node->next_;
+        node->prev_ = node->next_ = nullptr;
+        place(*node);
+        node = next;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Intrusive hook for timers kept in a TimingWheel. The node unlinks itself
+// when destroyed, so owners can be freed without cancelling first.
+class TimerNode {
+  public:
+    TimerNode() = default;
+    ~TimerNode() { unlink(); }
+    TimerNode(const TimerNode &) = delete;
+    TimerNode &operator=(const TimerNode &) = delete;
+
+    bool scheduled() const noexcept { return next_ != nullptr; }
+    std::uint32_t expires() const noexcept { return expires_; }
+
+  private:
+    friend class TimingWheel;
+
+    void unlink() noexcept;
+
+    TimerNode *prev_ = nullptr;
+    TimerNode *next_ = nullptr;
+    std::uint32_t expires_ = 0;
+};
+
+// Hierarchical timing wheel with one-second resolution, as in the classic
+// Linux kernel timers. Scheduling and cancelling are O(1); timers due far in
+// the future sit in coarser levels and cascade down as their time nears.
+// Not thread-safe.
+class TimingWheel {
+    static constexpr int LEVEL_BITS = 6;
+    static constexpr std::size_t SLOTS = 1 << LEVEL_BITS;
+    static constexpr int LEVELS = 4;
+
+  public:
+    explicit TimingWheel(std::uint32_t now);
+    ~TimingWheel();
+    TimingWheel(const TimingWheel &) = delete;
+    TimingWheel &operator=(const TimingWheel &) = delete;
+
+    // Reschedules the node if it was already scheduled
+    void schedule(TimerNode &node, std::uint32_t expires);
+    void cancel(TimerNode &node) { node.unlink(); }
+
+    // Unlinks the timers that are due by now and hands them to on_expired,
+    // stopping early after budget timers. Returns whether the wheel caught
+    // up, or false if there may be more due timers.
+    template <typename F>
+    bool expire(std::uint32_t now, std::size_t budget, F &&on_expired);
+
+  private:
+    void place(TimerNode &node);
+    void cascade(int level);
+
+    TimerNode &slot(int level, std::uint32_t time) {
+        return levels_[level][(time >> (level * LEVEL_BITS)) & (SLOTS - 1)];
+    }
+
+    // Sentinels of circular lists
+    std::array<std::array<TimerNode, SLOTS>, LEVELS> levels_;
+    // Every second before this one has been processed
+    std::uint32_t current_;
+};
+
+template <typename F>
+bool TimingWheel::expire(std::uint32_t now, std::size_t budget,
+                         F &&on_expired) {
+    while (current_ <= now) {
+        auto &head = slot(0, current_);
+        while (head.next_ != &head) {
+            if (budget-- == 0) {
+                return false;
+            }
+            auto &node = *head.next_;
+            node.unlink();
+            on_expired(node);
+        }
+
+        ++current_;
+        for (int level = 1; level < LEVELS; ++level) {
+            if ((current_ & ((1u << (level * LEVEL_BITS)) - 1)) != 0) {
+                break;
+            }
+            cascade(level);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,550 @@
+#include "uringloop.h"
+
+#ifdef UNDIS_HAVE_IO_URING
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <string_view>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "stats.h"
+#include "threadpool.h"
+
+namespace {
+int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+template <typename T> T *offset(void *base, std::uint32_t off) {
+    return reinterpret_cast<T *>(static_cast<char *>(base) + off);
+}
+} // namespace
+
+// The mapped submission and completion queues, and the provided buffer ring
+// that receives pick their buffers from
+struct UringLoop::Ring {
+    explicit Ring(unsigned entries);
+    ~Ring() { release(); }
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    io_uring_sqe *get_sqe();
+    // Submits queued entries and waits for at least `wait` completions
+    int submit(unsigned wait);
+
+    template <typename F> void for_each_cqe(F &&f);
+
+    char *buffer(unsigned id) { return buffers + id * BUFFER_SIZE; }
+    void recycle(unsigned id);
+
+    // Unmaps and closes whatever has been set up so far
+    void release() noexcept;
+
+    int fd = -1;
+    io_uring_params params{};
+
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    std::size_t sq_size = 0;
+    std::size_t cq_size = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail = 0;
+    unsigned sq_submitted = 0;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    io_uring_buf_ring *buf_ring = static_cast<io_uring_buf_ring *>(MAP_FAILED);
+    char *buffers = nullptr;
+    unsigned short buf_tail = 0;
+
+    __kernel_timespec timeout{0, TIMEOUT_NS};
+};
+
+UringLoop::Ring::Ring(unsigned entries) {
+    // Loops are created on one thread and run on another, which rules out
+    // IORING_SETUP_SINGLE_ISSUER
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    fd = io_uring_setup(entries, &params);
+    if (fd < 0) {
+        // Older kernels reject the optimization flag
+        params = {};
+        fd = io_uring_setup(entries, &params);
+    }
+    if (fd < 0) {
+        throw std::runtime_error{"io_uring_setup failed."};
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP)) {
+        release();
+        throw std::runtime_error{"io_uring lacks required features."};
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+             IORING_OFF_SQES));
+    if (sq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        release();
+        throw std::runtime_error{"io_uring mmap failed."};
+    }
+    cq_ptr = sq_ptr;
+
+    sq_head = offset<unsigned>(sq_ptr, params.sq_off.head);
+    sq_tail = offset<unsigned>(sq_ptr, params.sq_off.tail);
+    sq_mask = offset<unsigned>(sq_ptr, params.sq_off.ring_mask);
+    sq_array = offset<unsigned>(sq_ptr, params.sq_off.array);
+    sq_local_tail = sq_submitted = *sq_tail;
+
+    cq_head = offset<unsigned>(cq_ptr, params.cq_off.head);
+    cq_tail = offset<unsigned>(cq_ptr, params.cq_off.tail);
+    cq_mask = offset<unsigned>(cq_ptr, params.cq_off.ring_mask);
+    cqes = offset<io_uring_cqe>(cq_ptr, params.cq_off.cqes);
+
+    // Provided buffers need Linux 5.19
+    buf_ring = static_cast<io_uring_buf_ring *>(
+        mmap(nullptr, BUFFER_COUNT * sizeof(io_uring_buf),
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buf_ring == MAP_FAILED) {
+        release();
+        throw std::runtime_error{"buffer ring allocation failed."};
+    }
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+    reg.ring_entries = BUFFER_COUNT;
+    reg.bgid = 0;
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        release();
+        throw std::runtime_error{"provided buffer rings are not supported."};
+    }
+
+    try {
+        buffers = new char[BUFFER_COUNT * BUFFER_SIZE];
+    } catch (const std::bad_alloc &) {
+        release();
+        throw;
+    }
+    for (unsigned i = 0; i < BUFFER_COUNT; ++i) {
+        recycle(i);
+    }
+}
+
+void UringLoop::Ring::release() noexcept {
+    delete[] buffers;
+    buffers = nullptr;
+    if (buf_ring != MAP_FAILED) {
+        munmap(buf_ring, BUFFER_COUNT * sizeof(io_uring_buf));
+        buf_ring = static_cast<io_uring_buf_ring *>(MAP_FAILED);
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    }
+    if (sq_ptr != MAP_FAILED) {
+        munmap(sq_ptr, sq_size);
+        sq_ptr = MAP_FAILED;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+io_uring_sqe *UringLoop::Ring::get_sqe() {
+    unsigned head = std::atomic_ref{*sq_head}.load(std::memory_order_acquire);
+    if (sq_local_tail - head >= params.sq_entries) {
+        submit(0);
+        head = std::atomic_ref{*sq_head}.load(std::memory_order_acquire);
+        if (sq_local_tail - head >= params.sq_entries) {
+            return nullptr;
+        }
+    }
+
+    unsigned index = sq_local_tail & *sq_mask;
+    auto *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof *sqe);
+    sq_array[index] = index;
+    ++sq_local_tail;
+    return sqe;
+}
+
+int UringLoop::Ring::submit(unsigned wait) {
+    std::atomic_ref{*sq_tail}.store(sq_local_tail, std::memory_order_release);
+    unsigned to_submit = sq_local_tail - sq_submitted;
+    sq_submitted = sq_local_tail;
+
+    Stats::add(Stats::Counter::syscalls);
+    int res = io_uring_enter(fd, to_submit, wait,
+                             wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    return res < 0 ? -errno : res;
+}
+
+template <typename F> void UringLoop::Ring::for_each_cqe(F &&f) {
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref{*cq_tail}.load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+        const auto &cqe = cqes[head & *cq_mask];
+        f(cqe.user_data, cqe.res, cqe.flags);
+    }
+    std::atomic_ref{*cq_head}.store(head, std::memory_order_release);
+}
+
+void UringLoop::Ring::recycle(unsigned id) {
+    constexpr unsigned short mask = BUFFER_COUNT - 1;
+    // The header's flexible array member is misplaced when compiled as C++,
+    // so index the entries directly; the tail overlays the first entry
+    auto &buf = reinterpret_cast<io_uring_buf *>(buf_ring)[buf_tail & mask];
+    buf.addr = reinterpret_cast<std::uint64_t>(buffer(id));
+    buf.len = BUFFER_SIZE;
+    buf.bid = static_cast<unsigned short>(id);
+    ++buf_tail;
+    std::atomic_ref{buf_ring->tail}.store(buf_tail, std::memory_order_release);
+}
+
+UringLoop::UringLoop(SOCKET listen_fd, KVStore &store, ThreadPool &pool,
+                     const ServerOptions &options)
+    : listen_fd_{listen_fd}, store_{store}, pool_{pool}, options_{options},
+      ring_{std::make_unique<Ring>(RING_ENTRIES)},
+      wakefd_{eventfd(0, EFD_CLOEXEC)} {
+    if (wakefd_ == -1) {
+        throw std::runtime_error{"eventfd failed."};
+    }
+    arm_accept();
+    arm_wake();
+    arm_timeout();
+}
+
+UringLoop::~UringLoop() {
+    // Tear the ring down before the memory its requests refer to
+    ring_.reset();
+    for (auto &[ptr, conn] : conns_) {
+        Server::close_socket(conn->fd);
+    }
+    ::close(wakefd_);
+}
+
+void UringLoop::run(const volatile std::sig_atomic_t &stop) {
+    while (true) {
+        if (!stopping_ && stop) {
+            stopping_ = true;
+            std::vector<Connection *> open;
+            for (auto &[ptr, conn] : conns_) {
+                close(*conn);
+                open.push_back(ptr);
+            }
+            for (auto *conn : open) {
+                release(*conn);
+            }
+        }
+        // Workers and in-flight requests still reference connections, so
+        // wait for them on the way out
+        if (stopping_ && busy_count_ == 0 && conns_.empty()) {
+            break;
+        }
+
+        int res = ring_->submit(1);
+        if (res < 0 && res != -EINTR && res != -EBUSY) {
+            throw std::runtime_error{"io_uring_enter failed."};
+        }
+
+        ring_->for_each_cqe([this](std::uint64_t user_data, int res,
+                                   std::uint32_t flags) {
+            on_completion(user_data, res, flags);
+        });
+    }
+}
+
+void UringLoop::arm_accept() {
+    if (auto *sqe = ring_->get_sqe()) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd_;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = accept_op;
+    }
+}
+
+void UringLoop::arm_wake() {
+    if (auto *sqe = ring_->get_sqe()) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakefd_;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&wake_buf_);
+        sqe->len = sizeof wake_buf_;
+        sqe->user_data = wake_op;
+    }
+}
+
+void UringLoop::arm_timeout() {
+    // Bounds how long a stop request goes unnoticed
+    if (auto *sqe = ring_->get_sqe()) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&ring_->timeout);
+        sqe->len = 1;
+        sqe->user_data = timeout_op;
+    }
+}
+
+void UringLoop::arm_recv(Connection &conn) {
+    auto *sqe = ring_->get_sqe();
+    if (!sqe) {
+        close(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = multishot_recv_ ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = reinterpret_cast<std::uint64_t>(&conn) | recv_op;
+    conn.receiving = true;
+    ++conn.ops;
+}
+
+void UringLoop::send(Connection &conn) {
+    if (conn.sending || conn.out.empty()) {
+        return;
+    }
+    auto *sqe = ring_->get_sqe();
+    if (!sqe) {
+        close(conn);
+        return;
+    }
+
+    conn.bufs.clear();
+    conn.out.buffers(conn.bufs, IOV_MAX);
+    conn.iov.clear();
+    std::size_t gathered = 0;
+    for (auto buf : conn.bufs) {
+        conn.iov.push_back({const_cast<char *>(buf.data()), buf.size()});
+        gathered += buf.size();
+    }
+    conn.msg = {};
+    conn.msg.msg_iov = conn.iov.data();
+    conn.msg.msg_iovlen = conn.iov.size();
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&conn.msg);
+    sqe->msg_flags = static_cast<std::uint32_t>(
+        Server::send_flags(options_, gathered < conn.out.size()));
+    sqe->user_data = reinterpret_cast<std::uint64_t>(&conn) | send_op;
+    conn.sending = true;
+    ++conn.ops;
+}
+
+void UringLoop::on_completion(std::uint64_t user_data, int res,
+                              std::uint32_t flags) {
+    auto *conn = reinterpret_cast<Connection *>(user_data & ~std::uint64_t{7});
+    if (conn == nullptr) {
+        switch (user_data) {
+        case accept_op:
+            on_accept(res, flags);
+            break;
+        case wake_op:
+            on_completions();
+            arm_wake();
+            break;
+        case timeout_op:
+            arm_timeout();
+            break;
+        }
+        return;
+    }
+
+    // Multishot receives keep going until a completion without F_MORE
+    if (!(flags & IORING_CQE_F_MORE)) {
+        --conn->ops;
+    }
+    if ((user_data & 7) == recv_op) {
+        on_recv(*conn, res, flags);
+    } else {
+        on_send(*conn, res);
+    }
+    release(*conn);
+}
+
+void UringLoop::on_accept(int res, std::uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE) && !stopping_) {
+        arm_accept();
+    }
+    if (res < 0) {
+        return;
+    }
+    if (stopping_) {
+        Server::close_socket(res);
+        return;
+    }
+    Stats::connection_opened();
+    Server::configure_socket(res, options_);
+
+    auto owned = std::make_unique<Connection>(res, store_, options_.prompt);
+    auto &conn = *owned;
+    conns_.emplace(&conn, std::move(owned));
+
+    arm_recv(conn);
+    release(conn);
+}
+
+void UringLoop::on_recv(Connection &conn, int res, std::uint32_t flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn.receiving = false;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0) {
+            Stats::add(Stats::Counter::bytes_read, res);
+            std::string_view data{ring_->buffer(id),
+                                  static_cast<std::size_t>(res)};
+            (conn.busy ? conn.incoming : conn.in).append(data);
+            conn.unprocessed = true;
+        }
+        ring_->recycle(id);
+    }
+
+    if (res == -EINVAL && multishot_recv_) {
+        // Multishot receives need Linux 6.0; fall back to one per request
+        multishot_recv_ = false;
+    } else if (res == 0) {
+        // A worker may still be answering what came before
+        conn.eof = true;
+    } else if (res < 0 && res != -ENOBUFS) {
+        close(conn);
+        return;
+    }
+
+    if (!conn.receiving && !conn.closing && !conn.eof) {
+        arm_recv(conn);
+    }
+    if (!conn.busy) {
+        resume(conn);
+    }
+}
+
+void UringLoop::on_send(Connection &conn, int res) {
+    conn.sending = false;
+    if (res < 0) {
+        close(conn);
+        return;
+    }
+    Stats::add(Stats::Counter::bytes_written, res);
+    conn.out.consume(res);
+    if (!conn.busy) {
+        resume(conn);
+    }
+}
+
+void UringLoop::dispatch(Connection &conn) {
+    conn.busy = true;
+    conn.unprocessed = false;
+    ++busy_count_;
+    pool_.queue_job([this, c = &conn]() {
+        c->in.erase(0, c->session.process(c->in, c->out));
+        complete(c);
+    });
+}
+
+void UringLoop::complete(Connection *conn) {
+    bool was_empty;
+    {
+        std::scoped_lock lk{completed_mtx_};
+        was_empty = completed_.empty();
+        completed_.push_back(conn);
+    }
+    if (was_empty) {
+        eventfd_write(wakefd_, 1);
+    }
+}
+
+void UringLoop::on_completions() {
+    std::vector<Connection *> completed;
+    {
+        std::scoped_lock lk{completed_mtx_};
+        completed.swap(completed_);
+    }
+
+    for (auto *conn : completed) {
+        conn->busy = false;
+        --busy_count_;
+        if (!conn->incoming.empty()) {
+            conn->in.append(conn->incoming);
+            conn->incoming.clear();
+        }
+        resume(*conn);
+        release(*conn);
+    }
+}
+
+void UringLoop::resume(Connection &conn) {
+    if (conn.closing) {
+        return;
+    }
+    send(conn);
+
+    // After quit, close once the replies before it are sent
+    if (conn.session.closed()) {
+        if (!conn.sending && conn.out.empty()) {
+            close(conn);
+        }
+        return;
+    }
+
+    if (conn.unprocessed && !stopping_ &&
+        conn.out.size() < MAX_PENDING_OUTPUT) {
+        dispatch(conn);
+        return;
+    }
+
+    if (conn.eof && !conn.sending && conn.out.empty()) {
+        close(conn);
+    }
+}
+
+void UringLoop::close(Connection &conn) {
+    if (!conn.closing) {
+        conn.closing = true;
+        // Completes the outstanding receive and send
+        shutdown(conn.fd, SHUT_RDWR);
+    }
+}
+
+void UringLoop::release(Connection &conn) {
+    if (conn.closing && conn.ops == 0 && !conn.busy) {
+        Server::close_socket(conn.fd);
+        Stats::connection_closed();
+        conns_.erase(&conn);
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+
+#ifdef UNDIS_HAVE_IO_URING
+
+#include <csignal>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "reply.h"
+#include "server.h"
+#include "session.h"
+
+class KVStore;
+
+// io_uring counterpart of EventLoop. Connections are accepted with a
+// multishot accept and read with multishot receives into a ring of provided
+// buffers; everything queued while handling completions, sends included, is
+// submitted with a single io_uring_enter call. Requests run on the thread
+// pool exactly as with EventLoop.
+class UringLoop {
+  public:
+    // Throws std::runtime_error if the kernel lacks the required features
+    UringLoop(SOCKET listen_fd, KVStore &store, ThreadPool &pool,
+              const ServerOptions &options);
+    ~UringLoop();
+    UringLoop(const UringLoop &) = delete;
+    UringLoop(UringLoop &&) = delete;
+    UringLoop &operator=(const UringLoop &) = delete;
+    UringLoop &operator=(UringLoop &&) = delete;
+
+    // Serves clients until `stop` is set
+    void run(const volatile std::sig_atomic_t &stop);
+
+  private:
+    struct Ring;
+
+    struct alignas(8) Connection {
+        Connection(SOCKET fd, KVStore &store, bool prompt)
+            : fd{fd}, session{store, prompt} {}
+
+        SOCKET fd;
+        Session session;
+        std::string in;
+        // Received while a worker owns `in`
+        std::string incoming;
+        ReplyQueue out;
+        bool busy = false;
+        bool unprocessed = false;
+        bool receiving = false;
+        bool sending = false;
+        // The client sent everything it will send; close once the requests
+        // already received are answered
+        bool eof = false;
+        bool closing = false;
+        // Ring operations that will still complete for this connection
+        unsigned ops = 0;
+
+        // Must stay valid while a send is in flight
+        std::vector<std::string_view> bufs;
+        std::vector<iovec> iov;
+        msghdr msg{};
+    };
+
+    enum Op : std::uint64_t { accept_op = 1, wake_op, timeout_op };
+    enum ConnOp : std::uint64_t { recv_op = 0, send_op };
+
+    static constexpr std::size_t MAX_PENDING_OUTPUT = 1 << 20;
+    static constexpr unsigned RING_ENTRIES = 1024;
+    static constexpr unsigned BUFFER_COUNT = 512;
+    static constexpr std::size_t BUFFER_SIZE = 16 * 1024;
+    static constexpr long TIMEOUT_NS = 200'000'000;
+
+    void arm_accept();
+    void arm_wake();
+    void arm_timeout();
+    void arm_recv(Connection &conn);
+    void send(Connection &conn);
+
+    void on_completion(std::uint64_t user_data, int res, std::uint32_t flags);
+    void on_accept(int res, std::uint32_t flags);
+    void on_recv(Connection &conn, int res, std::uint32_t flags);
+    void on_send(Connection &conn, int res);
+    void on_completions();
+
+    void dispatch(Connection &conn);
+    void complete(Connection *conn);
+    void resume(Connection &conn);
+    void close(Connection &conn);
+    // Frees the connection once nothing refers to it any more
+    void release(Connection &conn);
+
+    SOCKET listen_fd_;
+    KVStore &store_;
+    ThreadPool &pool_;
+    ServerOptions options_;
+    std::unique_ptr<Ring> ring_;
+
+    std::unordered_map<Connection *, std::unique_ptr<Connection>> conns_;
+    unsigned busy_count_ = 0;
+    bool stopping_ = false;
+    bool multishot_recv_ = true;
+
+    int wakefd_;
+    std::uint64_t wake_buf_ = 0;
+
+    std::mutex completed_mtx_;
+    std::vector<Connection *> completed_;
+};
+
+#endif
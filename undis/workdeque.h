@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// A Chase-Lev work-stealing deque, following the C11 formulation of Lê et
+// al., "Correct and Efficient Work-Stealing for Weak Memory Models". Its
+// owner pushes and pops at the bottom without locking or, on the fast path,
+// any read-modify-write; any other thread may steal from the top. The buffer
+// doubles as needed. Replaced buffers are kept until the deque is destroyed,
+// as a stealer may still be reading one.
+template <typename T>
+    requires std::is_trivially_copyable_v<T>
+class WorkDeque {
+  public:
+    explicit WorkDeque(std::size_t capacity = 256) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        buffers_.push_back(std::make_unique<Buffer>(size));
+        buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkDeque(const WorkDeque &) = delete;
+    WorkDeque &operator=(const WorkDeque &) = delete;
+
+    // Owner only
+    void push(T value) {
+        auto b = bottom_.load(std::memory_order_relaxed);
+        auto t = top_.load(std::memory_order_acquire);
+        auto *buf = buffer_.load(std::memory_order_relaxed);
+        if (b - t > static_cast<std::int64_t>(buf->mask)) {
+            buf = grow(buf, t, b);
+        }
+        buf->put(b, value);
+        // A release store in place of the paper's release fence and relaxed
+        // store, which thread sanitizers cannot follow
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only. Takes the most recently pushed value.
+    std::optional<T> pop() {
+        auto b = bottom_.load(std::memory_order_relaxed) - 1;
+        auto *buf = buffer_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        std::optional<T> value = buf->get(b);
+        if (t == b) {
+            // The last value, which a stealer may be taking too
+            if (!top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                value.reset();
+            }
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return value;
+    }
+
+    // Any thread. Takes the least recently pushed value, or nothing when the
+    // deque is empty or another thread won the race for it.
+    std::optional<T> steal() {
+        auto t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return std::nullopt;
+        }
+        auto *buf = buffer_.load(std::memory_order_acquire);
+        T value = buf->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    // A hint for stealers, which may be stale by the time it returns
+    bool empty() const {
+        return bottom_.load(std::memory_order_relaxed) <=
+               top_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct Buffer {
+        explicit Buffer(std::size_t size)
+            : mask{size - 1}, slots{std::make_unique<std::atomic<T>[]>(size)} {
+        }
+
+        T get(std::int64_t i) const {
+            return slots[static_cast<std::size_t>(i) & mask].load(
+                std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, T value) {
+            slots[static_cast<std::size_t>(i) & mask].store(
+                value, std::memory_order_relaxed);
+        }
+
+        std::size_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+
+    Buffer *grow(Buffer *old, std::int64_t t, std::int64_t b) {
+        buffers_.push_back(std::make_unique<Buffer>(2 * (old->mask + 1)));
+        auto *buf = buffers_.back().get();
+        for (auto i = t; i < b; ++i) {
+            buf->put(i, old->get(i));
+        }
+        buffer_.store(buf, std::memory_order_release);
+        return buf;
+    }
+
+    // Apart, so that stealers bumping top do not contend with the owner
+    alignas(64) std::atomic<std::int64_t> top_{0};
+    alignas(64) std::atomic<std::int64_t> bottom_{0};
+    std::atomic<Buffer *> buffer_;
+    // Owner only
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+};
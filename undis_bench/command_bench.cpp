@@ -0,0 +1,104 @@
+// Text protocol throughput: tokenizing request lines into commands,
+// executing them against a store, and whole pipelined buffers through a
+// session.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "../undis/command.h"
+#include "../undis/kvstore.h"
+#include "../undis/reply.h"
+#include "../undis/session.h"
+#include "workload.h"
+
+using namespace std::literals;
+
+namespace {
+constexpr auto multi_get =
+    "get user:1 user:2 user:3 user:4 user:5 user:6 user:7 user:8 user:9 "
+    "user:10"sv;
+
+void BM_CommandParse(benchmark::State &state, std::string_view line) {
+    for (auto _ : state) {
+        Command c{line};
+        benchmark::DoNotOptimize(c.status());
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() *
+                            static_cast<std::int64_t>(line.size()));
+}
+BENCHMARK_CAPTURE(BM_CommandParse, get, "get user:session:42"sv);
+BENCHMARK_CAPTURE(BM_CommandParse, set, "set user:session:42 0 3600 128"sv);
+BENCHMARK_CAPTURE(BM_CommandParse, multi_get, multi_get);
+BENCHMARK_CAPTURE(BM_CommandParse, incr, "incr counter 1"sv);
+BENCHMARK_CAPTURE(BM_CommandParse, invalid, "bogus command"sv);
+
+// Every key the commands refer to holds a value of the given size
+void fill(KVStore &store, std::size_t value_size) {
+    std::string value(value_size, 'x');
+    for (int i = 1; i <= 10; ++i) {
+        store.set("user:" + std::to_string(i), value, 0u, 0);
+    }
+    store.set("counter", "0"s, 0u, 0);
+}
+
+void BM_CommandExecute(benchmark::State &state, std::string_view line) {
+    KVStore store;
+    auto value_size = static_cast<std::size_t>(state.range(0));
+    fill(store, value_size);
+    std::string data(value_size, 'y');
+    for (auto _ : state) {
+        Command c{line};
+        auto reply = c.status() == Command::data_required
+                         ? c.execute(store, std::string{data})
+                         : c.execute(store);
+        benchmark::DoNotOptimize(reply);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_CAPTURE(BM_CommandExecute, get, "get user:1"sv)
+    ->ArgName("value")
+    ->Arg(16)
+    ->Arg(1024);
+BENCHMARK_CAPTURE(BM_CommandExecute, multi_get, multi_get)
+    ->ArgName("value")
+    ->Arg(16)
+    ->Arg(1024);
+BENCHMARK_CAPTURE(BM_CommandExecute, set, "set user:1 0 0 16"sv)
+    ->ArgName("value")
+    ->Arg(16);
+BENCHMARK_CAPTURE(BM_CommandExecute, incr, "incr counter 1"sv)
+    ->ArgName("value")
+    ->Arg(16);
+
+// A buffer of pipelined gets and sets, half each, fed to a session at once
+// Args: requests in the buffer
+void BM_SessionPipeline(benchmark::State &state) {
+    KVStore store;
+    auto requests = static_cast<std::size_t>(state.range(0));
+    auto keys = workload::make_keys(requests);
+    std::string input;
+    for (std::size_t i = 0; i < requests; ++i) {
+        if (i % 2 == 0) {
+            input.append("set " + keys[i] + " 0 0 8\r\nvalue:42\r\n");
+        } else {
+            input.append("get " + keys[i - 1] + "\r\n");
+        }
+    }
+
+    for (auto _ : state) {
+        Session session{store, false};
+        ReplyQueue out;
+        benchmark::DoNotOptimize(session.process(input, out));
+        benchmark::DoNotOptimize(out.size());
+    }
+    state.SetItemsProcessed(state.iterations() *
+                            static_cast<std::int64_t>(requests));
+    state.SetBytesProcessed(state.iterations() *
+                            static_cast<std::int64_t>(input.size()));
+}
+BENCHMARK(BM_SessionPipeline)->ArgName("requests")->Arg(16)->Arg(256);
+} // namespace
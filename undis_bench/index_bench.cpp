@@ -0,0 +1,126 @@
+// Lookup latency of the store's flat index against the std::unordered_set it
+// replaced, for keys that are present and keys that are not. Both index
+// pointers to the keys, as the store's index points to items, and are large
+// enough that most lookups miss the cache, as in a full store.
+
+#include <benchmark/benchmark.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "../undis/flatindex.h"
+#include "workload.h"
+
+namespace {
+constexpr std::size_t MAX_KEYS = 10'000'000;
+constexpr std::size_t MISSES = 1'000'000;
+
+struct Hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view txt) const {
+        return std::hash<std::string_view>{}(txt);
+    }
+    std::size_t operator()(const std::string *s) const { return (*this)(*s); }
+};
+
+struct Equal {
+    using is_transparent = void;
+    static std::string_view key(std::string_view s) { return s; }
+    static std::string_view key(const std::string *s) { return *s; }
+    bool operator()(const auto &lhs, const auto &rhs) const {
+        return key(lhs) == key(rhs);
+    }
+};
+
+struct Identity {
+    std::string_view operator()(const std::string &s) const { return s; }
+};
+
+using Flat = FlatIndex<const std::string, Identity, Hash>;
+using Node = std::unordered_set<const std::string *, Hash, Equal>;
+
+bool contains(const Flat &index, std::string_view key) {
+    return index.find(key) != nullptr;
+}
+bool contains(const Node &index, std::string_view key) {
+    return index.find(key) != index.end();
+}
+
+void insert(Flat &index, const std::string &key) { index.insert(key); }
+void insert(Node &index, const std::string &key) { index.insert(&key); }
+
+const std::vector<std::string> &keys() {
+    static const auto keys = workload::make_keys(MAX_KEYS);
+    return keys;
+}
+
+const std::vector<std::string> &misses() {
+    static const auto misses = [] {
+        std::vector<std::string> misses;
+        misses.reserve(MISSES);
+        for (std::size_t i = 0; i < MISSES; ++i) {
+            misses.push_back("miss:" + std::to_string(i));
+        }
+        return misses;
+    }();
+    return misses;
+}
+
+// Building an index of millions of keys takes seconds, so it is kept across
+// the runs of a benchmark and only rebuilt when the size or the kind of
+// index changes. Only one is alive at a time, to bound memory.
+void (*release)() = nullptr;
+
+template <typename Index> const Index &build(std::size_t n) {
+    static std::unique_ptr<Index> index;
+    static std::size_t size = 0;
+    if (index == nullptr || size != n) {
+        if (release != nullptr) {
+            release();
+        }
+        index = std::make_unique<Index>();
+        index->reserve(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            insert(*index, keys()[i]);
+        }
+        size = n;
+        release = [] { index.reset(); };
+    }
+    return *index;
+}
+
+// Args: whether the looked-up keys are present, keys in the index
+template <typename Index> void BM_Find(benchmark::State &state) {
+    bool hit = state.range(0) != 0;
+    auto n = static_cast<std::size_t>(state.range(1));
+    const auto &index = build<Index>(n);
+    const auto &probes = hit ? keys() : misses();
+    auto range = hit ? n : MISSES;
+
+    std::minstd_rand rng;
+    std::int64_t found = 0;
+    for (auto _ : state) {
+        bool present = contains(index, probes[rng() % range]);
+        benchmark::DoNotOptimize(present);
+        found += present;
+    }
+
+    if (found != (hit ? state.iterations() : 0)) {
+        state.SkipWithError("wrong lookup result");
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_Find, Flat)
+    ->ArgNames({"hit", "keys"})
+    ->ArgsProduct({{1, 0}, {100'000, 1'000'000, 10'000'000}});
+BENCHMARK_TEMPLATE(BM_Find, Node)
+    ->ArgNames({"hit", "keys"})
+    ->ArgsProduct({{1, 0}, {100'000, 1'000'000, 10'000'000}});
+} // namespace
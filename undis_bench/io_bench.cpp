@@ -0,0 +1,182 @@
+// Compares the I/O engines end to end: each engine serves the same
+// request/response workload over loopback, and the server-side system calls
+// per request and client-observed latencies are reported. With a pipeline
+// depth above 1, each client sends that many requests at once and waits for
+// all of their replies, and latencies are those of the whole batch.
+//
+// Usage: undis_io_bench [clients (8)] [requests per client (1000)]
+//                       [pipeline depth (1)]
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../undis/kvstore.h"
+#include "../undis/server.h"
+
+using namespace std::literals;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+struct Result {
+    double syscalls_per_request;
+    double throughput;
+    std::chrono::nanoseconds p50, p99, p999;
+};
+
+SOCKET connect_to(unsigned port) {
+    SOCKET fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0) {
+        throw std::runtime_error{"connect failed."};
+    }
+    return fd;
+}
+
+// Reads until `count` replies have arrived
+void read_replies(SOCKET fd, std::string &buf, unsigned count) {
+    constexpr auto terminator = "END\r\n"sv;
+    buf.clear();
+    char chunk[4096];
+    std::size_t scanned = 0;
+    while (count > 0) {
+        auto n = recv(fd, chunk, sizeof chunk, 0);
+        if (n <= 0) {
+            throw std::runtime_error{"connection closed."};
+        }
+        buf.append(chunk, n);
+        // A terminator may straddle two chunks
+        for (auto pos = buf.find(terminator, scanned);
+             pos != std::string::npos && count > 0;
+             pos = buf.find(terminator, scanned)) {
+            scanned = pos + terminator.size();
+            --count;
+        }
+    }
+}
+
+Result run(IoEngine engine, unsigned clients, unsigned requests,
+           unsigned depth) {
+    KVStore store;
+    store.set("key"s, std::string(100, 'v'), 0u, 0);
+
+    ServerOptions options{engine, 1};
+    options.prompt = false;
+    Server server{0, store, options};
+    std::jthread server_thread{[&server]() { server.start(); }};
+
+    // Warm up each connection so that accepting it is not measured
+    std::string request;
+    for (unsigned i = 0; i < depth; ++i) {
+        request.append("get key\r\n"sv);
+    }
+    std::vector<SOCKET> fds;
+    std::string buf;
+    for (unsigned i = 0; i < clients; ++i) {
+        fds.push_back(connect_to(server.port()));
+        send(fds.back(), request.data(), request.size(), 0);
+        read_replies(fds.back(), buf, depth);
+    }
+
+    std::vector<std::vector<Clock::duration>> latencies(clients);
+    auto syscalls_before = Server::syscall_count();
+    auto start = Clock::now();
+    {
+        std::vector<std::jthread> threads;
+        for (unsigned i = 0; i < clients; ++i) {
+            threads.emplace_back([fd = fds[i], &lat = latencies[i],
+                                  requests, depth, &request]() {
+                std::string reply;
+                lat.reserve(requests / depth);
+                for (unsigned r = 0; r < requests; r += depth) {
+                    auto t0 = Clock::now();
+                    send(fd, request.data(), request.size(), 0);
+                    read_replies(fd, reply, depth);
+                    lat.push_back(Clock::now() - t0);
+                }
+            });
+        }
+    }
+    auto elapsed = Clock::now() - start;
+    auto syscalls = Server::syscall_count() - syscalls_before;
+
+    for (auto fd : fds) {
+#ifdef _WIN32
+        closesocket(fd);
+#else
+        close(fd);
+#endif
+    }
+    server.stop();
+    server_thread.join();
+
+    std::vector<Clock::duration> all;
+    for (const auto &lat : latencies) {
+        all.insert(all.end(), lat.begin(), lat.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            all[static_cast<std::size_t>(p * (all.size() - 1))]);
+    };
+
+    double total = static_cast<double>(all.size()) * depth;
+    return {static_cast<double>(syscalls) / total,
+            total / std::chrono::duration<double>(elapsed).count(),
+            percentile(0.5), percentile(0.99), percentile(0.999)};
+}
+
+unsigned parse_arg(int argc, char **argv, int i, unsigned fallback) {
+    if (i >= argc) {
+        return fallback;
+    }
+    std::string_view arg{argv[i]};
+    unsigned value = fallback;
+    std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    return value;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+    // The blocking engine needs a pool thread per client
+    unsigned clients = std::min(parse_arg(argc, argv, 1, 8), 10u);
+    unsigned requests = parse_arg(argc, argv, 2, 1000);
+    unsigned depth = std::max(parse_arg(argc, argv, 3, 1), 1u);
+
+    std::vector<std::pair<std::string_view, IoEngine>> engines{
+        {"blocking"sv, IoEngine::blocking},
+        {"epoll"sv, IoEngine::epoll},
+        {"io_uring"sv, IoEngine::io_uring}};
+
+    std::vector<std::pair<std::string_view, Result>> results;
+    for (auto [name, engine] : engines) {
+        results.emplace_back(name, run(engine, clients, requests, depth));
+    }
+
+    std::cout << '\n'
+              << clients << " clients x " << requests << " requests, "
+              << depth << " per round trip\n"
+              << std::left << std::setw(10) << "engine" << std::right
+              << std::setw(14) << "syscalls/req" << std::setw(12) << "req/s"
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << '\n';
+    for (const auto &[name, r] : results) {
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(14)
+                  << r.syscalls_per_request << std::setprecision(0)
+                  << std::setw(12) << r.throughput << std::setprecision(1)
+                  << std::setw(10) << r.p50.count() / 1e3 << std::setw(10)
+                  << r.p99.count() / 1e3 << std::setw(10)
+                  << r.p999.count() / 1e3 << '\n';
+    }
+}
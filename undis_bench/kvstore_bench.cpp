@@ -0,0 +1,144 @@
+// KVStore operations under mixed workloads. Each run preloads KEYS keys and
+// then issues gets and sets from every benchmark thread, picking keys
+// uniformly or with a Zipfian skew.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../undis/kvstore.h"
+#include "workload.h"
+
+namespace {
+constexpr std::size_t KEYS = 100'000;
+
+const std::vector<std::string> &keys() {
+    static const auto keys = workload::make_keys(KEYS);
+    return keys;
+}
+
+// Shared by the threads of a run; set up and torn down by thread 0, while
+// the others wait at the start and end of the timing loop
+std::unique_ptr<KVStore> store;
+std::optional<workload::KeyChooser> chooser;
+
+void set_up(const benchmark::State &state, workload::Distribution dist,
+            std::size_t value_size) {
+    if (state.thread_index() != 0) {
+        return;
+    }
+    store = std::make_unique<KVStore>();
+    chooser.emplace(KEYS, dist);
+    std::string value(value_size, 'x');
+    for (const auto &key : keys()) {
+        store->set(key, value, 0u, 0);
+    }
+}
+
+void tear_down(const benchmark::State &state) {
+    if (state.thread_index() == 0) {
+        store.reset();
+        chooser.reset();
+    }
+}
+
+workload::Distribution distribution(const benchmark::State &state,
+                                    int arg) {
+    return state.range(arg) != 0 ? workload::Distribution::zipfian
+                                 : workload::Distribution::uniform;
+}
+
+// Args: percentage of gets, Zipfian keys (0 or 1), value size
+void BM_GetSet(benchmark::State &state) {
+    auto read_percent = state.range(0);
+    auto dist = distribution(state, 1);
+    auto value_size = static_cast<std::size_t>(state.range(2));
+    set_up(state, dist, value_size);
+
+    std::minstd_rand rng(static_cast<unsigned>(state.thread_index()) + 1);
+    std::uniform_int_distribution<std::int64_t> percent{0, 99};
+    const std::string value(value_size, 'y');
+    std::int64_t hits = 0;
+    for (auto _ : state) {
+        const auto &key = keys()[(*chooser)(rng)];
+        if (percent(rng) < read_percent) {
+            auto val = store->get(key);
+            hits += val.has_value();
+            benchmark::DoNotOptimize(val);
+        } else {
+            store->set(key, value, 0u, 0);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(std::string{workload::distribution_name(dist)});
+    benchmark::DoNotOptimize(hits);
+    tear_down(state);
+}
+BENCHMARK(BM_GetSet)
+    ->ArgNames({"read%", "zipf", "value"})
+    ->ArgsProduct({{0, 50, 90, 100}, {0, 1}, {16, 1024}})
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// Gets only, on up to every core. Reads take no locks, so gets per thread
+// should hold steady as threads are added, Zipfian keys included.
+// Args: Zipfian keys (0 or 1)
+void BM_GetScaling(benchmark::State &state) {
+    auto dist = distribution(state, 0);
+    set_up(state, dist, 64);
+
+    std::minstd_rand rng(static_cast<unsigned>(state.thread_index()) + 1);
+    for (auto _ : state) {
+        auto val = store->get(keys()[(*chooser)(rng)]);
+        benchmark::DoNotOptimize(val);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["gets_per_thread"] = benchmark::Counter(
+        static_cast<double>(state.iterations()),
+        benchmark::Counter::kIsRate | benchmark::Counter::kAvgThreads);
+    state.SetLabel(std::string{workload::distribution_name(dist)});
+    tear_down(state);
+}
+BENCHMARK(BM_GetScaling)
+    ->ArgNames({"zipf"})
+    ->Args({0})
+    ->Args({1})
+    ->ThreadRange(1, static_cast<int>(
+                         std::max(1u, std::thread::hardware_concurrency())))
+    ->UseRealTime();
+
+// Args: Zipfian keys (0 or 1), suffix size. Values keep growing, so the
+// iteration count is capped to bound memory.
+void BM_Append(benchmark::State &state) {
+    auto dist = distribution(state, 0);
+    auto suffix_size = static_cast<std::size_t>(state.range(1));
+    set_up(state, dist, 16);
+
+    std::minstd_rand rng(static_cast<unsigned>(state.thread_index()) + 1);
+    const std::string suffix(suffix_size, 'z');
+    for (auto _ : state) {
+        store->append(keys()[(*chooser)(rng)], suffix);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() *
+                            static_cast<std::int64_t>(suffix_size));
+    state.SetLabel(std::string{workload::distribution_name(dist)});
+    tear_down(state);
+}
+BENCHMARK(BM_Append)
+    ->ArgNames({"zipf", "suffix"})
+    ->ArgsProduct({{0, 1}, {8, 128}})
+    ->ThreadRange(1, 8)
+    ->Iterations(200'000)
+    ->UseRealTime();
+} // namespace
@@ -0,0 +1,629 @@
+// Drives a running server end to end, in the spirit of memtier_benchmark:
+// each thread keeps many connections busy with a mix of gets, sets and
+// multi-key gets over the text protocol, keeping up to a pipeline depth of
+// requests in flight on each. Latencies are measured from a request being
+// sent to its reply being read, and reported per command as percentiles.
+//
+// Usage: undis_loadgen [-s host (127.0.0.1)] [-p port (8080)]
+//                      [-t threads (4)] [-c connections per thread (8)]
+//                      [-d seconds (5)] [-n requests per connection]
+//                      [-P pipeline depth (1)]
+//                      [-r gets:sets:multigets (9:1:0)]
+//                      [-k keys (100000)] [-z zipf theta (0, uniform)]
+//                      [-K keys per multiget (10)]
+//                      [-v value size or min-max (100)] [-F]
+//
+// -F fills the key space before the run so that gets hit. Start the server
+// with -q; prompts are tolerated but cost bandwidth.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#include "../undis/server.h"
+#include "../undis/stats.h"
+#include "workload.h"
+
+using namespace std::literals;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+enum class Op { get, set, multiget };
+constexpr std::size_t OPS = 3;
+constexpr std::array<std::string_view, OPS> op_names = {"get", "set",
+                                                        "multiget"};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    unsigned port = 8080;
+    unsigned threads = 4;
+    unsigned connections = 8;
+    std::chrono::seconds duration{5};
+    // Per connection; 0 to run for the duration instead
+    std::uint64_t requests = 0;
+    unsigned depth = 1;
+    std::array<unsigned, OPS> ratio = {9, 1, 0};
+    std::size_t keys = 100'000;
+    double theta = 0;
+    unsigned multiget_keys = 10;
+    std::size_t min_value = 100;
+    std::size_t max_value = 100;
+    bool fill = false;
+};
+
+// What one thread saw; added up at the end
+struct Results {
+    std::array<Histogram, OPS> latencies;
+    std::array<std::uint64_t, OPS> max_ns{};
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t errors = 0;
+
+    Results &operator+=(const Results &other) {
+        for (std::size_t i = 0; i < OPS; ++i) {
+            latencies[i] += other.latencies[i];
+            max_ns[i] = std::max(max_ns[i], other.max_ns[i]);
+        }
+        hits += other.hits;
+        misses += other.misses;
+        errors += other.errors;
+        return *this;
+    }
+};
+
+SOCKET connect_to(const Options &options) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *info = nullptr;
+    if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(),
+                    &hints, &info) != 0) {
+        throw std::runtime_error{"getaddrinfo failed."};
+    }
+    SOCKET fd = INVALID_SOCKET;
+    for (auto *p = info; p != nullptr; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == INVALID_SOCKET) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+#ifdef _WIN32
+        closesocket(fd);
+#else
+        close(fd);
+#endif
+        fd = INVALID_SOCKET;
+    }
+    freeaddrinfo(info);
+    if (fd == INVALID_SOCKET) {
+        throw std::runtime_error{"connect failed."};
+    }
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char *>(&yes),
+               sizeof yes);
+    return fd;
+}
+
+void send_all(SOCKET fd, std::string_view data) {
+    while (!data.empty()) {
+        auto n = send(fd, data.data(), static_cast<int>(data.size()), 0);
+        if (n <= 0) {
+            throw std::runtime_error{"send failed."};
+        }
+        data.remove_prefix(static_cast<std::size_t>(n));
+    }
+}
+
+// Reads one text reply at a time from the front of a buffer
+class ReplyParser {
+  public:
+    struct Reply {
+        std::size_t size;
+        unsigned hits;
+        bool error;
+    };
+
+    // Nothing until the whole reply has arrived
+    static std::optional<Reply> parse(std::string_view buf, bool retrieval) {
+        std::size_t pos = 0;
+        Reply reply{0, 0, false};
+        while (true) {
+            auto line = next_line(buf, pos);
+            if (!line.has_value()) {
+                return std::nullopt;
+            }
+            if (line->starts_with("CLIENT_ERROR")) {
+                // Followed by an ERROR line
+                if (!next_line(buf, pos).has_value()) {
+                    return std::nullopt;
+                }
+                reply.error = true;
+                break;
+            }
+            if (!retrieval) {
+                reply.error = *line != "STORED";
+                break;
+            }
+            if (*line == "END") {
+                break;
+            }
+            if (!line->starts_with("VALUE ")) {
+                reply.error = true;
+                break;
+            }
+            // VALUE <key> <flags> <bytes>, then the data and CRLF
+            auto last = line->rfind(' ');
+            std::size_t bytes = 0;
+            std::from_chars(line->data() + last + 1,
+                            line->data() + line->size(), bytes);
+            if (buf.size() < pos + bytes + 2) {
+                return std::nullopt;
+            }
+            pos += bytes + 2;
+            ++reply.hits;
+        }
+        reply.size = pos;
+        return reply;
+    }
+
+  private:
+    static constexpr auto prompt = "undis > "sv;
+
+    static std::optional<std::string_view> next_line(std::string_view buf,
+                                                     std::size_t &pos) {
+        auto end = buf.find("\r\n"sv, pos);
+        if (end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        auto line = buf.substr(pos, end - pos);
+        pos = end + 2;
+        while (line.starts_with(prompt)) {
+            line.remove_prefix(prompt.size());
+        }
+        return line;
+    }
+};
+
+// Shared, read-only state of the workload
+struct Workload {
+    const Options &options;
+    std::vector<std::string> keys;
+    workload::KeyChooser chooser;
+    std::string values;
+
+    explicit Workload(const Options &options)
+        : options{options}, keys{workload::make_keys(options.keys)},
+          chooser{options.keys,
+                  options.theta > 0 ? workload::Distribution::zipfian
+                                    : workload::Distribution::uniform,
+                  options.theta},
+          values(options.max_value, 'v') {}
+
+    void append_set(std::string &out, const std::string &key,
+                    std::size_t size) const {
+        out.append("set ")
+            .append(key)
+            .append(" 0 0 ")
+            .append(std::to_string(size))
+            .append("\r\n")
+            .append(values, 0, size)
+            .append("\r\n");
+    }
+};
+
+class Worker {
+  public:
+    Worker(const Workload &workload, unsigned seed)
+        : workload_{workload}, options_{workload.options}, rng_{seed},
+          op_dist_{options_.ratio.begin(), options_.ratio.end()},
+          size_dist_{options_.min_value, options_.max_value} {
+        for (unsigned i = 0; i < options_.connections; ++i) {
+            conns_.push_back({connect_to(options_)});
+        }
+    }
+
+    ~Worker() {
+        for (auto &conn : conns_) {
+#ifdef _WIN32
+            closesocket(conn.fd);
+#else
+            close(conn.fd);
+#endif
+        }
+    }
+
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+
+    // Runs until the deadline, or until every connection has sent its
+    // requests, and then waits for the replies in flight
+    Results run(Clock::time_point deadline) {
+        std::vector<pollfd> fds;
+        for (const auto &conn : conns_) {
+            fds.push_back({conn.fd, POLLIN, 0});
+        }
+        std::string out;
+        char chunk[64 * 1024];
+        while (true) {
+            bool sending = Clock::now() < deadline;
+            bool in_flight = false;
+            for (auto &conn : conns_) {
+                out.clear();
+                while (sending && conn.pending.size() < options_.depth &&
+                       (options_.requests == 0 ||
+                        conn.sent < options_.requests)) {
+                    conn.pending.push_back({next_request(out), Clock::now()});
+                    ++conn.sent;
+                }
+                if (!out.empty()) {
+                    send_all(conn.fd, out);
+                }
+                in_flight |= !conn.pending.empty();
+            }
+            if (!in_flight) {
+                break;
+            }
+
+            if (poll(fds.data(), static_cast<unsigned long>(fds.size()),
+                     100) < 0) {
+                throw std::runtime_error{"poll failed."};
+            }
+            for (std::size_t i = 0; i < fds.size(); ++i) {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                auto &conn = conns_[i];
+                auto n = recv(conn.fd, chunk, sizeof chunk, 0);
+                if (n <= 0) {
+                    throw std::runtime_error{"connection closed."};
+                }
+                conn.in.append(chunk, static_cast<std::size_t>(n));
+                receive(conn);
+            }
+        }
+        return std::move(results_);
+    }
+
+  private:
+    struct Pending {
+        Op op;
+        Clock::time_point sent;
+    };
+
+    struct Connection {
+        SOCKET fd;
+        std::string in{};
+        std::deque<Pending> pending{};
+        std::uint64_t sent = 0;
+    };
+
+    Op next_request(std::string &out) {
+        auto op = static_cast<Op>(op_dist_(rng_));
+        const auto &keys = workload_.keys;
+        switch (op) {
+        case Op::get:
+            out.append("get ").append(keys[workload_.chooser(rng_)]);
+            out.append("\r\n");
+            break;
+        case Op::set:
+            workload_.append_set(out, keys[workload_.chooser(rng_)],
+                                 size_dist_(rng_));
+            break;
+        case Op::multiget:
+            out.append("get");
+            for (unsigned k = 0; k < options_.multiget_keys; ++k) {
+                out.append(" ").append(keys[workload_.chooser(rng_)]);
+            }
+            out.append("\r\n");
+            break;
+        }
+        return op;
+    }
+
+    // Matches complete replies with their requests, in order
+    void receive(Connection &conn) {
+        std::size_t consumed = 0;
+        auto now = Clock::now();
+        while (!conn.pending.empty()) {
+            auto [op, sent] = conn.pending.front();
+            auto reply = ReplyParser::parse(
+                std::string_view{conn.in}.substr(consumed), op != Op::set);
+            if (!reply.has_value()) {
+                break;
+            }
+            consumed += reply->size;
+            conn.pending.pop_front();
+
+            auto i = static_cast<std::size_t>(op);
+            auto ns = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now -
+                                                                     sent)
+                    .count());
+            results_.latencies[i].record(ns);
+            results_.max_ns[i] = std::max(results_.max_ns[i], ns);
+            results_.errors += reply->error;
+            if (op != Op::set) {
+                auto keys = op == Op::get ? 1u : options_.multiget_keys;
+                results_.hits += reply->hits;
+                results_.misses += keys - std::min(reply->hits, keys);
+            }
+        }
+        conn.in.erase(0, consumed);
+    }
+
+    const Workload &workload_;
+    const Options &options_;
+    std::minstd_rand rng_;
+    std::discrete_distribution<std::size_t> op_dist_;
+    std::uniform_int_distribution<std::size_t> size_dist_;
+    std::vector<Connection> conns_;
+    Results results_;
+};
+
+// Sets every key once, over one connection with pipelined batches
+void fill(const Workload &workload) {
+    constexpr std::size_t BATCH = 256;
+    SOCKET fd = connect_to(workload.options);
+    std::minstd_rand rng;
+    std::uniform_int_distribution<std::size_t> size_dist{
+        workload.options.min_value, workload.options.max_value};
+    std::string out, in;
+    char chunk[64 * 1024];
+    for (std::size_t begin = 0; begin < workload.keys.size(); begin += BATCH) {
+        auto end = std::min(begin + BATCH, workload.keys.size());
+        out.clear();
+        for (auto i = begin; i < end; ++i) {
+            workload.append_set(out, workload.keys[i], size_dist(rng));
+        }
+        send_all(fd, out);
+        for (auto remaining = end - begin; remaining > 0;) {
+            auto reply = ReplyParser::parse(in, false);
+            if (reply.has_value()) {
+                in.erase(0, reply->size);
+                --remaining;
+                continue;
+            }
+            auto n = recv(fd, chunk, sizeof chunk, 0);
+            if (n <= 0) {
+                throw std::runtime_error{"connection closed."};
+            }
+            in.append(chunk, static_cast<std::size_t>(n));
+        }
+    }
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+void report(const Options &options, const Results &results,
+            std::chrono::duration<double> elapsed) {
+    std::cout << options.threads << " threads x " << options.connections
+              << " connections, pipeline depth " << options.depth << ", "
+              << std::fixed << std::setprecision(2) << elapsed.count()
+              << " s\n"
+              << std::left << std::setw(10) << "command" << std::right
+              << std::setw(12) << "ops/s" << std::setw(10) << "p50 us"
+              << std::setw(10) << "p90 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << std::setw(10) << "p9999 us"
+              << std::setw(10) << "max us" << '\n';
+
+    auto row = [&elapsed](std::string_view name, const Histogram &h,
+                          std::uint64_t max_ns) {
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::fixed << std::setprecision(0) << std::setw(12)
+                  << static_cast<double>(h.count()) / elapsed.count()
+                  << std::setprecision(1);
+        // Percentiles are bucket upper bounds, which may overshoot the max
+        for (double q : {0.5, 0.9, 0.99, 0.999, 0.9999}) {
+            auto ns = std::min(h.percentile(q), max_ns);
+            std::cout << std::setw(10) << static_cast<double>(ns) / 1e3;
+        }
+        std::cout << std::setw(10) << static_cast<double>(max_ns) / 1e3
+                  << '\n';
+    };
+
+    Histogram total;
+    std::uint64_t max_ns = 0;
+    for (std::size_t i = 0; i < OPS; ++i) {
+        if (results.latencies[i].count() > 0) {
+            row(op_names[i], results.latencies[i], results.max_ns[i]);
+        }
+        total += results.latencies[i];
+        max_ns = std::max(max_ns, results.max_ns[i]);
+    }
+    row("total", total, max_ns);
+
+    auto lookups = results.hits + results.misses;
+    std::cout << "hits " << results.hits << ", misses " << results.misses;
+    if (lookups > 0) {
+        std::cout << " (" << std::setprecision(1)
+                  << 100.0 * static_cast<double>(results.hits) /
+                         static_cast<double>(lookups)
+                  << "% hit rate)";
+    }
+    std::cout << ", errors " << results.errors << '\n';
+}
+
+template <typename T> bool parse_number(std::string_view str, T &value) {
+    auto res = std::from_chars(str.data(), str.data() + str.size(), value);
+    return res.ec == std::errc{} && res.ptr == str.data() + str.size();
+}
+
+// Fills in the options, or returns false after reporting a bad argument
+bool parse_options(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg{argv[i]};
+        if (arg == "-F") {
+            options.fill = true;
+            continue;
+        }
+        if (arg.size() != 2 || arg[0] != '-' || i + 1 >= argc) {
+            std::cerr << "Unknown option or missing value: " << arg << '\n';
+            return false;
+        }
+        std::string_view value{argv[++i]};
+        bool ok = true;
+        switch (arg[1]) {
+        case 's':
+            options.host = value;
+            break;
+        case 'p':
+            ok = parse_number(value, options.port);
+            break;
+        case 't':
+            ok = parse_number(value, options.threads) && options.threads > 0;
+            break;
+        case 'c':
+            ok = parse_number(value, options.connections) &&
+                 options.connections > 0;
+            break;
+        case 'd': {
+            unsigned seconds;
+            ok = parse_number(value, seconds);
+            options.duration = std::chrono::seconds{seconds};
+            break;
+        }
+        case 'n':
+            ok = parse_number(value, options.requests);
+            break;
+        case 'P':
+            ok = parse_number(value, options.depth) && options.depth > 0;
+            break;
+        case 'r': {
+            // gets:sets:multigets
+            std::size_t begin = 0;
+            for (std::size_t k = 0; k < OPS && ok; ++k) {
+                auto end = std::min(value.find(':', begin), value.size());
+                ok = parse_number(value.substr(begin, end - begin),
+                                  options.ratio[k]);
+                begin = end + 1;
+            }
+            ok = ok && begin == value.size() + 1 &&
+                 options.ratio[0] + options.ratio[1] + options.ratio[2] > 0;
+            break;
+        }
+        case 'k':
+            ok = parse_number(value, options.keys) && options.keys > 0;
+            break;
+        case 'z': {
+            // from_chars for doubles is not available everywhere yet
+            try {
+                std::size_t used;
+                options.theta = std::stod(std::string{value}, &used);
+                ok = used == value.size() && options.theta >= 0 &&
+                     options.theta != 1;
+            } catch (const std::exception &) {
+                ok = false;
+            }
+            break;
+        }
+        case 'K':
+            ok = parse_number(value, options.multiget_keys) &&
+                 options.multiget_keys > 0;
+            break;
+        case 'v': {
+            auto dash = value.find('-');
+            ok = parse_number(value.substr(0, dash), options.min_value);
+            options.max_value = options.min_value;
+            if (ok && dash != std::string_view::npos) {
+                ok = parse_number(value.substr(dash + 1), options.max_value) &&
+                     options.max_value >= options.min_value;
+            }
+            break;
+        }
+        default:
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << "Invalid value for " << arg << ": " << value << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+#ifdef _WIN32
+    WSAData wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data)) {
+        std::cerr << "WSAStartup failed.\n";
+        return 2;
+    }
+#else
+    // A closing server must not kill the generator mid-send
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    try {
+        Workload workload{options};
+        if (options.fill) {
+            fill(workload);
+        }
+
+        // Every connection is open before the clock starts
+        std::vector<std::unique_ptr<Worker>> workers;
+        for (unsigned t = 0; t < options.threads; ++t) {
+            workers.push_back(std::make_unique<Worker>(workload, t + 1));
+        }
+
+        std::vector<Results> results(options.threads);
+        std::atomic<bool> failed = false;
+        auto start = Clock::now();
+        auto deadline = options.requests > 0 ? Clock::time_point::max()
+                                             : start + options.duration;
+        {
+            std::vector<std::jthread> threads;
+            for (unsigned t = 0; t < options.threads; ++t) {
+                threads.emplace_back([&, t] {
+                    try {
+                        results[t] = workers[t]->run(deadline);
+                    } catch (const std::exception &e) {
+                        std::cerr << e.what() << '\n';
+                        failed = true;
+                    }
+                });
+            }
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        Results total;
+        for (const auto &r : results) {
+            total += r;
+        }
+        report(options, total, elapsed);
+        return failed ? 2 : 0;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 2;
+    }
+}
@@ -0,0 +1,204 @@
+// Compares request parsing against the istringstream-based parser it
+// replaced: splitting a pipelined buffer into lines, and tokenizing those
+// lines into commands. Throughput is reported in MB of requests per second.
+//
+// Usage: undis_parse_bench [passes (200)]
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "../undis/command.h"
+#include "../undis/scan.h"
+
+using namespace std::literals;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+// The previous parser, kept as the baseline
+namespace legacy {
+struct Storage {
+    std::string type;
+    std::string key;
+    std::uint32_t flags;
+    int exp_time;
+    unsigned bytes;
+};
+struct Retrieval {
+    std::vector<std::string> keys;
+};
+struct Deletion {
+    std::string key;
+};
+using CommandVariant =
+    std::variant<std::monostate, Storage, Retrieval, Deletion>;
+
+CommandVariant parse(const std::string &s) {
+    CommandVariant result;
+    std::istringstream is{s};
+    std::string command;
+    is >> command;
+    if (command == "set" || command == "add" || command == "replace" ||
+        command == "append" || command == "prepend") {
+        std::string key;
+        std::uint32_t flags;
+        int exp_time;
+        unsigned bytes;
+        is >> key >> flags >> exp_time >> std::ws;
+        if (!is || is.peek() == '-') {
+            return result;
+        }
+        is >> bytes;
+        if (is) {
+            result.emplace<Storage>(
+                Storage{command, key, flags, exp_time, bytes});
+        }
+    } else if (command == "get") {
+        std::vector<std::string> keys;
+        std::copy(std::istream_iterator<std::string>{is},
+                  std::istream_iterator<std::string>{},
+                  std::back_inserter(keys));
+        if (!keys.empty()) {
+            result.emplace<Retrieval>(Retrieval{keys});
+        }
+    } else if (command == "delete") {
+        std::string key;
+        is >> key;
+        if (is) {
+            result.emplace<Deletion>(Deletion{key});
+        }
+    }
+    return result;
+}
+
+// Copies each line out, as the blocking connection handler used to
+std::size_t split(const std::string &buf, std::vector<std::string> &lines) {
+    constexpr auto crlf = "\r\n"sv;
+    lines.clear();
+    auto it = buf.begin();
+    while (true) {
+        auto end = std::search(it, buf.end(), crlf.begin(), crlf.end());
+        if (end == buf.end()) {
+            break;
+        }
+        lines.emplace_back(it, end);
+        it = end + crlf.size();
+    }
+    return lines.size();
+}
+} // namespace legacy
+
+std::size_t split(std::string_view buf, std::vector<std::string_view> &lines) {
+    lines.clear();
+    std::size_t pos = 0;
+    while (true) {
+        auto end = scan::find_crlf(buf, pos);
+        if (end == std::string_view::npos) {
+            break;
+        }
+        lines.push_back(buf.substr(pos, end - pos));
+        pos = end + 2;
+    }
+    return lines.size();
+}
+
+// A mix of short gets, multi-key gets, storage commands and deletes
+std::string make_requests() {
+    std::string buf;
+    for (int i = 0; i < 1000; ++i) {
+        auto key = "user:session:" + std::to_string(i);
+        buf.append("get " + key + "\r\n");
+        buf.append("set " + key + " 0 3600 " + std::to_string(i % 500) +
+                   "\r\n");
+        if (i % 4 == 0) {
+            buf.append("get");
+            for (int k = 0; k < 10; ++k) {
+                buf.append(" " + key + ":" + std::to_string(k));
+            }
+            buf.append("\r\n");
+        }
+        if (i % 8 == 0) {
+            buf.append("delete " + key + "\r\n");
+        }
+    }
+    return buf;
+}
+
+template <typename F> double megabytes_per_second(std::size_t bytes, F f) {
+    auto start = Clock::now();
+    f();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    return static_cast<double>(bytes) / 1e6 / elapsed.count();
+}
+
+void report(std::string_view name, double baseline, double current) {
+    std::cout << std::left << std::setw(10) << name << std::right
+              << std::fixed << std::setprecision(0) << std::setw(14)
+              << baseline << std::setw(14) << current << std::setprecision(1)
+              << std::setw(10) << current / baseline << "x\n";
+}
+
+unsigned parse_arg(int argc, char **argv, int i, unsigned fallback) {
+    if (i >= argc) {
+        return fallback;
+    }
+    std::string_view arg{argv[i]};
+    unsigned value = fallback;
+    std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    return value;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+    unsigned passes = std::max(parse_arg(argc, argv, 1, 200), 1u);
+    auto requests = make_requests();
+    auto bytes = requests.size() * passes;
+
+    // Keeps the results observable so the work is not optimized away
+    std::size_t sink = 0;
+
+    std::vector<std::string> legacy_lines;
+    std::vector<std::string_view> lines;
+    auto split_legacy = megabytes_per_second(bytes, [&] {
+        for (unsigned p = 0; p < passes; ++p) {
+            sink += legacy::split(requests, legacy_lines);
+        }
+    });
+    auto split_scan = megabytes_per_second(bytes, [&] {
+        for (unsigned p = 0; p < passes; ++p) {
+            sink += split(requests, lines);
+        }
+    });
+
+    auto parse_legacy = megabytes_per_second(bytes, [&] {
+        for (unsigned p = 0; p < passes; ++p) {
+            for (const auto &line : legacy_lines) {
+                sink += legacy::parse(line).index();
+            }
+        }
+    });
+    auto parse_current = megabytes_per_second(bytes, [&] {
+        for (unsigned p = 0; p < passes; ++p) {
+            for (auto line : lines) {
+                sink += static_cast<std::size_t>(Command{line}.status());
+            }
+        }
+    });
+
+    std::cout << requests.size() << " bytes, " << lines.size()
+              << " requests x " << passes << " passes (" << sink << ")\n"
+              << std::left << std::setw(10) << "MB/s" << std::right
+              << std::setw(14) << "before" << std::setw(14) << "after"
+              << std::setw(11) << "speedup" << '\n';
+    report("lines", split_legacy, split_scan);
+    report("commands", parse_legacy, parse_current);
+}
@@ -0,0 +1,91 @@
+// Snapshot write and read rates for datasets of various sizes. Bytes are
+// those of the keys and values, so rates are comparable across codecs.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+#include "../undis/serializer.h"
+#include "../undis/storevalue.h"
+#include "workload.h"
+
+namespace {
+using Map = std::unordered_map<std::string, StoreValue>;
+
+constexpr std::size_t VALUE_SIZE = 100;
+
+std::filesystem::path snapshot_file() {
+    return std::filesystem::temp_directory_path() / "undis_bench.db";
+}
+
+// Values differ in content, so compression does not flatter the rates
+Map make_dataset(std::size_t items) {
+    Map map;
+    map.reserve(items);
+    auto keys = workload::make_keys(items);
+    for (std::size_t i = 0; i < items; ++i) {
+        std::string value(VALUE_SIZE, 'v');
+        auto digits = std::to_string(i * 2654435761u);
+        value.replace(0, digits.size(), digits);
+        map.emplace(std::move(keys[i]), StoreValue{std::move(value), 0u, 0});
+    }
+    return map;
+}
+
+std::int64_t data_bytes(const Map &map) {
+    std::int64_t bytes = 0;
+    for (const auto &[key, val] : map) {
+        bytes += static_cast<std::int64_t>(key.size() + val.str_val.size());
+    }
+    return bytes;
+}
+
+// Args: items
+void BM_SerializerSave(benchmark::State &state) {
+    auto map = make_dataset(static_cast<std::size_t>(state.range(0)));
+    Serializer ser{snapshot_file()};
+    for (auto _ : state) {
+        ser << map;
+        if (!ser.good()) {
+            state.SkipWithError("snapshot could not be written");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * data_bytes(map));
+    std::filesystem::remove(snapshot_file());
+}
+BENCHMARK(BM_SerializerSave)
+    ->ArgName("items")
+    ->RangeMultiplier(10)
+    ->Range(1'000, 1'000'000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Args: items
+void BM_SerializerLoad(benchmark::State &state) {
+    auto map = make_dataset(static_cast<std::size_t>(state.range(0)));
+    auto bytes = data_bytes(map);
+    Serializer ser{snapshot_file()};
+    ser << map;
+    map.clear();
+
+    for (auto _ : state) {
+        Map loaded;
+        ser >> loaded;
+        benchmark::DoNotOptimize(loaded.size());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * bytes);
+    std::filesystem::remove(snapshot_file());
+}
+BENCHMARK(BM_SerializerLoad)
+    ->ArgName("items")
+    ->RangeMultiplier(10)
+    ->Range(1'000, 1'000'000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+} // namespace
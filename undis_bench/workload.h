@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Keys and their popularity, shared by the benchmarks
+namespace workload {
+
+enum class Distribution { uniform, zipfian };
+
+// Picks key indices below n, either uniformly or following a Zipfian
+// distribution where the i-th most popular key is requested in proportion to
+// 1 / i^theta. The Zipfian sampler is the one YCSB uses (Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases"), constant time per draw
+// after summing the series once.
+class KeyChooser {
+  public:
+    KeyChooser(std::size_t n, Distribution distribution, double theta = 0.99)
+        : n_{n}, distribution_{distribution}, theta_{theta} {
+        if (distribution_ == Distribution::zipfian) {
+            for (std::size_t i = 1; i <= n_; ++i) {
+                zetan_ += 1 / std::pow(static_cast<double>(i), theta_);
+            }
+            auto zeta2 = 1 + 1 / std::pow(2.0, theta_);
+            alpha_ = 1 / (1 - theta_);
+            eta_ = (1 - std::pow(2.0 / static_cast<double>(n_), 1 - theta_)) /
+                   (1 - zeta2 / zetan_);
+            half_pow_theta_ = 1 + std::pow(0.5, theta_);
+        }
+    }
+
+    template <typename Rng> std::size_t operator()(Rng &rng) const {
+        std::uniform_real_distribution<double> uniform{0, 1};
+        auto u = uniform(rng);
+        if (distribution_ == Distribution::uniform) {
+            return std::min(static_cast<std::size_t>(u * n_), n_ - 1);
+        }
+        auto uz = u * zetan_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < half_pow_theta_) {
+            return 1;
+        }
+        auto i = static_cast<std::size_t>(
+            static_cast<double>(n_) * std::pow(eta_ * u - eta_ + 1, alpha_));
+        return std::min(i, n_ - 1);
+    }
+
+  private:
+    std::size_t n_;
+    Distribution distribution_;
+    double theta_;
+    double zetan_ = 0;
+    double alpha_ = 0;
+    double eta_ = 0;
+    double half_pow_theta_ = 0;
+};
+
+inline std::vector<std::string> make_keys(std::size_t n) {
+    std::vector<std::string> keys;
+    keys.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        keys.push_back("key:" + std::to_string(i));
+    }
+    return keys;
+}
+
+inline std::string_view distribution_name(Distribution distribution) {
+    return distribution == Distribution::uniform ? "uniform" : "zipfian";
+}
+
+} // namespace workload
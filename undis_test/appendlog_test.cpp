@@ -0,0 +1,189 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "utils.h"
+
+#include "../undis/appendlog.h"
+#include "../undis/kvstore.h"
+#include "../undis/serializer.h"
+
+using namespace std::chrono_literals;
+
+class AppendLogTest : public ::testing::Test {
+  protected:
+    void TearDown() override {
+        std::filesystem::remove(log);
+        std::filesystem::remove(db);
+    }
+
+    StoreOptions options(FsyncPolicy fsync = FsyncPolicy::everysec) {
+        return StoreOptions{.log_file = log, .fsync = fsync};
+    }
+
+    const std::filesystem::path log{"AppendLogTest.log"};
+    const std::filesystem::path db{"AppendLogTest.db"};
+};
+
+TEST_F(AppendLogTest, ReplaysMutations) {
+    const auto m = map_factory(20);
+    {
+        // Without a snapshot, the log is all there is
+        KVStore store{options(FsyncPolicy::always)};
+        for (const auto &[k, v] : m) {
+            store.set(k, v.str_val, v.flags, 0);
+        }
+        store.set("key", "value", 1u, 0);
+        store.append("key", "_suffix");
+        store.prepend("key", "prefix_");
+        store.add("added", "value", 0u, 0);
+        store.replace("added", "replaced", 2u, 0);
+        store.set("deleted", "value", 0u, 0);
+        store.del("deleted");
+    }
+
+    KVStore store{options()};
+    EXPECT_EQ(store.size(), m.size() + 2);
+    for (const auto &[k, v] : m) {
+        auto val = store.get(k);
+        ASSERT_TRUE(val.has_value());
+        EXPECT_EQ(val->str_val, v.str_val);
+    }
+    EXPECT_EQ(store.get("key")->str_val, "prefix_value_suffix");
+    EXPECT_EQ(store.get("key")->flags, 1u);
+    EXPECT_EQ(store.get("added")->str_val, "replaced");
+    EXPECT_FALSE(store.get("deleted").has_value());
+}
+
+TEST_F(AppendLogTest, TruncatesTornRecord) {
+    {
+        KVStore store{options()};
+        store.set("key", "value", 0u, 0);
+    }
+    auto size = std::filesystem::file_size(log);
+    {
+        // A set record cut short by a crash
+        std::ofstream ofs{log, std::ios::binary | std::ios::app};
+        ofs.write("S\x03\0\0\0\x05\0", 7);
+    }
+
+    {
+        KVStore store{options()};
+        EXPECT_EQ(std::filesystem::file_size(log), size);
+        EXPECT_EQ(store.get("key")->str_val, "value");
+        store.set("other", "value", 0u, 0);
+    }
+
+    KVStore store{options()};
+    EXPECT_EQ(store.size(), 2);
+}
+
+TEST_F(AppendLogTest, Rewrites) {
+    {
+        KVStore store{options()};
+        for (int i = 0; i < 1000; ++i) {
+            store.set("key", std::to_string(i), 0u, 0);
+        }
+        store.set("deleted", "value", 0u, 0);
+        store.del("deleted");
+        std::this_thread::sleep_for(100ms);
+
+        auto size = std::filesystem::file_size(log);
+        EXPECT_TRUE(store.rewrite_log());
+        for (int i = 0; i < 100 && std::filesystem::file_size(log) >= size;
+             ++i) {
+            std::this_thread::sleep_for(20ms);
+        }
+        EXPECT_LT(std::filesystem::file_size(log), size);
+        store.set("after", "value", 0u, 0);
+    }
+
+    // Entries missing from the log's point-in-time view do not come back
+    // from an older snapshot
+    Serializer ser{db};
+    ser << map_factory(10);
+
+    KVStore store{db, options()};
+    EXPECT_EQ(store.size(), 2);
+    EXPECT_EQ(store.get("key")->str_val, "999");
+    EXPECT_TRUE(store.get("after").has_value());
+}
+
+TEST_F(AppendLogTest, AbandonsFailedRewrite) {
+    // A directory in the way keeps the rewrite from opening its output
+    auto blocker = log;
+    blocker += ".rewrite";
+    std::filesystem::create_directory(blocker);
+    {
+        KVStore store{options(FsyncPolicy::always)};
+        store.set("key", "value", 0u, 0);
+        auto size = std::filesystem::file_size(log);
+        EXPECT_TRUE(store.rewrite_log());
+        std::this_thread::sleep_for(100ms);
+        EXPECT_EQ(std::filesystem::file_size(log), size);
+        store.set("after", "value", 0u, 0);
+
+        std::filesystem::remove(blocker);
+        for (int i = 0; i < 100 && !store.rewrite_log(); ++i) {
+            std::this_thread::sleep_for(20ms);
+        }
+    }
+    std::filesystem::remove_all(blocker);
+
+    KVStore store{options()};
+    EXPECT_EQ(store.size(), 2);
+    EXPECT_EQ(store.get("key")->str_val, "value");
+}
+
+TEST_F(AppendLogTest, ResetsAfterSnapshot) {
+    {
+        KVStore store{db, options()};
+        store.set("key", "value", 0u, 0);
+    }
+    EXPECT_LT(std::filesystem::file_size(log), 16);
+
+    KVStore store{db, options()};
+    EXPECT_EQ(store.get("key")->str_val, "value");
+}
+
+TEST_F(AppendLogTest, KeepsLogIfSnapshotFails) {
+    // The snapshot's directory does not exist, so writing it fails
+    const std::filesystem::path missing{"AppendLogTest.missing/db"};
+    {
+        KVStore store{missing, options()};
+        store.set("key", "value", 0u, 0);
+    }
+    EXPECT_FALSE(std::filesystem::exists(missing));
+
+    KVStore store{options()};
+    EXPECT_EQ(store.get("key")->str_val, "value");
+}
+
+TEST_F(AppendLogTest, KeepsLogIfResetFails) {
+    // A directory where the reset writes the new log makes it fail
+    auto blocker = log;
+    blocker += ".rewrite";
+    std::filesystem::create_directory(blocker);
+    {
+        KVStore store{db, options()};
+        store.set("key", "value", 0u, 0);
+    }
+    std::filesystem::remove(blocker);
+    EXPECT_GT(std::filesystem::file_size(log), 16);
+
+    KVStore store{db, options()};
+    EXPECT_EQ(store.get("key")->str_val, "value");
+}
+
+TEST_F(AppendLogTest, RejectsOtherFiles) {
+    {
+        std::ofstream ofs{log, std::ios::binary};
+        ofs << "not a log";
+    }
+    EXPECT_THROW(KVStore{options()}, std::runtime_error);
+}
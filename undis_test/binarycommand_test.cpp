@@ -0,0 +1,263 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "../undis/binarycommand.h"
+#include "../undis/kvstore.h"
+#include "../undis/reply.h"
+#include "../undis/session.h"
+
+using namespace std::literals;
+using binary_protocol::Opcode;
+using binary_protocol::Status;
+
+namespace {
+void put(std::string &s, std::uint64_t value, std::size_t size) {
+    for (std::size_t i = size; i-- > 0;) {
+        s.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+std::uint64_t get(std::string_view s, std::size_t offset, std::size_t size) {
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+        value = value << 8 | static_cast<unsigned char>(s[offset + i]);
+    }
+    return value;
+}
+
+std::string request(Opcode op, std::string_view key,
+                    std::string_view value = {}, std::string_view extras = {},
+                    std::uint32_t opaque = 0, std::uint64_t cas = 0) {
+    std::string s;
+    put(s, binary_protocol::REQUEST_MAGIC, 1);
+    put(s, static_cast<std::uint8_t>(op), 1);
+    put(s, key.size(), 2);
+    put(s, extras.size(), 1);
+    put(s, 0, 3);
+    put(s, extras.size() + key.size() + value.size(), 4);
+    put(s, opaque, 4);
+    put(s, cas, 8);
+    s.append(extras).append(key).append(value);
+    return s;
+}
+
+std::string set_extras(std::uint32_t flags, std::uint32_t exp_time) {
+    std::string s;
+    put(s, flags, 4);
+    put(s, exp_time, 4);
+    return s;
+}
+
+std::string arithmetic_extras(std::uint64_t delta, std::uint64_t initial,
+                              std::uint32_t exp_time) {
+    std::string s;
+    put(s, delta, 8);
+    put(s, initial, 8);
+    put(s, exp_time, 4);
+    return s;
+}
+
+Status status(std::string_view response) {
+    return static_cast<Status>(get(response, 6, 2));
+}
+} // namespace
+
+class BinaryCommandTest : public ::testing::Test {
+  protected:
+    std::string execute(std::string_view req) {
+        EXPECT_EQ(BinaryCommand::size(req), req.size());
+        return BinaryCommand{req}.execute(store).str();
+    }
+
+    KVStore store;
+};
+
+TEST_F(BinaryCommandTest, SetsAndGets) {
+    auto res =
+        execute(request(Opcode::set, "key", "value", set_extras(42, 0), 7));
+    ASSERT_EQ(res.size(), binary_protocol::HEADER_SIZE);
+    EXPECT_EQ(static_cast<std::uint8_t>(res[0]),
+              binary_protocol::RESPONSE_MAGIC);
+    EXPECT_EQ(status(res), Status::no_error);
+    EXPECT_EQ(get(res, 12, 4), 7);
+    EXPECT_EQ(store.get("key")->flags, 42u);
+
+    res = execute(request(Opcode::getk, "key", {}, {}, 8));
+    EXPECT_EQ(status(res), Status::no_error);
+    EXPECT_EQ(get(res, 2, 2), 3);
+    EXPECT_EQ(get(res, 4, 1), 4);
+    EXPECT_EQ(get(res, 8, 4), 4 + 3 + 5);
+    EXPECT_EQ(get(res, 12, 4), 8);
+    EXPECT_EQ(get(res, 24, 4), 42);
+    EXPECT_EQ(res.substr(28), "keyvalue");
+
+    // Values may hold any bytes
+    auto value = "\r\n\0\x80"s;
+    execute(request(Opcode::set, "key", value, set_extras(0, 0)));
+    EXPECT_EQ(execute(request(Opcode::get, "key")).substr(28), value);
+}
+
+TEST_F(BinaryCommandTest, ComparesAndSwaps) {
+    execute(request(Opcode::set, "key", "value", set_extras(0, 0)));
+    auto version = get(execute(request(Opcode::get, "key")), 16, 8);
+    EXPECT_EQ(version, store.get("key")->cas);
+
+    EXPECT_EQ(status(execute(request(Opcode::set, "key", "stale",
+                                     set_extras(0, 0), 0, version + 1))),
+              Status::key_exists);
+    EXPECT_EQ(status(execute(request(Opcode::replace, "key", "fresh",
+                                     set_extras(0, 0), 0, version))),
+              Status::no_error);
+    EXPECT_EQ(store.get("key")->str_val, "fresh");
+    EXPECT_EQ(status(execute(request(Opcode::set, "missing", "value",
+                                     set_extras(0, 0), 0, version))),
+              Status::key_not_found);
+}
+
+TEST_F(BinaryCommandTest, IncrementsAndDecrements) {
+    // Created with the initial value on a miss, unless the expiration is
+    // all ones
+    EXPECT_EQ(status(execute(request(Opcode::increment, "counter", {},
+                                     arithmetic_extras(1, 0, 0xffffffff)))),
+              Status::key_not_found);
+    auto res = execute(
+        request(Opcode::increment, "counter", {}, arithmetic_extras(1, 7, 0)));
+    EXPECT_EQ(status(res), Status::no_error);
+    EXPECT_EQ(get(res, 24, 8), 7u);
+
+    res = execute(request(Opcode::increment, "counter", {},
+                          arithmetic_extras(5, 0, 0)));
+    EXPECT_EQ(get(res, 24, 8), 12u);
+    res = execute(request(Opcode::decrement, "counter", {},
+                          arithmetic_extras(20, 0, 0)));
+    EXPECT_EQ(get(res, 24, 8), 0u);
+    EXPECT_EQ(execute(request(Opcode::incrementq, "counter", {},
+                              arithmetic_extras(3, 0, 0))),
+              "");
+    EXPECT_EQ(store.get("counter")->str_val, "3");
+
+    execute(request(Opcode::set, "key", "value", set_extras(0, 0)));
+    EXPECT_EQ(status(execute(request(Opcode::decrementq, "key", {},
+                                     arithmetic_extras(1, 0, 0)))),
+              Status::non_numeric);
+    EXPECT_EQ(status(execute(request(Opcode::increment, "key"))),
+              Status::invalid_arguments);
+}
+
+TEST_F(BinaryCommandTest, Touches) {
+    std::string extras;
+    put(extras, 100, 4);
+    EXPECT_EQ(status(execute(request(Opcode::touch, "key", {}, extras))),
+              Status::key_not_found);
+    EXPECT_EQ(execute(request(Opcode::gatq, "key", {}, extras)), "");
+
+    execute(request(Opcode::set, "key", "value", set_extras(42, 0)));
+    EXPECT_EQ(status(execute(request(Opcode::touch, "key", {}, extras))),
+              Status::no_error);
+    EXPECT_NEAR(store.get("key")->exp_time, CoarseClock::now() + 100, 1);
+
+    extras.clear();
+    put(extras, 0, 4);
+    auto res = execute(request(Opcode::gatk, "key", {}, extras));
+    EXPECT_EQ(status(res), Status::no_error);
+    EXPECT_EQ(get(res, 24, 4), 42u);
+    EXPECT_EQ(res.substr(28), "keyvalue");
+    EXPECT_EQ(store.get("key")->exp_time, StoreValue::NO_EXPIRY);
+
+    EXPECT_EQ(status(execute(request(Opcode::gat, "key"))),
+              Status::invalid_arguments);
+}
+
+TEST_F(BinaryCommandTest, ReportsStats) {
+    execute(request(Opcode::set, "key", "value", set_extras(0, 0)));
+    auto res = execute(request(Opcode::stat, {}));
+
+    // One response per statistic, then an empty one
+    using Stat = std::pair<std::string, std::string>;
+    std::vector<Stat> stats;
+    for (std::size_t pos = 0; pos < res.size();) {
+        EXPECT_EQ(status(res.substr(pos)), Status::no_error);
+        auto key_length = get(res, pos + 2, 2);
+        auto body_length = get(res, pos + 8, 4);
+        auto body = res.substr(pos + 24, body_length);
+        stats.emplace_back(body.substr(0, key_length),
+                           body.substr(key_length));
+        pos += 24 + body_length;
+    }
+    ASSERT_FALSE(stats.empty());
+    EXPECT_EQ(stats.back(), Stat("", ""));
+    EXPECT_NE(std::find(stats.begin(), stats.end(), Stat("curr_items", "1")),
+              stats.end());
+
+    EXPECT_EQ(status(execute(request(Opcode::stat, "items"))),
+              Status::key_not_found);
+}
+
+TEST_F(BinaryCommandTest, ReportsFailures) {
+    EXPECT_EQ(status(execute(request(Opcode::get, "missing"))),
+              Status::key_not_found);
+    EXPECT_EQ(status(execute(request(Opcode::replace, "missing", "value",
+                                     set_extras(0, 0)))),
+              Status::key_not_found);
+    EXPECT_EQ(status(execute(request(Opcode::append, "missing", "value"))),
+              Status::not_stored);
+    EXPECT_EQ(status(execute(request(Opcode::del, "missing"))),
+              Status::key_not_found);
+
+    execute(request(Opcode::add, "key", "value", set_extras(0, 0)));
+    EXPECT_EQ(status(execute(request(Opcode::add, "key", "value",
+                                     set_extras(0, 0)))),
+              Status::key_exists);
+    EXPECT_EQ(status(execute(request(Opcode::set, "key", "value"))),
+              Status::invalid_arguments);
+    EXPECT_EQ(status(execute(request(static_cast<Opcode>(0x42), "key"))),
+              Status::unknown_command);
+}
+
+TEST_F(BinaryCommandTest, QuietCommands) {
+    EXPECT_EQ(execute(request(Opcode::setq, "key", "value", set_extras(0, 0))),
+              "");
+    EXPECT_EQ(execute(request(Opcode::appendq, "key", "_suffix")), "");
+    EXPECT_EQ(execute(request(Opcode::getq, "missing")), "");
+    EXPECT_EQ(execute(request(Opcode::getkq, "key")).substr(28),
+              "keyvalue_suffix");
+    EXPECT_EQ(execute(request(Opcode::delq, "key")), "");
+    // Failures are still reported
+    EXPECT_EQ(status(execute(request(Opcode::delq, "key"))),
+              Status::key_not_found);
+}
+
+TEST_F(BinaryCommandTest, DetectedBySession) {
+    Session session{store};
+    ReplyQueue out;
+    auto input = request(Opcode::setq, "key", "value", set_extras(0, 0)) +
+                 request(Opcode::getq, "key") + request(Opcode::noop, {}) +
+                 request(Opcode::quit, {});
+
+    // Fed a byte at a time
+    std::string pending;
+    for (char c : input) {
+        pending.push_back(c);
+        pending.erase(0, session.process(pending, out));
+    }
+    EXPECT_TRUE(pending.empty());
+    EXPECT_TRUE(session.closed());
+
+    std::vector<std::string_view> bufs;
+    out.buffers(bufs, 1024);
+    std::string res;
+    for (auto buf : bufs) {
+        res.append(buf);
+    }
+    // The get's value, then the noop and the quit
+    ASSERT_EQ(res.size(), 3 * binary_protocol::HEADER_SIZE + 4 + 5);
+    EXPECT_EQ(res.substr(28, 5), "value");
+    EXPECT_EQ(static_cast<Opcode>(res[34]), Opcode::noop);
+    EXPECT_EQ(static_cast<Opcode>(res[58]), Opcode::quit);
+}
@@ -0,0 +1,20 @@
+#include <gtest/gtest.h>
+
+#include <string_view>
+
+#include "../undis/checksum.h"
+
+TEST(ChecksumTest, MatchesKnownValues) {
+    EXPECT_EQ(crc32c(""), 0u);
+    EXPECT_EQ(crc32c("123456789"), 0xe3069283u);
+    EXPECT_EQ(crc32c(std::string_view{"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
+                                      "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",
+                                      32}),
+              0x8a9136aau);
+}
+
+TEST(ChecksumTest, ChecksumsInPieces) {
+    std::string_view data{"The quick brown fox jumps over the lazy dog"};
+    auto crc = crc32c(data.substr(0, 11));
+    EXPECT_EQ(crc32c(data.substr(11), crc), crc32c(data));
+}
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 
+#include <exception>
+#include <new>
 #include <stdexcept>
 #include <string>
 
@@ -30,6 +32,92 @@ TEST_F(CommandTest, GetCommand) {
     EXPECT_EQ(c.execute(store), "VALUE exists 42 5\r\nvalue\r\nEND\r\n");
 }
 
+TEST_F(CommandTest, GetsManyKeys) {
+    // More keys than are stored inline
+    std::string line = "get";
+    std::string expected;
+    for (int i = 0; i < 40; ++i) {
+        auto key = "key" + std::to_string(i);
+        store.set(key, std::to_string(i), 0u, 0);
+        line.append("  ").append(key);
+        expected.append("VALUE " + key + " 0 " +
+                        std::to_string(std::to_string(i).size()) + "\r\n" +
+                        std::to_string(i) + "\r\n");
+    }
+    Command c{line};
+    EXPECT_EQ(c.execute(store), expected + "END\r\n");
+}
+
+TEST_F(CommandTest, CasCommands) {
+    auto version = std::to_string(store.get("exists")->cas);
+    Command c{"gets exists not_exists"};
+    EXPECT_EQ(c.execute(store),
+              "VALUE exists 42 5 " + version + "\r\nvalue\r\nEND\r\n");
+
+    c.set_command("cas exists 1 0 3 " + version);
+    EXPECT_EQ(c.status(), Command::data_required);
+    EXPECT_EQ(c.execute(store, "new"), "STORED\r\n");
+    EXPECT_EQ(store.get("exists")->str_val, "new");
+
+    c.set_command("cas exists 1 0 3 " + version);
+    EXPECT_EQ(c.execute(store, "old"), "EXISTS\r\n");
+    c.set_command("cas not_exists 1 0 3 1");
+    EXPECT_EQ(c.execute(store, "old"), "NOT_FOUND\r\n");
+
+    EXPECT_EQ(c.set_command("cas exists 1 0 3"), Command::invalid_command);
+}
+
+TEST_F(CommandTest, TouchCommands) {
+    Command c{"touch exists 100"};
+    EXPECT_EQ(c.execute(store), "TOUCHED\r\n");
+    EXPECT_NEAR(store.get("exists")->exp_time, CoarseClock::now() + 100, 1);
+    c.set_command("touch not_exists 100");
+    EXPECT_EQ(c.execute(store), "NOT_FOUND\r\n");
+
+    c.set_command("gat 0 exists not_exists");
+    EXPECT_EQ(c.execute(store), "VALUE exists 42 5\r\nvalue\r\nEND\r\n");
+    EXPECT_EQ(store.get("exists")->exp_time, StoreValue::NO_EXPIRY);
+    auto version = std::to_string(store.get("exists")->cas);
+    c.set_command("gats -1 exists");
+    EXPECT_EQ(c.execute(store),
+              "VALUE exists 42 5 " + version + "\r\nvalue\r\nEND\r\n");
+    EXPECT_FALSE(store.get("exists").has_value());
+
+    EXPECT_EQ(c.set_command("touch exists"), Command::invalid_command);
+    EXPECT_EQ(c.set_command("gat exists"), Command::invalid_command);
+    EXPECT_EQ(c.set_command("gat 0"), Command::invalid_command);
+}
+
+TEST_F(CommandTest, StatsCommand) {
+    Command c{"get exists not_exists"};
+    c.execute(store);
+    c.set_command("stats");
+    auto reply = c.execute(store).str();
+    EXPECT_NE(reply.find("STAT curr_items 1\r\n"), std::string::npos);
+    EXPECT_NE(reply.find("STAT get_hits "), std::string::npos);
+    EXPECT_TRUE(reply.ends_with("END\r\n"));
+
+    c.set_command("stats latency");
+    EXPECT_TRUE(c.execute(store).str().ends_with("END\r\n"));
+    c.set_command("stats items");
+    EXPECT_THROW(c.execute(store), std::invalid_argument);
+}
+
+TEST_F(CommandTest, ArithmeticCommands) {
+    store.set("counter", "5"s, 0u, 0);
+    Command c{"incr counter 10"};
+    EXPECT_EQ(c.execute(store), "15\r\n");
+    c.set_command("decr counter 20");
+    EXPECT_EQ(c.execute(store), "0\r\n");
+    c.set_command("incr not_exists 1");
+    EXPECT_EQ(c.execute(store), "NOT_FOUND\r\n");
+    c.set_command("incr exists 1");
+    EXPECT_THROW(c.execute(store), std::invalid_argument);
+
+    EXPECT_EQ(c.set_command("incr counter"), Command::invalid_command);
+    EXPECT_EQ(c.set_command("incr counter -1"), Command::invalid_command);
+}
+
 TEST_F(CommandTest, DeleteCommand) {
     Command c{"delete exists"};
     EXPECT_EQ(c.execute(store), "DELETED\r\n");
@@ -100,4 +188,26 @@ TEST_F(CommandTest, BadCommandErrors) {
     EXPECT_EQ(c.set_command("replace exists 0"), Command::invalid_command);
     EXPECT_EQ(c.set_command("append exists 0 0"), Command::invalid_command);
     EXPECT_EQ(c.set_command("prepend exists 0 0 -1"), Command::invalid_command);
+    EXPECT_EQ(c.set_command("set exists 0 0 5x"), Command::invalid_command);
+    EXPECT_EQ(c.set_command("set exists x 0 5"), Command::invalid_command);
+}
+
+TEST_F(CommandTest, RewriteLogCommand) {
+    Command c{"bgrewriteaof"};
+    EXPECT_EQ(c.status(), Command::valid_command);
+    EXPECT_EQ(c.execute(store), "SERVER_ERROR append-only log disabled\r\n");
+}
+
+TEST_F(CommandTest, SnapshotCommands) {
+    Command c{"bgsave"};
+    EXPECT_EQ(c.execute(store), "SERVER_ERROR snapshots disabled\r\n");
+    c.set_command("lastsave");
+    EXPECT_EQ(c.execute(store), "SERVER_ERROR snapshots disabled\r\n");
+}
+
+TEST(ErrorReplyTest, FailsOnlyTheCommand) {
+    EXPECT_EQ(error_reply(std::make_exception_ptr(std::bad_alloc{})),
+              "SERVER_ERROR out of memory\r\n");
+    EXPECT_EQ(error_reply(std::make_exception_ptr(std::runtime_error{"boom"})),
+              "SERVER_ERROR boom\r\n");
 }
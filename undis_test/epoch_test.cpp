@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+
+#include "../undis/epoch.h"
+
+namespace {
+void count(void *freed) noexcept { ++*static_cast<int *>(freed); }
+} // namespace
+
+TEST(EpochTest, FreesOnceReadersLeave) {
+    int freed = 0;
+    epoch::RetireList list;
+
+    std::atomic<bool> pinned = false;
+    std::atomic<bool> leave = false;
+    std::thread reader{[&] {
+        epoch::Guard guard;
+        {
+            // Nested guards keep the thread pinned
+            epoch::Guard inner;
+        }
+        pinned = true;
+        while (!leave) {
+            std::this_thread::yield();
+        }
+    }};
+    while (!pinned) {
+        std::this_thread::yield();
+    }
+
+    list.retire(&freed, count);
+    for (int i = 0; i < 10; ++i) {
+        list.collect();
+    }
+    EXPECT_EQ(freed, 0);
+    EXPECT_EQ(list.size(), 1);
+
+    leave = true;
+    reader.join();
+    for (int i = 0; i < 3; ++i) {
+        list.collect();
+    }
+    EXPECT_EQ(freed, 1);
+    EXPECT_EQ(list.size(), 0);
+
+    // Unpinned threads do not hold anything back
+    {
+        epoch::Guard guard;
+    }
+    list.retire(&freed, count);
+    for (int i = 0; i < 3; ++i) {
+        list.collect();
+    }
+    EXPECT_EQ(freed, 2);
+}
+
+TEST(EpochTest, FreesTheRestOnDestruction) {
+    int freed = 0;
+    {
+        epoch::Guard guard;
+        epoch::RetireList list;
+        list.retire(&freed, count);
+        list.retire(&freed, count);
+        list.collect();
+        EXPECT_EQ(freed, 0);
+    }
+    EXPECT_EQ(freed, 2);
+}
@@ -0,0 +1,216 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <deque>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../undis/epoch.h"
+#include "../undis/flatindex.h"
+
+using namespace std::literals;
+
+namespace {
+struct Identity {
+    std::string_view operator()(const std::string &s) const { return s; }
+};
+using StringIndex = FlatIndex<std::string, Identity>;
+
+// Sends every key to the same group, so that probes run long
+struct Collide {
+    std::size_t operator()(std::string_view) const { return 42; }
+};
+
+// Keeps the indexed strings alive
+template <typename Index> class Strings {
+  public:
+    explicit Strings(Index &index) : index_{index} {}
+
+    bool insert(std::string key) {
+        return index_.insert(strings_.emplace_back(std::move(key)));
+    }
+
+  private:
+    Index &index_;
+    std::deque<std::string> strings_;
+};
+} // namespace
+
+TEST(FlatIndexTest, InsertsAndFinds) {
+    StringIndex index;
+    Strings strings{index};
+    EXPECT_TRUE(index.empty());
+    EXPECT_EQ(index.find("a"), nullptr);
+    EXPECT_EQ(index.begin(), index.end());
+
+    for (int i = 0; i < 10'000; ++i) {
+        EXPECT_TRUE(strings.insert(std::to_string(i)));
+    }
+    EXPECT_EQ(index.size(), 10'000);
+    EXPECT_GE(index.capacity() * 7 / 8, index.size());
+
+    for (int i = 0; i < 10'000; ++i) {
+        // Looked up by string_view, without a temporary string
+        auto key = std::to_string(i);
+        auto *found = index.find(std::string_view{key});
+        ASSERT_NE(found, nullptr);
+        EXPECT_EQ(*found, key);
+    }
+    EXPECT_FALSE(index.contains("10000"sv));
+    EXPECT_FALSE(index.contains(""sv));
+
+    EXPECT_FALSE(strings.insert("5"));
+    EXPECT_EQ(index.size(), 10'000);
+
+    std::string five = "5";
+    auto *old = index.replace(five);
+    ASSERT_NE(old, nullptr);
+    EXPECT_EQ(*old, "5");
+    EXPECT_EQ(index.find("5"), &five);
+    std::string absent = "absent";
+    EXPECT_EQ(index.replace(absent), nullptr);
+    EXPECT_FALSE(index.contains("absent"));
+}
+
+TEST(FlatIndexTest, Erases) {
+    StringIndex index;
+    Strings strings{index};
+    for (int i = 0; i < 1000; ++i) {
+        strings.insert(std::to_string(i));
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        auto *erased = index.erase(std::to_string(i));
+        ASSERT_NE(erased, nullptr);
+        EXPECT_EQ(*erased, std::to_string(i));
+    }
+    EXPECT_EQ(index.erase("0"), nullptr);
+    EXPECT_EQ(index.size(), 500);
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(index.contains(std::to_string(i)), i % 2 == 1);
+    }
+
+    // Erased slots are reused rather than growing the table
+    auto capacity = index.capacity();
+    std::vector<std::string> churn;
+    for (int i = 0; i < 500; ++i) {
+        churn.push_back("x" + std::to_string(i));
+    }
+    for (int round = 0; round < 100; ++round) {
+        for (auto &key : churn) {
+            index.insert(key);
+        }
+        for (auto &key : churn) {
+            index.erase(key);
+        }
+    }
+    EXPECT_EQ(index.capacity(), capacity);
+    EXPECT_EQ(index.size(), 500);
+
+    index.clear();
+    EXPECT_TRUE(index.empty());
+    EXPECT_FALSE(index.contains("1"));
+}
+
+TEST(FlatIndexTest, ProbesPastCollisions) {
+    FlatIndex<std::string, Identity, Collide> index;
+    Strings strings{index};
+    for (int i = 0; i < 100; ++i) {
+        strings.insert(std::to_string(i));
+    }
+    // Tombstones keep later keys on the probe sequence reachable
+    for (int i = 0; i < 50; ++i) {
+        index.erase(std::to_string(i));
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(index.contains(std::to_string(i)), i >= 50);
+    }
+    for (int i = 0; i < 50; ++i) {
+        strings.insert(std::to_string(i));
+    }
+    EXPECT_EQ(index.size(), 100);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(index.contains(std::to_string(i)));
+    }
+}
+
+TEST(FlatIndexTest, IteratesAndSamples) {
+    StringIndex index;
+    Strings strings{index};
+    std::set<std::string> keys;
+    for (int i = 0; i < 300; ++i) {
+        keys.insert(std::to_string(i));
+        strings.insert(std::to_string(i));
+    }
+    std::set<std::string> seen;
+    for (auto *s : index) {
+        seen.insert(*s);
+    }
+    EXPECT_EQ(seen, keys);
+
+    for (std::size_t n = 0; n < 1000; ++n) {
+        auto *s = index.sample(n * 7919);
+        ASSERT_NE(s, nullptr);
+        EXPECT_TRUE(keys.contains(*s));
+    }
+
+    index.reserve(10'000);
+    auto capacity = index.capacity();
+    for (int i = 300; i < 10'000; ++i) {
+        strings.insert(std::to_string(i));
+    }
+    EXPECT_EQ(index.capacity(), capacity);
+    EXPECT_TRUE(index.contains("9999"));
+}
+
+TEST(FlatIndexTest, ReadsWhileWriting) {
+    StringIndex index;
+    Strings strings{index};
+    constexpr int STABLE = 1000;
+    for (int i = 0; i < STABLE; ++i) {
+        strings.insert("stable:" + std::to_string(i));
+    }
+
+    // Readers always find the keys that stay, while the writer grows the
+    // table, leaves tombstones and swaps elements
+    std::atomic<bool> done = false;
+    std::atomic<int> missed = 0;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&, t] {
+            for (int i = t; !done.load(std::memory_order_relaxed);
+                 i = (i + 7) % STABLE) {
+                epoch::Guard guard;
+                auto key = "stable:" + std::to_string(i);
+                auto *found = index.find(key);
+                if (found == nullptr || *found != key) {
+                    ++missed;
+                }
+                index.find("churn:" + std::to_string(i));
+            }
+        });
+    }
+
+    std::deque<std::string> replacements;
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 2000; ++i) {
+            strings.insert("churn:" + std::to_string(round * 2000 + i));
+        }
+        for (int i = 0; i < 2000; i += 2) {
+            index.erase("churn:" + std::to_string(round * 2000 + i));
+        }
+        // The old strings stay alive, as their owner would retire them
+        auto &s = replacements.emplace_back(
+            "stable:" + std::to_string(round * 37 % STABLE));
+        index.replace(s);
+        index.collect();
+    }
+    done = true;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(missed, 0);
+    EXPECT_EQ(index.size(), STABLE + 20 * 1000);
+}
@@ -1,8 +1,17 @@
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "utils.h"
 
@@ -10,6 +19,7 @@
 #include "../undis/serializer.h"
 
 using namespace std::chrono_literals;
+using namespace std::string_literals;
 
 TEST(KVStoreTest, SetsAndGets) {
     KVStore db{};
@@ -37,7 +47,7 @@ TEST(KVStoreTest, Adds) {
     EXPECT_EQ(db.size(), m.size());
 
     for (const auto &[k, v] : m) {
-        EXPECT_FALSE(db.add(k, v.str_val + "new", v.flags, 0));
+        EXPECT_FALSE(db.add(k, std::string{v.str_val} + "new", v.flags, 0));
     }
 
     for (const auto &[k, v] : m) {
@@ -61,13 +71,14 @@ TEST(KVStoreTest, Replaces) {
     }
 
     for (const auto &[k, v] : m) {
-        EXPECT_TRUE(db.replace(k, v.str_val + "new", v.flags + 1, 0));
+        EXPECT_TRUE(
+            db.replace(k, std::string{v.str_val} + "new", v.flags + 1, 0));
     }
 
     for (const auto &[k, v] : m) {
         auto db_val = db.get(k);
         EXPECT_TRUE(db_val.has_value());
-        EXPECT_EQ(db_val->str_val, v.str_val + "new");
+        EXPECT_EQ(db_val->str_val, std::string{v.str_val} + "new");
         EXPECT_EQ(db_val->flags, v.flags + 1);
     }
 }
@@ -87,6 +98,121 @@ TEST(KVStoreTest, Deletes) {
     EXPECT_EQ(db.size(), 0);
 }
 
+TEST(KVStoreTest, BatchesOperations) {
+    KVStore db{StoreOptions{.shards = 4, .memory_limit = 4 << 20}};
+
+    // The last write to a repeated key wins
+    std::vector<std::pair<std::string, StoreValue>> items;
+    for (int i = 0; i < 20; ++i) {
+        items.emplace_back("key" + std::to_string(i),
+                           StoreValue{std::to_string(i), 0u, 0});
+    }
+    items.emplace_back("key0", StoreValue{"again"s, 1u, 0});
+    items.emplace_back("huge", StoreValue{std::string(2 << 20, 'x'), 0u, 0});
+    auto stored = db.multi_set(items);
+    ASSERT_EQ(stored.size(), items.size());
+    for (int i = 0; i < 21; ++i) {
+        EXPECT_TRUE(stored[i].done);
+        EXPECT_FALSE(stored[i].error);
+    }
+    EXPECT_FALSE(stored[21].done);
+    EXPECT_THROW(std::rethrow_exception(stored[21].error), std::length_error);
+
+    std::vector<std::string_view> keys{"key1", "missing", "key0", "key19"};
+    auto values = db.multi_get(keys);
+    ASSERT_EQ(values.size(), keys.size());
+    EXPECT_EQ(values[0]->str_val, "1");
+    EXPECT_FALSE(values[1].has_value());
+    EXPECT_EQ(values[2]->str_val, "again");
+    EXPECT_EQ(values[2]->flags, 1u);
+    EXPECT_EQ(values[3]->str_val, "19");
+
+    auto deleted = db.multi_delete(keys);
+    EXPECT_TRUE(deleted[0].done);
+    EXPECT_FALSE(deleted[1].done);
+    EXPECT_TRUE(deleted[2].done);
+    EXPECT_TRUE(deleted[3].done);
+    EXPECT_EQ(db.size(), 17);
+}
+
+TEST(KVStoreTest, ComparesAndSwaps) {
+    KVStore db{};
+    using enum KVStore::CasResult;
+
+    EXPECT_EQ(db.cas("key", 1, "value"s, 0u, 0), not_found);
+    db.set("key", "value"s, 0u, 0);
+    auto version = db.get("key")->cas;
+    EXPECT_NE(version, 0);
+    EXPECT_EQ(db.cas("key", version + 1, "other"s, 0u, 0), exists);
+    EXPECT_EQ(db.cas("key", version, "other"s, 1u, 0), stored);
+    EXPECT_EQ(db.get("key")->str_val, "other");
+    EXPECT_EQ(db.cas("key", version, "third"s, 0u, 0), exists);
+
+    // Every write changes the version
+    version = db.get("key")->cas;
+    db.append("key", "_suffix");
+    EXPECT_NE(db.get("key")->cas, version);
+
+    // Writers that retry on conflict lose no updates
+    db.set("counter", "0"s, 0u, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&db] {
+            for (int i = 0; i < 100; ++i) {
+                while (true) {
+                    auto val = db.get("counter");
+                    auto next = std::to_string(
+                        std::stoi(std::string{val->str_val.view()}) + 1);
+                    if (db.cas("counter", val->cas, next, 0u, 0) == stored) {
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(db.get("counter")->str_val, "400");
+}
+
+TEST(KVStoreTest, IncrementsAndDecrements) {
+    KVStore db{};
+
+    EXPECT_EQ(db.incr("counter", 1), std::nullopt);
+    db.set("counter", "10"s, 3u, 0);
+    EXPECT_EQ(db.incr("counter", 5), 15u);
+    EXPECT_EQ(db.decr("counter", 3), 12u);
+    EXPECT_EQ(db.get("counter")->str_val, "12");
+    EXPECT_EQ(db.get("counter")->flags, 3u);
+
+    // incr wraps around, while decr stops at zero
+    db.set("counter", "18446744073709551615"s, 0u, 0);
+    EXPECT_EQ(db.incr("counter", 2), 1u);
+    EXPECT_EQ(db.decr("counter", 5), 0u);
+    EXPECT_EQ(db.get("counter")->str_val, "0");
+
+    // Other writes are seen by the next update
+    db.incr("counter", 7);
+    db.set("counter", "100"s, 0u, 0);
+    EXPECT_EQ(db.incr("counter", 1), 101u);
+    db.append("counter", "0");
+    EXPECT_EQ(db.decr("counter", 10), 1000u);
+
+    // Readers keep the number they were given
+    auto held = db.get("counter");
+    db.incr("counter", 1);
+    EXPECT_EQ(held->str_val, "1000");
+    EXPECT_EQ(db.get("counter")->str_val, "1001");
+
+    db.set("text", "value"s, 0u, 0);
+    EXPECT_THROW(db.incr("text", 1), std::invalid_argument);
+    db.set("text", "-1"s, 0u, 0);
+    EXPECT_THROW(db.decr("text", 1), std::invalid_argument);
+    db.set("text", ""s, 0u, 0);
+    EXPECT_THROW(db.incr("text", 1), std::invalid_argument);
+}
+
 TEST(KVStoreTest, Expires) {
     KVStore db{};
 
@@ -111,6 +237,297 @@ TEST(KVStoreTest, Expires) {
     }
 }
 
+TEST(KVStoreTest, Touches) {
+    KVStore db{};
+
+    EXPECT_FALSE(db.touch("missing", 0));
+    EXPECT_EQ(db.get_and_touch("missing", 0), std::nullopt);
+
+    db.set("key", "value"s, 3u, 1);
+    auto before = db.get("key");
+    EXPECT_TRUE(db.touch("key", 0));
+    auto after = db.get_and_touch("key", 0);
+    ASSERT_TRUE(after.has_value());
+    EXPECT_EQ(after->exp_time, StoreValue::NO_EXPIRY);
+    EXPECT_EQ(after->flags, 3u);
+    // Neither the value nor its version change
+    EXPECT_EQ(after->str_val.view().data(), before->str_val.view().data());
+    EXPECT_EQ(after->cas, before->cas);
+
+    db.set("short", "value"s, 0u, 0);
+    EXPECT_TRUE(db.touch("short", 1));
+    std::this_thread::sleep_for(2s);
+    EXPECT_TRUE(db.get("key").has_value());
+    EXPECT_FALSE(db.get("short").has_value());
+    EXPECT_FALSE(db.touch("short", 0));
+
+    EXPECT_EQ(db.get_and_touch("key", -1)->str_val, "value");
+    EXPECT_FALSE(db.get("key").has_value());
+}
+
+TEST(KVStoreTest, ReclaimsExpired) {
+    KVStore db{};
+
+    const auto m = map_factory(20);
+    for (const auto &[k, v] : m) {
+        db.set(k, v.str_val, v.flags, 1);
+    }
+    db.set("forever", "value", 0u, 0);
+    EXPECT_EQ(db.size(), m.size() + 1);
+
+    std::this_thread::sleep_for(2500ms);
+
+    // Removed without being looked up
+    EXPECT_EQ(db.size(), 1);
+    EXPECT_EQ(db.reclaimed(), m.size());
+    EXPECT_TRUE(db.get("forever").has_value());
+}
+
+TEST(KVStoreTest, IgnoresExpired) {
+    KVStore db{};
+    db.set("key", "value", 0u, -1);
+
+    EXPECT_FALSE(db.replace("key", "new", 0u, 0));
+    EXPECT_FALSE(db.append("key", "_suffix"));
+    EXPECT_FALSE(db.prepend("key", "prefix_"));
+    EXPECT_TRUE(db.add("key", "new", 0u, 0));
+    EXPECT_EQ(db.get("key")->str_val, "new");
+
+    db.set("key", "value", 0u, -1);
+    EXPECT_FALSE(db.del("key"));
+    EXPECT_EQ(db.size(), 0);
+}
+
+TEST(KVStoreTest, ShardCounts) {
+    const auto m = map_factory(50);
+    for (unsigned shards : {0u, 1u, 7u, 64u}) {
+        KVStore db{shards};
+        EXPECT_EQ(db.shard_count(), std::max(shards, 1u));
+
+        for (const auto &[k, v] : m) {
+            db.set(k, v.str_val, v.flags, 0);
+        }
+        EXPECT_EQ(db.size(), m.size());
+
+        for (const auto &[k, v] : m) {
+            auto db_val = db.get(k);
+            EXPECT_TRUE(db_val.has_value());
+            EXPECT_EQ(db_val->str_val, v.str_val);
+        }
+    }
+}
+
+TEST(KVStoreTest, ConcurrentWrites) {
+    KVStore db{};
+
+    constexpr int thread_count = 8, per_thread = 500;
+    std::vector<std::jthread> threads;
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&db, t]() {
+            for (int i = 0; i < per_thread; ++i) {
+                auto key = std::to_string(t) + "_" + std::to_string(i);
+                db.set(key, "value", 0u, 0);
+                db.append(key, "_suffix");
+                db.get(key);
+            }
+        });
+    }
+    threads.clear();
+
+    EXPECT_EQ(db.size(), thread_count * per_thread);
+    EXPECT_EQ(db.get("3_42")->str_val, "value_suffix");
+}
+
+TEST(KVStoreTest, SharesValues) {
+    KVStore db{};
+    db.set("key", "value", 0u, 0);
+
+    auto first = db.get("key"), second = db.get("key");
+    EXPECT_EQ(first->str_val.data(), second->str_val.data());
+
+    // Readers keep their buffer when the stored value is modified
+    db.append("key", "_suffix");
+    db.prepend("key", "prefix_");
+    EXPECT_EQ(first->str_val, "value");
+    EXPECT_EQ(db.get("key")->str_val, "prefix_value_suffix");
+
+    first.reset();
+    second.reset();
+    db.append("key", "!");
+    EXPECT_EQ(db.get("key")->str_val, "prefix_value_suffix!");
+}
+
+TEST(KVStoreTest, ReadsWhileWriting) {
+    KVStore db{2};
+    constexpr int keys = 64;
+    auto key = [](int i) { return "key" + std::to_string(i); };
+    // Values are one letter repeated, which is also their flags, so a read
+    // mixing two versions shows
+    auto write = [&db, &key](int i, int round) {
+        char c = static_cast<char>('a' + (i + round) % 26);
+        db.set(key(i), std::string(1 + (round * 7 + i) % 300, c),
+               static_cast<std::uint32_t>(c), 0);
+    };
+    for (int i = 0; i < keys; ++i) {
+        write(i, 0);
+    }
+
+    std::atomic<bool> done = false;
+    std::atomic<int> torn = 0;
+    std::vector<std::jthread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            std::vector<std::uint64_t> seen(keys);
+            for (int i = t; !done.load(std::memory_order_relaxed);
+                 i = (i + 1) % keys) {
+                auto val = db.get(key(i));
+                if (!val.has_value()) {
+                    continue;
+                }
+                auto str = std::string_view{val->str_val};
+                // Versions only go forward
+                if (str.empty() || val->flags != std::uint32_t(str[0]) ||
+                    str.find_first_not_of(str[0]) != str.npos ||
+                    val->cas < seen[i]) {
+                    ++torn;
+                }
+                seen[i] = val->cas;
+            }
+        });
+    }
+
+    // Every kind of write replaces items under the readers, and the slab
+    // keeps moving them out of sparse pages
+    for (int round = 1; round < 300; ++round) {
+        for (int i = 0; i < keys; ++i) {
+            switch ((round + i) % 4) {
+            case 0:
+                write(i, round);
+                break;
+            case 1: {
+                auto val = db.get(key(i));
+                if (val.has_value() && !val->str_val.empty()) {
+                    db.append(key(i), std::string(3, val->str_val.view()[0]));
+                }
+                break;
+            }
+            case 2:
+                db.touch(key(i), 1000);
+                break;
+            case 3:
+                db.del(key(i));
+                write(i, round);
+                break;
+            }
+        }
+    }
+    done = true;
+    readers.clear();
+    EXPECT_EQ(torn, 0);
+    EXPECT_EQ(db.size(), keys);
+}
+
+TEST(KVStoreTest, MovesItemsOutOfSparsePages) {
+    KVStore db{1};
+    auto key = [](int i) { return std::to_string(100'000 + i); };
+    auto pages = [&db] {
+        std::size_t total = 0;
+        for (const auto &c : db.slab_stats().classes) {
+            total += c.pages;
+        }
+        return total;
+    };
+
+    // Equally sized items filling a few pages, most of them then deleted
+    constexpr int count = 40'000;
+    for (int i = 0; i < count; ++i) {
+        db.set(key(i), "value", 0u, 0);
+    }
+    auto full = pages();
+    ASSERT_GE(full, 3);
+    for (int i = 0; i < count; ++i) {
+        if (i % 10 != 0) {
+            db.del(key(i));
+        }
+    }
+
+    // The expiry thread rebalances every interval, a page at a time
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (pages() > 1 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(10ms);
+    }
+    EXPECT_EQ(pages(), 1);
+    EXPECT_GT(db.slab_stats().moved, 0);
+    for (int i = 0; i < count; i += 10) {
+        EXPECT_EQ(db.get(key(i))->str_val, "value");
+    }
+}
+
+TEST(KVStoreTest, EvictsLeastRecentlyUsed) {
+    // Equally sized items
+    auto key = [](int i) { return std::to_string(1000 + i); };
+    const std::string value(100, 'x');
+    KVStore probe{1u};
+    probe.set(key(0), value, 0u, 0);
+    const auto item = probe.memory_usage();
+
+    KVStore db{StoreOptions{.shards = 1, .memory_limit = 100 * item}};
+    for (int i = 0; i < 100; ++i) {
+        db.set(key(i), value, 0u, 0);
+    }
+    EXPECT_EQ(db.size(), 100);
+    EXPECT_EQ(db.evictions(), 0);
+
+    std::this_thread::sleep_for(30ms);
+    for (int i = 0; i < 10; ++i) {
+        db.get(key(i));
+    }
+    std::this_thread::sleep_for(30ms);
+    for (int i = 100; i < 130; ++i) {
+        db.set(key(i), value, 0u, 0);
+    }
+
+    EXPECT_EQ(db.size(), 100);
+    EXPECT_EQ(db.evictions(), 30);
+    EXPECT_LE(db.memory_usage(), db.memory_limit());
+
+    int survivors = 0;
+    for (int i = 0; i < 10; ++i) {
+        survivors += db.get(key(i)).has_value();
+    }
+    EXPECT_GE(survivors, 8);
+
+    for (int i = 100; i < 130; ++i) {
+        EXPECT_TRUE(db.del(key(i)));
+    }
+    EXPECT_EQ(db.memory_usage(), 70 * item);
+}
+
+TEST(KVStoreTest, FailsWhenFull) {
+    KVStore db{StoreOptions{.shards = 1, .memory_limit = 1024, .evict = false}};
+
+    EXPECT_THROW(db.set("key", std::string(2048, 'x'), 0u, 0),
+                 std::length_error);
+    EXPECT_EQ(db.size(), 0);
+    EXPECT_EQ(db.memory_usage(), 0);
+
+    int stored = 0;
+    try {
+        for (; stored < 1024; ++stored) {
+            db.add("key_" + std::to_string(stored), "value", 0u, 0);
+        }
+    } catch (const std::length_error &) {
+    }
+    EXPECT_GT(stored, 0);
+    EXPECT_EQ(db.size(), stored);
+    EXPECT_EQ(db.evictions(), 0);
+
+    // Existing items are left untouched by failed writes
+    EXPECT_THROW(db.append("key_0", std::string(1024, 'x')),
+                 std::length_error);
+    EXPECT_EQ(db.get("key_0")->str_val, "value");
+}
+
 TEST(KVStoreTest, Loads) {
     const std::filesystem::path p{"KVStoreTest_Loads.db"};
     Serializer ser{p};
@@ -150,3 +567,39 @@ TEST(KVStoreTest, Dumps) {
 
     EXPECT_TRUE(std::filesystem::remove(p));
 }
+
+TEST(KVStoreTest, LoadsLazily) {
+    const std::filesystem::path p{"KVStoreTest_LoadsLazily.db"};
+    Serializer ser{p};
+
+    std::unordered_map<std::string, StoreValue> m;
+    for (int i = 0; i < 50000; ++i) {
+        m.emplace("key_" + std::to_string(i), StoreValue{"value", 0u, 0});
+    }
+    ser << m;
+
+    std::optional<KVStore> db{std::in_place, p,
+                              StoreOptions{.lazy_load = true}};
+    // Writes made while loading win over the snapshot
+    db->set("key_1", "new", 0u, 0);
+    db->set("key_2", "new", 0u, 0);
+    EXPECT_TRUE(db->del("key_2"));
+    try {
+        EXPECT_EQ(db->get("key_3")->str_val, "value");
+    } catch (const LoadingError &) {
+        EXPECT_TRUE(db->loading());
+    }
+
+    while (db->loading()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(db->size(), m.size() - 1);
+    EXPECT_EQ(db->get("key_1")->str_val, "new");
+    EXPECT_FALSE(db->get("key_2").has_value());
+    EXPECT_EQ(db->get("key_3")->str_val, "value");
+    EXPECT_FALSE(db->get("missing").has_value());
+
+    db.reset();
+
+    EXPECT_TRUE(std::filesystem::remove(p));
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../undis/reply.h"
+#include "../undis/storevalue.h"
+
+TEST(ReplyTest, MergesText) {
+    Reply r{"VALUE "};
+    r.append("key").append(" 0 5\r\n");
+    EXPECT_EQ(r.buffers().size(), 1);
+    EXPECT_EQ(r, "VALUE key 0 5\r\n");
+}
+
+TEST(ReplyTest, ReferencesValues) {
+    SharedString value{std::string(1000, 'x')};
+
+    Reply r{"VALUE key 0 1000\r\n"};
+    r.append(value).append("\r\nEND\r\n");
+
+    auto bufs = r.buffers();
+    ASSERT_EQ(bufs.size(), 3);
+    EXPECT_EQ(bufs[1].data(), value.data());
+    EXPECT_EQ(r.size(), 1000 + 18 + 7);
+}
+
+TEST(ReplyTest, QueueConsumesPartially) {
+    ReplyQueue q;
+    q.push(Reply{"first\r\n"});
+    Reply second{"second "};
+    second.append(SharedString{std::string{"value"}}).append("\r\n");
+    q.push(std::move(second));
+    EXPECT_EQ(q.size(), 21);
+
+    q.consume(3);
+    std::vector<std::string_view> bufs;
+    q.buffers(bufs, 16);
+    ASSERT_EQ(bufs.size(), 4);
+    EXPECT_EQ(bufs[0], "st\r\n");
+
+    q.consume(8);
+    bufs.clear();
+    q.buffers(bufs, 2);
+    ASSERT_EQ(bufs.size(), 2);
+    EXPECT_EQ(bufs[0], "nd ");
+    EXPECT_EQ(bufs[1], "value");
+
+    q.consume(10);
+    EXPECT_TRUE(q.empty());
+    EXPECT_EQ(q.size(), 0);
+}
@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+
+#include "../undis/scan.h"
+
+using namespace std::literals;
+
+TEST(ScanTest, FindsByte) {
+    // Long enough to cover the vector loops and the byte loop
+    std::string s(100, 'a');
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        s[i] = ' ';
+        EXPECT_EQ(scan::find(s, ' '), i);
+        EXPECT_EQ(scan::find(s, ' ', i), i);
+        EXPECT_EQ(scan::find(s, ' ', i + 1), std::string_view::npos);
+        s[i] = 'a';
+    }
+    EXPECT_EQ(scan::find(""sv, ' '), std::string_view::npos);
+}
+
+TEST(ScanTest, FindsCrlf) {
+    std::string s(100, 'a');
+    for (std::size_t i = 0; i + 1 < s.size(); ++i) {
+        s[i] = '\r';
+        s[i + 1] = '\n';
+        EXPECT_EQ(scan::find_crlf(s), i);
+        EXPECT_EQ(scan::find_crlf(s, i), i);
+        EXPECT_EQ(scan::find_crlf(s, i + 1), std::string_view::npos);
+        s[i] = 'a';
+        s[i + 1] = 'a';
+    }
+
+    // Lone halves do not match
+    EXPECT_EQ(scan::find_crlf("\n\r\r\r\n"sv), 3);
+    EXPECT_EQ(scan::find_crlf(std::string(40, '\r') + "x\n"),
+              std::string_view::npos);
+    EXPECT_EQ(scan::find_crlf("\r"sv), std::string_view::npos);
+}
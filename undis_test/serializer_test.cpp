@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 
@@ -9,6 +13,23 @@
 #include "../undis/serializer.h"
 #include "../undis/storevalue.h"
 
+namespace {
+// Lets the serializer load from several threads
+struct ConcurrentMap {
+    static constexpr bool concurrent = true;
+
+    void clear() { map.clear(); }
+    void reserve(std::size_t n) { map.reserve(n); }
+    void emplace(std::string &&key, StoreValue &&val) {
+        std::scoped_lock lk{mtx};
+        map.emplace(std::move(key), std::move(val));
+    }
+
+    std::unordered_map<std::string, StoreValue> map;
+    std::mutex mtx;
+};
+} // namespace
+
 TEST(SerializerTest, CreatesFile) {
     const std::filesystem::path p{"SerializerTest_CreatesFile.db"};
     Serializer ser{p};
@@ -44,3 +65,89 @@ TEST(SerializerTest, IgnoresExpired) {
 
     EXPECT_TRUE(std::filesystem::remove(p));
 }
+
+TEST(SerializerTest, KeepsFileOnFailure) {
+    const std::filesystem::path p{"SerializerTest_KeepsFileOnFailure.db"};
+    Serializer ser{p};
+
+    auto m1 = map_factory(10);
+    decltype(m1) m2;
+    ser << m1;
+    EXPECT_TRUE(ser.good());
+
+    // The temporary file cannot be created where a directory is in the way
+    auto tmp = p;
+    tmp += ".tmp";
+    std::filesystem::create_directories(tmp / "dir");
+    ser << map_factory(5);
+    EXPECT_FALSE(ser.good());
+    ser >> m2;
+    EXPECT_EQ(m1, m2);
+
+    std::filesystem::remove_all(tmp);
+    EXPECT_TRUE(std::filesystem::remove(p));
+}
+
+TEST(SerializerTest, LoadsBlocksInParallel) {
+    const std::filesystem::path p{"SerializerTest_LoadsBlocksInParallel.db"};
+    Serializer ser{p};
+
+    // Large enough to span several blocks
+    auto m = map_factory(1500);
+    ConcurrentMap loaded;
+    ser << m;
+    ser >> loaded;
+    EXPECT_EQ(m, loaded.map);
+
+    EXPECT_TRUE(std::filesystem::remove(p));
+}
+
+TEST(SerializerTest, LoadsVersion1) {
+    const std::filesystem::path p{"SerializerTest_LoadsVersion1.db"};
+    {
+        std::ofstream ofs{p, std::ios::binary};
+        auto put = [&ofs](std::uint32_t n) {
+            ofs.write(reinterpret_cast<const char *>(&n), sizeof n);
+        };
+        ofs.write("UNDS", 4);
+        put(2);
+        for (std::string_view kv : {"key", "other"}) {
+            put(StoreValue::NO_EXPIRY);
+            put(kv.size());
+            ofs.write(kv.data(), kv.size());
+            put(kv.size());
+            ofs.write(kv.data(), kv.size());
+            put(42);
+        }
+    }
+
+    Serializer ser{p};
+    std::unordered_map<std::string, StoreValue> m;
+    ser >> m;
+    ASSERT_EQ(m.size(), 2);
+    EXPECT_EQ(m.at("key").str_val, "key");
+    EXPECT_EQ(m.at("other").flags, 42);
+
+    EXPECT_TRUE(std::filesystem::remove(p));
+}
+
+TEST(SerializerTest, DetectsCorruption) {
+    const std::filesystem::path p{"SerializerTest_DetectsCorruption.db"};
+    Serializer ser{p};
+    ser << map_factory(100);
+
+    std::unordered_map<std::string, StoreValue> m;
+    {
+        std::fstream fs{p, std::ios::in | std::ios::out | std::ios::binary};
+        fs.seekp(40);
+        fs.put('\xff');
+    }
+    EXPECT_THROW(ser >> m, std::runtime_error);
+
+    // Compressed sizes vary with the random data
+    ser << map_factory(100);
+    std::filesystem::resize_file(p, std::filesystem::file_size(p) - 1);
+    EXPECT_THROW(ser >> m, std::runtime_error);
+
+    EXPECT_TRUE(std::filesystem::remove(p));
+}
@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../undis/kvstore.h"
+#include "../undis/reply.h"
+#include "../undis/session.h"
+#include "../undis/stats.h"
+
+using namespace std::literals;
+
+class SessionTest : public ::testing::Test {
+  protected:
+    // Feeds `input` in chunks of `chunk` bytes, returning everything queued
+    std::string feed(std::string_view input, std::size_t chunk) {
+        std::string pending;
+        for (std::size_t i = 0; i < input.size(); i += chunk) {
+            pending.append(input.substr(i, chunk));
+            pending.erase(0, session.process(pending, out));
+        }
+        EXPECT_TRUE(pending.empty());
+        return drain();
+    }
+
+    std::string drain() {
+        std::vector<std::string_view> bufs;
+        out.buffers(bufs, 1024);
+        std::string s;
+        for (auto buf : bufs) {
+            s.append(buf);
+        }
+        out.consume(s.size());
+        return s;
+    }
+
+    KVStore store;
+    Session session{store};
+    ReplyQueue out;
+};
+
+TEST_F(SessionTest, WaitsForFirstRequest) {
+    // Nothing is sent until the protocol is known
+    EXPECT_EQ(session.process(""sv, out), 0);
+    EXPECT_TRUE(out.empty());
+    EXPECT_EQ(feed("get k\r\n"sv, 2), "END\r\nundis > ");
+}
+
+TEST_F(SessionTest, ProcessesPipelinedRequests) {
+    constexpr auto input = "set k 1 0 5\r\nvalue\r\nget k\r\ndelete k\r\n"sv;
+    constexpr auto expected = "STORED\r\nundis > "
+                              "VALUE k 1 5\r\nvalue\r\nEND\r\nundis > "
+                              "DELETED\r\nundis > "sv;
+    EXPECT_EQ(feed(input, input.size()), expected);
+    EXPECT_EQ(feed(input, 1), expected);
+    EXPECT_EQ(feed(input, 7), expected);
+}
+
+TEST_F(SessionTest, BatchesWrites) {
+    // Batched sets and deletes still reply, and take effect, in order
+    constexpr auto input = "set a 0 0 1\r\n1\r\nset b 0 0 1\r\n2\r\n"
+                           "delete a\r\ndelete c\r\nset a 0 0 1\r\n3\r\n"
+                           "get a b\r\nset b 0 0 1\r\nlong\r\n"
+                           "delete b\r\nquit\r\n"sv;
+    constexpr auto expected = "STORED\r\nundis > STORED\r\nundis > "
+                              "DELETED\r\nundis > NOT_FOUND\r\nundis > "
+                              "STORED\r\nundis > "
+                              "VALUE a 0 1\r\n3\r\nVALUE b 0 1\r\n2\r\n"
+                              "END\r\nundis > "
+                              "CLIENT_ERROR bad data chunk\r\nERROR\r\n"
+                              "undis > DELETED\r\nundis > "sv;
+    EXPECT_EQ(feed(input, input.size()), expected);
+    EXPECT_TRUE(session.closed());
+    EXPECT_EQ(store.size(), 1);
+}
+
+TEST_F(SessionTest, RecordsLatency) {
+    using enum Stats::Op;
+    auto before = Stats::collect();
+    feed("set a 0 0 1\r\n1\r\ndelete a\r\n get a\r\nbogus\r\n"
+         "incr a 1\r\n"sv,
+         4);
+    auto after = Stats::collect();
+    for (auto op : {set, del, get, incr}) {
+        EXPECT_EQ(after[op].count() - before[op].count(), 1);
+    }
+    EXPECT_EQ(after[Stats::Counter::get_misses] -
+                  before[Stats::Counter::get_misses],
+              1);
+}
+
+TEST_F(SessionTest, ReportsErrors) {
+    EXPECT_EQ(feed("bogus\r\nset k 0 0 2\r\nlong\r\n"sv, 3),
+              "ERROR\r\nundis > "
+              "CLIENT_ERROR bad data chunk\r\nERROR\r\nundis > ");
+    EXPECT_FALSE(store.get("k").has_value());
+}
+
+TEST_F(SessionTest, Quits) {
+    EXPECT_EQ(session.process("quit\r\nget k\r\n"sv, out), 6);
+    EXPECT_TRUE(session.closed());
+    EXPECT_TRUE(out.empty());
+}
+
+TEST_F(SessionTest, OmitsPrompt) {
+    Session quiet{store, false};
+    constexpr auto input = "set k 1 0 5\r\nvalue\r\nget k\r\n"sv;
+    EXPECT_EQ(quiet.process(input, out), input.size());
+    EXPECT_EQ(drain(), "STORED\r\nVALUE k 1 5\r\nvalue\r\nEND\r\n");
+}
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "../undis/slab.h"
+
+TEST(SlabAllocatorTest, SizesChunksByClass) {
+    auto slab = SlabAllocator::create();
+    for (std::size_t size : {1, 64, 65, 100, 1000, 100'000}) {
+        auto chunk = slab->allocate(size);
+        EXPECT_GE(chunk.size, size);
+        EXPECT_LE(chunk.size, std::max(size * 5 / 4 + 8,
+                                       SlabAllocator::MIN_CHUNK));
+        std::memset(chunk.ptr, 'x', chunk.size);
+        SlabAllocator::deallocate(chunk.ptr, chunk.size);
+    }
+
+    // Served by operator new
+    auto large = slab->allocate(SlabAllocator::MAX_CHUNK + 1);
+    EXPECT_EQ(large.size, SlabAllocator::MAX_CHUNK + 1);
+    SlabAllocator::deallocate(large.ptr, large.size);
+
+    auto stats = slab->stats();
+    ASSERT_EQ(stats.size(), SlabAllocator::class_count());
+    for (const auto &c : stats) {
+        EXPECT_EQ(c.used_chunks, 0);
+        EXPECT_EQ(c.free_chunks, c.pages * c.chunks_per_page);
+    }
+}
+
+TEST(SlabAllocatorTest, ReusesChunksFreedElsewhere) {
+    auto slab = SlabAllocator::create();
+    std::vector<SlabAllocator::Chunk> chunks;
+    for (int i = 0; i < 1000; ++i) {
+        chunks.push_back(slab->allocate(100));
+    }
+    EXPECT_EQ(slab->stats()[2].used_chunks, 1000);
+
+    std::thread{[&chunks] {
+        for (auto chunk : chunks) {
+            SlabAllocator::deallocate(chunk.ptr, chunk.size);
+        }
+    }}.join();
+    auto stats = slab->stats()[2];
+    EXPECT_EQ(stats.used_chunks, 0);
+    EXPECT_EQ(stats.pages, 1);
+
+    // Outlives its owner while chunks are in use
+    auto last = slab->allocate(100);
+    slab.reset();
+    std::memset(last.ptr, 'x', last.size);
+    SlabAllocator::deallocate(last.ptr, last.size);
+}
+
+TEST(SlabAllocatorTest, RebalancesSparsePages) {
+    auto slab = SlabAllocator::create();
+    auto per_page = slab->stats()[0].chunks_per_page;
+    std::vector<SlabAllocator::Chunk> chunks, kept;
+    for (std::size_t i = 0; i < 4 * per_page; ++i) {
+        chunks.push_back(slab->allocate(SlabAllocator::MIN_CHUNK));
+    }
+    // Leave the first page full, and a few chunks in each of the others
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (i < per_page || i % per_page < 5) {
+            kept.push_back(chunks[i]);
+        } else {
+            SlabAllocator::deallocate(chunks[i].ptr, chunks[i].size);
+        }
+    }
+    EXPECT_EQ(slab->stats()[0].pages, 4);
+
+    auto moving = slab->rebalance();
+    ASSERT_EQ(moving.size(), 5);
+    for (auto *ptr : moving) {
+        // Never handed out again while being emptied
+        auto chunk = slab->allocate(SlabAllocator::MIN_CHUNK);
+        EXPECT_EQ(std::find(moving.begin(), moving.end(), chunk.ptr),
+                  moving.end());
+        kept.push_back(chunk);
+        std::erase_if(kept, [ptr](auto c) { return c.ptr == ptr; });
+        SlabAllocator::deallocate(ptr, chunk.size);
+    }
+    // Released, while the next page is picked
+    EXPECT_EQ(slab->rebalance().size(), 5);
+    EXPECT_EQ(slab->stats()[0].pages, 3);
+
+    for (auto chunk : kept) {
+        SlabAllocator::deallocate(chunk.ptr, chunk.size);
+    }
+}
@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "utils.h"
+
+#include "../undis/kvstore.h"
+#include "../undis/serializer.h"
+#include "../undis/storevalue.h"
+
+using namespace std::chrono_literals;
+
+class SnapshotterTest : public ::testing::Test {
+  protected:
+    void TearDown() override { std::filesystem::remove(db); }
+
+    // Waits for the running snapshot, if any, to finish
+    static Snapshotter::Status wait_for_save(const KVStore &store) {
+        auto status = store.snapshot_status().value();
+        for (int i = 0; i < 200 && status.in_progress; ++i) {
+            std::this_thread::sleep_for(10ms);
+            status = store.snapshot_status().value();
+        }
+        return status;
+    }
+
+    const std::filesystem::path db{"SnapshotterTest.db"};
+};
+
+TEST_F(SnapshotterTest, SavesInBackground) {
+    const auto m = map_factory(100);
+    KVStore store{db, StoreOptions{}};
+    for (const auto &[k, v] : m) {
+        store.set(k, v.str_val, v.flags, 0);
+    }
+    EXPECT_EQ(store.snapshot_status()->changes, m.size());
+
+    ASSERT_TRUE(store.save_snapshot());
+    auto status = wait_for_save(store);
+    EXPECT_FALSE(status.in_progress);
+    EXPECT_TRUE(status.last_ok);
+    EXPECT_NE(status.last_save, 0);
+    EXPECT_EQ(status.changes, 0);
+
+    std::unordered_map<std::string, StoreValue> loaded;
+    Serializer{db} >> loaded;
+    EXPECT_EQ(loaded.size(), m.size());
+    for (const auto &[k, v] : m) {
+        EXPECT_EQ(loaded.at(k).str_val, v.str_val);
+    }
+
+    store.del(m.begin()->first);
+    EXPECT_EQ(store.snapshot_status()->changes, 1);
+}
+
+TEST_F(SnapshotterTest, KeepsCopyUnchanged) {
+    KVStore store{db, StoreOptions{}};
+    store.set("key", "value", 0u, 0);
+    ASSERT_TRUE(store.save_snapshot());
+    // Concurrent writes modify shared values by replacing them
+    store.append("key", "_suffix");
+    wait_for_save(store);
+
+    std::unordered_map<std::string, StoreValue> loaded;
+    Serializer{db} >> loaded;
+    auto value = loaded.at("key").str_val;
+    EXPECT_TRUE(value == "value" || value == "value_suffix");
+    EXPECT_EQ(store.get("key")->str_val, "value_suffix");
+}
+
+TEST_F(SnapshotterTest, SavesPeriodically) {
+    KVStore store{db, StoreOptions{.save = {.interval = 1s, .changes = 2}}};
+    store.set("key", "value", 0u, 0);
+    std::this_thread::sleep_for(1500ms);
+    EXPECT_EQ(store.snapshot_status()->last_save, 0);
+
+    store.set("other", "value", 0u, 0);
+    auto status = store.snapshot_status().value();
+    for (int i = 0; i < 300 && status.last_save == 0; ++i) {
+        std::this_thread::sleep_for(10ms);
+        status = store.snapshot_status().value();
+    }
+    EXPECT_NE(status.last_save, 0);
+    EXPECT_TRUE(std::filesystem::exists(db));
+}
+
+TEST_F(SnapshotterTest, DisabledWithoutFile) {
+    KVStore store;
+    EXPECT_FALSE(store.snapshots());
+    EXPECT_FALSE(store.save_snapshot());
+    EXPECT_FALSE(store.snapshot_status().has_value());
+}
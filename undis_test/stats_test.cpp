@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "../undis/kvstore.h"
+#include "../undis/stats.h"
+#include "../undis/threadpool.h"
+
+using namespace std::literals;
+
+TEST(StatsTest, BucketsValues) {
+    // Exact for small values, then within 1/16
+    for (std::uint64_t v = 0; v < 32; ++v) {
+        EXPECT_EQ(Histogram::highest(Histogram::bucket(v)), v);
+    }
+    for (std::uint64_t v = 32; v < 1'000'000; v = v * 3 / 2 + 1) {
+        auto highest = Histogram::highest(Histogram::bucket(v));
+        EXPECT_GE(highest, v);
+        EXPECT_LE(highest - v, v / 16);
+        EXPECT_EQ(Histogram::bucket(highest), Histogram::bucket(v));
+        EXPECT_EQ(Histogram::bucket(highest + 1), Histogram::bucket(v) + 1);
+    }
+    EXPECT_EQ(Histogram::bucket(std::uint64_t{1} << 40),
+              Histogram::BUCKETS - 1);
+}
+
+TEST(StatsTest, Percentiles) {
+    Histogram h;
+    EXPECT_EQ(h.percentile(0.5), 0);
+
+    for (std::uint64_t v = 1; v <= 1000; ++v) {
+        h.record(v * 1000);
+    }
+    EXPECT_EQ(h.count(), 1000);
+    EXPECT_NEAR(h.percentile(0.5), 500'000, 500'000 / 16);
+    EXPECT_NEAR(h.percentile(0.99), 990'000, 990'000 / 16);
+    EXPECT_NEAR(h.percentile(0.999), 999'000, 999'000 / 16);
+    EXPECT_GE(h.percentile(1), 1'000'000);
+
+    Histogram slow;
+    slow.record(10'000'000);
+    slow += h;
+    EXPECT_EQ(slow.count(), 1001);
+    EXPECT_EQ(slow.percentile(0.5), h.percentile(0.5));
+    EXPECT_GE(slow.percentile(1), 10'000'000);
+}
+
+TEST(StatsTest, SumsThreads) {
+    auto before = Stats::collect();
+
+    // Kept after the threads exit
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([] {
+            for (int i = 0; i < 1000; ++i) {
+                Stats::add(Stats::Counter::bytes_read, 2);
+                Stats::record(Stats::Op::incr, 1us);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto after = Stats::collect();
+    EXPECT_EQ(after[Stats::Counter::bytes_read] -
+                  before[Stats::Counter::bytes_read],
+              8000);
+    EXPECT_EQ(after[Stats::Op::incr].count() - before[Stats::Op::incr].count(),
+              4000);
+    EXPECT_NEAR(after[Stats::Op::incr].percentile(0.5), 1000, 1000 / 16);
+}
+
+TEST(StatsTest, RecordsDuringThreadExit) {
+    // Destroyed after the thread's stats block is returned
+    struct Late {
+        ~Late() { Stats::add(Stats::Counter::bytes_read); }
+    };
+    std::thread thread{[] {
+        thread_local Late late;
+        Stats::add(Stats::Counter::bytes_read);
+    }};
+    thread.join();
+    EXPECT_GE(Stats::collect()[Stats::Counter::bytes_read], 1);
+}
+
+TEST(StatsTest, Reports) {
+    KVStore store;
+    store.set("key", "value"s, 0u, 0);
+    Stats::connection_opened();
+
+    auto general = Stats::report("", store);
+    ASSERT_TRUE(general.has_value());
+    auto find = [](const Stats::Report &report, std::string_view name) {
+        for (const auto &[key, value] : report) {
+            if (key == name) {
+                return value;
+            }
+        }
+        return "missing"s;
+    };
+    EXPECT_EQ(find(*general, "curr_items"), "1");
+    EXPECT_NE(find(*general, "curr_connections"), "0");
+    EXPECT_NE(find(*general, "uptime"), "missing");
+    Stats::connection_closed();
+
+    Stats::record(Stats::Op::touch, 5us);
+    auto latency = Stats::report("latency", store);
+    ASSERT_TRUE(latency.has_value());
+    EXPECT_NE(find(*latency, "touch_p99_ns"), "missing");
+
+    {
+        ThreadPool pool{2, 4};
+        Stats::watch_pool(&pool);
+        auto report = Stats::report("pool", store);
+        ASSERT_TRUE(report.has_value());
+        EXPECT_EQ(find(*report, "threads"), "2");
+        EXPECT_EQ(find(*report, "max_threads"), "4");
+        EXPECT_NE(find(*report, "wait_p99_ns"), "missing");
+        Stats::watch_pool(nullptr);
+    }
+    auto pool = Stats::report("pool", store);
+    ASSERT_TRUE(pool.has_value());
+    EXPECT_TRUE(pool->empty());
+
+    auto slabs = Stats::report("slabs", store);
+    ASSERT_TRUE(slabs.has_value());
+    EXPECT_EQ(find(*slabs, "active_slabs"), "1");
+    EXPECT_EQ(find(*slabs, "total_malloced"),
+              std::to_string(SlabAllocator::PAGE_SIZE));
+
+    EXPECT_FALSE(Stats::report("items", store).has_value());
+}
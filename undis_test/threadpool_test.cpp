@@ -1,12 +1,17 @@
 #include <gtest/gtest.h>
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <future>
+#include <memory>
+#include <thread>
 #include <vector>
 
+#include "../undis/task.h"
 #include "../undis/threadpool.h"
+#include "../undis/workdeque.h"
 
 using namespace std::chrono_literals;
 
@@ -26,10 +31,10 @@ TEST_F(ThreadPoolTest, ThreadsCreated) {
 }
 
 TEST_F(ThreadPoolTest, CompletesJobs) {
-    std::vector<std::promise<int>> ps;
-    std::vector<std::future<int>> fs;
+    std::vector<std::promise<unsigned>> ps;
+    std::vector<std::future<unsigned>> fs;
 
-    for (int i = 0; i < 2 * MAX_THREAD_COUNT; ++i) {
+    for (unsigned i = 0; i < 2 * MAX_THREAD_COUNT; ++i) {
         ps.emplace_back();
         fs.push_back(ps[i].get_future());
         tp.queue_job({[&ps, i] { ps[i].set_value(i); }});
@@ -37,7 +42,7 @@ TEST_F(ThreadPoolTest, CompletesJobs) {
 
     std::this_thread::sleep_for(100ms);
 
-    for (int i = 0; i < 2 * MAX_THREAD_COUNT; ++i) {
+    for (unsigned i = 0; i < 2 * MAX_THREAD_COUNT; ++i) {
         EXPECT_EQ(fs[i].get(), i);
     }
 }
@@ -48,7 +53,7 @@ TEST_F(ThreadPoolTest, CreatesMoreThreads) {
     std::condition_variable cv;
     std::atomic<unsigned> finished = 0;
 
-    for (int i = 0; i < MAX_THREAD_COUNT + 1; ++i) {
+    for (unsigned i = 0; i < MAX_THREAD_COUNT + 1; ++i) {
         tp.queue_job({[&]() {
             std::unique_lock lk{mtx};
             cv.wait(lk, [&start]() { return start; });
@@ -84,3 +89,173 @@ TEST_F(ThreadPoolTest, CleansUpThreads) {
     tp.cleanup();
     EXPECT_EQ(tp.threads(), MIN_THREAD_COUNT);
 }
+
+TEST_F(ThreadPoolTest, QueuesFromWorkers) {
+    constexpr int FANOUT = 8;
+    std::atomic<int> done = 0;
+
+    // Each job queues its children from a pool thread, onto its own deque
+    for (int i = 0; i < FANOUT; ++i) {
+        tp.queue_job([&] {
+            for (int j = 0; j < FANOUT; ++j) {
+                tp.queue_job([&done] { ++done; });
+            }
+        });
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    while (done < FANOUT * FANOUT &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(1ms);
+    }
+    EXPECT_EQ(done, FANOUT * FANOUT);
+}
+
+TEST_F(ThreadPoolTest, ReportsMetrics) {
+    constexpr int JOBS = 100;
+    std::atomic<int> done = 0;
+    for (int i = 0; i < JOBS; ++i) {
+        tp.queue_job([&done] { ++done; });
+    }
+    while (done < JOBS) {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    auto metrics = tp.metrics();
+    EXPECT_EQ(metrics.jobs, JOBS);
+    EXPECT_EQ(metrics.wait.count(), JOBS);
+    EXPECT_EQ(metrics.queued, 0);
+    EXPECT_EQ(metrics.min_threads, MIN_THREAD_COUNT);
+    EXPECT_EQ(metrics.max_threads, MAX_THREAD_COUNT);
+    EXPECT_GE(metrics.spawned, MIN_THREAD_COUNT);
+    EXPECT_EQ(metrics.spawned - metrics.reaped, metrics.threads);
+}
+
+TEST_F(ThreadPoolTest, AdjustsLimits) {
+    tp.set_limits(3, 6);
+    EXPECT_EQ(tp.threads(), 3);
+    tp.grow(6);
+    EXPECT_EQ(tp.threads(), 6);
+
+    // Idle threads over a lowered maximum stop at once
+    std::this_thread::sleep_for(10ms);
+    tp.set_limits(1, 2);
+    EXPECT_EQ(tp.threads(), 2);
+    EXPECT_EQ(tp.metrics().reaped, 4);
+}
+
+TEST_F(ThreadPoolTest, ShrinksWhenIdle) {
+    tp.grow(MAX_THREAD_COUNT);
+    EXPECT_EQ(tp.threads(), MAX_THREAD_COUNT);
+
+    // Without calls to cleanup, the controller stops threads once the pool
+    // has been idle for the timeout
+    auto deadline = std::chrono::steady_clock::now() + TIMEOUT * 3;
+    while (tp.threads() > MIN_THREAD_COUNT &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(ThreadPool::TICK);
+    }
+    EXPECT_EQ(tp.threads(), MIN_THREAD_COUNT);
+}
+
+TEST(ThreadPoolDestroyTest, JobsQueueWhileDestroyed) {
+    std::atomic<unsigned> started = 0;
+    {
+        ThreadPool pool{1, MAX_THREAD_COUNT, TIMEOUT};
+        // Below the maximum, so the queued jobs would start threads
+        for (unsigned i = 0; i < MIN_THREAD_COUNT; ++i) {
+            pool.queue_job({[&] {
+                ++started;
+                std::this_thread::sleep_for(100ms);
+                pool.queue_job({[] {}});
+            }});
+        }
+        while (started < MIN_THREAD_COUNT) {
+            std::this_thread::sleep_for(10ms);
+        }
+    }
+    EXPECT_EQ(started, MIN_THREAD_COUNT);
+}
+
+TEST(TaskTest, RunsMoveOnlyCallables) {
+    auto n = std::make_unique<int>(1);
+    Task small{[n = std::move(n)] { ++*n; }};
+    EXPECT_TRUE(small);
+
+    // Too large to be stored inline
+    std::array<int, 64> big{};
+    int sum = 0;
+    Task large{[big, &sum] {
+        for (int v : big) {
+            sum += v + 1;
+        }
+    }};
+
+    Task moved{std::move(large)};
+    EXPECT_FALSE(large);
+    moved();
+    EXPECT_EQ(sum, 64);
+
+    moved = std::move(small);
+    moved();
+    EXPECT_FALSE(small);
+    EXPECT_FALSE(Task{});
+}
+
+TEST(WorkDequeTest, PopsNewestAndStealsOldest) {
+    WorkDeque<int> deque{2};
+    EXPECT_FALSE(deque.pop().has_value());
+    EXPECT_FALSE(deque.steal().has_value());
+
+    // Grows past its initial capacity
+    for (int i = 0; i < 10; ++i) {
+        deque.push(i);
+    }
+    EXPECT_EQ(deque.steal(), 0);
+    EXPECT_EQ(deque.pop(), 9);
+    EXPECT_EQ(deque.steal(), 1);
+    EXPECT_EQ(deque.pop(), 8);
+    for (int i = 0; i < 6; ++i) {
+        EXPECT_TRUE(deque.pop().has_value());
+    }
+    EXPECT_TRUE(deque.empty());
+    EXPECT_FALSE(deque.pop().has_value());
+}
+
+TEST(WorkDequeTest, TakesEachValueOnce) {
+    constexpr int VALUES = 100'000;
+    constexpr int THIEVES = 3;
+    WorkDeque<int> deque;
+    std::vector<std::atomic<int>> taken(VALUES);
+    std::atomic<bool> pushing = true;
+
+    std::vector<std::jthread> thieves;
+    for (int t = 0; t < THIEVES; ++t) {
+        thieves.emplace_back([&] {
+            while (pushing || !deque.empty()) {
+                if (auto v = deque.steal()) {
+                    ++taken[*v];
+                }
+            }
+        });
+    }
+
+    // The owner pops every other value it pushes, racing the thieves
+    for (int i = 0; i < VALUES; ++i) {
+        deque.push(i);
+        if (i % 2 == 0) {
+            if (auto v = deque.pop()) {
+                ++taken[*v];
+            }
+        }
+    }
+    while (auto v = deque.pop()) {
+        ++taken[*v];
+    }
+    pushing = false;
+    thieves.clear();
+
+    for (int i = 0; i < VALUES; ++i) {
+        ASSERT_EQ(taken[i], 1) << i;
+    }
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "../undis/timingwheel.h"
+
+namespace {
+struct Timer : TimerNode {
+    int id;
+    explicit Timer(int id) : id{id} {}
+};
+
+std::vector<int> expire(TimingWheel &wheel, std::uint32_t now,
+                        std::size_t budget = 1000) {
+    std::vector<int> ids;
+    wheel.expire(now, budget, [&ids](TimerNode &node) {
+        ids.push_back(static_cast<Timer &>(node).id);
+    });
+    return ids;
+}
+} // namespace
+
+TEST(TimingWheelTest, ExpiresInOrder) {
+    constexpr std::uint32_t start = 1'000'000'000;
+    TimingWheel wheel{start};
+
+    Timer soon{1}, later{2}, hours{3}, days{4}, past{5};
+    wheel.schedule(later, start + 100);
+    wheel.schedule(soon, start + 10);
+    wheel.schedule(hours, start + 5 * 3600);
+    wheel.schedule(days, start + 40 * 86400);
+    wheel.schedule(past, start - 10);
+
+    EXPECT_EQ(expire(wheel, start), std::vector<int>{5});
+    EXPECT_TRUE(expire(wheel, start + 9).empty());
+    EXPECT_EQ(expire(wheel, start + 10), std::vector<int>{1});
+    EXPECT_TRUE(expire(wheel, start + 99).empty());
+    EXPECT_EQ(expire(wheel, start + 100), std::vector<int>{2});
+    EXPECT_TRUE(expire(wheel, start + 5 * 3600 - 1).empty());
+    EXPECT_EQ(expire(wheel, start + 5 * 3600), std::vector<int>{3});
+    EXPECT_TRUE(expire(wheel, start + 40 * 86400 - 1).empty());
+    EXPECT_TRUE(days.scheduled());
+    EXPECT_EQ(expire(wheel, start + 40 * 86400), std::vector<int>{4});
+    EXPECT_FALSE(days.scheduled());
+}
+
+TEST(TimingWheelTest, ReschedulesAndCancels) {
+    TimingWheel wheel{0};
+
+    Timer a{1}, b{2};
+    wheel.schedule(a, 10);
+    wheel.schedule(b, 10);
+    wheel.schedule(a, 5000);
+    wheel.cancel(b);
+    EXPECT_FALSE(b.scheduled());
+
+    EXPECT_TRUE(expire(wheel, 4999).empty());
+    {
+        // Destroyed timers leave the wheel
+        Timer c{3};
+        wheel.schedule(c, 5000);
+    }
+    EXPECT_EQ(expire(wheel, 5000), std::vector<int>{1});
+}
+
+TEST(TimingWheelTest, RespectsBudget) {
+    TimingWheel wheel{0};
+
+    std::deque<Timer> timers;
+    for (int i = 0; i < 10; ++i) {
+        wheel.schedule(timers.emplace_back(i), i % 2);
+    }
+
+    EXPECT_EQ(expire(wheel, 1, 4).size(), 4);
+    EXPECT_FALSE(wheel.expire(1, 0, [](TimerNode &) {}));
+    EXPECT_EQ(expire(wheel, 1).size(), 6);
+    EXPECT_TRUE(wheel.expire(1, 0, [](TimerNode &) {}));
+}